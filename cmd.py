@@ -5,6 +5,7 @@
 import sys, os, subprocess, argparse, math, json
 from pathlib import Path
 from functools import reduce
+from ctypes import *
 
 parser = argparse.ArgumentParser()
 parser.add_argument("-b", "--build", help="Build the target module.")
@@ -17,6 +18,7 @@ parser.add_argument("--count", action="store_true", help="Count the lines of sou
 parser.add_argument("--format", action="store_true", help="Format the lines of source code.")
 parser.add_argument("--copyright", action="store_true", help="Add copyright info to source code.")
 parser.add_argument("--csim", action="store_true", help="Check and verify the cache module.")
+parser.add_argument("--csweep", nargs=3, metavar=("TRACE", "MAX_S", "B"), help="Sweep all cache shapes (s <= MAX_S, E, b = B) of the trace in one pass.")
 args = parser.parse_args()
 
 # print arguments
@@ -240,6 +242,42 @@ def cache_verify():
         print(" ".join(a))
         subprocess.run(a)
 
+def cache_sweep():
+    make_build_directory()
+    [trace_file, max_s, b] = args.csweep
+    max_s = int(max_s)
+    b = int(b)
+    max_E = 1024
+
+    assert(os.path.isfile(trace_file))
+
+    # compile the stack distance analyzer
+    subprocess.run(
+        [
+            "/usr/bin/gcc-7",
+            "-Wall", "-g", "-O2", "-Werror", "-std=gnu99", "-Wno-unused-function",
+            "-I", "./src",
+            "-shared", "-fPIC",
+            "./src/hardware/cpu/stackdist.c",
+            "-o", "./bin/stackdist.so"
+        ])
+    lib = cdll.LoadLibrary("./bin/stackdist.so")
+    lib.stackdist_run.restype = c_uint64
+    lib.stackdist_missratio.restype = c_double
+
+    # read the trace file only once for all the (s, E) shapes
+    n = lib.stackdist_run(c_char_p(trace_file.encode("ascii")), c_int(max_s), c_int(b), c_int(max_E))
+    print("%s: %d accesses, b = %d" % (trace_file, n, b))
+
+    E_list = [2 ** i for i in range(int(math.log2(max_E)) + 1)]
+    print("miss ratio\t" + "\t".join(["E=%d" % E for E in E_list]))
+    for s in range(max_s + 1):
+        line = "s=%d\t" % s
+        for E in E_list:
+            line += "\t%.4f" % lib.stackdist_missratio(c_int(s), c_int(E))
+        print(line)
+    lib.stackdist_free()
+
 def printHex():
     strVal = args.hex
     print(strVal)
@@ -277,4 +315,6 @@ elif args.copyright == True:
 elif args.format == True:
     format_code()
 elif args.csim == True:
-    cache_verify()
\ No newline at end of file
+    cache_verify()
+elif args.csweep:
+    cache_sweep()
\ No newline at end of file
@@ -437,7 +437,7 @@ rb_node_t *rbt_find(rb_tree_t *tree, uint64_t key)
 
 rb_node_t *rbt_find_succ(rb_tree_t *tree, uint64_t key)
 {
-    return rbt_find_succ(tree, key);
+    return bst_find_succ(tree, key);
 }
 
 int rbt_compare(rb_tree_t *a, rb_tree_t *b)
@@ -324,8 +324,93 @@ void nop_handler(od_t *src_od, od_t *dst_od)
 void parse_instruction(char *inst_str, inst_t *inst);
 
 // time, the craft of god
-static uint64_t global_time = 0;
+uint64_t global_time = 0;
 static uint64_t timer_period = 5000000;
+// one-shot mode of APIC timer, set by the scheduler. 0 for periodic mode
+uint64_t timer_deadline = 0;
+
+#ifdef USE_SCHED_SMP
+// the registers of a core, including its local APIC timer
+typedef struct
+{
+    cpu_reg_t reg;
+    cpu_flags_t flags;
+    cpu_pc_t pc;
+    cpu_cr_t controls;
+    tss_s0_t tss;
+    uint64_t timer_deadline;
+} core_state_t;
+
+static core_state_t core_states[MAX_NUM_CORES];
+int num_cores = 1;
+int current_core = 0;
+
+void smp_init(int num)
+{
+    assert(1 <= num && num <= MAX_NUM_CORES);
+    memset(core_states, 0, sizeof(core_states));
+    num_cores = num;
+    current_core = 0;
+    timer_deadline = 0;
+}
+
+// save the registers of the running core and load the other one
+void switch_core(int core)
+{
+    assert(0 <= core && core < num_cores);
+    if (core == current_core)
+    {
+        return;
+    }
+
+    core_state_t *s = &core_states[current_core];
+    s->reg = cpu_reg;
+    s->flags = cpu_flags;
+    s->pc = cpu_pc;
+    s->controls = cpu_controls;
+    s->tss = tr_global_tss;
+    s->timer_deadline = timer_deadline;
+
+    s = &core_states[core];
+    cpu_reg = s->reg;
+    cpu_flags = s->flags;
+    cpu_pc = s->pc;
+    cpu_controls = s->controls;
+    tr_global_tss = s->tss;
+    timer_deadline = s->timer_deadline;
+    current_core = core;
+
+    // host TLB is not tagged by core
+#ifdef USE_SOFTMMU
+    softmmu_flush();
+#endif
+}
+
+// inter-processor interrupt: the core enters scheduler at next cycle
+void smp_send_reschedule(int core)
+{
+    uint64_t now = global_time > 0 ? global_time : 1;
+    if (core == current_core)
+    {
+        timer_deadline = now;
+    }
+    else
+    {
+        core_states[core].timer_deadline = now;
+    }
+}
+
+// all cores run one instruction in one tick of global time
+void smp_cycle()
+{
+    for (int i = 0; i < num_cores; ++ i)
+    {
+        switch_core(i);
+        instruction_cycle();
+    }
+    global_time += 1;
+}
+#endif
 
 // instruction cycle is implemented in CPU
 // the only exposed interface outside CPU
@@ -339,7 +424,9 @@ void instruction_cycle()
     // This is especially useful for page fault handling.
     setjmp(USER_INSTRUCTION_ON_IRET);
 
+#ifndef USE_SCHED_SMP
     global_time += 1;
+#endif
 
     // FETCH: get the instruction string by program counter
     char inst_str[MAX_INSTRUCTION_CHAR + 10];
@@ -358,7 +445,8 @@ void instruction_cycle()
     inst.op(&(inst.src), &(inst.dst));
     
     // check timer interrupt from APIC
-    if ((global_time % timer_period) == 0)
+    if ((timer_deadline == 0 && (global_time % timer_period) == 0) ||
+        (timer_deadline != 0 && global_time >= timer_deadline))
     {
         interrupt_stack_switching(0x81);
     }
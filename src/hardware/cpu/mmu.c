@@ -24,42 +24,234 @@
 // TLB cache struct
 // -------------------------------------------- //
 
-#define NUM_TLB_CACHE_LINE_PER_SET (8)
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+
+// Two levels of TLB:
+//  L1 - iTLB for instruction fetch, dTLB for data read & write
+//  L2 - STLB shared by both, looked up when L1 misses
+// Each level has separate arrays for 4KB, 2MB and 1GB pages,
+// all of them are looked up in parallel.
+// Entries are tagged with ASID, so switching CR3 does not flush them.
+// The number of sets is (1 << INDEX_LENGTH)
+
+#ifndef ITLB_INDEX_LENGTH
+#define ITLB_INDEX_LENGTH (4)
+#endif
+
+#ifndef ITLB_NUM_WAYS
+#define ITLB_NUM_WAYS (4)
+#endif
+
+#ifndef ITLB_2M_INDEX_LENGTH
+#define ITLB_2M_INDEX_LENGTH (0)
+#endif
+
+#ifndef ITLB_2M_NUM_WAYS
+#define ITLB_2M_NUM_WAYS (8)
+#endif
+
+#ifndef ITLB_1G_INDEX_LENGTH
+#define ITLB_1G_INDEX_LENGTH (0)
+#endif
+
+#ifndef ITLB_1G_NUM_WAYS
+#define ITLB_1G_NUM_WAYS (4)
+#endif
+
+#ifndef DTLB_INDEX_LENGTH
+#define DTLB_INDEX_LENGTH (4)
+#endif
+
+#ifndef DTLB_NUM_WAYS
+#define DTLB_NUM_WAYS (4)
+#endif
+
+#ifndef DTLB_2M_INDEX_LENGTH
+#define DTLB_2M_INDEX_LENGTH (3)
+#endif
+
+#ifndef DTLB_2M_NUM_WAYS
+#define DTLB_2M_NUM_WAYS (4)
+#endif
+
+#ifndef DTLB_1G_INDEX_LENGTH
+#define DTLB_1G_INDEX_LENGTH (0)
+#endif
+
+#ifndef DTLB_1G_NUM_WAYS
+#define DTLB_1G_NUM_WAYS (4)
+#endif
+
+#ifndef STLB_INDEX_LENGTH
+#define STLB_INDEX_LENGTH (7)
+#endif
+
+#ifndef STLB_NUM_WAYS
+#define STLB_NUM_WAYS (8)
+#endif
+
+#ifndef STLB_2M_INDEX_LENGTH
+#define STLB_2M_INDEX_LENGTH (5)
+#endif
+
+#ifndef STLB_2M_NUM_WAYS
+#define STLB_2M_NUM_WAYS (8)
+#endif
+
+#ifndef STLB_1G_INDEX_LENGTH
+#define STLB_1G_INDEX_LENGTH (2)
+#endif
+
+#ifndef STLB_1G_NUM_WAYS
+#define STLB_1G_NUM_WAYS (4)
+#endif
+
+#define TLB_LRU     (0)
+// tree pseudo-LRU: number of ways must be power of 2, at most 64
+#define TLB_PLRU    (1)
+
+#ifndef TLB_REPLACEMENT
+#define TLB_REPLACEMENT TLB_LRU
+#endif
+
+// page sizes
+#define TLB_PAGE_4K         (0)
+#define TLB_PAGE_2M         (1)
+#define TLB_PAGE_1G         (2)
+#define TLB_NUM_PAGE_SIZE   (3)
+
+#define TLB_PAGE_SHIFT(size) (PHYSICAL_PAGE_OFFSET_LENGTH + (size) * VIRTUAL_PAGE_NUMBER_LENGTH)
 
 typedef struct 
 {
     int valid;
-    uint64_t tag;
-    uint64_t ppn;
-} tlb_cacheline_t;
+    int global;         // shared by all address spaces
+    int readonly;
+    int dirty;          // write is allowed without page walk
+    int size;           // TLB_PAGE_4K, TLB_PAGE_2M or TLB_PAGE_1G
+    uint64_t asid;
+    uint64_t vpn;       // vaddr >> page shift, low bits are the set index
+    uint64_t ppn;       // first 4KB frame of the page
+    uint64_t time;      // LRU stamp
+} tlb_entry_t;
 
 typedef struct
 {
-    tlb_cacheline_t lines[NUM_TLB_CACHE_LINE_PER_SET];
-} tlb_cacheset_t;
+    const char *name;
+    int index_length;
+    int num_ways;
+    tlb_entry_t *entries;   // sets * ways
+    uint64_t *plru;         // tree bits of each set
+    uint64_t clock;
+} tlb_t;
+
+#define TLB_ARRAY(array, index_length, num_ways) \
+    static tlb_entry_t array##_entries[(1 << (index_length)) * (num_ways)]; \
+    static uint64_t array##_plru[(1 << (index_length))]
+
+#define TLB_INIT(array, name, index_length, num_ways) \
+    { name, index_length, num_ways, array##_entries, array##_plru, 0 }
+
+TLB_ARRAY(itlb, ITLB_INDEX_LENGTH, ITLB_NUM_WAYS);
+TLB_ARRAY(itlb_2m, ITLB_2M_INDEX_LENGTH, ITLB_2M_NUM_WAYS);
+TLB_ARRAY(itlb_1g, ITLB_1G_INDEX_LENGTH, ITLB_1G_NUM_WAYS);
+TLB_ARRAY(dtlb, DTLB_INDEX_LENGTH, DTLB_NUM_WAYS);
+TLB_ARRAY(dtlb_2m, DTLB_2M_INDEX_LENGTH, DTLB_2M_NUM_WAYS);
+TLB_ARRAY(dtlb_1g, DTLB_1G_INDEX_LENGTH, DTLB_1G_NUM_WAYS);
+TLB_ARRAY(stlb, STLB_INDEX_LENGTH, STLB_NUM_WAYS);
+TLB_ARRAY(stlb_2m, STLB_2M_INDEX_LENGTH, STLB_2M_NUM_WAYS);
+TLB_ARRAY(stlb_1g, STLB_1G_INDEX_LENGTH, STLB_1G_NUM_WAYS);
+
+static tlb_t mmu_tlb[3][TLB_NUM_PAGE_SIZE] = {
+    [TLB_ITLB] = {
+        [TLB_PAGE_4K] = TLB_INIT(itlb, "iTLB 4K", ITLB_INDEX_LENGTH, ITLB_NUM_WAYS),
+        [TLB_PAGE_2M] = TLB_INIT(itlb_2m, "iTLB 2M", ITLB_2M_INDEX_LENGTH, ITLB_2M_NUM_WAYS),
+        [TLB_PAGE_1G] = TLB_INIT(itlb_1g, "iTLB 1G", ITLB_1G_INDEX_LENGTH, ITLB_1G_NUM_WAYS),
+    },
+    [TLB_DTLB] = {
+        [TLB_PAGE_4K] = TLB_INIT(dtlb, "dTLB 4K", DTLB_INDEX_LENGTH, DTLB_NUM_WAYS),
+        [TLB_PAGE_2M] = TLB_INIT(dtlb_2m, "dTLB 2M", DTLB_2M_INDEX_LENGTH, DTLB_2M_NUM_WAYS),
+        [TLB_PAGE_1G] = TLB_INIT(dtlb_1g, "dTLB 1G", DTLB_1G_INDEX_LENGTH, DTLB_1G_NUM_WAYS),
+    },
+    [TLB_STLB] = {
+        [TLB_PAGE_4K] = TLB_INIT(stlb, "STLB 4K", STLB_INDEX_LENGTH, STLB_NUM_WAYS),
+        [TLB_PAGE_2M] = TLB_INIT(stlb_2m, "STLB 2M", STLB_2M_INDEX_LENGTH, STLB_2M_NUM_WAYS),
+        [TLB_PAGE_1G] = TLB_INIT(stlb_1g, "STLB 1G", STLB_1G_INDEX_LENGTH, STLB_1G_NUM_WAYS),
+    },
+};
+
+static tlb_entry_t *read_tlb(int level, uint64_t vaddr, int access);
+static void write_tlb(int level, tlb_entry_t *entry);
+
+static uint64_t tlb_paddr(tlb_entry_t *entry, uint64_t vaddr)
+{
+    uint64_t offset = vaddr & ((1ul << TLB_PAGE_SHIFT(entry->size)) - 1);
+    return (entry->ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + offset;
+}
+
+// -------------------------------------------- //
+// page walk cache
+// -------------------------------------------- //
+
+// Page structure caches of the upper levels, fully associative:
+//  PGD entries - indexed by vpn1, point to PUD
+//  PUD entries - indexed by vpn1:vpn2, point to PMD
+//  PMD entries - indexed by vpn1:vpn2:vpn3, point to PT
+// A TLB miss starts the walk from the deepest hit.
+// Only the entries pointing to next level tables are cached, not huge page leaves.
+
+#ifndef PWC_PGD_NUM_ENTRIES
+#define PWC_PGD_NUM_ENTRIES (2)
+#endif
+
+#ifndef PWC_PUD_NUM_ENTRIES
+#define PWC_PUD_NUM_ENTRIES (4)
+#endif
+
+#ifndef PWC_PMD_NUM_ENTRIES
+#define PWC_PMD_NUM_ENTRIES (32)
+#endif
 
 typedef struct
 {
-    tlb_cacheset_t sets[(1 << TLB_CACHE_INDEX_LENGTH)];
-} tlb_cache_t;
+    int valid;
+    uint64_t prefix;    // the VPNs of the upper levels
+    pte123_t *tab;      // next level table
+    uint64_t time;      // LRU stamp
+} pwc_entry_t;
 
-static tlb_cache_t mmu_tlb;
+static pwc_entry_t pwc_pgd[PWC_PGD_NUM_ENTRIES];
+static pwc_entry_t pwc_pud[PWC_PUD_NUM_ENTRIES];
+static pwc_entry_t pwc_pmd[PWC_PMD_NUM_ENTRIES];
 
-static uint64_t page_walk(uint64_t vaddr_value, int write_request);
-static void page_fault_handler(pte4_t *pte, address_t vaddr);
+static struct
+{
+    pwc_entry_t *entries;
+    int num;
+} pwc[3] = {
+    { pwc_pgd, PWC_PGD_NUM_ENTRIES },
+    { pwc_pud, PWC_PUD_NUM_ENTRIES },
+    { pwc_pmd, PWC_PMD_NUM_ENTRIES },
+};
+
+static uint64_t pwc_clock = 0;
+// the CR3 the cached entries belong to
+static uint64_t pwc_cr3 = 0;
+
+static int read_pwc(int *vpns, pte123_t **tab_ptr);
+static void write_pwc(int *vpns, int level, pte123_t *tab);
+#endif
 
-static int read_tlb(uint64_t vaddr_value, uint64_t *paddr_value_ptr,
-    int *free_tlb_line_index);
-static int write_tlb(uint64_t vaddr_value, uint64_t paddr_value, 
-    int free_tlb_line_index);
+static uint64_t page_walk(uint64_t vaddr_value, int access, pte4_t **pte_ptr, int *page_shift_ptr, int *readonly_ptr);
+static void page_fault_handler(pte4_t *pte, address_t vaddr);
 
 int swap_in(uint64_t saddr, uint64_t ppn);
 int swap_out(uint64_t saddr, uint64_t ppn);
 
 // consider this function va2pa as functional
 // vaddr - the virutal address to be translated into physical address
-// write_request - if this translation is caused by write request
-uint64_t va2pa(uint64_t vaddr, int write_request)
+// access - MMU_READ, MMU_WRITE or MMU_FETCH
+uint64_t va2pa(uint64_t vaddr, int access)
 {
 #ifdef USE_NAVIE_VA2PA
     return vaddr % PHYSICAL_MEMORY_SPACE;
@@ -67,35 +259,49 @@ uint64_t va2pa(uint64_t vaddr, int write_request)
     uint64_t paddr = 0;
 
 #if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
-    int free_tlb_line_index = -1;
-    int tlb_hit = read_tlb(vaddr, &paddr, &free_tlb_line_index);
-
-    // TODO: add flag to read tlb failed
-    if (tlb_hit)
+    int l1 = access == MMU_FETCH ? TLB_ITLB : TLB_DTLB;
+    tlb_entry_t *entry = read_tlb(l1, vaddr, access);
+    if (entry != NULL)
     {
-        // TLB read hit
-        return paddr;
+        // L1 TLB hit
+        tlb_hit_count[l1] += 1;
+        return tlb_paddr(entry, vaddr);
     }
+    tlb_miss_count[l1] += 1;
 
-    // TLB read miss
+    entry = read_tlb(TLB_STLB, vaddr, access);
+    if (entry != NULL)
+    {
+        // L2 TLB hit, refill L1
+        tlb_hit_count[TLB_STLB] += 1;
+        write_tlb(l1, entry);
+        return tlb_paddr(entry, vaddr);
+    }
+    tlb_miss_count[TLB_STLB] += 1;
 #endif
 
 #ifdef USE_PAGETABLE_VA2PA
     // assume that page_walk is consuming much time
-    paddr = page_walk(vaddr, write_request);
+    pte4_t *pte = NULL;
+    int page_shift = PHYSICAL_PAGE_OFFSET_LENGTH;
+    int readonly = 0;
+    paddr = page_walk(vaddr, access, &pte, &page_shift, &readonly);
 #endif
 
 #if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
-    // refresh TLB
-    // TODO: check if this paddr from page table is a legal address
-    if (paddr != 0)
-    {
-        // TLB write
-        if (write_tlb(vaddr, paddr, free_tlb_line_index) == 1)
-        {
-            return paddr;
-        }
-    }
+    // page_walk returns only if the translation is legal
+    tlb_entry_t walked = {
+        .valid = 1,
+        .global = pte->global,
+        .readonly = readonly,
+        .dirty = (pte->dirty == 1 || access == MMU_WRITE),
+        .size = (page_shift - PHYSICAL_PAGE_OFFSET_LENGTH) / VIRTUAL_PAGE_NUMBER_LENGTH,
+        .asid = cpu_controls.asid,
+        .vpn = vaddr >> page_shift,
+        .ppn = pte->ppn,
+    };
+    write_tlb(TLB_STLB, &walked);
+    write_tlb(l1, &walked);
 #endif
 
     // use page table as va2pa
@@ -105,83 +311,284 @@ uint64_t va2pa(uint64_t vaddr, int write_request)
 #if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
 void flush_tlb()
 {
-    memset(&mmu_tlb, 0, sizeof(tlb_cache_t));
+    for (int i = 0; i < 3; ++ i)
+    {
+        for (int j = 0; j < TLB_NUM_PAGE_SIZE; ++ j)
+        {
+            tlb_t *tlb = &mmu_tlb[i][j];
+            memset(tlb->entries, 0, sizeof(tlb_entry_t) * (1 << tlb->index_length) * tlb->num_ways);
+            memset(tlb->plru, 0, sizeof(uint64_t) * (1 << tlb->index_length));
+        }
+    }
 }
 
-static int read_tlb(uint64_t vaddr_value, uint64_t *paddr_value_ptr, 
-    int *free_tlb_line_index)
+// invalidate the non-global entries of one address space
+void flush_tlb_asid(uint64_t asid)
 {
-    address_t vaddr = {
-        .address_value = vaddr_value
-    };
+    for (int i = 0; i < 3; ++ i)
+    {
+        for (int j = 0; j < TLB_NUM_PAGE_SIZE; ++ j)
+        {
+            tlb_t *tlb = &mmu_tlb[i][j];
+            for (int k = 0; k < (1 << tlb->index_length) * tlb->num_ways; ++ k)
+            {
+                tlb_entry_t *entry = &tlb->entries[k];
+                if (entry->valid == 1 && entry->global == 0 && entry->asid == asid)
+                {
+                    entry->valid = 0;
+                }
+            }
+        }
+    }
+}
 
-    tlb_cacheset_t *set = &mmu_tlb.sets[vaddr.tlbi];
-    *free_tlb_line_index = -1;
+// invalidate the entries of one page in all address spaces
+void flush_tlb_page(uint64_t vaddr)
+{
+    for (int i = 0; i < 3; ++ i)
+    {
+        for (int j = 0; j < TLB_NUM_PAGE_SIZE; ++ j)
+        {
+            tlb_t *tlb = &mmu_tlb[i][j];
+            uint64_t vpn = vaddr >> TLB_PAGE_SHIFT(j);
+            int set = vpn & ((1 << tlb->index_length) - 1);
+            for (int k = 0; k < tlb->num_ways; ++ k)
+            {
+                tlb_entry_t *entry = &tlb->entries[set * tlb->num_ways + k];
+                if (entry->valid == 1 && entry->vpn == vpn)
+                {
+                    entry->valid = 0;
+                }
+            }
+        }
+    }
+}
 
-    for (int i = 0; i < NUM_TLB_CACHE_LINE_PER_SET; ++ i)
+void print_tlb_stats()
+{
+    for (int i = 0; i < 3; ++ i)
     {
-        tlb_cacheline_t *line = &set->lines[i];
+        uint64_t n = tlb_hit_count[i] + tlb_miss_count[i];
+        for (int j = 0; j < TLB_NUM_PAGE_SIZE; ++ j)
+        {
+            tlb_t *tlb = &mmu_tlb[i][j];
+            printf("%s: %d sets * %d ways\n", tlb->name, (1 << tlb->index_length), tlb->num_ways);
+        }
+        printf("    hit %lu, miss %lu, hit rate %.2f%%\n",
+            tlb_hit_count[i], tlb_miss_count[i],
+            n == 0 ? 0.0 : 100.0 * (double)tlb_hit_count[i] / (double)n);
+    }
+}
 
-        if (line->valid == 0)
+// mark the way as the most recently used one
+static void touch_tlb(tlb_t *tlb, int set, int way)
+{
+#if TLB_REPLACEMENT == TLB_PLRU
+    // walk down the tree and point every node away from this way
+    // node bit 1: the victim is in the right half
+    uint64_t *tree = &tlb->plru[set];
+    int node = 1;
+    for (int half = tlb->num_ways >> 1; half > 0; half = half >> 1)
+    {
+        int right = (way & half) != 0;
+        if (right == 1)
+        {
+            *tree &= ~(1ul << node);
+        }
+        else
         {
-            *free_tlb_line_index = i;
+            *tree |= (1ul << node);
         }
+        node = node * 2 + right;
+    }
+#else
+    tlb->clock += 1;
+    tlb->entries[set * tlb->num_ways + way].time = tlb->clock;
+#endif
+}
 
-        if (line->tag == vaddr.tlbt &&
-            line->valid == 1)
+static int tlb_victim(tlb_t *tlb, int set)
+{
+    tlb_entry_t *entries = &tlb->entries[set * tlb->num_ways];
+    for (int i = 0; i < tlb->num_ways; ++ i)
+    {
+        if (entries[i].valid == 0)
         {
-            // TLB read hit
-            *paddr_value_ptr = line->ppn;
-            return 1;
+            return i;
         }
     }
 
-    // TLB read miss
-    *paddr_value_ptr = NULL;
-    return 0;
+#if TLB_REPLACEMENT == TLB_PLRU
+    uint64_t tree = tlb->plru[set];
+    int node = 1;
+    int way = 0;
+    for (int half = tlb->num_ways >> 1; half > 0; half = half >> 1)
+    {
+        int right = (tree >> node) & 1;
+        way |= right * half;
+        node = node * 2 + right;
+    }
+    return way;
+#else
+    int victim = 0;
+    for (int i = 1; i < tlb->num_ways; ++ i)
+    {
+        if (entries[i].time < entries[victim].time)
+        {
+            victim = i;
+        }
+    }
+    return victim;
+#endif
 }
 
-static int write_tlb(uint64_t vaddr_value, uint64_t paddr_value, 
-    int free_tlb_line_index)
+// find the entry of current address space
+static int find_tlb(tlb_t *tlb, uint64_t vpn)
 {
-    address_t vaddr = {
-        .address_value = vaddr_value
-    };
+    int set = vpn & ((1 << tlb->index_length) - 1);
+    for (int i = 0; i < tlb->num_ways; ++ i)
+    {
+        tlb_entry_t *entry = &tlb->entries[set * tlb->num_ways + i];
+        if (entry->valid == 1 && entry->vpn == vpn &&
+            (entry->global == 1 || entry->asid == cpu_controls.asid))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    address_t paddr = {
-        .address_value = paddr_value
-    };
+// return NULL if miss, or the access needs a page walk:
+// write to a readonly page faults, write to a clean page sets dirty bit
+static tlb_entry_t *read_tlb(int level, uint64_t vaddr, int access)
+{
+    for (int size = 0; size < TLB_NUM_PAGE_SIZE; ++ size)
+    {
+        tlb_t *tlb = &mmu_tlb[level][size];
+        uint64_t vpn = vaddr >> TLB_PAGE_SHIFT(size);
+        int set = vpn & ((1 << tlb->index_length) - 1);
+        int way = find_tlb(tlb, vpn);
+        if (way < 0)
+        {
+            continue;
+        }
+
+        tlb_entry_t *entry = &tlb->entries[set * tlb->num_ways + way];
+        if (access == MMU_WRITE && (entry->readonly == 1 || entry->dirty == 0))
+        {
+            return NULL;
+        }
+
+        touch_tlb(tlb, set, way);
+        return entry;
+    }
+    return NULL;
+}
 
-    tlb_cacheset_t *set = &mmu_tlb.sets[vaddr.tlbi];
+static void write_tlb(int level, tlb_entry_t *entry)
+{
+    tlb_t *tlb = &mmu_tlb[level][entry->size];
+    int set = entry->vpn & ((1 << tlb->index_length) - 1);
 
-    if (0 <= free_tlb_line_index && free_tlb_line_index < NUM_TLB_CACHE_LINE_PER_SET)
+    // update the stale entry in place
+    int way = find_tlb(tlb, entry->vpn);
+    if (way < 0)
     {
-        tlb_cacheline_t *line = &set->lines[free_tlb_line_index];
+        way = tlb_victim(tlb, set);
+    }
 
-        line->valid = 1;
-        line->ppn = paddr.ppn;
-        line->tag = vaddr.tlbt;
+    tlb_entry_t *line = &tlb->entries[set * tlb->num_ways + way];
+    *line = *entry;
+    touch_tlb(tlb, set, way);
+}
+
+void flush_pwc()
+{
+    for (int i = 0; i < 3; ++ i)
+    {
+        memset(pwc[i].entries, 0, sizeof(pwc_entry_t) * pwc[i].num);
+    }
+}
+
+void print_pwc_stats()
+{
+    uint64_t n = pagewalk_ref_count + pagewalk_saved_count;
+    printf("PWC: %d PGD, %d PUD, %d PMD entries\n",
+        PWC_PGD_NUM_ENTRIES, PWC_PUD_NUM_ENTRIES, PWC_PMD_NUM_ENTRIES);
+    printf("    page walk references %lu, saved %lu (%.2f%%)\n",
+        pagewalk_ref_count, pagewalk_saved_count,
+        n == 0 ? 0.0 : 100.0 * (double)pagewalk_saved_count / (double)n);
+}
 
-        return 1;
+// the VPNs of the first levels
+static uint64_t pwc_prefix(int *vpns, int levels)
+{
+    uint64_t prefix = 0;
+    for (int i = 0; i < levels; ++ i)
+    {
+        prefix = (prefix << VIRTUAL_PAGE_NUMBER_LENGTH) | vpns[i];
     }
+    return prefix;
+}
 
-    // no free TLB cache line, select one RANDOM victim
-    int random_victim_index = random() % NUM_TLB_CACHE_LINE_PER_SET;
+// return the number of levels to skip, and the table to start with
+static int read_pwc(int *vpns, pte123_t **tab_ptr)
+{
+    for (int level = 3; level > 0; -- level)
+    {
+        uint64_t prefix = pwc_prefix(vpns, level);
+        pwc_entry_t *entries = pwc[level - 1].entries;
+        for (int i = 0; i < pwc[level - 1].num; ++ i)
+        {
+            if (entries[i].valid == 1 && entries[i].prefix == prefix)
+            {
+                pwc_clock += 1;
+                entries[i].time = pwc_clock;
+                *tab_ptr = entries[i].tab;
+                return level;
+            }
+        }
+    }
+    return 0;
+}
 
-    tlb_cacheline_t *line = &set->lines[random_victim_index];
+// level - the number of VPNs consumed to reach tab
+static void write_pwc(int *vpns, int level, pte123_t *tab)
+{
+    uint64_t prefix = pwc_prefix(vpns, level);
+    pwc_entry_t *entries = pwc[level - 1].entries;
 
-    line->valid = 1;
-    line->ppn = paddr.ppn;
-    line->tag = vaddr.tlbt;
+    // not cached yet, or read_pwc would start from here
+    // use the invalid entry, or the LRU victim
+    int victim = 0;
+    for (int i = 0; i < pwc[level - 1].num; ++ i)
+    {
+        if (entries[i].valid == 0)
+        {
+            victim = i;
+            break;
+        }
+        if (entries[i].time < entries[victim].time)
+        {
+            victim = i;
+        }
+    }
 
-    return 1;
+    pwc_clock += 1;
+    entries[victim].valid = 1;
+    entries[victim].prefix = prefix;
+    entries[victim].tab = tab;
+    entries[victim].time = pwc_clock;
 }
 #endif
 
 #ifdef USE_PAGETABLE_VA2PA
 // input - virtual address
-// output - physical address
-static uint64_t page_walk(uint64_t vaddr_value, int write_request)
+// output - physical address, the leaf page table entry, the page size
+//  and the write protection of the whole path
+// readonly in PGD, PUD or PMD entry protects the subtree below it:
+// fork shares the page tables this way
+static uint64_t page_walk(uint64_t vaddr_value, int access, pte4_t **pte_ptr, int *page_shift_ptr, int *readonly_ptr)
 {
     // parse address
     address_t vaddr = {
@@ -193,7 +600,6 @@ static uint64_t page_walk(uint64_t vaddr_value, int write_request)
         vaddr.vpn3,
         vaddr.vpn4,
     };
-    int vpo = vaddr.vpo;
 
     int page_table_size = PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t);
 
@@ -205,9 +611,29 @@ static uint64_t page_walk(uint64_t vaddr_value, int write_request)
 
     int level = 0;
     pte123_t *tab = pgd;
+    pte4_t *pte = NULL;
+    int page_shift = PHYSICAL_PAGE_OFFSET_LENGTH;
+    int readonly = 0;
+
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+    if (cpu_controls.cr3 != pwc_cr3)
+    {
+        // another address space
+        flush_pwc();
+        pwc_cr3 = cpu_controls.cr3;
+    }
+
+    // skip the levels cached
+    level = read_pwc(vpns, &tab);
+    pagewalk_saved_count += level;
+#endif
+
     while (level < 3)
     {
         int vpn = vpns[level];
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+        pagewalk_ref_count += 1;
+#endif
         if (tab[vpn].present != 1)
         {
             // page fault
@@ -215,28 +641,61 @@ static uint64_t page_walk(uint64_t vaddr_value, int write_request)
             goto RAISE_PAGE_FAULT;
         }
 
+        if (level > 0 && tab[vpn].pagesize == 1)
+        {
+            // huge page: 1GB leaf in PUD, 2MB leaf in PMD
+            pte = (pte4_t *)&tab[vpn];
+            page_shift = PHYSICAL_PAGE_OFFSET_LENGTH + (3 - level) * VIRTUAL_PAGE_NUMBER_LENGTH;
+            break;
+        }
+
         // move to next level
+        readonly |= tab[vpn].readonly;
         tab = (pte123_t *)((uint64_t)tab[vpn].paddr);
         level += 1;
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+        // read_pwc skips the levels: only cache the writable path
+        if (readonly == 0)
+        {
+            write_pwc(vpns, level, tab);
+        }
+#endif
+    }
+
+    if (pte == NULL)
+    {
+        pte = &((pte4_t *)tab)[vaddr.vpn4];
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+        pagewalk_ref_count += 1;
+#endif
     }
 
-    pte4_t *pte = &((pte4_t *)tab)[vaddr.vpn4];
     if (pte->present == 1)
     {
         // find page table entry
-        address_t paddr = {
-            .ppn = pte->ppn,
-            .ppo = vpo    // page offset inside the 4KB page
-        };
+        // the offset inside a huge page covers the lower VPNs
+        uint64_t offset = vaddr_value & ((1ul << page_shift) - 1);
+        uint64_t paddr = ((uint64_t)pte->ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + offset;
 
-        if (pte->readonly == 1 && write_request)
+        readonly |= pte->readonly;
+        if (readonly == 1 && access == MMU_WRITE)
         {
             // actually protection fault
             printf(REDSTR("\tProtection Fault\n"));
             goto RAISE_PAGE_FAULT;
         }
 
-        return paddr.paddr_value;
+        // accessed and dirty bits for page reclaim
+        pte->reference = 1;
+        if (access == MMU_WRITE)
+        {
+            pte->dirty = 1;
+        }
+
+        *pte_ptr = pte;
+        *page_shift_ptr = page_shift;
+        *readonly_ptr = readonly;
+        return paddr;
     }
     else
     {
@@ -245,6 +704,11 @@ static uint64_t page_walk(uint64_t vaddr_value, int write_request)
 
 RAISE_PAGE_FAULT:
     mmu_vaddr_pagefault = vaddr.vaddr_value;
+    if (mmu_fault_fixup != NULL)
+    {
+        // the kernel fixes the fault and retries
+        longjmp(*mmu_fault_fixup, 1);
+    }
     // This interrupt will not return
     interrupt_stack_switching(0x0e);
     return 0;
@@ -0,0 +1,443 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+// Hardware prefetchers in front of the SRAM cache
+// The demand accesses of sram.c train the prefetchers. The prefetchers
+// push cache line addresses to the prefetch queue, and the queue issues
+// them to the cache in the background (before the next demand access)
+// as long as the DRAM bandwidth budget of the current window allows.
+
+#include "headers/address.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+/*======================================*/
+/*      configuration                   */
+/*======================================*/
+
+#define PREFETCH_NEXT_LINE  (0x1)
+#define PREFETCH_IP_STRIDE  (0x2)
+#define PREFETCH_STREAM     (0x4)
+
+// prefetchers enabled
+#ifndef PREFETCHERS
+#define PREFETCHERS (PREFETCH_NEXT_LINE | PREFETCH_IP_STRIDE | PREFETCH_STREAM)
+#endif
+
+// number of cache lines requested for one trigger
+#ifndef PREFETCH_DEGREE
+#define PREFETCH_DEGREE (2)
+#endif
+
+// how many cache lines ahead of the trigger access
+#ifndef PREFETCH_DISTANCE
+#define PREFETCH_DISTANCE (2)
+#endif
+
+#ifndef PREFETCH_QUEUE_SIZE
+#define PREFETCH_QUEUE_SIZE (16)
+#endif
+
+// DRAM bandwidth budget: at most PREFETCH_BANDWIDTH cache line transfers
+// (demand misses + prefetches) in every PREFETCH_WINDOW demand accesses
+#ifndef PREFETCH_BANDWIDTH
+#define PREFETCH_BANDWIDTH (4)
+#endif
+
+#ifndef PREFETCH_WINDOW
+#define PREFETCH_WINDOW (16)
+#endif
+
+// DRAM latency counted in demand accesses
+// a prefetched line hit earlier than this is a late prefetch
+#ifndef PREFETCH_LATENCY
+#define PREFETCH_LATENCY (8)
+#endif
+
+#define PREFETCH_IP_TABLE_SIZE      (64)
+#define PREFETCH_NUM_STREAM         (8)
+#define PREFETCH_POLLUTION_FILTER   (256)
+
+// can be changed before the simulation starts
+int prefetchers = PREFETCHERS;
+int prefetch_degree = PREFETCH_DEGREE;
+int prefetch_distance = PREFETCH_DISTANCE;
+
+/*======================================*/
+/*      statistics                      */
+/*======================================*/
+
+uint64_t prefetch_clock = 0;            // number of demand accesses
+uint64_t prefetch_demand_miss_count = 0;
+uint64_t prefetch_requested_count = 0;  // pushed by the prefetchers
+uint64_t prefetch_dropped_count = 0;    // queue full
+uint64_t prefetch_redundant_count = 0;  // line already in cache
+uint64_t prefetch_issued_count = 0;     // lines filled by prefetch
+uint64_t prefetch_useful_count = 0;     // prefetched lines hit by demand
+uint64_t prefetch_late_count = 0;       // useful but arrived after the demand
+uint64_t prefetch_useless_count = 0;    // prefetched lines evicted unused
+uint64_t prefetch_pollution_count = 0;  // demand misses caused by prefetch evictions
+uint64_t prefetch_hidden_latency = 0;   // DRAM latency hidden, in demand accesses
+
+/*======================================*/
+/*      interface of sram.c             */
+/*======================================*/
+
+// fill the line by prefetch, return 0 if the line is already in cache,
+// -1 if the timing cache has no MSHR for it now
+int sram_cache_prefetch(uint64_t paddr_value);
+
+// the demand access that trains the prefetchers
+#define PREFETCH_TRAIN_MISS         (0)
+#define PREFETCH_TRAIN_HIT          (1)
+#define PREFETCH_TRAIN_HIT_PREFETCH (2)
+
+/*======================================*/
+/*      prefetch queue                  */
+/*======================================*/
+
+static struct
+{
+    uint64_t block[PREFETCH_QUEUE_SIZE];
+    int head;
+    int count;
+    // bandwidth used inside the current window
+    int window_used;
+    uint64_t window_start;
+} queue;
+
+static uint64_t block_of(uint64_t paddr)
+{
+    return paddr >> SRAM_CACHE_OFFSET_LENGTH;
+}
+
+static int same_page(uint64_t block_a, uint64_t block_b)
+{
+    // hardware prefetchers do not cross the physical page
+    int shift = PHYSICAL_PAGE_OFFSET_LENGTH - SRAM_CACHE_OFFSET_LENGTH;
+    if (shift <= 0)
+    {
+        return block_a == block_b;
+    }
+    return (block_a >> shift) == (block_b >> shift);
+}
+
+static void queue_push(uint64_t trigger, int64_t delta)
+{
+    uint64_t block = (uint64_t)((int64_t)trigger + delta);
+    if (delta == 0 || same_page(trigger, block) == 0)
+    {
+        return;
+    }
+
+    prefetch_requested_count ++;
+
+    for (int i = 0; i < queue.count; ++ i)
+    {
+        if (queue.block[(queue.head + i) % PREFETCH_QUEUE_SIZE] == block)
+        {
+            // merge with the pending request
+            return;
+        }
+    }
+
+    if (queue.count == PREFETCH_QUEUE_SIZE)
+    {
+        prefetch_dropped_count ++;
+        return;
+    }
+
+    queue.block[(queue.head + queue.count) % PREFETCH_QUEUE_SIZE] = block;
+    queue.count ++;
+}
+
+static void push_degree(uint64_t trigger, int64_t step)
+{
+    for (int i = 0; i < prefetch_degree; ++ i)
+    {
+        queue_push(trigger, step * (prefetch_distance + i));
+    }
+}
+
+// issue the pending prefetches before the next demand access
+void prefetch_issue()
+{
+    if (prefetch_clock - queue.window_start >= PREFETCH_WINDOW)
+    {
+        queue.window_start = prefetch_clock;
+        queue.window_used = 0;
+    }
+
+    while (queue.count > 0 && queue.window_used < PREFETCH_BANDWIDTH)
+    {
+        uint64_t block = queue.block[queue.head];
+        int filled = sram_cache_prefetch(block << SRAM_CACHE_OFFSET_LENGTH);
+        if (filled == -1)
+        {
+            // all MSHRs are busy, try again before the next demand access
+            break;
+        }
+        queue.head = (queue.head + 1) % PREFETCH_QUEUE_SIZE;
+        queue.count --;
+
+        if (filled == 0)
+        {
+            // no DRAM transfer for redundant prefetch
+            prefetch_redundant_count ++;
+            continue;
+        }
+
+        prefetch_issued_count ++;
+        queue.window_used ++;
+    }
+}
+
+/*======================================*/
+/*      pollution filter                */
+/*======================================*/
+
+// lines evicted by prefetch fills, if the demand misses on them later,
+// the prefetch polluted the cache
+static struct
+{
+    int valid;
+    uint64_t block;
+} pollution_filter[PREFETCH_POLLUTION_FILTER];
+
+void prefetch_evict(uint64_t victim_paddr)
+{
+    uint64_t block = block_of(victim_paddr);
+    int i = block % PREFETCH_POLLUTION_FILTER;
+    pollution_filter[i].valid = 1;
+    pollution_filter[i].block = block;
+}
+
+void prefetch_unused()
+{
+    prefetch_useless_count ++;
+}
+
+void prefetch_used(uint64_t issue_time)
+{
+    prefetch_useful_count ++;
+
+    uint64_t elapsed = prefetch_clock - issue_time;
+    if (elapsed < PREFETCH_LATENCY)
+    {
+        // the line is still on the way, part of the latency is hidden
+        prefetch_late_count ++;
+        prefetch_hidden_latency += elapsed;
+    }
+    else
+    {
+        prefetch_hidden_latency += PREFETCH_LATENCY;
+    }
+}
+
+/*======================================*/
+/*      prefetchers                     */
+/*======================================*/
+
+static void next_line_train(uint64_t block, int event)
+{
+    // tagged next-line: trigger on miss and on the first use of a prefetched line
+    if (event == PREFETCH_TRAIN_HIT)
+    {
+        return;
+    }
+    push_degree(block, 1);
+}
+
+// IP-stride: the stride of the block addresses accessed by one instruction
+static struct
+{
+    int valid;
+    uint64_t pc;
+    uint64_t last_block;
+    int64_t stride;
+    int confidence;
+} ip_table[PREFETCH_IP_TABLE_SIZE];
+
+static void ip_stride_train(uint64_t pc, uint64_t block)
+{
+    int i = (pc ^ (pc >> 6)) % PREFETCH_IP_TABLE_SIZE;
+
+    if (ip_table[i].valid == 0 || ip_table[i].pc != pc)
+    {
+        ip_table[i].valid = 1;
+        ip_table[i].pc = pc;
+        ip_table[i].last_block = block;
+        ip_table[i].stride = 0;
+        ip_table[i].confidence = 0;
+        return;
+    }
+
+    int64_t stride = (int64_t)block - (int64_t)ip_table[i].last_block;
+    if (stride == 0)
+    {
+        // still inside the same cache line
+        return;
+    }
+
+    if (stride == ip_table[i].stride)
+    {
+        if (ip_table[i].confidence < 3)
+        {
+            ip_table[i].confidence ++;
+        }
+    }
+    else
+    {
+        if (ip_table[i].confidence > 0)
+        {
+            ip_table[i].confidence --;
+        }
+        if (ip_table[i].confidence == 0)
+        {
+            ip_table[i].stride = stride;
+        }
+    }
+    ip_table[i].last_block = block;
+
+    if (ip_table[i].confidence >= 2)
+    {
+        push_degree(block, ip_table[i].stride);
+    }
+}
+
+// stream buffer: ascending or descending misses inside one page
+static struct
+{
+    int valid;
+    uint64_t last_block;
+    int direction;
+    int confidence;
+    uint64_t time;  // for LRU
+} streams[PREFETCH_NUM_STREAM];
+
+static void stream_train(uint64_t block, int event)
+{
+    if (event == PREFETCH_TRAIN_HIT)
+    {
+        return;
+    }
+
+    int lru = 0;
+    for (int i = 0; i < PREFETCH_NUM_STREAM; ++ i)
+    {
+        if (streams[i].valid == 1 && same_page(streams[i].last_block, block))
+        {
+            streams[i].time = prefetch_clock;
+
+            int direction = block > streams[i].last_block ? 1 : -1;
+            if (block == streams[i].last_block)
+            {
+                return;
+            }
+
+            if (direction == streams[i].direction)
+            {
+                if (streams[i].confidence < 3)
+                {
+                    streams[i].confidence ++;
+                }
+            }
+            else
+            {
+                streams[i].direction = direction;
+                streams[i].confidence = 1;
+            }
+            streams[i].last_block = block;
+
+            if (streams[i].confidence >= 2)
+            {
+                push_degree(block, streams[i].direction);
+            }
+            return;
+        }
+
+        if (streams[i].valid == 0)
+        {
+            lru = i;
+        }
+        else if (streams[lru].valid == 1 && streams[i].time < streams[lru].time)
+        {
+            lru = i;
+        }
+    }
+
+    // allocate a new stream
+    streams[lru].valid = 1;
+    streams[lru].last_block = block;
+    streams[lru].direction = 0;
+    streams[lru].confidence = 0;
+    streams[lru].time = prefetch_clock;
+}
+
+// called by sram.c for every demand access
+void prefetch_train(uint64_t pc, uint64_t paddr, int event)
+{
+    uint64_t block = block_of(paddr);
+
+    prefetch_clock ++;
+
+    if (event == PREFETCH_TRAIN_MISS)
+    {
+        prefetch_demand_miss_count ++;
+
+        // demand fill consumes the DRAM bandwidth
+        queue.window_used ++;
+
+        int i = block % PREFETCH_POLLUTION_FILTER;
+        if (pollution_filter[i].valid == 1 && pollution_filter[i].block == block)
+        {
+            prefetch_pollution_count ++;
+            pollution_filter[i].valid = 0;
+        }
+    }
+
+    if ((prefetchers & PREFETCH_NEXT_LINE) != 0)
+    {
+        next_line_train(block, event);
+    }
+    if ((prefetchers & PREFETCH_IP_STRIDE) != 0)
+    {
+        ip_stride_train(pc, block);
+    }
+    if ((prefetchers & PREFETCH_STREAM) != 0)
+    {
+        stream_train(block, event);
+    }
+}
+
+void print_prefetch_stats()
+{
+    double accuracy = prefetch_issued_count == 0 ? 0.0 :
+        (double)prefetch_useful_count / (double)prefetch_issued_count;
+    double coverage = (prefetch_useful_count + prefetch_demand_miss_count) == 0 ? 0.0 :
+        (double)prefetch_useful_count / (double)(prefetch_useful_count + prefetch_demand_miss_count);
+    uint64_t total_latency = (prefetch_useful_count + prefetch_demand_miss_count) * PREFETCH_LATENCY;
+
+    printf("prefetch: degree %d distance %d prefetchers 0x%x\n",
+        prefetch_degree, prefetch_distance, prefetchers);
+    printf("    demand accesses     %lu\n", prefetch_clock);
+    printf("    demand misses       %lu\n", prefetch_demand_miss_count);
+    printf("    requested           %lu (dropped %lu, redundant %lu)\n",
+        prefetch_requested_count, prefetch_dropped_count, prefetch_redundant_count);
+    printf("    issued              %lu\n", prefetch_issued_count);
+    printf("    useful              %lu (late %lu)\n", prefetch_useful_count, prefetch_late_count);
+    printf("    useless             %lu\n", prefetch_useless_count);
+    printf("    pollution           %lu\n", prefetch_pollution_count);
+    printf("    accuracy            %.4f\n", accuracy);
+    printf("    coverage            %.4f\n", coverage);
+    printf("    latency hidden      %lu / %lu\n", prefetch_hidden_latency, total_latency);
+}
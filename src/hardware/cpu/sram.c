@@ -39,6 +39,29 @@ char *trace_ptr = (char *)&trace_buf;
 #define NUM_CACHE_LINE_PER_SET (8)
 #endif
 
+#ifdef USE_SRAM_PREFETCH
+// prefetch.c
+void prefetch_issue();
+void prefetch_train(uint64_t pc, uint64_t paddr, int event);
+void prefetch_used(uint64_t issue_time);
+void prefetch_unused();
+void prefetch_evict(uint64_t victim_paddr);
+extern uint64_t prefetch_clock;
+
+#define PREFETCH_TRAIN_MISS         (0)
+#define PREFETCH_TRAIN_HIT          (1)
+#define PREFETCH_TRAIN_HIT_PREFETCH (2)
+
+#ifdef CACHE_SIMULATION_VERIFICATION
+// no instruction in the trace, set by python script
+uint64_t trace_pc = 0;
+#define PREFETCH_PC (trace_pc)
+#else
+#include "headers/cpu.h"
+#define PREFETCH_PC (cpu_pc.rip)
+#endif
+#endif
+
 // write-back and write-allocate
 typedef enum
 {
@@ -52,6 +75,10 @@ typedef struct
     sram_cacheline_state_t state;
     int time;  // timer to find LRU line inside one set
     uint64_t tag;
+#ifdef USE_SRAM_PREFETCH
+    int prefetched;             // filled by prefetch and not used yet
+    uint64_t prefetch_time;     // prefetch_clock when issued
+#endif
     uint8_t block[(1 << SRAM_CACHE_OFFSET_LENGTH)];
 } sram_cacheline_t;
 
@@ -67,10 +94,470 @@ typedef struct
 
 static sram_cache_t cache;
 
+// physical address of the cache line in set ci
+static uint64_t line_paddr(sram_cacheline_t *line, uint64_t ci)
+{
+    return (line->tag << (SRAM_CACHE_INDEX_LENGTH + SRAM_CACHE_OFFSET_LENGTH)) |
+        (ci << SRAM_CACHE_OFFSET_LENGTH);
+}
+
+#ifdef USE_SRAM_TIMING
+/*  Timing model of the non-blocking cache
+    The data still moves synchronously (functional), only the cycles
+    are modeled. One demand access is issued per cycle and the core
+    does not wait for the data:
+    - a miss takes one MSHR until the line arrives from DRAM;
+      the core stalls only when all MSHRs are busy
+    - a later access to the in-flight line merges into its MSHR
+    - a dirty victim goes to the write buffer, which drains to DRAM
+      in the background; the core stalls only when it is full
+    - a prefetch takes one MSHR and one DRAM request as a miss does,
+      but it never stalls the core: it waits in the prefetch queue
+      till an MSHR is free. The prefetched line is filled at once, but
+      a demand access to it merges into the MSHR till the line arrives
+ */
+
+#ifndef NUM_MSHR
+#define NUM_MSHR (8)
+#endif
+
+// demand accesses one MSHR can merge
+// dram.c reads a 64-bit word byte by byte, 8 accesses
+#ifndef NUM_MSHR_TARGET
+#define NUM_MSHR_TARGET (8)
+#endif
+
+#ifndef NUM_WRITE_BUFFER
+#define NUM_WRITE_BUFFER (8)
+#endif
+
+#ifndef SRAM_HIT_CYCLES
+#define SRAM_HIT_CYCLES (4)
+#endif
+
+#ifndef DRAM_READ_CYCLES
+#define DRAM_READ_CYCLES (100)
+#endif
+
+// DRAM occupancy of one line written back
+#ifndef DRAM_WRITE_CYCLES
+#define DRAM_WRITE_CYCLES (20)
+#endif
+
+typedef struct
+{
+    int valid;
+    uint64_t block;     // paddr >> SRAM_CACHE_OFFSET_LENGTH
+    uint64_t ready;     // cycle when the line arrives
+    int targets;        // demand accesses waiting for this line
+#ifdef USE_DRAM_TIMING
+    int request;        // id in the DRAM controller queue
+#endif
+#ifdef USE_SRAM_PREFETCH
+    int prefetch;       // requested by prefetch, not by demand
+#endif
+} sram_mshr_t;
+
+typedef struct
+{
+    uint64_t paddr;
+    uint64_t done;      // cycle when the line is written into DRAM
+#ifdef USE_DRAM_TIMING
+    int request;        // id in the DRAM controller queue
+#endif
+    uint8_t block[(1 << SRAM_CACHE_OFFSET_LENGTH)];
+} sram_writebuffer_entry_t;
+
+static sram_mshr_t mshr[NUM_MSHR];
+
+static struct
+{
+    sram_writebuffer_entry_t entries[NUM_WRITE_BUFFER];
+    int head;
+    int count;
+    uint64_t last_done;
+} write_buffer;
+
+uint64_t sram_cycle = 0;
+uint64_t sram_finish_cycle = 0;     // when the last access completes
+uint64_t sram_access_count = 0;
+uint64_t sram_mshr_miss_count = 0;  // primary misses
+uint64_t sram_mshr_merge_count = 0; // secondary misses merged
+uint64_t sram_mshr_inflight_sum = 0;// in-flight MSHRs seen by primary misses
+uint64_t sram_mshr_stall_cycles = 0;
+uint64_t sram_wb_push_count = 0;
+uint64_t sram_wb_forward_count = 0;
+uint64_t sram_wb_stall_cycles = 0;
+uint64_t sram_prefetch_mshr_count = 0;  // prefetches sent to DRAM
+uint64_t sram_prefetch_late_count = 0;  // demand accesses waiting for a prefetch
+
+static void sram_timing_complete(uint64_t cycle)
+{
+    if (sram_finish_cycle < cycle)
+    {
+        sram_finish_cycle = cycle;
+    }
+}
+
+#ifdef USE_DRAM_TIMING
+// the completion cycle is known after the controller schedules the request
+static void dram_resolve(int request, uint64_t *ready)
+{
+    if (*ready == 0)
+    {
+        *ready = dram_ctrl_complete(request);
+        if (*ready != 0)
+        {
+            dram_ctrl_release(request);
+        }
+    }
+}
+#endif
+
+// let DRAM schedule the requests starting before `until`
+// 0 in ready and done means not scheduled yet
+static void sram_timing_resolve(uint64_t until)
+{
+#ifdef USE_DRAM_TIMING
+    dram_ctrl_run(until);
+
+    for (int i = 0; i < NUM_MSHR; ++ i)
+    {
+        if (mshr[i].valid == 1)
+        {
+            dram_resolve(mshr[i].request, &mshr[i].ready);
+        }
+    }
+
+    for (int i = 0; i < write_buffer.count; ++ i)
+    {
+        sram_writebuffer_entry_t *e =
+            &write_buffer.entries[(write_buffer.head + i) % NUM_WRITE_BUFFER];
+        dram_resolve(e->request, &e->done);
+    }
+#endif
+}
+
+// nobody waits for the line prefetched but not accessed yet
+static int mshr_waited(sram_mshr_t *m)
+{
+#ifdef USE_SRAM_PREFETCH
+    return m->prefetch == 0 || m->targets > 0;
+#else
+    return 1;
+#endif
+}
+
+// move the clock forward: retire MSHRs and drain the write buffer
+static void sram_timing_advance(uint64_t cycle)
+{
+    sram_cycle = cycle;
+    sram_timing_resolve(cycle);
+
+    for (int i = 0; i < NUM_MSHR; ++ i)
+    {
+        if (mshr[i].valid == 1 && mshr[i].ready != 0 && mshr[i].ready <= cycle)
+        {
+            if (mshr_waited(&mshr[i]) == 1)
+            {
+                sram_timing_complete(mshr[i].ready);
+            }
+            mshr[i].valid = 0;
+        }
+    }
+
+    while (write_buffer.count > 0 &&
+        write_buffer.entries[write_buffer.head].done != 0 &&
+        write_buffer.entries[write_buffer.head].done <= cycle)
+    {
+#ifndef CACHE_SIMULATION_VERIFICATION
+        sram_writebuffer_entry_t *e = &write_buffer.entries[write_buffer.head];
+        bus_write_cacheline(e->paddr, e->block);
+#endif
+        write_buffer.head = (write_buffer.head + 1) % NUM_WRITE_BUFFER;
+        write_buffer.count --;
+    }
+}
+
+static void sram_timing_stall(uint64_t until, uint64_t *stall_cycles)
+{
+    if (until > sram_cycle)
+    {
+        *stall_cycles += until - sram_cycle;
+        sram_timing_advance(until);
+    }
+    else
+    {
+        sram_timing_advance(sram_cycle);
+    }
+}
+
+static sram_mshr_t *sram_timing_inflight(uint64_t paddr_value)
+{
+    uint64_t block = paddr_value >> SRAM_CACHE_OFFSET_LENGTH;
+    for (int i = 0; i < NUM_MSHR; ++ i)
+    {
+        if (mshr[i].valid == 1 && mshr[i].block == block)
+        {
+            return &mshr[i];
+        }
+    }
+    return NULL;
+}
+
+static void sram_timing_merge(sram_mshr_t *m)
+{
+    sram_mshr_merge_count ++;
+#ifdef USE_SRAM_PREFETCH
+    if (m->prefetch == 1 && m->targets == 0)
+    {
+        // the prefetched line is still on the way
+        sram_prefetch_late_count ++;
+    }
+#endif
+
+    if (m->targets == NUM_MSHR_TARGET)
+    {
+        // no room to record this access, wait for the line
+        // no new request arrives while the core waits
+        sram_timing_resolve(UINT64_MAX);
+        sram_timing_stall(m->ready, &sram_mshr_stall_cycles);
+        return;
+    }
+    m->targets ++;
+}
+
+static void sram_timing_hit(uint64_t paddr_value)
+{
+    sram_access_count ++;
+
+    // the tag matches but the data may still be on the way
+    sram_mshr_t *m = sram_timing_inflight(paddr_value);
+    if (m != NULL)
+    {
+        sram_timing_merge(m);
+        return;
+    }
+    sram_timing_complete(sram_cycle + SRAM_HIT_CYCLES);
+}
+
+static void sram_timing_miss(uint64_t paddr_value)
+{
+    sram_access_count ++;
+
+    sram_mshr_t *m = sram_timing_inflight(paddr_value);
+    if (m != NULL)
+    {
+        // the line was evicted before it arrived, still one request
+        sram_timing_merge(m);
+        return;
+    }
+
+    sram_mshr_miss_count ++;
+
+    while (1)
+    {
+        int inflight = 0;
+
+        for (int i = 0; i < NUM_MSHR; ++ i)
+        {
+            if (mshr[i].valid == 0)
+            {
+                m = &mshr[i];
+            }
+            else
+            {
+                inflight ++;
+            }
+        }
+
+        if (m != NULL)
+        {
+            sram_mshr_inflight_sum += inflight;
+            break;
+        }
+
+        // all MSHRs are busy, stall until one of them retires
+        // no new request arrives while the core waits
+        sram_timing_resolve(UINT64_MAX);
+
+        uint64_t earliest = UINT64_MAX;
+        for (int i = 0; i < NUM_MSHR; ++ i)
+        {
+            if (mshr[i].ready < earliest)
+            {
+                earliest = mshr[i].ready;
+            }
+        }
+        sram_timing_stall(earliest, &sram_mshr_stall_cycles);
+    }
+
+    m->valid = 1;
+    m->block = paddr_value >> SRAM_CACHE_OFFSET_LENGTH;
+    m->targets = 1;
+#ifdef USE_SRAM_PREFETCH
+    m->prefetch = 0;
+#endif
+#ifdef USE_DRAM_TIMING
+    m->ready = 0;
+    m->request = dram_ctrl_request(paddr_value, 0, sram_cycle);
+#else
+    m->ready = sram_cycle + DRAM_READ_CYCLES;
+#endif
+}
+
+#ifdef USE_SRAM_PREFETCH
+// return value: 0 if no MSHR is free, the prefetch has to wait
+static int sram_timing_prefetch(uint64_t paddr_value)
+{
+    sram_timing_resolve(sram_cycle);
+
+    sram_mshr_t *m = NULL;
+    for (int i = 0; i < NUM_MSHR; ++ i)
+    {
+        if (mshr[i].valid == 0)
+        {
+            m = &mshr[i];
+            break;
+        }
+    }
+    if (m == NULL)
+    {
+        return 0;
+    }
+
+    sram_prefetch_mshr_count ++;
+    m->valid = 1;
+    m->block = paddr_value >> SRAM_CACHE_OFFSET_LENGTH;
+    m->targets = 0;
+    m->prefetch = 1;
+#ifdef USE_DRAM_TIMING
+    m->ready = 0;
+    m->request = dram_ctrl_request(paddr_value, 0, sram_cycle);
+#else
+    m->ready = sram_cycle + DRAM_READ_CYCLES;
+#endif
+    return 1;
+}
+#endif
+
+void print_sram_timing()
+{
+    // count the outstanding misses and write backs till they complete
+    sram_timing_resolve(UINT64_MAX);
+
+    uint64_t cycles = sram_cycle > sram_finish_cycle ? sram_cycle : sram_finish_cycle;
+    for (int i = 0; i < NUM_MSHR; ++ i)
+    {
+        if (mshr[i].valid == 1 && mshr_waited(&mshr[i]) == 1 && mshr[i].ready > cycles)
+        {
+            cycles = mshr[i].ready;
+        }
+    }
+    for (int i = 0; i < write_buffer.count; ++ i)
+    {
+        sram_writebuffer_entry_t *e =
+            &write_buffer.entries[(write_buffer.head + i) % NUM_WRITE_BUFFER];
+        if (e->done > cycles)
+        {
+            cycles = e->done;
+        }
+    }
+
+    printf("sram timing: %d MSHRs, %d write buffer entries\n", NUM_MSHR, NUM_WRITE_BUFFER);
+    printf("    cycles              %lu\n", cycles);
+    printf("    demand accesses     %lu\n", sram_access_count);
+    printf("    primary misses      %lu\n", sram_mshr_miss_count);
+    printf("    merged misses       %lu\n", sram_mshr_merge_count);
+    printf("    MSHR stall cycles   %lu\n", sram_mshr_stall_cycles);
+    printf("    memory parallelism  %.4f\n", sram_mshr_miss_count == 0 ? 0.0 :
+        1.0 + (double)sram_mshr_inflight_sum / (double)sram_mshr_miss_count);
+    printf("    write backs         %lu (forwarded %lu)\n", sram_wb_push_count, sram_wb_forward_count);
+    printf("    write buffer stall  %lu\n", sram_wb_stall_cycles);
+#ifdef USE_SRAM_PREFETCH
+    printf("    prefetch requests   %lu (late %lu)\n", sram_prefetch_mshr_count, sram_prefetch_late_count);
+#endif
+
+#ifdef USE_DRAM_TIMING
+    print_dram_stats();
+#endif
+}
+#endif
+
+// load the line from DRAM, or from the write buffer if it is still there
+static void cacheline_fetch(uint64_t paddr_value, uint8_t *block)
+{
+#ifdef USE_SRAM_TIMING
+    uint64_t line = (paddr_value >> SRAM_CACHE_OFFSET_LENGTH) << SRAM_CACHE_OFFSET_LENGTH;
+
+    // the newest copy wins
+    for (int i = write_buffer.count - 1; i >= 0; -- i)
+    {
+        sram_writebuffer_entry_t *e =
+            &write_buffer.entries[(write_buffer.head + i) % NUM_WRITE_BUFFER];
+        if (e->paddr == line)
+        {
+            memcpy(block, e->block, (1 << SRAM_CACHE_OFFSET_LENGTH));
+            sram_wb_forward_count ++;
+            return;
+        }
+    }
+#endif
+
+#ifndef CACHE_SIMULATION_VERIFICATION
+    bus_read_cacheline(paddr_value, block);
+#endif
+}
+
+// write the dirty line back to DRAM
+static void cacheline_writeback(uint64_t paddr_value, uint8_t *block)
+{
+#ifdef USE_SRAM_TIMING
+    if (write_buffer.count == NUM_WRITE_BUFFER)
+    {
+        // write buffer is full, stall until the oldest line drains
+        sram_timing_resolve(UINT64_MAX);
+        sram_timing_stall(write_buffer.entries[write_buffer.head].done, &sram_wb_stall_cycles);
+    }
+
+    sram_writebuffer_entry_t *e =
+        &write_buffer.entries[(write_buffer.head + write_buffer.count) % NUM_WRITE_BUFFER];
+    write_buffer.count ++;
+    sram_wb_push_count ++;
+
+    e->paddr = paddr_value;
+    memcpy(e->block, block, (1 << SRAM_CACHE_OFFSET_LENGTH));
+
+#ifdef USE_DRAM_TIMING
+    e->done = 0;
+    e->request = dram_ctrl_request(paddr_value, 1, sram_cycle);
+#else
+    // DRAM writes are served one after another
+    uint64_t start = write_buffer.last_done > sram_cycle ? write_buffer.last_done : sram_cycle;
+    e->done = start + DRAM_WRITE_CYCLES;
+    write_buffer.last_done = e->done;
+#endif
+#else
+#ifndef CACHE_SIMULATION_VERIFICATION
+    bus_write_cacheline(paddr_value, block);
+#endif
+#endif
+}
+
 uint8_t sram_cache_read(uint64_t paddr_value)
 {
+#ifdef USE_SRAM_TIMING
+    // one demand access is issued every cycle
+    sram_timing_advance(sram_cycle + 1);
+#endif
+
+#ifdef USE_SRAM_PREFETCH
+    // pending prefetches are issued between the demand accesses
+    prefetch_issue();
+#endif
+
     address_t paddr = {
-        .paddr_value = paddr_value,
+        .address_value = paddr_value,
     };
 
     sram_cacheset_t *set = &cache.sets[paddr.ci];
@@ -117,6 +604,24 @@ uint8_t sram_cache_read(uint64_t paddr_value)
             // update LRU time
             line->time = 0;
 
+#ifdef USE_SRAM_TIMING
+            sram_timing_hit(paddr_value);
+#endif
+
+#ifdef USE_SRAM_PREFETCH
+            if (line->prefetched == 1)
+            {
+                // first demand access to the prefetched line
+                line->prefetched = 0;
+                prefetch_used(line->prefetch_time);
+                prefetch_train(PREFETCH_PC, paddr_value, PREFETCH_TRAIN_HIT_PREFETCH);
+            }
+            else
+            {
+                prefetch_train(PREFETCH_PC, paddr_value, PREFETCH_TRAIN_HIT);
+            }
+#endif
+
             // find the byte
             return line->block[paddr.co];
         }
@@ -128,13 +633,20 @@ uint8_t sram_cache_read(uint64_t paddr_value)
     cache_miss_count ++;
 #endif
 
+#ifdef USE_SRAM_TIMING
+    sram_timing_miss(paddr_value);
+#endif
+
+#ifdef USE_SRAM_PREFETCH
+    prefetch_train(PREFETCH_PC, paddr_value, PREFETCH_TRAIN_MISS);
+#endif
+
     // try to find one free cache line
     if (invalid != NULL)
     {
-#ifndef CACHE_SIMULATION_VERIFICATION
         // load data from DRAM to this invalid cache line
-        bus_read_cacheline(paddr.paddr_value, &(invalid->block));
-#endif
+        cacheline_fetch(paddr.paddr_value, invalid->block);
+
         // update cache line state
         invalid->state = CACHE_LINE_CLEAN;
 
@@ -143,6 +655,9 @@ uint8_t sram_cache_read(uint64_t paddr_value)
 
         // update tag
         invalid->tag = paddr.ct;
+#ifdef USE_SRAM_PREFETCH
+        invalid->prefetched = 0;
+#endif
 
         return invalid->block[paddr.co];
     }
@@ -152,10 +667,9 @@ uint8_t sram_cache_read(uint64_t paddr_value)
 
     if (victim->state == CACHE_LINE_DIRTY)
     {
-#ifndef CACHE_SIMULATION_VERIFICATION
         // write back the dirty line to dram
-        bus_write_cacheline(paddr.paddr_value, victim);
-#else
+        cacheline_writeback(line_paddr(victim, paddr.ci), victim->block);
+#ifdef CACHE_SIMULATION_VERIFICATION
         dirty_bytes_evicted_count   += (1 << SRAM_CACHE_OFFSET_LENGTH);
         dirty_bytes_in_cache_count  -= (1 << SRAM_CACHE_OFFSET_LENGTH);
 #endif
@@ -166,14 +680,19 @@ uint8_t sram_cache_read(uint64_t paddr_value)
     cache_evict_count ++;
 #endif
 
+#ifdef USE_SRAM_PREFETCH
+    if (victim->prefetched == 1)
+    {
+        prefetch_unused();
+    }
+#endif
+
     // update state
     victim->state = CACHE_LINE_INVALID;
 
-#ifndef CACHE_SIMULATION_VERIFICATION
     // read from dram
     // load data from DRAM to this invalid cache line
-    bus_read_cacheline(paddr.paddr_value, &(victim->block));
-#endif
+    cacheline_fetch(paddr.paddr_value, victim->block);
 
     // update cache line state
     victim->state = CACHE_LINE_CLEAN;
@@ -183,14 +702,27 @@ uint8_t sram_cache_read(uint64_t paddr_value)
 
     // update tag
     victim->tag = paddr.ct;
+#ifdef USE_SRAM_PREFETCH
+    victim->prefetched = 0;
+#endif
 
     return victim->block[paddr.co];
 }
 
 void sram_cache_write(uint64_t paddr_value, uint8_t data)
 {
+#ifdef USE_SRAM_TIMING
+    // one demand access is issued every cycle
+    sram_timing_advance(sram_cycle + 1);
+#endif
+
+#ifdef USE_SRAM_PREFETCH
+    // pending prefetches are issued between the demand accesses
+    prefetch_issue();
+#endif
+
     address_t paddr = {
-        .paddr_value = paddr_value,
+        .address_value = paddr_value,
     };
 
     sram_cacheset_t *set = &(cache.sets[paddr.ci]);
@@ -241,6 +773,24 @@ void sram_cache_write(uint64_t paddr_value, uint8_t data)
             // update LRU time
             line->time = 0;
 
+#ifdef USE_SRAM_TIMING
+            sram_timing_hit(paddr_value);
+#endif
+
+#ifdef USE_SRAM_PREFETCH
+            if (line->prefetched == 1)
+            {
+                // first demand access to the prefetched line
+                line->prefetched = 0;
+                prefetch_used(line->prefetch_time);
+                prefetch_train(PREFETCH_PC, paddr_value, PREFETCH_TRAIN_HIT_PREFETCH);
+            }
+            else
+            {
+                prefetch_train(PREFETCH_PC, paddr_value, PREFETCH_TRAIN_HIT);
+            }
+#endif
+
             // find the byte
             line->block[paddr.co] = data;
 
@@ -257,15 +807,22 @@ void sram_cache_write(uint64_t paddr_value, uint8_t data)
     cache_miss_count ++;
 #endif
 
+#ifdef USE_SRAM_TIMING
+    sram_timing_miss(paddr_value);
+#endif
+
+#ifdef USE_SRAM_PREFETCH
+    prefetch_train(PREFETCH_PC, paddr_value, PREFETCH_TRAIN_MISS);
+#endif
+
     // write-allocate
 
     // try to find one free cache line
     if (invalid != NULL)
     {
-#ifndef CACHE_SIMULATION_VERIFICATION
         // load data from DRAM to this invalid cache line
-        bus_read_cacheline(paddr.paddr_value, &(invalid->block));
-#else
+        cacheline_fetch(paddr.paddr_value, invalid->block);
+#ifdef CACHE_SIMULATION_VERIFICATION
         dirty_bytes_in_cache_count += (1 << SRAM_CACHE_OFFSET_LENGTH);
 #endif
 
@@ -277,6 +834,9 @@ void sram_cache_write(uint64_t paddr_value, uint8_t data)
 
         // update tag
         invalid->tag = paddr.ct;
+#ifdef USE_SRAM_PREFETCH
+        invalid->prefetched = 0;
+#endif
 
         // write data
         invalid->block[paddr.co] = data;
@@ -289,10 +849,9 @@ void sram_cache_write(uint64_t paddr_value, uint8_t data)
 
     if (victim->state == CACHE_LINE_DIRTY)
     {
-#ifndef CACHE_SIMULATION_VERIFICATION
         // write back the dirty line to dram
-        bus_write_cacheline(paddr.paddr_value, victim);
-#else
+        cacheline_writeback(line_paddr(victim, paddr.ci), victim->block);
+#ifdef CACHE_SIMULATION_VERIFICATION
         dirty_bytes_evicted_count   += (1 << SRAM_CACHE_OFFSET_LENGTH);
         dirty_bytes_in_cache_count  -= (1 << SRAM_CACHE_OFFSET_LENGTH);
 #endif
@@ -305,15 +864,20 @@ void sram_cache_write(uint64_t paddr_value, uint8_t data)
     dirty_bytes_in_cache_count += (1 << SRAM_CACHE_OFFSET_LENGTH);
 #endif
 
+#ifdef USE_SRAM_PREFETCH
+    if (victim->prefetched == 1)
+    {
+        prefetch_unused();
+    }
+#endif
+
     // update state
     victim->state = CACHE_LINE_INVALID;
 
-#ifndef CACHE_SIMULATION_VERIFICATION
     // read from dram
     // write-allocate
     // load data from DRAM to this invalid cache line
-    bus_read_cacheline(paddr.paddr_value, &(victim->block));
-#endif
+    cacheline_fetch(paddr.paddr_value, victim->block);
 
     // update cache line state
     victim->state = CACHE_LINE_DIRTY;
@@ -323,10 +887,106 @@ void sram_cache_write(uint64_t paddr_value, uint8_t data)
 
     // update tag
     victim->tag = paddr.ct;
+#ifdef USE_SRAM_PREFETCH
+    victim->prefetched = 0;
+#endif
 
     victim->block[paddr.co] = data;
 }
 
+#ifdef USE_SRAM_PREFETCH
+// fill one cache line requested by the prefetcher
+// not a demand access: the hit/miss counters are not touched
+// return 0 if the line is already in cache, -1 if no MSHR is free
+int sram_cache_prefetch(uint64_t paddr_value)
+{
+    address_t paddr = {
+        .address_value = paddr_value,
+    };
+
+    sram_cacheset_t *set = &cache.sets[paddr.ci];
+
+    sram_cacheline_t *victim = NULL;
+    sram_cacheline_t *invalid = NULL;
+    int max_time = -1;
+
+    for (int i = 0; i < NUM_CACHE_LINE_PER_SET; ++ i)
+    {
+        sram_cacheline_t *line = &(set->lines[i]);
+
+        if (line->state != CACHE_LINE_INVALID && line->tag == paddr.ct)
+        {
+            return 0;
+        }
+
+        if (max_time < line->time)
+        {
+            victim = line;
+            max_time = line->time;
+        }
+
+        if (line->state == CACHE_LINE_INVALID)
+        {
+            invalid = line;
+        }
+    }
+
+#ifdef USE_SRAM_TIMING
+    if (sram_timing_inflight(paddr_value) != NULL)
+    {
+        // the line is on the way
+        return 0;
+    }
+    if (sram_timing_prefetch(paddr_value) == 0)
+    {
+        return -1;
+    }
+#endif
+
+    if (invalid != NULL)
+    {
+        victim = invalid;
+    }
+    else
+    {
+        assert(victim != NULL);
+
+        if (victim->prefetched == 1)
+        {
+            prefetch_unused();
+        }
+
+        // remember the victim to count the pollution
+        prefetch_evict(line_paddr(victim, paddr.ci));
+
+        if (victim->state == CACHE_LINE_DIRTY)
+        {
+            cacheline_writeback(line_paddr(victim, paddr.ci), victim->block);
+#ifdef CACHE_SIMULATION_VERIFICATION
+            dirty_bytes_evicted_count   += (1 << SRAM_CACHE_OFFSET_LENGTH);
+            dirty_bytes_in_cache_count  -= (1 << SRAM_CACHE_OFFSET_LENGTH);
+#endif
+        }
+    }
+
+    cacheline_fetch(paddr.paddr_value, victim->block);
+
+    // insert as the most recently used line
+    for (int i = 0; i < NUM_CACHE_LINE_PER_SET; ++ i)
+    {
+        set->lines[i].time ++;
+    }
+
+    victim->state = CACHE_LINE_CLEAN;
+    victim->time = 0;
+    victim->tag = paddr.ct;
+    victim->prefetched = 1;
+    victim->prefetch_time = prefetch_clock;
+
+    return 1;
+}
+#endif
+
 #ifdef CACHE_SIMULATION_VERIFICATION
 void print_cache()
 {
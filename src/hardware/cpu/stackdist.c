@@ -0,0 +1,446 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+// LRU stack distance analysis (Mattson et al. 1970)
+//
+// For a set associative LRU cache, the access to block X hits
+// if and only if the number of DISTINCT blocks mapped to the same
+// set since the last access to X is less than E. This number is
+// called the stack distance of the access. It does not depend on E.
+// So with ONE pass over the trace, we can get the histogram of
+// stack distances, and then the hit/miss/eviction counts of ALL
+// associativities at once. We also do this for all set index
+// widths s = 0, 1, ..., max_s in the same pass.
+//
+// To count the distinct blocks since the last access, each set keeps
+// its own local clock. Only the latest access of each block is marked
+// on a Binary Indexed Tree (Fenwick Tree) over the local clock. Then
+// the stack distance is just a range sum of the marks:
+//      distance = sum(marks(last, now))
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FENWICK_INITIAL_SIZE (16)
+#define BLOCK_TABLE_INITIAL_SIZE (1024)
+
+// Binary Indexed Tree over the local clock of one cache set
+typedef struct
+{
+    uint32_t size;      // capacity of the local clock
+    uint32_t clock;     // local clock: number of accesses to this set
+    uint32_t distinct;  // number of distinct blocks ever mapped to this set
+    int32_t *tree;      // 1-based fenwick tree
+    uint8_t *marks;     // 1-based: marks[t] = 1 if t is the latest access of some block
+} fenwick_set_t;
+
+// open addressing hash table: block address --> record index
+// the trace is read once and blocks are never deleted,
+// so linear probing is simple and fast enough
+typedef struct
+{
+    uint64_t size;      // power of 2
+    uint64_t count;
+    uint64_t *keys;     // block address + 1, 0 for empty slot
+    uint64_t *values;   // record index
+} block_table_t;
+
+typedef struct
+{
+    int max_s;
+    int b;
+    int max_E;
+
+    // sets[s][i] is the i-th set of the cache with s index bits
+    fenwick_set_t **sets;
+
+    // hist[s][d] is the count of accesses with stack distance d
+    // hist[s][max_E] collects distance >= max_E
+    uint64_t **hist;
+    // cold[s]: the count of compulsory misses
+    uint64_t *cold;
+
+    uint64_t access_count;
+
+    // block address --> record index
+    block_table_t blocks;
+
+    // the records of the blocks: for record r and width s,
+    // last[r * (max_s + 1) + s] is the local time of the latest access
+    // 0 for never accessed
+    uint32_t *last;
+    uint64_t last_size;
+} stackdist_t;
+
+static stackdist_t sd;
+
+/*======================================*/
+/*      Binary Indexed Tree             */
+/*======================================*/
+
+static inline uint32_t lowbit(uint32_t x)
+{
+    return x & (-x);
+}
+
+static void fenwick_add(fenwick_set_t *f, uint32_t t, int32_t delta)
+{
+    for (uint32_t i = t; i <= f->size; i += lowbit(i))
+    {
+        f->tree[i] += delta;
+    }
+}
+
+static uint32_t fenwick_prefix(fenwick_set_t *f, uint32_t t)
+{
+    int32_t sum = 0;
+    for (uint32_t i = t; i > 0; i -= lowbit(i))
+    {
+        sum += f->tree[i];
+    }
+    assert(sum >= 0);
+    return (uint32_t)sum;
+}
+
+static void fenwick_init(fenwick_set_t *f)
+{
+    f->size = FENWICK_INITIAL_SIZE;
+    f->clock = 0;
+    f->distinct = 0;
+    f->tree = calloc(f->size + 1, sizeof(int32_t));
+    f->marks = calloc(f->size + 1, sizeof(uint8_t));
+}
+
+// double the capacity and rebuild the tree from the marks in O(n)
+static void fenwick_grow(fenwick_set_t *f)
+{
+    uint32_t size = f->size * 2;
+    f->tree = realloc(f->tree, (size + 1) * sizeof(int32_t));
+    f->marks = realloc(f->marks, (size + 1) * sizeof(uint8_t));
+    memset(&f->marks[f->size + 1], 0, (size - f->size) * sizeof(uint8_t));
+    f->size = size;
+
+    f->tree[0] = 0;
+    for (uint32_t i = 1; i <= size; ++ i)
+    {
+        f->tree[i] = f->marks[i];
+    }
+    for (uint32_t i = 1; i <= size; ++ i)
+    {
+        uint32_t parent = i + lowbit(i);
+        if (parent <= size)
+        {
+            f->tree[parent] += f->tree[i];
+        }
+    }
+}
+
+/*======================================*/
+/*      Block table                     */
+/*======================================*/
+
+static inline uint64_t block_hash(uint64_t block)
+{
+    // Fibonacci hashing: fold the high bits down to the low bits
+    uint64_t h = block * 0x9e3779b97f4a7c15;
+    return h ^ (h >> 32);
+}
+
+static void block_table_init(block_table_t *t, uint64_t size)
+{
+    t->size = size;
+    t->count = 0;
+    t->keys = calloc(size, sizeof(uint64_t));
+    t->values = calloc(size, sizeof(uint64_t));
+}
+
+static void block_table_free(block_table_t *t)
+{
+    free(t->keys);
+    free(t->values);
+    memset(t, 0, sizeof(block_table_t));
+}
+
+static void block_table_insert(block_table_t *t, uint64_t block, uint64_t value);
+
+static void block_table_grow(block_table_t *t)
+{
+    block_table_t old = *t;
+    block_table_init(t, old.size * 2);
+    for (uint64_t i = 0; i < old.size; ++ i)
+    {
+        if (old.keys[i] != 0)
+        {
+            block_table_insert(t, old.keys[i] - 1, old.values[i]);
+        }
+    }
+    block_table_free(&old);
+}
+
+static void block_table_insert(block_table_t *t, uint64_t block, uint64_t value)
+{
+    if ((t->count + 1) * 2 > t->size)
+    {
+        block_table_grow(t);
+    }
+
+    uint64_t i = block_hash(block) & (t->size - 1);
+    while (t->keys[i] != 0)
+    {
+        i = (i + 1) & (t->size - 1);
+    }
+    t->keys[i] = block + 1;
+    t->values[i] = value;
+    t->count += 1;
+}
+
+// return 1 if found
+static int block_table_get(block_table_t *t, uint64_t block, uint64_t *valptr)
+{
+    uint64_t i = block_hash(block) & (t->size - 1);
+    while (t->keys[i] != 0)
+    {
+        if (t->keys[i] == block + 1)
+        {
+            *valptr = t->values[i];
+            return 1;
+        }
+        i = (i + 1) & (t->size - 1);
+    }
+    return 0;
+}
+
+/*======================================*/
+/*      Stack distance                  */
+/*======================================*/
+
+void stackdist_free()
+{
+    if (sd.sets == NULL)
+    {
+        return;
+    }
+
+    for (int s = 0; s <= sd.max_s; ++ s)
+    {
+        for (uint64_t i = 0; i < (1ul << s); ++ i)
+        {
+            free(sd.sets[s][i].tree);
+            free(sd.sets[s][i].marks);
+        }
+        free(sd.sets[s]);
+        free(sd.hist[s]);
+    }
+    free(sd.sets);
+    free(sd.hist);
+    free(sd.cold);
+    free(sd.last);
+    block_table_free(&sd.blocks);
+
+    memset(&sd, 0, sizeof(stackdist_t));
+}
+
+void stackdist_init(int max_s, int b, int max_E)
+{
+    assert(0 <= max_s && max_s <= 20);
+    assert(0 <= b && b < 64);
+    assert(max_E >= 1);
+
+    stackdist_free();
+
+    sd.max_s = max_s;
+    sd.b = b;
+    sd.max_E = max_E;
+    sd.access_count = 0;
+
+    sd.sets = malloc((max_s + 1) * sizeof(fenwick_set_t *));
+    sd.hist = malloc((max_s + 1) * sizeof(uint64_t *));
+    sd.cold = calloc(max_s + 1, sizeof(uint64_t));
+    for (int s = 0; s <= max_s; ++ s)
+    {
+        sd.sets[s] = malloc((1ul << s) * sizeof(fenwick_set_t));
+        for (uint64_t i = 0; i < (1ul << s); ++ i)
+        {
+            fenwick_init(&sd.sets[s][i]);
+        }
+        sd.hist[s] = calloc(max_E + 1, sizeof(uint64_t));
+    }
+
+    block_table_init(&sd.blocks, BLOCK_TABLE_INITIAL_SIZE);
+    sd.last_size = BLOCK_TABLE_INITIAL_SIZE;
+    sd.last = calloc(sd.last_size * (max_s + 1), sizeof(uint32_t));
+}
+
+void stackdist_access(uint64_t paddr)
+{
+    assert(sd.sets != NULL);
+
+    uint64_t block = paddr >> sd.b;
+
+    // one hash table lookup serves all set index widths
+    uint64_t r = 0;
+    if (block_table_get(&sd.blocks, block, &r) == 0)
+    {
+        r = sd.blocks.count;
+        if (r == sd.last_size)
+        {
+            uint64_t width = sd.max_s + 1;
+            sd.last = realloc(sd.last, 2 * sd.last_size * width * sizeof(uint32_t));
+            memset(&sd.last[sd.last_size * width], 0, sd.last_size * width * sizeof(uint32_t));
+            sd.last_size *= 2;
+        }
+        block_table_insert(&sd.blocks, block, r);
+    }
+    uint32_t *last_times = &sd.last[r * (sd.max_s + 1)];
+
+    for (int s = 0; s <= sd.max_s; ++ s)
+    {
+        fenwick_set_t *f = &sd.sets[s][block & ((1ul << s) - 1)];
+
+        if (f->clock + 1 > f->size)
+        {
+            fenwick_grow(f);
+        }
+        f->clock += 1;
+        uint32_t now = f->clock;
+        uint32_t last = last_times[s];
+
+        if (last == 0)
+        {
+            // compulsory miss
+            sd.cold[s] += 1;
+            f->distinct += 1;
+        }
+        else
+        {
+            // count the distinct blocks accessed in (last, now)
+            uint32_t d = fenwick_prefix(f, now - 1) - fenwick_prefix(f, last);
+            if (d > sd.max_E)
+            {
+                d = sd.max_E;
+            }
+            sd.hist[s][d] += 1;
+
+            // the previous access is not the latest any more
+            f->marks[last] = 0;
+            fenwick_add(f, last, -1);
+        }
+
+        f->marks[now] = 1;
+        fenwick_add(f, now, 1);
+        last_times[s] = now;
+    }
+
+    sd.access_count += 1;
+}
+
+// parse one line of valgrind trace:
+//      I 0400d7d4,8
+//       L 7ff000384,4
+//       S 7ff000388,4
+//       M 0421c7f0,4
+// return the number of data accesses of this line
+static int parse_trace_line(char *line, uint64_t *paddr)
+{
+    int i = 0;
+    while (line[i] == ' ')
+    {
+        i += 1;
+    }
+
+    char op = line[i];
+    if (op != 'L' && op != 'S' && op != 'M')
+    {
+        // instruction load or empty line
+        return 0;
+    }
+
+    i += 1;
+    while (line[i] == ' ')
+    {
+        i += 1;
+    }
+
+    *paddr = strtoul(&line[i], NULL, 16);
+
+    // modify: one load and then one store
+    return op == 'M' ? 2 : 1;
+}
+
+// read the trace file exactly once
+// return the number of data accesses
+uint64_t stackdist_run(const char *trace_file, int max_s, int b, int max_E)
+{
+    FILE *fr = fopen(trace_file, "r");
+    if (fr == NULL)
+    {
+        printf("unable to open trace file %s\n", trace_file);
+        return 0;
+    }
+
+    stackdist_init(max_s, b, max_E);
+
+    char line[128];
+    while (fgets(line, 128, fr) != NULL)
+    {
+        uint64_t paddr = 0;
+        int n = parse_trace_line(line, &paddr);
+        for (int i = 0; i < n; ++ i)
+        {
+            stackdist_access(paddr);
+        }
+    }
+
+    fclose(fr);
+    return sd.access_count;
+}
+
+uint64_t stackdist_hits(int s, int E)
+{
+    assert(0 <= s && s <= sd.max_s);
+    assert(1 <= E && E <= sd.max_E);
+
+    uint64_t hits = 0;
+    for (int d = 0; d < E; ++ d)
+    {
+        hits += sd.hist[s][d];
+    }
+    return hits;
+}
+
+uint64_t stackdist_misses(int s, int E)
+{
+    return sd.access_count - stackdist_hits(s, E);
+}
+
+// misses filling an invalid line do not evict:
+// each set fills min(E, distinct blocks) invalid lines at most
+uint64_t stackdist_evictions(int s, int E)
+{
+    uint64_t fills = 0;
+    for (uint64_t i = 0; i < (1ul << s); ++ i)
+    {
+        uint32_t n = sd.sets[s][i].distinct;
+        fills += n < E ? n : E;
+    }
+    return stackdist_misses(s, E) - fills;
+}
+
+double stackdist_missratio(int s, int E)
+{
+    if (sd.access_count == 0)
+    {
+        return 0.0;
+    }
+    return (double)stackdist_misses(s, E) / (double)sd.access_count;
+}
@@ -9,8 +9,10 @@
  */
 
 // Dynamic Random Access Memory
+#define _DEFAULT_SOURCE
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include "headers/cpu.h"
 #include "headers/memory.h"
 #include "headers/common.h"
@@ -22,32 +24,204 @@ void sram_cache_write(uint64_t paddr, uint8_t data);
 #endif
 
 #ifdef USE_PAGETABLE_VA2PA
-void pagemap_update_time(uint64_t ppn);
 void pagemap_dirty(uint64_t ppn);
 #endif
 
+#if defined(USE_SOFTMMU) && defined(USE_SRAM_CACHE)
+#error "softmmu reads pm directly and bypasses the SRAM cache"
+#endif
+
+/*  physical memory
+    Small memory lives in the static array. Large memory is one anonymous
+    mapping reserved without swap space: the host kernel allocates a frame
+    only when it is touched, so untouched frames cost no host RSS.
+ */
+static uint8_t default_pm[DEFAULT_PHYSICAL_MEMORY_SPACE];
+uint8_t *pm = default_pm;
+uint64_t physical_memory_space = DEFAULT_PHYSICAL_MEMORY_SPACE;
+
+// call page_map_init after this to resize the physical page descriptors
+void physical_memory_init(uint64_t size)
+{
+    assert(size > 0 && size % PAGE_SIZE == 0);
+    assert(size <= (1ul << PHYSICAL_ADDRESS_LENGTH));
+
+    if (pm != default_pm)
+    {
+        munmap(pm, physical_memory_space);
+    }
+
+    if (size <= DEFAULT_PHYSICAL_MEMORY_SPACE)
+    {
+        pm = default_pm;
+        memset(pm, 0, DEFAULT_PHYSICAL_MEMORY_SPACE);
+    }
+    else
+    {
+        pm = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(pm != MAP_FAILED);
+    }
+    physical_memory_space = size;
+
+#ifdef USE_SOFTMMU
+    // the host pointers are stale
+    softmmu_flush();
+#endif
+}
+
+#ifdef USE_SOFTMMU
+/*  softmmu: host TLB like QEMU
+    Not the TLB modeled in MMU, only to make the functional simulation fast.
+    Direct mapped by the virtual page number. An entry keeps the page address
+    for each allowed access and the addend from the virtual address to the
+    host address in pm. A hit is a compare and a host load or store.
+    Filled after the slow path: va2pa has checked the permission, and a
+    write has marked the frame dirty.
+    The page addresses are stored inverted, so the zeroed table is invalid.
+ */
+#ifndef SOFTMMU_INDEX_LENGTH
+#define SOFTMMU_INDEX_LENGTH (8)
+#endif
+
+#define SOFTMMU_INVALID     (0)
+#define SOFTMMU_PAGE_MASK   (~((uint64_t)PAGE_SIZE - 1))
+
+typedef struct
+{
+    uint64_t addr_read;     // ~page
+    uint64_t addr_write;
+    uint64_t addr_code;
+    uintptr_t addend;       // host address - virtual address
+} softmmu_entry_t;
+
+static softmmu_entry_t softmmu_table[1 << SOFTMMU_INDEX_LENGTH];
+
+void softmmu_flush()
+{
+    memset(softmmu_table, 0, sizeof(softmmu_table));
+}
+
+// the table only holds the current address space
+void softmmu_flush_page(uint64_t vaddr)
+{
+    softmmu_entry_t *e = &softmmu_table[(vaddr >> PHYSICAL_PAGE_OFFSET_LENGTH) & ((1 << SOFTMMU_INDEX_LENGTH) - 1)];
+    memset(e, 0, sizeof(softmmu_entry_t));
+}
+
+// the host address if [vaddr, vaddr + size) hits a page allowing the access
+static inline uint8_t *softmmu_lookup(uint64_t vaddr, int access, uint64_t size)
+{
+    softmmu_entry_t *e = &softmmu_table[(vaddr >> PHYSICAL_PAGE_OFFSET_LENGTH) & ((1 << SOFTMMU_INDEX_LENGTH) - 1)];
+    uint64_t tag = access == MMU_READ ? e->addr_read : (access == MMU_WRITE ? e->addr_write : e->addr_code);
+
+    // must not cross the page
+    if (tag == ~(vaddr & SOFTMMU_PAGE_MASK) &&
+        (vaddr & ~SOFTMMU_PAGE_MASK) + size <= PAGE_SIZE)
+    {
+        softmmu_hit_count += 1;
+        return (uint8_t *)(uintptr_t)(vaddr + e->addend);
+    }
+    softmmu_miss_count += 1;
+    return NULL;
+}
+
+static void softmmu_fill(uint64_t vaddr, uint64_t paddr, int access)
+{
+    softmmu_entry_t *e = &softmmu_table[(vaddr >> PHYSICAL_PAGE_OFFSET_LENGTH) & ((1 << SOFTMMU_INDEX_LENGTH) - 1)];
+    uint64_t page = vaddr & SOFTMMU_PAGE_MASK;
+    uintptr_t addend = (uintptr_t)&pm[paddr & SOFTMMU_PAGE_MASK] - (uintptr_t)page;
+    uint64_t tag = ~page;
+
+    if (e->addend != addend || (e->addr_read != tag && e->addr_write != tag && e->addr_code != tag))
+    {
+        // another page
+        e->addr_read = SOFTMMU_INVALID;
+        e->addr_write = SOFTMMU_INVALID;
+        e->addr_code = SOFTMMU_INVALID;
+        e->addend = addend;
+    }
+
+    if (access == MMU_READ)
+    {
+        e->addr_read = tag;
+    }
+    else if (access == MMU_WRITE)
+    {
+        // a writable page is readable
+        e->addr_read = tag;
+        e->addr_write = tag;
+    }
+    else
+    {
+        e->addr_code = tag;
+    }
+}
+#endif
+
 uint64_t virtual_read_data(uint64_t vaddr)
 {
-    uint64_t paddr = va2pa(vaddr, 0);
+#ifdef USE_SOFTMMU
+    uint8_t *host = softmmu_lookup(vaddr, MMU_READ, sizeof(uint64_t));
+    if (host != NULL)
+    {
+        // little-endian host: one 64-bit load
+        uint64_t val;
+        memcpy(&val, host, sizeof(uint64_t));
+        return val;
+    }
+#endif
+
+    uint64_t paddr = va2pa(vaddr, MMU_READ);
     uint64_t data = cpu_read64bits_dram(paddr);
+
+#ifdef USE_SOFTMMU
+    softmmu_fill(vaddr, paddr, MMU_READ);
+#endif
     return data;
 }
 
 void virtual_write_data(uint64_t vaddr, uint64_t data)
 {
-    uint64_t paddr = va2pa(vaddr, 1);
+#ifdef USE_SOFTMMU
+    uint8_t *host = softmmu_lookup(vaddr, MMU_WRITE, sizeof(uint64_t));
+    if (host != NULL)
+    {
+        memcpy(host, &data, sizeof(uint64_t));
+        return;
+    }
+#endif
+
+    uint64_t paddr = va2pa(vaddr, MMU_WRITE);
     cpu_write64bits_dram(paddr, data);
+
+#ifdef USE_SOFTMMU
+    softmmu_fill(vaddr, paddr, MMU_WRITE);
+#endif
 }
 
 void virtual_read_inst(uint64_t vaddr, char *buf)
 {
-    uint64_t paddr = va2pa(vaddr, 0);
+#ifdef USE_SOFTMMU
+    uint8_t *host = softmmu_lookup(vaddr, MMU_FETCH, MAX_INSTRUCTION_CHAR);
+    if (host != NULL)
+    {
+        memcpy(buf, host, MAX_INSTRUCTION_CHAR);
+        return;
+    }
+#endif
+
+    uint64_t paddr = va2pa(vaddr, MMU_FETCH);
     cpu_readinst_dram(paddr, buf);
+
+#ifdef USE_SOFTMMU
+    softmmu_fill(vaddr, paddr, MMU_FETCH);
+#endif
 }
 
 void virtual_write_inst(uint64_t vaddr, const char *str)
 {
-    uint64_t paddr = va2pa(vaddr, 1);
+    uint64_t paddr = va2pa(vaddr, MMU_WRITE);
     cpu_writeinst_dram(paddr, str);
 }
 
@@ -67,7 +241,7 @@ uint64_t cpu_read64bits_dram(uint64_t paddr)
     // little-endian
     for (int i = 0; i < 8; ++ i)
     {
-        val += (sram_cache_read(paddr + i) << (i * 8));
+        val += (((uint64_t)sram_cache_read(paddr + i)) << (i * 8));
     }
 #else
     // read from DRAM directly
@@ -82,11 +256,6 @@ uint64_t cpu_read64bits_dram(uint64_t paddr)
     val += (((uint64_t)pm[paddr + 7 ]) << 56);
 #endif
 
-#ifdef USE_PAGETABLE_VA2PA
-    // Update page_map when read data's timestamp
-    pagemap_update_time(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
-#endif
-
     return val;
 }
 
@@ -111,13 +280,6 @@ void cpu_write64bits_dram(uint64_t paddr, uint64_t data)
     pm[paddr + 6] = (data >> 48) & 0xff;
     pm[paddr + 7] = (data >> 56) & 0xff;
 #endif
-
-#ifdef USE_PAGETABLE_VA2PA
-    // Update page_map when read data's timestamp
-    pagemap_update_time(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
-    // Update dirty bit
-    pagemap_dirty(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
-#endif
 }
 
 void cpu_readinst_dram(uint64_t paddr, char *buf)
@@ -126,11 +288,6 @@ void cpu_readinst_dram(uint64_t paddr, char *buf)
     {
         buf[i] = (char)pm[paddr + i];
     }
-
-#ifdef USE_PAGETABLE_VA2PA
-    // Update page_map when read data's timestamp
-    pagemap_update_time(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
-#endif
 }
 
 void cpu_writeinst_dram(uint64_t paddr, const char *str)
@@ -151,9 +308,7 @@ void cpu_writeinst_dram(uint64_t paddr, const char *str)
     }
 
 #ifdef USE_PAGETABLE_VA2PA
-    // Update page_map when read data's timestamp
-    pagemap_update_time(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
-    // Update dirty bit
+    // the code is loaded by the kernel, not through MMU
     pagemap_dirty(paddr >> PHYSICAL_PAGE_OFFSET_LENGTH);
 #endif
 }
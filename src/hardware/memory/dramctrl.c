@@ -0,0 +1,398 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+// DRAM controller timing model
+// The cache lines read and written through the bus are queued here.
+// The controller maps the physical address to channel, rank, bank, row
+// and column, and schedules the queue with FR-FCFS: among the requests
+// whose bank is ready, row buffer hits first, then the oldest one.
+// Row hits are pipelined: the next column command to the open row starts
+// tBURST after the previous one, only the precharge waits for the data.
+// A request bypassed by DRAM_MAX_BYPASS younger ones to its bank is not
+// bypassed any more, so a stream of row hits cannot starve a row miss.
+// Only the cycles are modeled, the data is still copied by dram.c.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include "headers/memory.h"
+
+/*======================================*/
+/*      configuration                   */
+/*======================================*/
+
+// all lengths are in bits
+#ifndef DRAM_CHANNEL_LENGTH
+#define DRAM_CHANNEL_LENGTH (0)
+#endif
+
+#ifndef DRAM_RANK_LENGTH
+#define DRAM_RANK_LENGTH (0)
+#endif
+
+#ifndef DRAM_BANK_LENGTH
+#define DRAM_BANK_LENGTH (3)
+#endif
+
+// cache lines in one row: 32 * 64 = 2KiB row buffer
+#ifndef DRAM_COLUMN_LENGTH
+#define DRAM_COLUMN_LENGTH (5)
+#endif
+
+// one burst transfers a cache line
+#define DRAM_BURST_LENGTH (6)
+
+#define DRAM_NUM_CHANNEL    (1 << DRAM_CHANNEL_LENGTH)
+#define DRAM_NUM_BANK       (1 << (DRAM_RANK_LENGTH + DRAM_BANK_LENGTH))
+
+// timings in CPU cycles
+#ifndef DRAM_tCAS
+#define DRAM_tCAS (15)
+#endif
+
+#ifndef DRAM_tRCD
+#define DRAM_tRCD (15)
+#endif
+
+#ifndef DRAM_tRP
+#define DRAM_tRP (15)
+#endif
+
+#ifndef DRAM_tBURST
+#define DRAM_tBURST (4)
+#endif
+
+#ifndef DRAM_QUEUE_SIZE
+#define DRAM_QUEUE_SIZE (64)
+#endif
+
+#ifndef DRAM_MAX_BYPASS
+#define DRAM_MAX_BYPASS (16)
+#endif
+
+// can be changed before the simulation starts
+int dram_page_policy = DRAM_OPEN_PAGE;
+int dram_address_mapping = DRAM_MAP_ROW_BANK_COLUMN;
+
+/*======================================*/
+/*      state                           */
+/*======================================*/
+
+typedef struct
+{
+    int valid;
+    int write;
+    uint64_t arrival;
+    uint64_t complete;  // 0 - not scheduled yet
+    int channel;
+    int bank;           // rank and bank
+    uint64_t row;
+    int bypassed;       // younger requests to the bank served before it
+} dram_request_t;
+
+typedef struct
+{
+    int active;         // 0 - precharged
+    uint64_t open_row;
+    uint64_t ready;     // when the next column command to the open row can start
+    uint64_t done;      // when the last burst ends and the row can be closed
+
+    // statistics
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t row_hits;
+    uint64_t row_misses;    // the bank was precharged
+    uint64_t row_conflicts; // another row was open
+    uint64_t latency;       // sum of arrival to completion
+    uint64_t starved;       // requests served by the bypass limit
+} dram_bank_t;
+
+typedef struct
+{
+    uint64_t now;       // command bus
+    uint64_t bus_free;  // data bus
+    dram_bank_t banks[DRAM_NUM_BANK];
+} dram_channel_t;
+
+static dram_request_t queue[DRAM_QUEUE_SIZE];
+static dram_channel_t channels[DRAM_NUM_CHANNEL];
+
+void dram_ctrl_reset()
+{
+    memset(queue, 0, sizeof(queue));
+    memset(channels, 0, sizeof(channels));
+}
+
+/*======================================*/
+/*      address mapping                 */
+/*======================================*/
+
+static uint64_t take_bits(uint64_t *addr, int length)
+{
+    uint64_t bits = (*addr) & ((1ul << length) - 1);
+    *addr = (*addr) >> length;
+    return bits;
+}
+
+void dram_ctrl_map(uint64_t paddr, int *channel, int *bank, uint64_t *row, uint64_t *column)
+{
+    uint64_t addr = paddr >> DRAM_BURST_LENGTH;
+
+    if (dram_address_mapping == DRAM_MAP_ROW_BANK_COLUMN)
+    {
+        // row | rank | bank | channel | column | offset
+        // consecutive lines stay in one row
+        *column = take_bits(&addr, DRAM_COLUMN_LENGTH);
+        *channel = take_bits(&addr, DRAM_CHANNEL_LENGTH);
+        *bank = take_bits(&addr, DRAM_RANK_LENGTH + DRAM_BANK_LENGTH);
+        *row = addr;
+    }
+    else
+    {
+        // row | column | rank | bank | channel | offset
+        // consecutive lines are spread over the channels and banks
+        *channel = take_bits(&addr, DRAM_CHANNEL_LENGTH);
+        *bank = take_bits(&addr, DRAM_RANK_LENGTH + DRAM_BANK_LENGTH);
+        *column = take_bits(&addr, DRAM_COLUMN_LENGTH);
+        *row = addr;
+    }
+}
+
+/*======================================*/
+/*      scheduling                      */
+/*======================================*/
+
+// return the request id
+int dram_ctrl_request(uint64_t paddr, int write, uint64_t arrival)
+{
+    for (int i = 0; i < DRAM_QUEUE_SIZE; ++ i)
+    {
+        if (queue[i].valid == 0)
+        {
+            uint64_t column;
+
+            queue[i].valid = 1;
+            queue[i].write = write;
+            queue[i].arrival = arrival;
+            queue[i].complete = 0;
+            queue[i].bypassed = 0;
+            dram_ctrl_map(paddr, &queue[i].channel, &queue[i].bank, &queue[i].row, &column);
+            return i;
+        }
+    }
+
+    // the cache never has more requests in flight than its MSHRs and write buffer
+    assert(0);
+    return -1;
+}
+
+// completion cycle of the request, 0 if it is not scheduled yet
+uint64_t dram_ctrl_complete(int id)
+{
+    assert(0 <= id && id < DRAM_QUEUE_SIZE && queue[id].valid == 1);
+    return queue[id].complete;
+}
+
+void dram_ctrl_release(int id)
+{
+    assert(0 <= id && id < DRAM_QUEUE_SIZE && queue[id].valid == 1);
+    assert(queue[id].complete != 0);
+    queue[id].valid = 0;
+}
+
+static int row_hit(dram_bank_t *bank, dram_request_t *req)
+{
+    return bank->active == 1 && bank->open_row == req->row;
+}
+
+// earliest cycle the bank can take the request
+static uint64_t bank_ready(dram_channel_t *ch, dram_request_t *req)
+{
+    dram_bank_t *bank = &ch->banks[req->bank];
+    return row_hit(bank, req) == 1 ? bank->ready : bank->done;
+}
+
+static void dram_ctrl_issue(dram_channel_t *ch, dram_request_t *req, uint64_t t)
+{
+    dram_bank_t *bank = &ch->banks[req->bank];
+
+    // the data is ready after the column access
+    uint64_t data;
+    if (row_hit(bank, req) == 1)
+    {
+        bank->row_hits ++;
+        data = t + DRAM_tCAS;
+    }
+    else if (bank->active == 0)
+    {
+        bank->row_misses ++;
+        data = t + DRAM_tRCD + DRAM_tCAS;
+    }
+    else
+    {
+        bank->row_conflicts ++;
+        data = t + DRAM_tRP + DRAM_tRCD + DRAM_tCAS;
+    }
+
+    // bursts share the data bus of the channel
+    if (data < ch->bus_free)
+    {
+        data = ch->bus_free;
+    }
+    req->complete = data + DRAM_tBURST;
+    ch->bus_free = req->complete;
+
+    // the next column command goes one burst after this one
+    bank->ready = data - DRAM_tCAS + DRAM_tBURST;
+    bank->done = req->complete;
+    if (dram_page_policy == DRAM_CLOSED_PAGE)
+    {
+        // precharge right after the access
+        bank->active = 0;
+        bank->done += DRAM_tRP;
+        bank->ready = bank->done;
+    }
+    else
+    {
+        bank->active = 1;
+        bank->open_row = req->row;
+    }
+
+    if (req->write == 1)
+    {
+        bank->writes ++;
+    }
+    else
+    {
+        bank->reads ++;
+    }
+    bank->latency += req->complete - req->arrival;
+
+    // the older requests to the bank are bypassed
+    for (int i = 0; i < DRAM_QUEUE_SIZE; ++ i)
+    {
+        dram_request_t *other = &queue[i];
+        if (other->valid == 1 && other->complete == 0 && other->channel == req->channel &&
+            other->bank == req->bank && other->arrival < req->arrival)
+        {
+            other->bypassed ++;
+        }
+    }
+
+    // one command per cycle
+    ch->now = t + 1;
+}
+
+// schedule the queued requests whose commands start no later than `until`
+// requests arriving later are not known yet
+void dram_ctrl_run(uint64_t until)
+{
+    for (int c = 0; c < DRAM_NUM_CHANNEL; ++ c)
+    {
+        dram_channel_t *ch = &channels[c];
+
+        while (1)
+        {
+            // the oldest request bypassed too many times, per bank
+            dram_request_t *starved[DRAM_NUM_BANK] = {NULL};
+            for (int i = 0; i < DRAM_QUEUE_SIZE; ++ i)
+            {
+                dram_request_t *req = &queue[i];
+                if (req->valid == 1 && req->complete == 0 && req->channel == c &&
+                    req->bypassed >= DRAM_MAX_BYPASS &&
+                    (starved[req->bank] == NULL || req->arrival < starved[req->bank]->arrival))
+                {
+                    starved[req->bank] = req;
+                }
+            }
+
+            // earliest cycle some pending request can be considered
+            // the bank of a starved request serves it first
+            uint64_t t = UINT64_MAX;
+            for (int i = 0; i < DRAM_QUEUE_SIZE; ++ i)
+            {
+                dram_request_t *req = &queue[i];
+                if (req->valid == 1 && req->complete == 0 && req->channel == c &&
+                    (starved[req->bank] == NULL || starved[req->bank] == req))
+                {
+                    uint64_t start = req->arrival > ch->now ? req->arrival : ch->now;
+                    if (start < bank_ready(ch, req))
+                    {
+                        start = bank_ready(ch, req);
+                    }
+                    if (start < t)
+                    {
+                        t = start;
+                    }
+                }
+            }
+
+            if (t == UINT64_MAX || t > until)
+            {
+                break;
+            }
+
+            // FR-FCFS among the arrived requests whose bank is ready at t
+            dram_request_t *first_ready = NULL;
+            dram_request_t *oldest = NULL;
+            for (int i = 0; i < DRAM_QUEUE_SIZE; ++ i)
+            {
+                dram_request_t *req = &queue[i];
+                if (req->valid == 0 || req->complete != 0 || req->channel != c ||
+                    req->arrival > t || bank_ready(ch, req) > t ||
+                    (starved[req->bank] != NULL && starved[req->bank] != req))
+                {
+                    continue;
+                }
+
+                if (row_hit(&ch->banks[req->bank], req) == 1 &&
+                    (first_ready == NULL || req->arrival < first_ready->arrival))
+                {
+                    first_ready = req;
+                }
+                if (oldest == NULL || req->arrival < oldest->arrival)
+                {
+                    oldest = req;
+                }
+            }
+
+            assert(oldest != NULL);
+            dram_request_t *req = first_ready != NULL ? first_ready : oldest;
+            if (req == starved[req->bank])
+            {
+                ch->banks[req->bank].starved ++;
+            }
+            dram_ctrl_issue(ch, req, t);
+        }
+    }
+}
+
+void print_dram_stats()
+{
+    printf("dram: %d channels, %d banks per channel, %s page, %s mapping\n",
+        DRAM_NUM_CHANNEL, DRAM_NUM_BANK,
+        dram_page_policy == DRAM_OPEN_PAGE ? "open" : "closed",
+        dram_address_mapping == DRAM_MAP_ROW_BANK_COLUMN ? "row:bank:column" : "row:column:bank");
+    printf("    ch bank    reads   writes     hits   misses  conflicts  starved  avg latency\n");
+
+    for (int c = 0; c < DRAM_NUM_CHANNEL; ++ c)
+    {
+        for (int b = 0; b < DRAM_NUM_BANK; ++ b)
+        {
+            dram_bank_t *bank = &channels[c].banks[b];
+            uint64_t n = bank->reads + bank->writes;
+            printf("    %2d %4d %8lu %8lu %8lu %8lu %10lu %8lu %12.2f\n",
+                c, b, bank->reads, bank->writes,
+                bank->row_hits, bank->row_misses, bank->row_conflicts, bank->starved,
+                n == 0 ? 0.0 : (double)bank->latency / (double)n);
+        }
+    }
+}
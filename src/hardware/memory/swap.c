@@ -3,47 +3,808 @@
  * Github:      https://github.com/yangminz/bcst_csapp
  * Bilibili:    https://space.bilibili.com/4564101
  * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
- * This project (code repository and videos) is exclusively owned by yangminz 
- * and shall not be used for commercial and profitting purpose 
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
  * without yangminz's permission.
  */
 
-// Dynamic Random Access Memory
+// Swap space: one binary file, one page per slot
+#define _DEFAULT_SOURCE
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef USE_ASYNC_SWAP
+#include <pthread.h>
+#endif
 #include "headers/cpu.h"
 #include "headers/memory.h"
 #include "headers/common.h"
 #include "headers/address.h"
 
 void set_pagemap_swapaddr(uint64_t ppn, uint64_t swap_address);
+void release_swapcache_frame(uint64_t ppn);
 
-// each swap file is swap page
-// each line of this swap page is one uint64
-#define SWAP_PAGE_FILE_LINES (512)
+// number of page slots in the swap file
+#ifndef SWAP_NUM_SLOTS
+#define SWAP_NUM_SLOTS (4096)
+#endif
+
+// slots are allocated from one cluster till it is used up,
+// so the pages swapped out together are neighbors in the file.
+// one cluster is one word of bitmap
+#define SWAP_CLUSTER_SLOTS (64)
+
+// swap address 0 means not backed by swap space
+// slot i is at swap address SWAP_ADDRESS_MIN + i
 #define SWAP_ADDRESS_MIN (100)
 
-// disk address counter
-static char *SWAP_FILE_DIRECTORY = "./files/swap";
-static uint64_t internal_swap_addr = SWAP_ADDRESS_MIN;
+// the pages of adjacent slots are read or written in one I/O
+#define SWAP_IO_MAX_PAGES (16)
+
+static char *SWAP_FILE_PATH = "./files/swap/swapfile";
+static int swap_fd = -1;
+
+// bit 1: the slot is in use
+static uint64_t swap_bitmap[SWAP_NUM_SLOTS / SWAP_CLUSTER_SLOTS];
+// the number of page table entries sharing the slot after fork
+// one entry of each forked process, far more than 255
+static uint32_t swap_count[SWAP_NUM_SLOTS];
+static uint64_t swap_used = 0;
+
+static uint64_t cluster_next = 0;
+static uint64_t cluster_left = 0;
+
+#ifdef USE_ASYNC_SWAP
+// the requests are served by one host thread in FIFO order,
+// so a swap-in of the slot always reads what was written before
+// The kernel may keep any number of completed requests before it
+// releases them, so a request takes any free entry, and more entries
+// are allocated when all are busy. Waiting for a release would never end
+#define SWAP_QUEUE_SIZE     (64)    // entries of one chunk
+#define SWAP_QUEUE_CHUNKS   (64)
+
+typedef struct
+{
+    int busy;       // submitted and not released
+    int done;
+    int write;
+    uint64_t slot;  // the first slot
+    uint8_t *buf[SWAP_IO_MAX_PAGES];
+    int num;        // 0: no I/O, served by zswap
+    int refs;       // releases left, 0: released by the I/O thread, and buf is freed
+    int next;       // the next request to be served, -1 if none
+} swap_request_t;
+
+// the entries never move: the I/O thread works on one without the lock
+static swap_request_t *swap_queue[SWAP_QUEUE_CHUNKS];
+static int swap_queue_chunks = 0;
+static int swap_queue_head = -1;    // the next to be served
+static int swap_queue_tail = -1;    // the last submitted
+
+static pthread_t swap_thread;
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t swap_submitted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t swap_completed = PTHREAD_COND_INITIALIZER;
+
+static void *swap_thread_main(void *arg);
+#endif
+
+static void swap_open()
+{
+    if (swap_fd >= 0)
+    {
+        return;
+    }
+
+    // swap space does not survive the simulator
+    swap_fd = open(SWAP_FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(swap_fd >= 0);
+    // the blocks of all slots are allocated on the host at once,
+    // not by the first write of each slot as a sparse file
+    int ret = posix_fallocate(swap_fd, 0, (off_t)SWAP_NUM_SLOTS * PAGE_SIZE);
+    assert(ret == 0);
+
+#ifdef USE_ASYNC_SWAP
+    ret = pthread_create(&swap_thread, NULL, swap_thread_main, NULL);
+    assert(ret == 0);
+#endif
+}
+
+uint64_t swap_read_count = 0;
+uint64_t swap_write_count = 0;
+
+static uint8_t *frame_of(uint64_t ppn)
+{
+    return &pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH];
+}
+
+// the pages of slot, slot + 1, ... are one I/O
+static void swap_io(int write, uint64_t slot, uint8_t **buf, int num)
+{
+    assert(0 < num && num <= SWAP_IO_MAX_PAGES);
+    struct iovec iov[SWAP_IO_MAX_PAGES];
+    for (int i = 0; i < num; ++ i)
+    {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    ssize_t n = 0;
+    if (write == 1)
+    {
+        n = pwritev(swap_fd, iov, num, (off_t)slot * PAGE_SIZE);
+    }
+    else
+    {
+        n = preadv(swap_fd, iov, num, (off_t)slot * PAGE_SIZE);
+    }
+    assert(n == (ssize_t)num * PAGE_SIZE);
+}
+
+// the counters are read by the kernel: updated under swap_lock if async
+static void count_io(int write)
+{
+    if (write == 1)
+    {
+        swap_write_count += 1;
+    }
+    else
+    {
+        swap_read_count += 1;
+    }
+}
+
+#ifdef USE_ASYNC_SWAP
+static swap_request_t *get_request(int id)
+{
+    assert(0 <= id && id < swap_queue_chunks * SWAP_QUEUE_SIZE);
+    return &swap_queue[id / SWAP_QUEUE_SIZE][id % SWAP_QUEUE_SIZE];
+}
+
+static void *swap_thread_main(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&swap_lock);
+        while (swap_queue_head < 0)
+        {
+            pthread_cond_wait(&swap_submitted, &swap_lock);
+        }
+        swap_request_t *req = get_request(swap_queue_head);
+        pthread_mutex_unlock(&swap_lock);
+
+        // the frame is locked by the kernel till the request is released
+        if (req->num > 0)
+        {
+            swap_io(req->write, req->slot, req->buf, req->num);
+        }
+
+        pthread_mutex_lock(&swap_lock);
+        if (req->num > 0)
+        {
+            count_io(req->write);
+        }
+        req->done = 1;
+        if (req->refs == 0)
+        {
+            free(req->buf[0]);
+            req->busy = 0;
+        }
+        swap_queue_head = req->next;
+        if (swap_queue_head < 0)
+        {
+            swap_queue_tail = -1;
+        }
+        pthread_cond_broadcast(&swap_completed);
+        pthread_mutex_unlock(&swap_lock);
+    }
+    return NULL;
+}
+
+// return value: a free entry, allocate one more chunk if none
+static int free_request()
+{
+    for (int id = 0; id < swap_queue_chunks * SWAP_QUEUE_SIZE; ++ id)
+    {
+        if (get_request(id)->busy == 0)
+        {
+            return id;
+        }
+    }
+
+    assert(swap_queue_chunks < SWAP_QUEUE_CHUNKS);
+    swap_queue[swap_queue_chunks] = calloc(SWAP_QUEUE_SIZE, sizeof(swap_request_t));
+    assert(swap_queue[swap_queue_chunks] != NULL);
+    swap_queue_chunks += 1;
+    return (swap_queue_chunks - 1) * SWAP_QUEUE_SIZE;
+}
+
+// refs: the number of swap_release to free the request
+// return value: the request id
+static int swap_submit(int write, uint64_t slot, uint8_t **buf, int num, int refs)
+{
+    swap_open();
+
+    pthread_mutex_lock(&swap_lock);
+    int id = free_request();
+    swap_request_t *req = get_request(id);
+    *req = (swap_request_t){
+        .busy = 1,
+        .done = 0,
+        .write = write,
+        .slot = slot,
+        .num = num,
+        .refs = refs,
+        .next = -1,
+    };
+    memcpy(req->buf, buf, num * sizeof(uint8_t *));
+
+    // append to the FIFO
+    if (swap_queue_tail >= 0)
+    {
+        get_request(swap_queue_tail)->next = id;
+    }
+    else
+    {
+        swap_queue_head = id;
+    }
+    swap_queue_tail = id;
+    pthread_cond_signal(&swap_submitted);
+    pthread_mutex_unlock(&swap_lock);
+
+    return id;
+}
+
+int swap_done(int id)
+{
+    pthread_mutex_lock(&swap_lock);
+    swap_request_t *req = get_request(id);
+    assert(req->busy == 1);
+    int done = req->done;
+    pthread_mutex_unlock(&swap_lock);
+    return done;
+}
+
+void swap_wait(int id)
+{
+    pthread_mutex_lock(&swap_lock);
+    swap_request_t *req = get_request(id);
+    assert(req->busy == 1);
+    while (req->done == 0)
+    {
+        pthread_cond_wait(&swap_completed, &swap_lock);
+    }
+    pthread_mutex_unlock(&swap_lock);
+}
+
+void swap_release(int id)
+{
+    pthread_mutex_lock(&swap_lock);
+    swap_request_t *req = get_request(id);
+    assert(req->busy == 1 && req->done == 1);
+    req->refs -= 1;
+    if (req->refs == 0)
+    {
+        req->busy = 0;
+    }
+    pthread_mutex_unlock(&swap_lock);
+}
+#endif
+
+static int slot_used(uint64_t slot)
+{
+    return (swap_bitmap[slot / SWAP_CLUSTER_SLOTS] >> (slot % SWAP_CLUSTER_SLOTS)) & 1;
+}
+
+static uint64_t saddr2slot(uint64_t saddr)
+{
+    assert(SWAP_ADDRESS_MIN <= saddr && saddr < SWAP_ADDRESS_MIN + SWAP_NUM_SLOTS);
+    uint64_t slot = saddr - SWAP_ADDRESS_MIN;
+    assert(slot_used(slot) == 1);
+    return slot;
+}
+
+#ifdef USE_ZSWAP
+/*  zswap: the compressed pool in front of the swap file
+    The evicted page is compressed and kept in host memory. The file is
+    written only when the pool is full and the LRU entry is spilled.
+    A same-filled page, e.g. zero page, is kept as one word.
+    The entry is kept after loaded, since the frame is clean after
+    swapped in and may be discarded without writing back.
+ */
+#ifndef ZSWAP_POOL_LIMIT
+#define ZSWAP_POOL_LIMIT (64 << 10)
+#endif
+
+// not worth to compress
+#define ZSWAP_MAX_LENGTH (PAGE_SIZE * 3 / 4)
+
+#define LZ_HASH_BITS (12)
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_MATCH (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS (0x80)
+
+typedef struct ZSWAP_ENTRY_STRUCT
+{
+    // LRU list: head is the most recently used
+    struct ZSWAP_ENTRY_STRUCT *prev;
+    struct ZSWAP_ENTRY_STRUCT *next;
+    uint64_t slot;
+    int same_filled;
+    uint64_t value;     // the word of same-filled page
+    uint32_t length;    // compressed length
+    uint8_t data[];
+} zswap_entry_t;
+
+static zswap_entry_t *zswap_index[SWAP_NUM_SLOTS];
+static zswap_entry_t *zswap_head = NULL;
+static zswap_entry_t *zswap_tail = NULL;
+
+uint64_t zswap_pool_size = 0;
+uint64_t zswap_store_count = 0;
+uint64_t zswap_same_filled_count = 0;
+uint64_t zswap_reject_count = 0;
+uint64_t zswap_load_count = 0;
+uint64_t zswap_spill_count = 0;
+
+// LZ77 in bytes, the control byte c:
+//  c < 0x80: c + 1 literals follow
+//  c >= 0x80: match of (c - 0x80 + LZ_MIN_MATCH) bytes, 2 bytes offset follow
+static int lz_literals(const uint8_t *src, uint32_t begin, uint32_t end,
+    uint8_t *dst, uint32_t *op_ptr, uint32_t limit)
+{
+    uint32_t op = *op_ptr;
+    while (begin < end)
+    {
+        uint32_t n = end - begin < LZ_MAX_LITERALS ? end - begin : LZ_MAX_LITERALS;
+        if (op + 1 + n > limit)
+        {
+            return 0;
+        }
+        dst[op] = n - 1;
+        memcpy(&dst[op + 1], &src[begin], n);
+        op += 1 + n;
+        begin += n;
+    }
+    *op_ptr = op;
+    return 1;
+}
+
+// return value: the compressed length, 0 if longer than limit
+static uint32_t lz_compress(const uint8_t *src, uint8_t *dst, uint32_t limit)
+{
+    // position + 1 of the last 4 bytes with the hash
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint32_t ip = 0, op = 0, literal = 0;
+    while (ip + LZ_MIN_MATCH <= PAGE_SIZE)
+    {
+        uint32_t seq;
+        memcpy(&seq, &src[ip], 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[h];
+        table[h] = ip + 1;
+
+        if (candidate == 0 || memcmp(&src[candidate - 1], &src[ip], LZ_MIN_MATCH) != 0)
+        {
+            ip += 1;
+            continue;
+        }
+
+        uint32_t ref = candidate - 1;
+        uint32_t len = LZ_MIN_MATCH;
+        while (ip + len < PAGE_SIZE && len < LZ_MAX_MATCH && src[ref + len] == src[ip + len])
+        {
+            len += 1;
+        }
+
+        if (lz_literals(src, literal, ip, dst, &op, limit) == 0 || op + 3 > limit)
+        {
+            return 0;
+        }
+        uint32_t offset = ip - ref;
+        dst[op + 0] = 0x80 + (len - LZ_MIN_MATCH);
+        dst[op + 1] = offset & 0xff;
+        dst[op + 2] = (offset >> 8) & 0xff;
+        op += 3;
+        ip += len;
+        literal = ip;
+    }
+
+    if (lz_literals(src, literal, PAGE_SIZE, dst, &op, limit) == 0)
+    {
+        return 0;
+    }
+    return op;
+}
+
+static void lz_decompress(const uint8_t *src, uint32_t length, uint8_t *dst)
+{
+    uint32_t ip = 0, op = 0;
+    while (ip < length)
+    {
+        uint8_t c = src[ip];
+        if (c < 0x80)
+        {
+            memcpy(&dst[op], &src[ip + 1], c + 1);
+            ip += 1 + c + 1;
+            op += c + 1;
+        }
+        else
+        {
+            uint32_t len = c - 0x80 + LZ_MIN_MATCH;
+            uint32_t offset = src[ip + 1] | ((uint32_t)src[ip + 2] << 8);
+            // the match may overlap the output
+            for (uint32_t k = 0; k < len; ++ k)
+            {
+                dst[op + k] = dst[op - offset + k];
+            }
+            ip += 3;
+            op += len;
+        }
+    }
+    assert(op == PAGE_SIZE);
+}
+
+static void zswap_unlink(zswap_entry_t *e)
+{
+    if (e->prev != NULL)
+    {
+        e->prev->next = e->next;
+    }
+    else
+    {
+        zswap_head = e->next;
+    }
+
+    if (e->next != NULL)
+    {
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        zswap_tail = e->prev;
+    }
+}
+
+static void zswap_link_head(zswap_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = zswap_head;
+    if (zswap_head != NULL)
+    {
+        zswap_head->prev = e;
+    }
+    zswap_head = e;
+    if (zswap_tail == NULL)
+    {
+        zswap_tail = e;
+    }
+}
+
+static void zswap_decompress(zswap_entry_t *e, uint8_t *buf)
+{
+    if (e->same_filled == 1)
+    {
+        for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+        {
+            memcpy(&buf[i], &e->value, 8);
+        }
+    }
+    else
+    {
+        lz_decompress(e->data, e->length, buf);
+    }
+}
+
+static void zswap_invalidate(uint64_t slot)
+{
+    zswap_entry_t *e = zswap_index[slot];
+    if (e != NULL)
+    {
+        zswap_unlink(e);
+        zswap_pool_size -= e->length;
+        zswap_index[slot] = NULL;
+        free(e);
+    }
+}
+
+// write the LRU entry to swap file
+static void zswap_spill()
+{
+    zswap_entry_t *e = zswap_tail;
+    assert(e != NULL);
+
+    uint8_t *buf = malloc(PAGE_SIZE);
+    assert(buf != NULL);
+    zswap_decompress(e, buf);
+#ifdef USE_ASYNC_SWAP
+    // in order with the other requests of the slot
+    swap_submit(1, e->slot, &buf, 1, 0);
+#else
+    swap_open();
+    swap_io(1, e->slot, &buf, 1);
+    free(buf);
+#endif
+
+    zswap_spill_count += 1;
+    zswap_invalidate(e->slot);
+}
+
+// return value: 1 if stored in the pool, 0 if it goes to swap file
+static int zswap_store(uint64_t slot, uint8_t *frame)
+{
+    // the old content of the slot
+    zswap_invalidate(slot);
+
+    uint64_t value;
+    memcpy(&value, frame, 8);
+    int same_filled = 1;
+    for (uint64_t i = 8; i < PAGE_SIZE; i += 8)
+    {
+        if (memcmp(&frame[i], &value, 8) != 0)
+        {
+            same_filled = 0;
+            break;
+        }
+    }
+
+    uint8_t buf[ZSWAP_MAX_LENGTH];
+    uint32_t length = 0;
+    if (same_filled == 0)
+    {
+        length = lz_compress(frame, buf, ZSWAP_MAX_LENGTH);
+        if (length == 0)
+        {
+            zswap_reject_count += 1;
+            return 0;
+        }
+    }
+
+    while (zswap_pool_size + length > ZSWAP_POOL_LIMIT)
+    {
+        zswap_spill();
+    }
+
+    zswap_entry_t *e = malloc(sizeof(zswap_entry_t) + length);
+    assert(e != NULL);
+    e->slot = slot;
+    e->same_filled = same_filled;
+    e->value = value;
+    e->length = length;
+    memcpy(e->data, buf, length);
+    zswap_link_head(e);
+    zswap_index[slot] = e;
+    zswap_pool_size += length;
+
+    zswap_store_count += 1;
+    zswap_same_filled_count += same_filled;
+    return 1;
+}
+
+// return value: 1 if loaded from the pool
+static int zswap_load(uint64_t slot, uint8_t *frame)
+{
+    zswap_entry_t *e = zswap_index[slot];
+    if (e == NULL)
+    {
+        return 0;
+    }
+
+    zswap_decompress(e, frame);
+    zswap_unlink(e);
+    zswap_link_head(e);
+    zswap_load_count += 1;
+    return 1;
+}
+#endif
+
+/*  swap cache: the frames holding the pages read ahead
+    The frame keeps a copy of the slot without mapping, so the page fault
+    of the slot maps the frame without I/O. The copy is dropped when the
+    slot is written or freed, and the frame is given back to the kernel.
+ */
+// ppn + 1 of the frame caching the slot, 0 if not cached
+static uint64_t swap_cache[SWAP_NUM_SLOTS];
+
+uint64_t swap_readahead_count = 0;
+uint64_t swap_cache_hit_count = 0;
+
+// hits of the pages read ahead since the last readahead
+static uint64_t readahead_hits = 0;
+static uint64_t readahead_window = 1;
+static uint64_t readahead_prev_slot = SWAP_NUM_SLOTS;
+
+static void swap_cache_invalidate(uint64_t slot)
+{
+    if (swap_cache[slot] != 0)
+    {
+        uint64_t ppn = swap_cache[slot] - 1;
+        swap_cache[slot] = 0;
+        release_swapcache_frame(ppn);
+    }
+}
+
+void swap_cache_add(uint64_t saddr, uint64_t ppn)
+{
+    uint64_t slot = saddr2slot(saddr);
+    assert(swap_cache[slot] == 0);
+    swap_cache[slot] = ppn + 1;
+    swap_readahead_count += 1;
+}
+
+// the frame is reused by the kernel
+void swap_cache_delete(uint64_t saddr)
+{
+    uint64_t slot = saddr2slot(saddr);
+    assert(swap_cache[slot] != 0);
+    swap_cache[slot] = 0;
+}
+
+// return value: the frame caching the slot, -1 if not cached
+// the frame is taken out of the cache to be mapped
+int64_t swap_cache_take(uint64_t saddr)
+{
+    uint64_t slot = saddr2slot(saddr);
+    if (swap_cache[slot] == 0)
+    {
+        return -1;
+    }
+
+    uint64_t ppn = swap_cache[slot] - 1;
+    swap_cache[slot] = 0;
+    readahead_hits += 1;
+    swap_cache_hit_count += 1;
+    return ppn;
+}
+
+/*  adaptive readahead window
+    The window grows with the hits of the pages read ahead by the last
+    window, and shrinks to half at most when they are not used. Without
+    any hit, only the sequential faults read ahead. The window goes
+    forward from the faulting slot, or backward if the faults go down.
+    saddrs: the used slots not cached yet in ascending order, with the
+            faulting one
+    return value: the number of saddrs
+ */
+int swap_readahead_window(uint64_t saddr, uint64_t *saddrs, int max)
+{
+    uint64_t slot = saddr2slot(saddr);
+
+    uint64_t pages = readahead_hits + 2;
+    if (readahead_hits == 0)
+    {
+        if (slot != readahead_prev_slot + 1 && slot + 1 != readahead_prev_slot)
+        {
+            pages = 1;
+        }
+    }
+    else
+    {
+        pages = 1ul << (64 - __builtin_clzl(pages - 1));
+    }
+    if (pages < readahead_window / 2)
+    {
+        pages = readahead_window / 2;
+    }
+    if (pages > (uint64_t)max)
+    {
+        pages = max;
+    }
+
+    uint64_t start = slot;
+    if (slot < readahead_prev_slot)
+    {
+        start = slot + 1 >= pages ? slot + 1 - pages : 0;
+    }
+    readahead_window = pages;
+    readahead_prev_slot = slot;
+    readahead_hits = 0;
+
+    int num = 0;
+    for (uint64_t s = start; s < start + pages && s < SWAP_NUM_SLOTS; ++ s)
+    {
+        if (s == slot || (slot_used(s) == 1 && swap_cache[s] == 0))
+        {
+            saddrs[num] = s + SWAP_ADDRESS_MIN;
+            num += 1;
+        }
+    }
+    return num;
+}
+
+static uint64_t allocate_slot()
+{
+    assert(swap_used < SWAP_NUM_SLOTS);
+
+    if (cluster_left == 0 || slot_used(cluster_next) == 1)
+    {
+        cluster_left = 0;
+
+        // 1. a free cluster
+        for (uint64_t i = 0; i < SWAP_NUM_SLOTS / SWAP_CLUSTER_SLOTS; ++ i)
+        {
+            if (swap_bitmap[i] == 0)
+            {
+                cluster_next = i * SWAP_CLUSTER_SLOTS;
+                cluster_left = SWAP_CLUSTER_SLOTS;
+                break;
+            }
+        }
+
+        // 2. any free slot
+        if (cluster_left == 0)
+        {
+            for (uint64_t i = 0; i < SWAP_NUM_SLOTS / SWAP_CLUSTER_SLOTS; ++ i)
+            {
+                if (swap_bitmap[i] != 0xffffffffffffffff)
+                {
+                    cluster_next = i * SWAP_CLUSTER_SLOTS + __builtin_ctzl(~swap_bitmap[i]);
+                    cluster_left = 1;
+                    break;
+                }
+            }
+        }
+    }
+    assert(cluster_left > 0);
+
+    uint64_t slot = cluster_next;
+    cluster_next += 1;
+    cluster_left -= 1;
+
+    swap_bitmap[slot / SWAP_CLUSTER_SLOTS] |= (1ul << (slot % SWAP_CLUSTER_SLOTS));
+    swap_count[slot] = 1;
+    swap_used += 1;
+    return slot + SWAP_ADDRESS_MIN;
+}
+
+// one page table entry does not use the swap page any more
+// e.g., the process exits, or the page is swapped in
+void free_swappage(uint64_t saddr)
+{
+    uint64_t slot = saddr2slot(saddr);
+    assert(swap_count[slot] > 0);
+    swap_count[slot] -= 1;
+
+    if (swap_count[slot] == 0)
+    {
+        swap_bitmap[slot / SWAP_CLUSTER_SLOTS] &= ~(1ul << (slot % SWAP_CLUSTER_SLOTS));
+        swap_used -= 1;
+        swap_cache_invalidate(slot);
+#ifdef USE_ZSWAP
+        zswap_invalidate(slot);
+#endif
+    }
+}
+
+// one more page table entry uses the swap page, e.g. copied by fork
+void duplicate_swappage(uint64_t saddr)
+{
+    uint64_t slot = saddr2slot(saddr);
+    assert(swap_count[slot] < UINT32_MAX);
+    swap_count[slot] += 1;
+}
+
+// swap space is more than half used: keep the slot only when necessary
+int swap_full()
+{
+    return swap_used * 2 > SWAP_NUM_SLOTS;
+}
 
 uint64_t allocate_swappage(uint64_t ppn)
 {
-    uint64_t saddr = internal_swap_addr++;
-    
-    char filename[128];
-    sprintf(filename, "%s/page-%ld.page.txt", SWAP_FILE_DIRECTORY, saddr);
-    FILE *fw = fopen(filename, "w");
-    assert(fw != NULL);
+    uint64_t saddr = allocate_slot();
 
     // write zero page for anonymous page
     // But there is no transaction actually
-    fclose(fw);
     uint64_t ppn_ppo = ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
     memset(&pm[ppn_ppo], 0, PAGE_SIZE);
-    
+
     // Now the page is like swapped in from swap space. So:
     // saddr is stored on page_map
     // ppn is sotred in page table entry (level 4)
@@ -53,54 +814,201 @@ uint64_t allocate_swappage(uint64_t ppn)
     return saddr;
 }
 
+// wait for the I/O
+static void swap_rw(int write, uint64_t slot, uint8_t **buf, int num)
+{
+#ifdef USE_ASYNC_SWAP
+    // keep the order with the requests in flight
+    int id = swap_submit(write, slot, buf, num, 1);
+    swap_wait(id);
+    swap_release(id);
+#else
+    swap_open();
+    swap_io(write, slot, buf, num);
+    count_io(write);
+#endif
+}
+
+// the pages of adjacent slots go in one I/O
+// slots: ascending
+// buf[i]: NULL if served by zswap
+// ids: the request id of each page, NULL to wait for the I/O
+static void swap_cluster_io(int write, uint64_t *slots, uint8_t **buf, int num, int *ids)
+{
+    int i = 0;
+    while (i < num)
+    {
+        int n = 1;
+        while (buf[i] != NULL && i + n < num && n < SWAP_IO_MAX_PAGES &&
+            buf[i + n] != NULL && slots[i + n] == slots[i] + n)
+        {
+            n += 1;
+        }
+
+#ifdef USE_ASYNC_SWAP
+        if (ids != NULL)
+        {
+            int id = buf[i] == NULL ?
+                swap_submit(write, slots[i], NULL, 0, 1) :
+                swap_submit(write, slots[i], &buf[i], n, n);
+            for (int k = 0; k < n; ++ k)
+            {
+                ids[i + k] = id;
+            }
+            i += n;
+            continue;
+        }
+#else
+        assert(ids == NULL);
+#endif
+
+        if (buf[i] != NULL)
+        {
+            swap_rw(write, slots[i], &buf[i], n);
+        }
+        i += n;
+    }
+}
+
 int swap_in(uint64_t saddr, uint64_t ppn)
 {
     assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
-    
-    FILE *fr = NULL;
-    char filename[128];
 
     if (saddr == 0)
     {
         // saddr == 0 indicates that this page is not backed by file
-        // nor backed by swap space. It should be a newly created 
-        // anonymous page. Allocate one swap address for it.
-        allocate_swappage(ppn);
+        // nor backed by swap space. It should be a newly created
+        // anonymous page: zero page, and the slot is allocated when
+        // it is swapped out
+        memset(&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH], 0, PAGE_SIZE);
         return 0;
     }
 
-    assert(saddr >= SWAP_ADDRESS_MIN);
-    sprintf(filename, "%s/page-%ld.page.txt", SWAP_FILE_DIRECTORY, saddr);
-    fr = fopen(filename, "r");
-    assert(fr != NULL);
-
-    uint64_t ppn_ppo = ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
-    char buf[64] = {'0'};
-    for (int i = 0; i < SWAP_PAGE_FILE_LINES; ++ i)
+    uint64_t slot = saddr2slot(saddr);
+#ifdef USE_ZSWAP
+    if (zswap_load(slot, frame_of(ppn)) == 1)
     {
-        char *str = fgets(buf, 64, fr);
-        *((uint64_t *)(&pm[ppn_ppo + i * 8])) = string2uint(str);
+        return 1;
     }
-    fclose(fr);
+#endif
+
+    uint8_t *buf = frame_of(ppn);
+    swap_rw(0, slot, &buf, 1);
     return 1;
 }
 
-int swap_out(uint64_t saddr, uint64_t ppn)
+// read the pages of ascending swap addresses, e.g. the readahead window
+void swap_in_cluster(uint64_t *saddrs, uint64_t *ppns, int num)
+{
+    uint64_t slots[num];
+    uint8_t *buf[num];
+    for (int i = 0; i < num; ++ i)
+    {
+        assert(0 <= ppns[i] && ppns[i] < MAX_NUM_PHYSICAL_PAGE);
+        slots[i] = saddr2slot(saddrs[i]);
+        assert(i == 0 || slots[i - 1] < slots[i]);
+        buf[i] = frame_of(ppns[i]);
+#ifdef USE_ZSWAP
+        if (zswap_load(slots[i], buf[i]) == 1)
+        {
+            buf[i] = NULL;
+        }
+#endif
+    }
+    swap_cluster_io(0, slots, buf, num, NULL);
+}
+
+// the slot to write the frame to
+static uint64_t swap_out_slot(uint64_t saddr, uint64_t ppn)
 {
     assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
-    assert(saddr >= SWAP_ADDRESS_MIN);
 
-    FILE *fw = NULL;
-    char filename[128];
-    sprintf(filename, "%s/page-%ld.page.txt", SWAP_FILE_DIRECTORY, saddr);
-    fw = fopen(filename, "w");
-    assert(fw != NULL);
+    if (saddr == 0 || swap_count[saddr2slot(saddr)] > 1)
+    {
+        // no slot, or the slot is still shared by others:
+        // write to a slot of its own
+        if (saddr != 0)
+        {
+            free_swappage(saddr);
+        }
+        saddr = allocate_slot();
+        set_pagemap_swapaddr(ppn, saddr);
+    }
 
-    uint64_t ppn_ppo = ppn << PHYSICAL_PAGE_OFFSET_LENGTH;
-    for (int i = 0; i < SWAP_PAGE_FILE_LINES; ++ i)
+    // the copy in swap cache is out of date
+    uint64_t slot = saddr2slot(saddr);
+    swap_cache_invalidate(slot);
+    return slot;
+}
+
+int swap_out(uint64_t saddr, uint64_t ppn)
+{
+    uint64_t slot = swap_out_slot(saddr, ppn);
+#ifdef USE_ZSWAP
+    if (zswap_store(slot, frame_of(ppn)) == 1)
     {
-        fprintf(fw, "0x%16lx\n", *((uint64_t *)(&pm[ppn_ppo + i * 8])));
+        return 0;
     }
-    fclose(fw);
+#endif
+
+    uint8_t *buf = frame_of(ppn);
+    swap_rw(1, slot, &buf, 1);
     return 0;
-}
\ No newline at end of file
+}
+
+#ifdef USE_ASYNC_SWAP
+// return value: the request id to check by swap_done
+int swap_in_async(uint64_t saddr, uint64_t ppn)
+{
+    assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
+    uint64_t slot = saddr2slot(saddr);
+#ifdef USE_ZSWAP
+    if (zswap_load(slot, frame_of(ppn)) == 1)
+    {
+        // completed without I/O
+        return swap_submit(0, slot, NULL, 0, 1);
+    }
+#endif
+    uint8_t *buf = frame_of(ppn);
+    return swap_submit(0, slot, &buf, 1, 1);
+}
+
+/*  clustered swap-out: the victims of adjacent slots are written in one I/O
+    The new slots of one cluster are allocated in order, so the victims
+    without slots are written together.
+    ppns: sorted by the slots in place
+    ids: the request id of each victim, shared by the victims of one I/O
+ */
+void swap_out_cluster_async(uint64_t *saddrs, uint64_t *ppns, int num, int *ids)
+{
+    uint64_t slots[num];
+    uint8_t *buf[num];
+    for (int i = 0; i < num; ++ i)
+    {
+        slots[i] = swap_out_slot(saddrs[i], ppns[i]);
+
+        // insertion sort
+        for (int j = i; j > 0 && slots[j - 1] > slots[j]; -- j)
+        {
+            uint64_t t = slots[j - 1];
+            slots[j - 1] = slots[j];
+            slots[j] = t;
+            t = ppns[j - 1];
+            ppns[j - 1] = ppns[j];
+            ppns[j] = t;
+        }
+    }
+
+    for (int i = 0; i < num; ++ i)
+    {
+        buf[i] = frame_of(ppns[i]);
+#ifdef USE_ZSWAP
+        if (zswap_store(slots[i], buf[i]) == 1)
+        {
+            buf[i] = NULL;
+        }
+#endif
+    }
+    swap_cluster_io(1, slots, buf, num, ids);
+}
+#endif
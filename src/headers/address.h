@@ -21,12 +21,12 @@
  */
 #define SRAM_CACHE_INDEX_LENGTH (6)
 #define SRAM_CACHE_OFFSET_LENGTH (6)
-#define SRAM_CACHE_TAG_LENGTH (4)
+#define SRAM_CACHE_TAG_LENGTH (40)
 #endif
 
 #define PHYSICAL_PAGE_OFFSET_LENGTH (12)
-#define PHYSICAL_PAGE_NUMBER_LENGTH (4)
-#define PHYSICAL_ADDRESS_LENGTH (16)
+#define PHYSICAL_PAGE_NUMBER_LENGTH (40)
+#define PHYSICAL_ADDRESS_LENGTH (52)
 
 #define VIRTUAL_PAGE_OFFSET_LENGTH (12)
 #define VIRTUAL_PAGE_NUMBER_LENGTH (9)  // 9 + 9 + 9 + 9 = 36
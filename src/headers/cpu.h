@@ -15,6 +15,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <setjmp.h>
 #include "headers/instruction.h"
 
 /*======================================*/
@@ -275,9 +276,15 @@ typedef struct
     uint64_t cr3;   // should be a 40-bit PPN for PGD in DRAM
                     // but we are using 48-bit virutal address on simulator's heap
                     // (by malloc())
+    uint64_t asid;  // address space ID tagging the TLB entries
+                    // PCID in x86 is CR3[11:0], but the low bits of cr3 are used here
 } cpu_cr_t;
 cpu_cr_t cpu_controls;
 
+// with USE_SCHED_SMP, the cores run in turn and the registers above
+// belong to the running core. The others are saved in isa.c
+#define MAX_NUM_CORES (32)
+
 // move to common.h to be shared by linker
 // #define MAX_INSTRUCTION_CHAR 64
 #define NUM_INSTRTYPE 14
@@ -293,14 +300,41 @@ void instruction_cycle();
 
 uint64_t mmu_vaddr_pagefault;
 
+// set by kernel accessing user memory, e.g. copy_from_user:
+// the page fault jumps to the fixup instead of interrupt
+jmp_buf *mmu_fault_fixup;
+
 // flush TLB if use it
 #if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+#define TLB_ITLB    (0)
+#define TLB_DTLB    (1)
+#define TLB_STLB    (2)
+
+uint64_t tlb_hit_count[3];
+uint64_t tlb_miss_count[3];
+
 void flush_tlb();
+void flush_tlb_asid(uint64_t asid);
+void flush_tlb_page(uint64_t vaddr);
+void print_tlb_stats();
+
+// page walk cache
+// memory references of page walk, and the ones skipped by PWC
+uint64_t pagewalk_ref_count;
+uint64_t pagewalk_saved_count;
+
+void flush_pwc();
+void print_pwc_stats();
 #endif
 
+// type of the memory access causing the translation
+#define MMU_READ    (0)
+#define MMU_WRITE   (1)
+#define MMU_FETCH   (2)
+
 // translate the virtual address to physical address in MMU
 // each MMU is owned by each core
-uint64_t va2pa(uint64_t vaddr, int write_request);
+uint64_t va2pa(uint64_t vaddr, int access);
 
 // end of include guard
 #endif
@@ -20,19 +20,31 @@
 /*======================================*/
 
 // physical memory space is decided by the physical address
-// in this simulator, there are 4 + 6 + 6 = 16 bit physical adderss
-// then the physical space is (1 << 16) = 65536
-// total 16 physical memory
-#define PHYSICAL_MEMORY_SPACE   (65536)
-#define MAX_NUM_PHYSICAL_PAGE (16)    // 1 + MAX_INDEX_PHYSICAL_PAGE
+// in this simulator, there are 40 + 12 = 52 bit physical adderss
+// the size actually simulated is set at runtime by physical_memory_init
+// by default 16 physical pages = 65536 bytes
+#define DEFAULT_PHYSICAL_MEMORY_SPACE   (65536)
+#define PHYSICAL_MEMORY_SPACE   (physical_memory_space)
+#define MAX_NUM_PHYSICAL_PAGE   (physical_memory_space >> 12)   // 1 + MAX_INDEX_PHYSICAL_PAGE
 
 #define PAGE_TABLE_ENTRY_NUM    (512)
 #define PAGE_SIZE    (4096)
 
+// huge pages mapped by the leaf entry of PMD (2MB) or PUD (1GB)
+#define HUGE_PAGE_2M_SIZE   ((uint64_t)PAGE_SIZE * PAGE_TABLE_ENTRY_NUM)
+#define HUGE_PAGE_1G_SIZE   (HUGE_PAGE_2M_SIZE * PAGE_TABLE_ENTRY_NUM)
+
+// the PTE is mapped by map_pte4 without its virtual address
+#define RMAP_NO_VADDR (0xffffffffffffffff)
+
 // physical memory
-// 16 physical memory pages
 // used only for user process
-uint8_t pm[PHYSICAL_MEMORY_SPACE];
+// defined in dram.c
+extern uint8_t *pm;
+extern uint64_t physical_memory_space;
+
+// reserve size bytes of physical memory, the host populates it lazily
+void physical_memory_init(uint64_t size);
 
 // page table entry struct
 
@@ -50,7 +62,8 @@ typedef union
         uint64_t cachedisabled      : 1;
         uint64_t reference          : 1;
         uint64_t unused6            : 1;
-        uint64_t smallpage          : 1;
+        uint64_t pagesize           : 1;    // PS - 1: leaf of a huge page in PUD or PMD
+                                            // the leaf is in the layout of pte4_t
         uint64_t global             : 1;
         uint64_t unused9_11         : 3;
         /*
@@ -120,4 +133,31 @@ void cpu_writeinst_dram(uint64_t paddr, const char *str);
 void bus_read_cacheline(uint64_t paddr, uint8_t *block);
 void bus_write_cacheline(uint64_t paddr, uint8_t *block);
 
+#ifdef USE_SOFTMMU
+// host TLB of the functional simulation in dram.c
+// flush it whenever a translation or its permission is changed
+uint64_t softmmu_hit_count;
+uint64_t softmmu_miss_count;
+
+void softmmu_flush();
+void softmmu_flush_page(uint64_t vaddr);
+#endif
+
+#ifdef USE_DRAM_TIMING
+// timing of the bus transfers: DRAM controller
+#define DRAM_OPEN_PAGE              (0)
+#define DRAM_CLOSED_PAGE            (1)
+
+#define DRAM_MAP_ROW_BANK_COLUMN    (0)
+#define DRAM_MAP_ROW_COLUMN_BANK    (1)
+
+void dram_ctrl_reset();
+void dram_ctrl_map(uint64_t paddr, int *channel, int *bank, uint64_t *row, uint64_t *column);
+int dram_ctrl_request(uint64_t paddr, int write, uint64_t arrival);
+uint64_t dram_ctrl_complete(int id);
+void dram_ctrl_release(int id);
+void dram_ctrl_run(uint64_t until);
+void print_dram_stats();
+#endif
+
 #endif
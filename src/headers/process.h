@@ -20,6 +20,10 @@
 
 #define     KERNEL_STACK_SIZE   (8192)
 
+#define     PROC_RUNNABLE       (0)
+#define     PROC_BLOCKED        (1)
+#define     PROC_ZOMBIE         (2)
+
 typedef union KERNEL_STACK_STRUCT
 {    
     uint8_t stack[KERNEL_STACK_SIZE];
@@ -51,20 +55,66 @@ typedef struct VIRTUAL_MEMORY_AREA_STRUCT
             uint64_t write:     1;
             uint64_t execute:   1;
             uint64_t private:   1;
+            // mapped from file, else anonymous, e.g. [stack], [heap]
+            uint64_t file:      1;
         } vma_mode;
     };
 
     // actually we need inode here but we do not implement file system
     char filepath[128];
+    // file-backed area: page vma_pgoff of the file is at vma_start
+    uint64_t vma_pgoff;
 
-    // used for RBT indexing
+    // used for RBT indexing, keyed by vma_start
     int rbt_color;
+    struct VIRTUAL_MEMORY_AREA_STRUCT *rbt_parent;
+    struct VIRTUAL_MEMORY_AREA_STRUCT *rbt_left;
+    struct VIRTUAL_MEMORY_AREA_STRUCT *rbt_right;
 } vm_area_t;
 
 typedef struct PROCESS_CONTROL_BLOCK_STRUCT
 {
     uint64_t pid;
 
+    // address space ID, tagging the TLB entries of this process
+    uint64_t asid;
+
+    // PROC_RUNNABLE, or PROC_BLOCKED waiting for I/O, e.g. swap-in
+    // PROC_ZOMBIE: exited, waiting for its parent to reap it
+    int state;
+
+    // scheduling entity, times are counted by global time
+    struct
+    {
+        // -20 to 19, the lower the nice, the larger the weight
+        int nice;
+        // runtime scaled by weight, the key of CFS run queue
+        uint64_t vruntime;
+        // when the process is switched in
+        uint64_t exec_start;
+        // when the process becomes runnable but not running
+        uint64_t wait_start;
+
+        // statistics
+        uint64_t sum_exec_runtime;
+        uint64_t sum_wait_time;
+        uint64_t max_wait_time;
+        uint64_t run_count;
+        uint64_t nr_migrations;
+
+        // bit i for core i, 0 for all cores
+        uint64_t cpus_allowed;
+        // the core where the process runs or waits
+        int core;
+
+        // used for RBT indexing in CFS run queue
+        int on_rq;
+        int rbt_color;
+        struct PROCESS_CONTROL_BLOCK_STRUCT *rbt_parent;
+        struct PROCESS_CONTROL_BLOCK_STRUCT *rbt_left;
+        struct PROCESS_CONTROL_BLOCK_STRUCT *rbt_right;
+    } sched;
+
     struct
     {
         // page global directory
@@ -77,10 +127,26 @@ typedef struct PROCESS_CONTROL_BLOCK_STRUCT
 
         // virtual memory area
         linkedlist_internal_t vma;
+        // the same areas indexed by red-black tree
+        rbtree_internal_t vma_tree;
+        // the area found by the last search
+        vm_area_t *vma_cache;
     } mm;
     
     kstack_t *kstack;
 
+    // the parent blocked by vfork till this process calls execve or exit
+    struct PROCESS_CONTROL_BLOCK_STRUCT *vfork_parent;
+
+    // the process reaping this one by wait, NULL if nobody waits
+    struct PROCESS_CONTROL_BLOCK_STRUCT *parent;
+    // blocked in wait till one child exits
+    int waiting;
+    // the signal sent by kill, the process exits when it is switched in
+    uint64_t killed;
+    // wait status: exit code in bits 8 to 15, or the signal killed it
+    uint64_t exit_status;
+
     // it's easier to store the context to PCB
     context_t context;
 
@@ -91,8 +157,30 @@ typedef struct PROCESS_CONTROL_BLOCK_STRUCT
 void syscall_init();
 
 pcb_t *get_current_pcb();
+void wake_up_process(pcb_t *proc);
+void wake_up_new_process(pcb_t *proc);
 
 void setup_pagetable_from_vma(pcb_t *proc);
 int vma_add_area(pcb_t *proc, vm_area_t *area);
+void vma_free_all(pcb_t *proc);
+
+// caches of kernel objects, see slab.c
+#define     KMEM_PAGETABLE      (0)
+#define     KMEM_PCB            (1)
+#define     KMEM_VMA            (2)
+#define     KMEM_KSTACK         (3)
+#define     KMEM_NUM_CACHES     (4)
+
+// objects in use, allocations, and the ones served by magazines
+uint64_t kmem_live_count[KMEM_NUM_CACHES];
+uint64_t kmem_alloc_count[KMEM_NUM_CACHES];
+uint64_t kmem_magazine_hit_count[KMEM_NUM_CACHES];
+// slabs held now, and slabs ever allocated from host
+uint64_t kmem_slab_count[KMEM_NUM_CACHES];
+uint64_t kmem_host_alloc_count[KMEM_NUM_CACHES];
+
+void *kmem_cache_alloc(int type);
+void kmem_cache_free(int type, void *obj);
+void print_kmem_stats();
 
 #endif
\ No newline at end of file
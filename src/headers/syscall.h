@@ -11,4 +11,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-uint64_t syscall_fork();
\ No newline at end of file
+uint64_t syscall_fork();
+uint64_t syscall_vfork();
+uint64_t syscall_spawn(const char *filename);
+uint64_t syscall_execve(const char *filename);
+uint64_t syscall_exit(uint64_t exit_code);
+uint64_t syscall_wait(int64_t pid, uint64_t options, uint64_t *status);
+uint64_t syscall_kill(uint64_t pid, uint64_t sig);
+
+// kernel access to user memory
+uint64_t copy_from_user(void *to, uint64_t from, uint64_t n);
+uint64_t copy_to_user(uint64_t to, const void *from, uint64_t n);
+int64_t strncpy_from_user(char *dst, uint64_t src, uint64_t size);
+void flush_output_sink();
\ No newline at end of file
@@ -0,0 +1,309 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/interrupt.h"
+#include "headers/process.h"
+#include "headers/linker.h"
+#include "headers/color.h"
+
+// from fork
+void update_userframe_returnvalue(pcb_t *p, uint64_t retval);
+void vfork_release(pcb_t *child);
+
+// from exit
+void free_mm(pcb_t *proc);
+
+// the anonymous areas of the new image
+#define USER_STACK_TOP      (0x7ffffffff000)
+#define USER_STACK_SIZE     (8 * PAGE_SIZE)
+#define USER_HEAP_SIZE      (16 * PAGE_SIZE)
+
+/*  Load the linked executable (EOF) produced by link_elf
+    The layout is computed by staticlink.c:compute_section_header.
+    The sections are compact in memory from 0x00400000:
+    .text is an array of instruction strings of MAX_INSTRUCTION_CHAR bytes,
+    .rodata and .data are arrays of 8-byte values. .symtab is not loaded.
+
+    We do not implement file system: the file is parsed once, and its
+    memory image is kept as the content of the file, paged by the offset.
+    execve only builds the areas: .text & .rodata and .data are mapped
+    from the file, the heap and stack are anonymous. No frame is allocated:
+    the pages are mapped from the page cache by fix_pagefault when touched.
+    The sections are not page aligned, so the page shared by .text and
+    .data belongs to the writable area.
+    The loader needs the areas: it works with USE_FORK_COW only.
+ */
+
+// return value: 1 if the executable can be loaded
+int check_executable(const char *filename)
+{
+#ifdef USE_FORK_COW
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+    fclose(fp);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef USE_FORK_COW
+// the content of one executable
+typedef struct EXEC_FILE_STRUCT
+{
+    char filepath[128];
+    // the key of page cache
+    uint64_t ino;
+
+    // [image_start, data_start): .text & .rodata
+    // [data_start, image_end): .data
+    uint64_t image_start;
+    uint64_t data_start;
+    uint64_t image_end;
+    uint64_t entry;
+
+    // file page i is the image from image_start + i * PAGE_SIZE
+    uint64_t num_pages;
+    uint8_t *pages;
+
+    struct EXEC_FILE_STRUCT *next;
+} exec_file_t;
+
+static exec_file_t *exec_files = NULL;
+static uint64_t exec_file_count = 0;
+
+static uint64_t round_up(uint64_t x)
+{
+    return (x + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+static uint64_t round_down(uint64_t x)
+{
+    return x / PAGE_SIZE * PAGE_SIZE;
+}
+
+// write the sections to the image
+static void build_image(exec_file_t *f, elf_t *eof)
+{
+    sh_entry_t *text = NULL;
+    f->data_start = 0;
+    f->image_end = 0;
+    for (int i = 0; i < eof->sht_count; ++ i)
+    {
+        sh_entry_t *sh = &eof->sht[i];
+        uint64_t end = sh->sh_addr + sh->sh_size * sizeof(uint64_t);
+        if (strcmp(sh->sh_name, ".text") == 0)
+        {
+            text = sh;
+            end = sh->sh_addr + sh->sh_size * MAX_INSTRUCTION_CHAR;
+        }
+        else if (strcmp(sh->sh_name, ".data") == 0)
+        {
+            f->data_start = sh->sh_addr;
+        }
+        else if (strcmp(sh->sh_name, ".rodata") != 0)
+        {
+            continue;
+        }
+        f->image_end = end > f->image_end ? end : f->image_end;
+    }
+    assert(text != NULL);
+    f->image_start = text->sh_addr;
+    if (f->data_start == 0)
+    {
+        // no .data: all pages are read only
+        f->data_start = round_up(f->image_end);
+    }
+
+    f->num_pages = (round_up(f->image_end) - round_down(f->image_start)) / PAGE_SIZE;
+    f->pages = KERNEL_malloc(f->num_pages * PAGE_SIZE);
+    memset(f->pages, 0, f->num_pages * PAGE_SIZE);
+    uint8_t *base = f->pages - round_down(f->image_start);
+
+    for (int i = 0; i < eof->sht_count; ++ i)
+    {
+        sh_entry_t *sh = &eof->sht[i];
+        if (strcmp(sh->sh_name, ".text") == 0)
+        {
+            for (int j = 0; j < sh->sh_size; ++ j)
+            {
+                strncpy((char *)&base[sh->sh_addr + j * MAX_INSTRUCTION_CHAR],
+                    eof->buffer[sh->sh_offset + j], MAX_INSTRUCTION_CHAR - 1);
+            }
+        }
+        else if (strcmp(sh->sh_name, ".rodata") == 0 || strcmp(sh->sh_name, ".data") == 0)
+        {
+            for (int j = 0; j < sh->sh_size; ++ j)
+            {
+                *(uint64_t *)&base[sh->sh_addr + j * sizeof(uint64_t)] =
+                    string2uint(eof->buffer[sh->sh_offset + j]);
+            }
+        }
+    }
+
+    f->entry = f->image_start;
+    for (int i = 0; i < eof->symt_count; ++ i)
+    {
+        if (strcmp(eof->symt[i].st_name, "main") == 0 &&
+            strcmp(eof->symt[i].st_shndx, ".text") == 0)
+        {
+            f->entry = f->image_start + eof->symt[i].st_value * MAX_INSTRUCTION_CHAR;
+        }
+    }
+}
+
+// return value: the content of the file, parsed at the first open
+static exec_file_t *open_executable(const char *filename)
+{
+    for (exec_file_t *f = exec_files; f != NULL; f = f->next)
+    {
+        if (strcmp(f->filepath, filename) == 0)
+        {
+            return f;
+        }
+    }
+
+    elf_t *eof = KERNEL_malloc(sizeof(elf_t));
+    memset(eof, 0, sizeof(elf_t));
+    parse_elf((char *)filename, eof);
+
+    exec_file_t *f = KERNEL_malloc(sizeof(exec_file_t));
+    memset(f, 0, sizeof(exec_file_t));
+    strncpy(f->filepath, filename, sizeof(f->filepath) - 1);
+    exec_file_count += 1;
+    f->ino = exec_file_count;
+    build_image(f, eof);
+    free_elf(eof);
+
+    f->next = exec_files;
+    exec_files = f;
+    return f;
+}
+
+// actually the inode of the file
+uint64_t get_inode(const char *filepath)
+{
+    return open_executable(filepath)->ino;
+}
+
+// read one page of the file to the frame of page cache
+void read_filepage(const char *filepath, uint64_t pgoff, uint8_t *buf)
+{
+    exec_file_t *f = open_executable(filepath);
+    if (pgoff < f->num_pages)
+    {
+        memcpy(buf, &f->pages[pgoff * PAGE_SIZE], PAGE_SIZE);
+    }
+    else
+    {
+        // beyond the end of file
+        memset(buf, 0, PAGE_SIZE);
+    }
+}
+
+static void add_area(pcb_t *proc, uint64_t start, uint64_t end, int write,
+    const char *filepath, int file, uint64_t pgoff)
+{
+    assert(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+    if (start >= end)
+    {
+        return;
+    }
+
+    vm_area_t *a = kmem_cache_alloc(KMEM_VMA);
+    memset(a, 0, sizeof(vm_area_t));
+    a->vma_start = start;
+    a->vma_end = end;
+    a->vma_mode.read = 1;
+    a->vma_mode.write = write;
+    a->vma_mode.execute = file == 1 && write == 0;
+    a->vma_mode.private = 1;
+    a->vma_mode.file = file;
+    a->vma_pgoff = pgoff;
+    strncpy(a->filepath, filepath, sizeof(a->filepath) - 1);
+    vma_add_area(proc, a);
+}
+
+// the old address space is dropped, or given back to the vfork parent
+static void release_mm(pcb_t *proc)
+{
+    if (proc->vfork_parent != NULL)
+    {
+        // the borrowed page table is not touched
+        memset(&proc->mm, 0, sizeof(proc->mm));
+        proc->mm.pgd = kmem_cache_alloc(KMEM_PAGETABLE);
+        memset(proc->mm.pgd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+        proc->asid = proc->pid;
+        vfork_release(proc);
+        return;
+    }
+
+    free_mm(proc);
+}
+#endif
+
+// the process starts from main of the executable at its next return to user
+void load_executable(pcb_t *proc, const char *filename)
+{
+#ifdef USE_FORK_COW
+    assert(check_executable(filename) == 1);
+    printf(BLUESTR("\tExecve: process %ld loads %s\n"), proc->pid, filename);
+
+    exec_file_t *f = open_executable(filename);
+    release_mm(proc);
+
+    // the areas only, the page table is empty
+    uint64_t file_start = round_down(f->image_start);
+    uint64_t data_start = round_down(f->data_start);
+    uint64_t data_end = round_up(f->image_end);
+    add_area(proc, file_start, data_start, 0, filename, 1, 0);
+    add_area(proc, data_start, data_end, 1, filename, 1, (data_start - file_start) / PAGE_SIZE);
+    add_area(proc, data_end, data_end + USER_HEAP_SIZE, 1, "[heap]", 0, 0);
+    add_area(proc, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP, 1, "[stack]", 0, 0);
+
+    // return to the entry with clean registers
+    uint64_t stack_top = (uint64_t)proc->kstack + KERNEL_STACK_SIZE;
+    trapframe_t *tf = (trapframe_t *)(stack_top - sizeof(trapframe_t));
+    tf->rip = f->entry;
+    tf->rsp = USER_STACK_TOP;
+    userframe_t *uf = (userframe_t *)(stack_top - sizeof(trapframe_t) - sizeof(userframe_t));
+    memset(uf, 0, sizeof(userframe_t));
+    proc->context.regs.rsp = (uint64_t)uf;
+#endif
+}
+
+/*  execve: the current process is replaced by the executable
+    return value: 0 if the executable cannot be loaded, then the process
+    goes on with -1 returned
+ */
+uint64_t syscall_execve(const char *filename)
+{
+    pcb_t *proc = get_current_pcb();
+    if (check_executable(filename) == 0)
+    {
+        update_userframe_returnvalue(proc, -1);
+        return 0;
+    }
+
+    load_executable(proc, filename);
+    return 1;
+}
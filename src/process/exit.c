@@ -0,0 +1,262 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/interrupt.h"
+#include "headers/common.h"
+#include "headers/syscall.h"
+#include "headers/process.h"
+#include "headers/color.h"
+
+// from fork
+void update_userframe_returnvalue(pcb_t *p, uint64_t retval);
+void free_pagetable(pte123_t *tab, int level);
+void vfork_release(pcb_t *child);
+
+// wait status, the same as Linux: WEXITSTATUS and WTERMSIG
+#define EXIT_STATUS(code)   (((code) & 0xff) << 8)
+#define KILL_STATUS(sig)    ((sig) & 0x7f)
+
+// the option of wait: return 0 at once if no child has exited
+#define WNOHANG             (1)
+
+/*  exit & wait
+    The address space is dropped in exit at once: frames, swap slots,
+    page tables and areas. What's left is the zombie: the PCB with the
+    exit status, and the kernel stack, which is in use when the process
+    exits itself. The parent reaps the zombie by wait and frees them.
+    The children of the exiting process are given to its parent.
+    Nobody waits for the process without parent: it's released once it
+    is off its kernel stack, i.e. switched out by os_schedule.
+ */
+
+// the address space is dropped, PGD is kept but empty
+void free_mm(pcb_t *proc)
+{
+#ifdef USE_PAGETABLE_VA2PA
+    free_pagetable(proc->mm.pgd, 1);
+#endif
+#ifdef USE_FORK_COW
+    // areas are kept only by COW
+    vma_free_all(proc);
+#endif
+
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+    flush_tlb_asid(proc->asid);
+#endif
+#ifdef USE_SOFTMMU
+    softmmu_flush();
+#endif
+}
+
+// the zombie is gone: its PCB and kernel stack are freed
+static void release_process(pcb_t *proc)
+{
+    assert(proc->state == PROC_ZOMBIE);
+    assert(proc != get_current_pcb());
+
+    proc->prev->next = proc->next;
+    proc->next->prev = proc->prev;
+
+    kmem_cache_free(KMEM_KSTACK, proc->kstack);
+    kmem_cache_free(KMEM_PCB, proc);
+}
+
+// the process becomes a zombie, it may be running or not
+static void exit_process(pcb_t *proc, uint64_t status)
+{
+    assert(proc->state == PROC_RUNNABLE);
+    printf(REDSTR("\tExit: process %ld, status 0x%lx\n"), proc->pid, status);
+
+    if (proc->vfork_parent != NULL)
+    {
+        // the borrowed address space is given back untouched
+        vfork_release(proc);
+    }
+    else
+    {
+        free_mm(proc);
+#ifdef USE_PAGETABLE_VA2PA
+        kmem_cache_free(KMEM_PAGETABLE, proc->mm.pgd);
+#endif
+    }
+    memset(&proc->mm, 0, sizeof(proc->mm));
+
+    proc->exit_status = status;
+    proc->state = PROC_ZOMBIE;
+
+    // the children are given to the parent
+    pcb_t *p = proc->next;
+    while (p != proc)
+    {
+        pcb_t *next = p->next;
+        if (p->parent == proc)
+        {
+            p->parent = proc->parent;
+            if (p->parent == NULL && p->state == PROC_ZOMBIE)
+            {
+                release_process(p);
+            }
+        }
+        p = next;
+    }
+
+    if (proc->parent != NULL && proc->parent->waiting == 1)
+    {
+        // the parent is waiting for it
+        proc->parent->waiting = 0;
+        wake_up_process(proc->parent);
+    }
+    else if (proc->parent == NULL && proc != get_current_pcb())
+    {
+        release_process(proc);
+    }
+}
+
+// called by os_schedule when the old process is switched out
+void release_orphan(pcb_t *proc)
+{
+    if (proc->state == PROC_ZOMBIE && proc->parent == NULL)
+    {
+        release_process(proc);
+    }
+}
+
+// called by os_schedule when the process is picked to run
+// return value: 1 if it is killed and exits now
+int exit_killed(pcb_t *proc)
+{
+    if (proc->killed == 0)
+    {
+        return 0;
+    }
+    exit_process(proc, KILL_STATUS(proc->killed));
+    return 1;
+}
+
+/*  exit: the current process exits with the code
+    return value: 0 for the last process, there is nothing to switch to
+ */
+uint64_t syscall_exit(uint64_t exit_code)
+{
+    pcb_t *proc = get_current_pcb();
+    if (proc->next == proc)
+    {
+        return 0;
+    }
+
+    exit_process(proc, EXIT_STATUS(exit_code));
+    return 1;
+}
+
+/*  wait: reap one zombie child, pid -1 for any child
+    return value: 1 if one child is reaped, its status is returned
+    The PID of the child is returned to user, -1 if there is no such
+    child. If the children are all alive, the parent is blocked and
+    the syscall is restarted when one of them exits.
+ */
+uint64_t syscall_wait(int64_t pid, uint64_t options, uint64_t *status)
+{
+    pcb_t *proc = get_current_pcb();
+    int found = 0;
+    for (pcb_t *p = proc->next; p != proc; p = p->next)
+    {
+        if (p->parent != proc || (pid != -1 && p->pid != pid))
+        {
+            continue;
+        }
+
+        found = 1;
+        if (p->state == PROC_ZOMBIE)
+        {
+            uint64_t child_pid = p->pid;
+            *status = p->exit_status;
+            release_process(p);
+            update_userframe_returnvalue(proc, child_pid);
+            return 1;
+        }
+    }
+
+    if (found == 0)
+    {
+        update_userframe_returnvalue(proc, -1);
+        return 0;
+    }
+    if ((options & WNOHANG) != 0)
+    {
+        update_userframe_returnvalue(proc, 0);
+        return 0;
+    }
+
+    // sleep till one child exits, then run the `int` again
+    proc->waiting = 1;
+    proc->state = PROC_BLOCKED;
+    trapframe_t *tf = (trapframe_t *)((uint64_t)proc->kstack + KERNEL_STACK_SIZE - sizeof(trapframe_t));
+    tf->rip -= sizeof(char) * MAX_INSTRUCTION_CHAR;
+    return 0;
+}
+
+/*  kill: send the signal to the process, every signal kills
+    The process exits at once if it kills itself. Otherwise it may be
+    running on other core, or blocked: it exits when it is switched in.
+    The signal is 1 to 127, or 0 to check if the process exists.
+    return value: 1 if the signal is sent
+ */
+uint64_t syscall_kill(uint64_t pid, uint64_t sig)
+{
+    pcb_t *proc = get_current_pcb();
+    if (sig > 0x7f)
+    {
+        // not a signal: KILL_STATUS would be a normal exit
+        update_userframe_returnvalue(proc, -1);
+        return 0;
+    }
+
+    pcb_t *p = proc;
+    while (p->pid != pid || p->state == PROC_ZOMBIE)
+    {
+        p = p->next;
+        if (p == proc)
+        {
+            update_userframe_returnvalue(proc, -1);
+            return 0;
+        }
+    }
+
+    update_userframe_returnvalue(proc, 0);
+    if (sig == 0)
+    {
+        // only check if the process exists
+        return 1;
+    }
+
+    if (p == proc)
+    {
+        if (proc->next != proc)
+        {
+            exit_process(proc, KILL_STATUS(sig));
+        }
+        return 1;
+    }
+
+    p->killed = sig;
+    if (p->waiting == 1)
+    {
+        p->waiting = 0;
+        wake_up_process(p);
+    }
+    return 1;
+}
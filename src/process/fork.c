@@ -15,17 +15,30 @@
 #include <stdint.h>
 #include "headers/cpu.h"
 #include "headers/memory.h"
+#include "headers/address.h"
 #include "headers/interrupt.h"
 #include "headers/syscall.h"
 #include "headers/process.h"
+#include "headers/algorithm.h"
 
 // from page fault
-int copy_physicalframe(pte4_t *child_pte, uint64_t parent_ppn);
+int copy_physicalframe(pte4_t *child_pte, uint64_t parent_ppn, uint64_t vaddr);
 int enough_frames(int request_num);
-void map_pte4(pte4_t *pte, uint64_t ppn);
+void duplicate_swappage(uint64_t saddr);
+void map_pte4_vaddr(pte4_t *pte, uint64_t ppn, uint64_t vaddr);
+uint64_t rmap_vaddr(pte4_t *pte);
+int allocate_hugeframe(pte123_t *pte, int level);
+void unmap_pte4(pte4_t *pte);
+void free_hugeframe(pte123_t *pte, int level);
+
+// from execve
+int check_executable(const char *filename);
+void load_executable(pcb_t *proc, const char *filename);
 
 static pcb_t *fork_naive_copy(pcb_t *parent_pcb);
 static pcb_t *fork_cow(pcb_t *parent_pcb);
+static pcb_t *copy_pcb(pcb_t *parent_pcb);
+void update_userframe_returnvalue(pcb_t *p, uint64_t retval);
 
 uint64_t syscall_fork()
 {
@@ -46,6 +59,63 @@ uint64_t syscall_fork()
     return 1;
 }
 
+/*  vfork: the child borrows the address space of parent, and the parent
+    is blocked till the child calls execve or exit. Nothing of the address
+    space is copied: the child of a shell usually calls execve at once.
+    The child must not return from the function calling vfork, the stack
+    is shared as well.
+ */
+uint64_t syscall_vfork()
+{
+    pcb_t *parent = get_current_pcb();
+    pcb_t *child = copy_pcb(parent);
+    assert(child != NULL);
+
+    // same page table, same TLB entries
+    child->asid = parent->asid;
+    child->vfork_parent = parent;
+
+    // os_schedule would not pick the parent
+    parent->state = PROC_BLOCKED;
+
+    return 1;
+}
+
+// the child calls execve or exit: the address space is given back
+void vfork_release(pcb_t *child)
+{
+    if (child->vfork_parent != NULL)
+    {
+        wake_up_process(child->vfork_parent);
+        child->vfork_parent = NULL;
+    }
+}
+
+/*  spawn: posix_spawn as one system call
+    The child is created with an empty address space and the executable
+    loaded, as vfork + execve but the parent is not blocked.
+    return value: 1 for success, 0 if the executable cannot be loaded
+ */
+uint64_t syscall_spawn(const char *filename)
+{
+    pcb_t *parent = get_current_pcb();
+    if (check_executable(filename) == 0)
+    {
+        update_userframe_returnvalue(parent, -1);
+        return 0;
+    }
+
+    pcb_t *child = copy_pcb(parent);
+    assert(child != NULL);
+
+    memset(&child->mm, 0, sizeof(child->mm));
+    child->mm.pgd = kmem_cache_alloc(KMEM_PAGETABLE);
+    memset(child->mm.pgd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+    load_executable(child, filename);
+
+    return 1;
+}
+
 // Implementation
 
 static uint64_t get_newpid()
@@ -80,6 +150,8 @@ static void copy_vmareas(pcb_t *src, pcb_t *dst)
     dst->mm.vma.head = 0;
     dst->mm.vma.count = 0;
     dst->mm.vma.update_head = src->mm.vma.update_head;
+    dst->mm.vma_tree.root = 0;
+    dst->mm.vma_cache = NULL;
 
     if (src->mm.vma.count == 0)
     {
@@ -89,11 +161,12 @@ static void copy_vmareas(pcb_t *src, pcb_t *dst)
     vm_area_t *src_vma = (vm_area_t *)src->mm.vma.head;
     for (int i = 0; i < src->mm.vma.count; ++ i)
     {
-        vm_area_t *dst_vma = KERNEL_malloc(sizeof(vm_area_t));
+        vm_area_t *dst_vma = kmem_cache_alloc(KMEM_VMA);
         dst_vma->vma_start = src_vma->vma_start;
         dst_vma->vma_end = src_vma->vma_end;
         dst_vma->mode_value = src_vma->mode_value;
         strcpy(dst_vma->filepath, src_vma->filepath);
+        dst_vma->vma_pgoff = src_vma->vma_pgoff;
         dst_vma->rbt_color = src_vma->rbt_color;
 
         // add the new virtual memory area to child process
@@ -107,10 +180,132 @@ static void copy_vmareas(pcb_t *src, pcb_t *dst)
 #endif
 }
 
+// number of 4KB frames mapped by the huge page leaf in this level
+static uint64_t hugepage_frames(int level)
+{
+    return 1ul << ((4 - level) * VIRTUAL_PAGE_NUMBER_LENGTH);
+}
+
+// huge pages are not shared by COW, the child gets its own copy at once
+// without aligned free frames, the copy is split into the pages of the
+// next level, same as setup_pagetable_from_vma falls back to 4KB pages
+// return value: 0 if no free frame
+static int copy_hugepage(pte123_t *src, pte123_t *dst, int level)
+{
+    uint64_t src_ppn = ((pte4_t *)src)->ppn;
+    if (allocate_hugeframe(dst, level) == 1)
+    {
+        dst->readonly = src->readonly;
+
+        uint64_t dst_ppn = ((pte4_t *)dst)->ppn;
+        memcpy(&pm[dst_ppn << PHYSICAL_PAGE_OFFSET_LENGTH],
+            &pm[src_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], PAGE_SIZE * hugepage_frames(level));
+        return 1;
+    }
+
+    pte123_t *tab = kmem_cache_alloc(KMEM_PAGETABLE);
+    memset(tab, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+    dst->pte_value = 0;
+    dst->paddr = (uint64_t)tab;
+    dst->present = 1;
+
+    // the leaves are read only, not the entry: a read only entry
+    // of table is shared by COW fork
+    uint64_t num = hugepage_frames(level + 1);
+    for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
+    {
+        if (level + 1 == 4)
+        {
+            pte4_t *pte = (pte4_t *)&tab[i];
+            if (copy_physicalframe(pte, src_ppn + i, RMAP_NO_VADDR) == 0)
+            {
+                return 0;
+            }
+            pte->readonly = src->readonly;
+        }
+        else
+        {
+            // the 2MB part of the 1GB page
+            pte123_t part = *src;
+            ((pte4_t *)&part)->ppn = src_ppn + i * num;
+            if (copy_hugepage(&part, &tab[i], level + 1) == 0)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+#ifdef USE_FORK_COW
+/*  Shared page tables
+    COW fork copies PGD only. Parent and child share the tables below it,
+    and the PGD entries of both are set read only: readonly in an upper
+    level entry write-protects the whole subtree (see MMU page walk).
+    The shared table is copied level by level, only when a write fault or
+    a mapping change walks through the read only entry. The copy shares
+    the next level tables in the same way. So fork is O(PGD), not O(size).
+    The number of entries pointing to a table is kept in the tree, keyed
+    by the table address. A table not in the tree has only one entry.
+ */
+static rb_tree_t *pagetable_refcounts = NULL;
+
+static uint64_t get_pagetable_refcount(pte123_t *tab)
+{
+    if (pagetable_refcounts == NULL)
+    {
+        return 1;
+    }
+    rb_node_t *node = rbt_find(pagetable_refcounts, (uint64_t)tab);
+    return node == NULL ? 1 : node->value;
+}
+
+static void set_pagetable_refcount(pte123_t *tab, uint64_t refcount)
+{
+    assert(refcount >= 1);
+    if (pagetable_refcounts == NULL)
+    {
+        pagetable_refcounts = rbt_construct();
+    }
+
+    rb_node_t *node = rbt_find(pagetable_refcounts, (uint64_t)tab);
+    if (refcount == 1)
+    {
+        if (node != NULL)
+        {
+            rbt_delete(pagetable_refcounts, node);
+            free(node);
+        }
+        return;
+    }
+
+    if (node == NULL)
+    {
+        rbt_add(pagetable_refcounts, (uint64_t)tab);
+        node = rbt_find(pagetable_refcounts, (uint64_t)tab);
+    }
+    node->value = refcount;
+}
+
+// src and its copy dst share the next level table
+static void share_pagetable(pte123_t *src, pte123_t *dst)
+{
+    pte123_t *next = (pte123_t *)(uint64_t)src->paddr;
+    set_pagetable_refcount(next, get_pagetable_refcount(next) + 1);
+
+    src->readonly = 1;
+    dst->readonly = 1;
+}
+#endif
+
+uint64_t pagetable_copy_count = 0;
+
 static pte123_t *copy_pagetable(pte123_t *src, int level)
 {
+    pagetable_copy_count += 1;
+
     // allocate one page for destination
-    pte123_t *dst = KERNEL_malloc(sizeof(pte123_t) * PAGE_TABLE_ENTRY_NUM);
+    pte123_t *dst = kmem_cache_alloc(KMEM_PAGETABLE);
 
     // copy the current page table to destination
     memcpy(dst, src, sizeof(pte123_t) * PAGE_TABLE_ENTRY_NUM);
@@ -134,32 +329,131 @@ static pte123_t *copy_pagetable(pte123_t *src, int level)
 
                 // update page_map.mappings
                 uint64_t ppn = (uint64_t)(((pte4_t *)&src[j])->ppn);
-                map_pte4((pte4_t *)&dst[j], ppn);
+                map_pte4_vaddr((pte4_t *)&dst[j], ppn, rmap_vaddr((pte4_t *)&src[j]));
             }
-            else
+        }
+#endif
+        for (int j = 0; j < PAGE_TABLE_ENTRY_NUM; ++ j)
+        {
+            uint64_t saddr = ((pte4_t *)&src[j])->saddr;
+            if (src[j].present == 0 && saddr != 0)
             {
-                // TODO:
-                // if parent page table entry tells that physical frame
-                // is swapped out ...
+                // the physical frame is swapped out
+                // parent and child share the swap page
+                duplicate_swappage(saddr);
             }
         }
-#endif
         return dst;
     }
 
     // check source
     for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
     {
-        if (src[i].present == 1)
+        if (src[i].present == 1 && src[i].pagesize == 1)
         {
+            // the frames are checked by enough_frames before fork
+            // a fault unsharing the table later runs out of memory as claim_frame
+            int copied = copy_hugepage(&src[i], &dst[i], level);
+            assert(copied == 1);
+        }
+        else if (src[i].present == 1)
+        {
+#ifdef USE_FORK_COW
+            // copied by unshare_pagetable when it is written
+            share_pagetable(&src[i], &dst[i]);
+#else
             pte123_t *src_next = (pte123_t *)(uint64_t)(src[i].paddr);
             dst[i].paddr = (uint64_t)copy_pagetable(src_next, level + 1);
+#endif
         }
     }
 
     return dst;
 }
 
+#ifdef USE_FORK_COW
+// pte: the read only entry in level, pointing to the next level table
+// after unsharing, the entry owns the table and is writable
+void unshare_pagetable(pte123_t *pte, int level)
+{
+    assert(1 <= level && level <= 3);
+    assert(pte->present == 1 && pte->pagesize == 0);
+    assert(pte->readonly == 1);
+
+    pte123_t *tab = (pte123_t *)(uint64_t)pte->paddr;
+    uint64_t refcount = get_pagetable_refcount(tab);
+    if (refcount > 1)
+    {
+        // the other entries still share the old table
+        pte->paddr = (uint64_t)copy_pagetable(tab, level + 1);
+        set_pagetable_refcount(tab, refcount - 1);
+
+        // the entry points to another table now
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+        flush_pwc();
+#endif
+    }
+
+    // The stale TLB entries are read only
+    pte->readonly = 0;
+}
+#endif
+
+#ifdef USE_FORK_COW
+// drop one reference of the shared table
+// return value: 1 if the table is still used by other entries
+static int put_shared_pagetable(pte123_t *tab)
+{
+    uint64_t refcount = get_pagetable_refcount(tab);
+    if (refcount > 1)
+    {
+        set_pagetable_refcount(tab, refcount - 1);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+// the inverse of copy_pagetable: unmap the frames, free the tables below
+// tab itself is cleared but not freed, e.g. the PGD
+void free_pagetable(pte123_t *tab, int level)
+{
+    for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
+    {
+        if (level == 4)
+        {
+            unmap_pte4((pte4_t *)&tab[i]);
+        }
+        else if (tab[i].present == 1 && tab[i].pagesize == 1)
+        {
+            free_hugeframe(&tab[i], level);
+        }
+        else if (tab[i].present == 1)
+        {
+            pte123_t *next = (pte123_t *)(uint64_t)tab[i].paddr;
+#ifdef USE_FORK_COW
+            if (tab[i].readonly == 1 && put_shared_pagetable(next) == 1)
+            {
+                // the other process frees it
+                tab[i].pte_value = 0;
+                continue;
+            }
+#endif
+            free_pagetable(next, level + 1);
+            kmem_cache_free(KMEM_PAGETABLE, next);
+            tab[i].pte_value = 0;
+        }
+    }
+
+    // the freed tables may be cached by PWC
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+    if (level == 1)
+    {
+        flush_pwc();
+    }
+#endif
+}
+
 static void copy_userframes(pte123_t *src, pte123_t *dst, int level)
 {
     if (level == 4)
@@ -173,7 +467,8 @@ static void copy_userframes(pte123_t *src, pte123_t *dst, int level)
             if (parent_pt[j].present == 1)
             {
                 // copy the physical frame to child
-                int copy_ = copy_physicalframe(&child_pt[j], parent_pt[j].ppn);
+                int copy_ = copy_physicalframe(&child_pt[j], parent_pt[j].ppn,
+                    rmap_vaddr(&parent_pt[j]));
                 assert(copy_ == 1);
             }
         }
@@ -182,9 +477,10 @@ static void copy_userframes(pte123_t *src, pte123_t *dst, int level)
     }
 
     // DFS to go down
+    // huge pages are copied with the page table
     for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
     {
-        if (src[i].present == 1)
+        if (src[i].present == 1 && src[i].pagesize == 0)
         {
             pte123_t *src_next = (pte123_t *)(uint64_t)(src[i].paddr);
             pte123_t *dst_next = (pte123_t *)(uint64_t)(dst[i].paddr);
@@ -211,7 +507,11 @@ static int get_childframe_num(pte123_t *p, int level)
     {
         for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
         {
-            if (p[i].present == 1)
+            if (p[i].present == 1 && p[i].pagesize == 1)
+            {
+                count += hugepage_frames(level);
+            }
+            else if (p[i].present == 1)
             {
                 count += get_childframe_num(
                     (pte123_t *)(uint64_t)p[i].paddr, level + 1);
@@ -222,12 +522,61 @@ static int get_childframe_num(pte123_t *p, int level)
     return count;
 }
 
-#define PAGE_TABLE_ENTRY_PADDR_MASK (~((0xffffffffffffffff >> 12) << 12))
+#ifdef USE_FORK_COW
+// the tables are shared by COW fork, but the huge pages in them
+// are copied once the tables are unshared
+static int get_hugeframe_num(pte123_t *p, int level)
+{
+    int count = 0;
+    for (int i = 0; i < PAGE_TABLE_ENTRY_NUM && level < 4; ++ i)
+    {
+        if (p[i].present == 1 && p[i].pagesize == 1)
+        {
+            count += hugepage_frames(level);
+        }
+        else if (p[i].present == 1)
+        {
+            count += get_hugeframe_num(
+                (pte123_t *)(uint64_t)p[i].paddr, level + 1);
+        }
+    }
+    return count;
+}
+#endif
+
+// accessed and dirty bits are set by MMU, not copied to child
+#define PAGE_TABLE_ENTRY_PADDR_MASK (~((0xffffffffffffffff >> 12) << 12) & ~(0x3 << 5))
+
+// q is the copy of huge page p, or split by copy_hugepage
+static int compare_hugepage(uint64_t p_ppn, pte123_t *q, int level)
+{
+    if (level == 4 || q->pagesize == 1)
+    {
+        uint64_t q_ppn = ((pte4_t *)q)->ppn;
+        assert(memcmp(&pm[p_ppn << 12], &pm[q_ppn << 12], PAGE_SIZE * hugepage_frames(level)) == 0);
+        return 1;
+    }
+
+    pte123_t *tab = (pte123_t *)(uint64_t)q->paddr;
+    for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
+    {
+        compare_hugepage(p_ppn + i * hugepage_frames(level + 1), &tab[i], level + 1);
+    }
+    return 1;
+}
 
 static int compare_pagetables(pte123_t *p, pte123_t *q, int level)
 {
     for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
     {
+        if (level < 4 && p[i].present == 1 && p[i].pagesize == 1)
+        {
+            // compare the frames of huge page
+            assert(q[i].present == 1);
+            compare_hugepage(((pte4_t *)&p[i])->ppn, &q[i], level);
+            continue;
+        }
+
         if ((p[i].pte_value & PAGE_TABLE_ENTRY_PADDR_MASK) != 
             (q[i].pte_value & PAGE_TABLE_ENTRY_PADDR_MASK))
         {
@@ -270,7 +619,7 @@ static pcb_t *copy_pcb(pcb_t *parent_pcb)
     // ATTENTION HERE!!!
     // In a realistic OS, you need to allocate kernel pages as well
     // And then copy the data on parent kernel page to child's.
-    pcb_t *child_pcb = KERNEL_malloc(sizeof(pcb_t));
+    pcb_t *child_pcb = kmem_cache_alloc(KMEM_PCB);
     if (child_pcb == NULL)
     {
         return NULL;
@@ -279,10 +628,16 @@ static pcb_t *copy_pcb(pcb_t *parent_pcb)
 
     // update child PID
     child_pcb->pid = get_newpid();
+    child_pcb->asid = child_pcb->pid;
+    child_pcb->vfork_parent = NULL;
+    child_pcb->parent = parent_pcb;
+    child_pcb->waiting = 0;
+    child_pcb->killed = 0;
+    child_pcb->exit_status = 0;
 
     // COW optimize: create a kernel stack for child process
     // NOTE KERNEL STACK MUST BE ALIGNED
-    kstack_t *child_kstack = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    kstack_t *child_kstack = kmem_cache_alloc(KMEM_KSTACK);
     memcpy(child_kstack, (kstack_t *)parent_pcb->kstack, sizeof(kstack_t));
     child_pcb->kstack = child_kstack;
     child_kstack->threadinfo.pcb = child_pcb;
@@ -294,33 +649,40 @@ static pcb_t *copy_pcb(pcb_t *parent_pcb)
 
     // add child process PCB to linked list for scheduling
     // it's better the child process is right after parent
-    if (parent_pcb->prev == parent_pcb)
-    {
-        // parent is the only PCB in the linked list
-        assert(parent_pcb->next == parent_pcb);
-        parent_pcb->prev = child_pcb;
-    }
-    parent_pcb->next = child_pcb;
+    child_pcb->next = parent_pcb->next;
     child_pcb->prev = parent_pcb;
+    parent_pcb->next->prev = child_pcb;
+    parent_pcb->next = child_pcb;
+    wake_up_new_process(child_pcb);
 
     // Fork's secret:
     // call once, return twice
     update_userframe_returnvalue(parent_pcb, child_pcb->pid);
     update_userframe_returnvalue(child_pcb, 0);
 
+    // All copy works are done here
+    return child_pcb;
+}
+
+// the address space of child is a copy of parent
+static void copy_mm(pcb_t *parent_pcb, pcb_t *child_pcb)
+{
     // copy the entire page table of parent
+    // COW: only PGD is copied, the lower levels are shared
     child_pcb->mm.pgd = copy_pagetable(parent_pcb->mm.pgd, 1);
 
     // copy virtual memory areas
     copy_vmareas(parent_pcb, child_pcb);
 
-    // flush TLB
+    // parent's pages are readonly now, flush its TLB entries
+    // the entries of other processes are kept
 #if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
-    flush_tlb();
+    flush_tlb_asid(parent_pcb->asid);
+    flush_pwc();
+#endif
+#ifdef USE_SOFTMMU
+    softmmu_flush();
 #endif
-
-    // All copy works are done here
-    return child_pcb;
 }
 
 static pcb_t *fork_naive_copy(pcb_t *parent_pcb)
@@ -337,6 +699,7 @@ static pcb_t *fork_naive_copy(pcb_t *parent_pcb)
     // copy PCB
     pcb_t *child_pcb = copy_pcb(parent_pcb);
     assert(child_pcb != NULL);
+    copy_mm(parent_pcb, child_pcb);
 
     // directly copy user frames in main memory now
     copy_userframes(parent_pcb->mm.pgd, child_pcb->mm.pgd, 1);
@@ -347,8 +710,19 @@ static pcb_t *fork_naive_copy(pcb_t *parent_pcb)
 
 static pcb_t *fork_cow(pcb_t *parent_pcb)
 {
+#ifdef USE_FORK_COW
+    int needed_hugeframe_num = get_hugeframe_num(parent_pcb->mm.pgd, 1);
+    if (enough_frames(needed_hugeframe_num) == 0)
+    {
+        // no frames for the copies of huge pages
+        update_userframe_returnvalue(parent_pcb, -1);
+        return NULL;
+    }
+#endif
+
     pcb_t *child_pcb = copy_pcb(parent_pcb);
     assert(child_pcb != NULL);
+    copy_mm(parent_pcb, child_pcb);
 
     return child_pcb;
 }
\ No newline at end of file
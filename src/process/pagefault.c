@@ -28,26 +28,67 @@
 // swap in/out
 int swap_in(uint64_t saddr, uint64_t ppn);
 int swap_out(uint64_t saddr, uint64_t ppn);
+void free_swappage(uint64_t saddr);
+void duplicate_swappage(uint64_t saddr);
+int swap_full();
+
+// swap readahead
+int swap_readahead_window(uint64_t saddr, uint64_t *saddrs, int max);
+void swap_in_cluster(uint64_t *saddrs, uint64_t *ppns, int num);
+void swap_cache_add(uint64_t saddr, uint64_t ppn);
+void swap_cache_delete(uint64_t saddr);
+int64_t swap_cache_take(uint64_t saddr);
 
 // virtual memory area
 vm_area_t *search_vma_vaddr(pcb_t *p, uint64_t vaddr);
 
-int copy_physicalframe(pte4_t *child_pte, uint64_t parent_ppn);
+int copy_physicalframe(pte4_t *child_pte, uint64_t parent_ppn, uint64_t vaddr);
+#ifdef USE_FORK_COW
+void unshare_pagetable(pte123_t *pte, int level);
+
+// from execve
+uint64_t get_inode(const char *filepath);
+void read_filepage(const char *filepath, uint64_t pgoff, uint8_t *buf);
+#endif
 
-#define MAX_REVERSED_MAPPING_NUMBER (4)
+#define MAX_SWAP_READAHEAD (8)
+
+// reversed mapping item: one PTE mapping the frame
+typedef struct RMAP_ITEM_STRUCT
+{
+    pte4_t *pte;
+    // the page mapped by the PTE, to invalidate its translations only
+    // a shared page table maps it at the same address in all sharers
+    uint64_t vaddr;
+    struct RMAP_ITEM_STRUCT *next;
+} rmap_item_t;
 
 // physical page descriptor
 typedef struct
 {
     int allocated;
+    // written by the kernel without MMU, e.g. code loading
+    // the writes through MMU set the dirty bits of the PTEs instead
     int dirty;
-    int time;   // LRU cache: 0 - Fresh
+
+    // free frame list: a freed frame is pushed to the head and stays
+    // in the list until popped, even if allocated again in between
+    int listed;
+    uint64_t next_free;
+
+    // swap I/O in flight: not mapped, not free, not reclaimable
+    int locked;
+
+    // a page read ahead in swap cache: not mapped, not free,
+    // the oldest is dropped when no frame is free
+    int cached;
+    int64_t cache_prev;
+    int64_t cache_next;
 
     /*  real world: mapping to anon_vma or address_space
         we simply the situation here:
-        We limit that one physical frame can be shared by 
-        at most MAX_REVERSED_MAPPING_NUMBER PTEs
-        And use mappings to manage them.
+        The PTEs sharing one physical frame are chained in a list
+        of rmap items, so the number of sharers is not limited.
 
             ** anon_vma
         The reversed mapping: from PPN to anonymous VMAs
@@ -62,20 +103,74 @@ typedef struct
         Multiple processes are sharing the same file-backed area
         This happens in Fork and Copy-On-Write
     */
-    pte4_t *mapping[MAX_REVERSED_MAPPING_NUMBER];
+    rmap_item_t *rmap;
 
-    // count the number of processes sharing this physical frame
-    // Actually it must be the number of non-NULL in mapping field
-    uint64_t reversed_counter;
+    // count the number of PTEs sharing this physical frame
+    // Actually it must be the length of rmap list
+    uint64_t mapcount;
 
     uint64_t saddr;   // binding the revesed mapping with mapping to disk
+
+    // frame of a huge page: mapped by one PUD or PMD leaf
+    // not in the reversed mapping and never swapped out
+    int huge;
+
+    // a page of file in page cache: shared by all processes, never
+    // written, and kept in LRU list when not mapped
+    int pagecache;
+    uint64_t ino;
+    uint64_t pgoff;
+    int64_t hash_next;
+    int64_t lru_prev;
+    int64_t lru_next;
 } pd_t;
 
 // for each pagable (swappable) physical page
 // create one reversed mapping
-static pd_t page_map[MAX_NUM_PHYSICAL_PAGE];
+// sized by the physical memory in page_map_init
+static pd_t *page_map = NULL;
+
+// CLOCK hand: the next frame to be checked by page reclaim
+static uint64_t clock_hand = 0;
+
+// frames released by unmapall_pte4
+static uint64_t free_head = 0;
+static int free_empty = 1;
+// frames never used are above the break, so a large map is not touched
+static uint64_t free_break = 0;
+static uint64_t free_count = 0;
+
+// rmap items are allocated in chunks and never returned to host
+#define RMAP_CHUNK_ITEMS (256)
+
+typedef struct RMAP_CHUNK_STRUCT
+{
+    struct RMAP_CHUNK_STRUCT *next;
+    rmap_item_t items[RMAP_CHUNK_ITEMS];
+} rmap_chunk_t;
+
+static rmap_chunk_t *rmap_chunks = NULL;
+static rmap_item_t *rmap_free = NULL;
+
+// swap cache in FIFO order
+static int64_t swapcache_head = -1;     // the oldest
+static int64_t swapcache_tail = -1;
+static uint64_t swapcache_count = 0;
+
+// page cache indexed by (inode, page offset)
+#define PAGECACHE_HASH_SIZE (64)
+static int64_t pagecache_hash[PAGECACHE_HASH_SIZE];
+// the cached pages not mapped, in LRU order
+static int64_t pagecache_lru_head = -1; // the least recently used
+static int64_t pagecache_lru_tail = -1;
+static uint64_t pagecache_lru_count = 0;
+
+uint64_t pagecache_hit_count = 0;
+uint64_t pagecache_miss_count = 0;
 
 // get the level page table entry
+// if a huge page leaf is found above the level, return the leaf
+// allocate: the path is to be changed, the tables shared by fork are copied
 pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate)
 {
     int vpns[4] = {
@@ -99,8 +194,15 @@ pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int all
         pte = &tab[vpn];
 
         // move to next level
-        if (tab_level < 4)
+        if (tab_level < level)
         {
+            if (pte->present == 1 && pte->pagesize == 1)
+            {
+                // huge page leaf in PUD or PMD
+                assert(tab_level > 1);
+                return pte;
+            }
+
             if (pte->present != 1)
             {
                 if (allocate == 1)
@@ -110,7 +212,9 @@ pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int all
                     // note that this is a 48-bit address !!!
                     // the high bits are all zero
                     // And sizeof(pte123_t) == sizeof(pte4_t)
-                    pte123_t *new_tab = (pte123_t *)KERNEL_malloc(PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+                    pte123_t *new_tab = kmem_cache_alloc(KMEM_PAGETABLE);
+                    // the entries are not present, with no swap address
+                    memset(new_tab, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
                     
                     // .paddr field is 50 bits
                     tab[vpn].paddr = (uint64_t)new_tab;
@@ -121,6 +225,12 @@ pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int all
                     return NULL;
                 }
             }
+#ifdef USE_FORK_COW
+            else if (pte->readonly == 1 && allocate == 1)
+            {
+                unshare_pagetable(pte, tab_level);
+            }
+#endif
             tab = (pte123_t *)((uint64_t)pte->paddr);
         }
 
@@ -132,65 +242,314 @@ pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int all
 
 void page_map_init()
 {
-    for (int k = 0; k < MAX_NUM_PHYSICAL_PAGE; ++ k)
+    // all zero is the initial state of the descriptors:
+    // not allocated, clean, no reversed mapping
+    // calloc leaves the pages of a large map untouched till used
+    if (page_map != NULL)
+    {
+        for (int64_t ppn = swapcache_head; ppn >= 0; ppn = page_map[ppn].cache_next)
+        {
+            swap_cache_delete(page_map[ppn].saddr);
+        }
+        free(page_map);
+    }
+    page_map = calloc(MAX_NUM_PHYSICAL_PAGE, sizeof(pd_t));
+    assert(page_map != NULL);
+
+    // all rmap items are free again
+    rmap_free = NULL;
+    for (rmap_chunk_t *c = rmap_chunks; c != NULL; c = c->next)
+    {
+        for (int i = 0; i < RMAP_CHUNK_ITEMS; ++ i)
+        {
+            c->items[i].next = rmap_free;
+            rmap_free = &c->items[i];
+        }
+    }
+
+    clock_hand = 0;
+    free_empty = 1;
+    free_break = 0;
+    free_count = MAX_NUM_PHYSICAL_PAGE;
+    swapcache_head = -1;
+    swapcache_tail = -1;
+    swapcache_count = 0;
+
+    for (int i = 0; i < PAGECACHE_HASH_SIZE; ++ i)
+    {
+        pagecache_hash[i] = -1;
+    }
+    pagecache_lru_head = -1;
+    pagecache_lru_tail = -1;
+    pagecache_lru_count = 0;
+}
+
+static rmap_item_t *allocate_rmap_item()
+{
+    if (rmap_free == NULL)
     {
-        page_map[k].allocated = 0;
-        page_map[k].dirty = 0;
-        page_map[k].time = 0;
-        page_map[k].reversed_counter = 0;
-        for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+        rmap_chunk_t *c = KERNEL_malloc(sizeof(rmap_chunk_t));
+        assert(c != NULL);
+        c->next = rmap_chunks;
+        rmap_chunks = c;
+        for (int i = 0; i < RMAP_CHUNK_ITEMS; ++ i)
         {
-            page_map[k].mapping[i] = NULL;
+            c->items[i].next = rmap_free;
+            rmap_free = &c->items[i];
         }
     }
+
+    rmap_item_t *item = rmap_free;
+    rmap_free = item->next;
+    return item;
 }
 
-void pagemap_update_time(uint64_t ppn)
+static void free_rmap_item(rmap_item_t *item)
+{
+    item->pte = NULL;
+    item->next = rmap_free;
+    rmap_free = item;
+}
+
+// the kernel writes the frame without MMU
+void pagemap_dirty(uint64_t ppn)
 {
     assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
     assert(page_map[ppn].allocated == 1);
-    int reversed_count = 0;
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+    page_map[ppn].dirty = 1;
+}
+
+static void push_free_frame(uint64_t ppn)
+{
+    if (page_map[ppn].listed == 0)
     {
-        if (page_map[ppn].mapping[i] != NULL)
+        page_map[ppn].listed = 1;
+        // the tail points to itself
+        page_map[ppn].next_free = free_empty == 1 ? ppn : free_head;
+        free_head = ppn;
+        free_empty = 0;
+    }
+}
+
+static void add_swapcache(uint64_t saddr, uint64_t ppn)
+{
+    pd_t *pd = &page_map[ppn];
+    assert(pd->allocated == 0 && pd->cached == 0);
+    pd->cached = 1;
+    pd->saddr = saddr;
+    pd->cache_prev = swapcache_tail;
+    pd->cache_next = -1;
+    if (swapcache_tail >= 0)
+    {
+        page_map[swapcache_tail].cache_next = ppn;
+    }
+    else
+    {
+        swapcache_head = ppn;
+    }
+    swapcache_tail = ppn;
+    swapcache_count += 1;
+    swap_cache_add(saddr, ppn);
+}
+
+// the frame is free after removed from swap cache
+static void remove_swapcache(uint64_t ppn)
+{
+    pd_t *pd = &page_map[ppn];
+    assert(pd->cached == 1);
+    if (pd->cache_prev >= 0)
+    {
+        page_map[pd->cache_prev].cache_next = pd->cache_next;
+    }
+    else
+    {
+        swapcache_head = pd->cache_next;
+    }
+    if (pd->cache_next >= 0)
+    {
+        page_map[pd->cache_next].cache_prev = pd->cache_prev;
+    }
+    else
+    {
+        swapcache_tail = pd->cache_prev;
+    }
+    pd->cached = 0;
+    swapcache_count -= 1;
+    free_count += 1;
+}
+
+// the slot cached by the frame is written or freed
+void release_swapcache_frame(uint64_t ppn)
+{
+    assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
+    remove_swapcache(ppn);
+    push_free_frame(ppn);
+}
+
+// return value: the frame of the page read ahead, -1 if not cached
+static int64_t take_swapcache(uint64_t saddr)
+{
+    int64_t ppn = swap_cache_take(saddr);
+    if (ppn >= 0)
+    {
+        remove_swapcache(ppn);
+    }
+    return ppn;
+}
+
+/*  Page cache
+    The frames of file pages are shared by all processes mapping the file,
+    e.g. N processes running the same executable use one copy of .text.
+    The frame is never written: it is mapped read only, and the private
+    writable area copies it on write. It is discarded by reclaim as clean.
+    When the last PTE is gone, the frame stays cached in the LRU list,
+    and the least recently used is dropped when no frame is free.
+ */
+static uint64_t pagecache_hashkey(uint64_t ino, uint64_t pgoff)
+{
+    return (ino * 31 + pgoff) % PAGECACHE_HASH_SIZE;
+}
+
+// return value: the frame caching the page, -1 if not cached
+static int64_t find_pagecache(uint64_t ino, uint64_t pgoff)
+{
+    int64_t ppn = pagecache_hash[pagecache_hashkey(ino, pgoff)];
+    while (ppn >= 0)
+    {
+        if (page_map[ppn].ino == ino && page_map[ppn].pgoff == pgoff)
         {
-            assert(page_map[ppn].mapping[i]->present == 1);
-            reversed_count += 1;
+            return ppn;
         }
+        ppn = page_map[ppn].hash_next;
     }
-    assert(reversed_count == page_map[ppn].reversed_counter);
+    return -1;
+}
+
+static void add_pagecache(uint64_t ppn, uint64_t ino, uint64_t pgoff)
+{
+    pd_t *pd = &page_map[ppn];
+    assert(pd->pagecache == 0);
+    uint64_t key = pagecache_hashkey(ino, pgoff);
+    pd->pagecache = 1;
+    pd->ino = ino;
+    pd->pgoff = pgoff;
+    pd->hash_next = pagecache_hash[key];
+    pagecache_hash[key] = ppn;
+}
 
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+// the frame not mapped is parked in LRU list
+static void add_pagecache_lru(uint64_t ppn)
+{
+    pd_t *pd = &page_map[ppn];
+    assert(pd->pagecache == 1 && pd->allocated == 0);
+    pd->lru_prev = pagecache_lru_tail;
+    pd->lru_next = -1;
+    if (pagecache_lru_tail >= 0)
     {
-        page_map[i].time += 1;
+        page_map[pagecache_lru_tail].lru_next = ppn;
     }
-    page_map[ppn].time = 0;
+    else
+    {
+        pagecache_lru_head = ppn;
+    }
+    pagecache_lru_tail = ppn;
+    pagecache_lru_count += 1;
 }
 
-void pagemap_dirty(uint64_t ppn)
+// the frame is free after removed from LRU list, till mapped again
+static void remove_pagecache_lru(uint64_t ppn)
 {
-    assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
-    assert(page_map[ppn].allocated == 1);
-    int reversed_count = 0;
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+    pd_t *pd = &page_map[ppn];
+    assert(pd->pagecache == 1 && pd->allocated == 0);
+    if (pd->lru_prev >= 0)
+    {
+        page_map[pd->lru_prev].lru_next = pd->lru_next;
+    }
+    else
+    {
+        pagecache_lru_head = pd->lru_next;
+    }
+    if (pd->lru_next >= 0)
+    {
+        page_map[pd->lru_next].lru_prev = pd->lru_prev;
+    }
+    else
+    {
+        pagecache_lru_tail = pd->lru_prev;
+    }
+    pagecache_lru_count -= 1;
+    free_count += 1;
+}
+
+// the frame does not cache the page any more
+static void remove_pagecache(uint64_t ppn)
+{
+    pd_t *pd = &page_map[ppn];
+    assert(pd->pagecache == 1);
+    int64_t *link = &pagecache_hash[pagecache_hashkey(pd->ino, pd->pgoff)];
+    while (*link != ppn)
+    {
+        assert(*link >= 0);
+        link = &page_map[*link].hash_next;
+    }
+    *link = pd->hash_next;
+    pd->pagecache = 0;
+}
+
+// the frames can be used without reclaim
+static uint64_t available_frames()
+{
+    return free_count + swapcache_count + pagecache_lru_count;
+}
+
+// return value: the free ppn, or -1 if all frames are allocated
+static int64_t pop_free_frame()
+{
+    while (free_empty == 0)
     {
-        if (page_map[ppn].mapping[i] != NULL)
+        uint64_t ppn = free_head;
+        free_empty = page_map[ppn].next_free == ppn;
+        free_head = page_map[ppn].next_free;
+        page_map[ppn].listed = 0;
+        if (page_map[ppn].allocated == 0 && page_map[ppn].locked == 0 &&
+            page_map[ppn].pagecache == 0)
         {
-            assert(page_map[ppn].mapping[i]->present == 1);
-            reversed_count += 1;
+            return ppn;
         }
+        // allocated again after freed, or under I/O and
+        // pushed again when the I/O completes
     }
-    assert(reversed_count == page_map[ppn].reversed_counter);
 
-    page_map[ppn].dirty = 1;
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+    while (free_break < MAX_NUM_PHYSICAL_PAGE)
     {
-        if (page_map[ppn].mapping[i] != NULL)
+        uint64_t ppn = free_break;
+        free_break += 1;
+        if (page_map[ppn].allocated == 0)
         {
-            page_map[ppn].mapping[i]->dirty = 1;
-            reversed_count += 1;
+            return ppn;
         }
+        // mapped directly by map_pte4 or a huge page
+    }
+
+    if (swapcache_head >= 0)
+    {
+        // drop the oldest page read ahead
+        uint64_t ppn = swapcache_head;
+        swap_cache_delete(page_map[ppn].saddr);
+        remove_swapcache(ppn);
+        return ppn;
     }
+
+    if (pagecache_lru_head >= 0)
+    {
+        // drop the least recently used page of file
+        uint64_t ppn = pagecache_lru_head;
+        remove_pagecache_lru(ppn);
+        remove_pagecache(ppn);
+        return ppn;
+    }
+
+    return -1;
 }
 
 // used by frame swap-in from swap space
@@ -201,42 +560,47 @@ void set_pagemap_swapaddr(uint64_t ppn, uint64_t swap_address)
     page_map[ppn].saddr = swap_address;
 }
 
-void map_pte4(pte4_t *pte, uint64_t ppn)
+void map_pte4_vaddr(pte4_t *pte, uint64_t ppn, uint64_t vaddr)
 {
     assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
-    // must use an empty reversed mapping slot
     // assert(page_map[ppn].allocated == 0);
-    assert(page_map[ppn].dirty == 0);
-    // for simplicity, the number is constrained
-    assert(page_map[ppn].reversed_counter < MAX_REVERSED_MAPPING_NUMBER);
+    assert(page_map[ppn].allocated == 1 || page_map[ppn].dirty == 0);
 
     // Let's consider this, where can we store the swap address on disk?
     // In this case of physical page being allocated and mapped,
-    // the swap address is stored in reversed mapping array
-    page_map[ppn].saddr = pte->saddr;
+    // the swap address is stored in the page descriptor
+    // The frame holds one reference of the swap slot for all its PTEs
+    uint64_t saddr = pte->present == 0 ? pte->saddr : 0;
+    if (page_map[ppn].allocated == 0)
+    {
+        page_map[ppn].saddr = saddr;
+    }
+    else if (saddr != 0)
+    {
+        // remapped to the frame after unmapall_pte4
+        assert(saddr == page_map[ppn].saddr);
+        free_swappage(saddr);
+    }
 
     // map the level 4 page table
     pte->present = 1;
     pte->ppn = ppn;
     pte->dirty = 0;
+    pte->reference = 0;
 
     // reversed mapping
-    page_map[ppn].allocated = 1;    // allocated for vaddr
-    // page_map[ppn].dirty = 0;        // allocated as clean
-    page_map[ppn].time = 0;         // most recently used physical page    
-    
-    int success = 0;
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+    if (page_map[ppn].allocated == 0)
     {
-        if (page_map[ppn].mapping[i] == NULL)
-        {
-            page_map[ppn].mapping[i] = pte;
-            success = 1;
-            break;
-        }
+        page_map[ppn].allocated = 1;    // allocated for vaddr
+        free_count -= 1;
     }
-    assert(success == 1);
-    page_map[ppn].reversed_counter += 1;
+
+    rmap_item_t *item = allocate_rmap_item();
+    item->pte = pte;
+    item->vaddr = vaddr;
+    item->next = page_map[ppn].rmap;
+    page_map[ppn].rmap = item;
+    page_map[ppn].mapcount += 1;
 
     /*  When mapped
         Page table entry: present = 1, ppn
@@ -245,39 +609,98 @@ void map_pte4(pte4_t *pte, uint64_t ppn)
      */
 }
 
+// the address is unknown: all translations are flushed when it's unmapped
+void map_pte4(pte4_t *pte, uint64_t ppn)
+{
+    map_pte4_vaddr(pte, ppn, RMAP_NO_VADDR);
+}
+
+// the virtual address of the mapped PTE
+uint64_t rmap_vaddr(pte4_t *pte)
+{
+    assert(pte->present == 1);
+    for (rmap_item_t *item = page_map[pte->ppn].rmap; item != NULL; item = item->next)
+    {
+        if (item->pte == pte)
+        {
+            return item->vaddr;
+        }
+    }
+    assert(0);
+    return RMAP_NO_VADDR;
+}
+
+// the page may be cached by TLB of any address space sharing the PTE
+// only the leaf is changed, the page walk cache keeps the tables
+static void flush_translation(uint64_t vaddr)
+{
+    if (vaddr == RMAP_NO_VADDR)
+    {
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+        flush_tlb();
+        flush_pwc();
+#endif
+#ifdef USE_SOFTMMU
+        softmmu_flush();
+#endif
+        return;
+    }
+
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+    flush_tlb_page(vaddr);
+#endif
+#ifdef USE_SOFTMMU
+    softmmu_flush_page(vaddr);
+#endif
+}
+
 void unmapall_pte4(uint64_t ppn)
 {
     assert(0 <= ppn && ppn < MAX_NUM_PHYSICAL_PAGE);
-    // Get the page table entry from reversed mapping array by ppn
+    // Get the page table entries from reversed mapping list by ppn
     // Note that in this case the page MUST be allocated
     assert(page_map[ppn].allocated == 1);
-    assert(page_map[ppn].reversed_counter > 0);
+    assert(page_map[ppn].mapcount > 0);
 
     // clear all the reversed mapping
+    if (page_map[ppn].pagecache == 1)
+    {
+        // the clean page is read from the file again
+        remove_pagecache(ppn);
+    }
     page_map[ppn].allocated = 0;
     page_map[ppn].dirty = 0;
-    page_map[ppn].time = 0;
-    
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+    if (page_map[ppn].locked == 0)
     {
-        if (page_map[ppn].mapping[i] != NULL)
-        {
-            // release PTE
-            pte4_t *pte = page_map[ppn].mapping[i];
-            assert(pte->present == 1);
-            pte->pte_value = 0;
-            pte->present = 0;
-            // In this case, page_map[ppn] would be mapped by other page table.
-            // Previously, this is used to store the swap address.
-            // Now we need to move the swap address to the page table entry.
-            pte->saddr = page_map[ppn].saddr;
+        push_free_frame(ppn);
+        free_count += 1;
+    }
 
-            // release reversed mapping
-            page_map[ppn].mapping[i] = NULL;
-            page_map[ppn].reversed_counter -= 1;
+    while (page_map[ppn].rmap != NULL)
+    {
+        // release PTE
+        rmap_item_t *item = page_map[ppn].rmap;
+        pte4_t *pte = item->pte;
+        assert(pte->present == 1);
+        pte->pte_value = 0;
+        pte->present = 0;
+        // In this case, page_map[ppn] would be mapped by other page table.
+        // Previously, this is used to store the swap address.
+        // Now we need to move the swap address to the page table entry.
+        pte->saddr = page_map[ppn].saddr;
+        if (pte->saddr != 0 && page_map[ppn].mapcount > 1)
+        {
+            // every PTE holds one reference of the slot
+            duplicate_swappage(pte->saddr);
         }
+
+        // release reversed mapping
+        page_map[ppn].rmap = item->next;
+        page_map[ppn].mapcount -= 1;
+        flush_translation(item->vaddr);
+        free_rmap_item(item);
     }
-    assert(page_map[ppn].reversed_counter == 0);
+    assert(page_map[ppn].mapcount == 0);
 
     /*  When unmapped
         Page table entry: present = 0, swap address
@@ -287,6 +710,56 @@ void unmapall_pte4(uint64_t ppn)
     // now page_map[ppn] can be used by other page table entry
 }
 
+// remove the PTE from the reversed mapping of the frame
+// the other PTEs are not touched
+// return value: the virtual address of the PTE
+static uint64_t remove_rmap(pd_t *pd, pte4_t *pte)
+{
+    rmap_item_t **link = &pd->rmap;
+    while ((*link)->pte != pte)
+    {
+        assert((*link)->next != NULL);
+        link = &(*link)->next;
+    }
+    rmap_item_t *item = *link;
+    uint64_t vaddr = item->vaddr;
+    *link = item->next;
+    free_rmap_item(item);
+    pd->mapcount -= 1;
+    return vaddr;
+}
+
+static uint64_t claim_frame();
+
+// the private copy of the page of file, e.g. the .data written
+static void copy_pagecache(pte4_t *pte)
+{
+    uint64_t old_ppn = (uint64_t)pte->ppn;
+    pd_t *pd = &page_map[old_ppn];
+
+    // the old frame may be the victim to claim
+    uint8_t buf[PAGE_SIZE];
+    memcpy(buf, &pm[old_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], PAGE_SIZE);
+    uint64_t vaddr = remove_rmap(pd, pte);
+    if (pd->mapcount == 0)
+    {
+        pd->allocated = 0;
+        add_pagecache_lru(old_ppn);
+    }
+
+    uint64_t ppn = claim_frame();
+    memcpy(&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH], buf, PAGE_SIZE);
+    map_pte4_vaddr(pte, ppn, vaddr);
+    // anonymous page not in swap space yet
+    page_map[ppn].dirty = 1;
+    pte->readonly = 0;
+
+    flush_translation(vaddr);
+
+    printf(BLUESTR("\tPTE<%p> copied page cache Frame[%ld] to Frame[%ld]\n"),
+        pte, old_ppn, ppn);
+}
+
 static void copy_on_write(pte4_t *pte)
 {
     //  pte: the corresponding pte of COW vaddr
@@ -297,60 +770,498 @@ static void copy_on_write(pte4_t *pte)
 
     // Get the old ppn, this ppn should be mapped by multiple processes's PTEs
     uint64_t old_ppn = (uint64_t)pte->ppn;
-    assert(page_map[old_ppn].reversed_counter > 1);
+    pd_t *pd = &page_map[old_ppn];
+    assert(pd->mapcount > 0);
 
-    // Update the left mappings
-    pte4_t *remaining[MAX_REVERSED_MAPPING_NUMBER];
-    int remaining_count = 0;
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+    if (pd->pagecache == 1)
     {
-        pte4_t *t = page_map[old_ppn].mapping[i];
-        if (t != pte && t != NULL)
+        copy_pagecache(pte);
+        return;
+    }
+
+    if (pd->mapcount == 1)
+    {
+        // the other sharers are gone by execve or exit: reuse the frame
+        pte->readonly = 0;
+        flush_translation(rmap_vaddr(pte));
+        return;
+    }
+
+    // the old frame may be the victim to claim
+    uint8_t buf[PAGE_SIZE];
+    memcpy(buf, &pm[old_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], PAGE_SIZE);
+    uint64_t vaddr = remove_rmap(pd, pte);
+
+    if (pd->mapcount == 1)
+    {
+        // if only one pte is left, set it to read/write
+        // This is the case: old mappings = [parent, child]
+        // both are read only. The new mappings are [parent]
+        // [child], both are read/write.
+        pd->rmap->pte->readonly = 0;
+    }
+
+    // Allocate new physical frame for the PTE, reclaim if no free one
+    uint64_t new_ppn = claim_frame();
+    memcpy(&pm[new_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], buf, PAGE_SIZE);
+    map_pte4_vaddr(pte, new_ppn, vaddr);
+    // not in swap space yet
+    page_map[new_ppn].dirty = 1;
+    pte->readonly = 0;
+
+    // the read only translations of both frames are cached
+    flush_translation(vaddr);
+
+    printf(BLUESTR("\tPTE<%p> removed from Frame[%ld]. New Frame[%ld] allocated\n"),
+        pte, old_ppn, new_ppn);
+}
+
+/*  The PTE is dropped with its address space, by execve or exit.
+    The frame is freed with its last PTE, so is the swap slot bound to it.
+ */
+void unmap_pte4(pte4_t *pte)
+{
+    if (pte->present == 1)
+    {
+        uint64_t ppn = pte->ppn;
+        pd_t *pd = &page_map[ppn];
+        assert(pd->allocated == 1 && pd->mapcount > 0);
+        remove_rmap(pd, pte);
+
+        if (pd->mapcount == 0 && pd->pagecache == 1)
         {
-            remaining[i] = t;
-            remaining_count += 1;
+            // cached for the next process mapping the file
+            pd->allocated = 0;
+            add_pagecache_lru(ppn);
+        }
+        else if (pd->mapcount == 0)
+        {
+            if (pd->saddr != 0)
+            {
+                free_swappage(pd->saddr);
+                pd->saddr = 0;
+            }
+            pd->allocated = 0;
+            pd->dirty = 0;
+            if (pd->locked == 0)
+            {
+                push_free_frame(ppn);
+                free_count += 1;
+            }
+        }
+    }
+    else if (pte->saddr != 0)
+    {
+        // the PTE holds one reference of the slot
+        free_swappage(pte->saddr);
+    }
+
+    pte->pte_value = 0;
+}
+
+// the leaf in PUD (level 2) or PMD (level 3) is dropped with its address space
+void free_hugeframe(pte123_t *pte, int level)
+{
+    assert(level == 2 || level == 3);
+    assert(pte->present == 1 && pte->pagesize == 1);
+    uint64_t num = 1ul << ((4 - level) * VIRTUAL_PAGE_NUMBER_LENGTH);
+    uint64_t ppn = ((pte4_t *)pte)->ppn;
+
+    for (uint64_t j = ppn; j < ppn + num; ++ j)
+    {
+        assert(page_map[j].allocated == 1 && page_map[j].huge == 1);
+        page_map[j].allocated = 0;
+        page_map[j].huge = 0;
+        page_map[j].dirty = 0;
+        push_free_frame(j);
+    }
+    free_count += num;
+
+    pte->pte_value = 0;
+}
+
+/*  CLOCK page reclaim
+    MMU sets the reference bit of PTE in translation, and the hand clears it.
+    The frame referenced since the last sweep gets a second chance, so the
+    hand stops at the first frame not referenced by any PTE.
+    The translation cached by TLB does not set the bit again. Same as x86,
+    clearing the bit does not flush TLB: the aging is only approximate.
+    dirty_ptr: 1 if the victim must be written back
+    return value: the victim ppn, -1 if none
+ */
+static int64_t reclaim_clock(int *dirty_ptr)
+{
+    // the first round clears all reference bits at most
+    for (uint64_t n = 0; n < 2 * MAX_NUM_PHYSICAL_PAGE; ++ n)
+    {
+        uint64_t ppn = clock_hand;
+        clock_hand = (clock_hand + 1) % MAX_NUM_PHYSICAL_PAGE;
+
+        pd_t *pd = &page_map[ppn];
+        if (pd->allocated == 0 || pd->huge == 1 || pd->locked == 1)
+        {
+            continue;
+        }
+
+        int referenced = 0;
+        int dirty = pd->dirty;
+        for (rmap_item_t *item = pd->rmap; item != NULL; item = item->next)
+        {
+            referenced |= item->pte->reference;
+            dirty |= item->pte->dirty;
+            item->pte->reference = 0;
+        }
+
+        if (referenced == 0)
+        {
+            *dirty_ptr = dirty;
+            return ppn;
+        }
+    }
+
+    // all frames are of huge pages or under I/O
+    return -1;
+}
+
+// map the frame loaded from swap space
+static void map_swapped_in(pte4_t *pte, uint64_t ppn, uint64_t vaddr)
+{
+    map_pte4_vaddr(pte, ppn, vaddr);
+
+    if (page_map[ppn].saddr != 0 && swap_full() == 1)
+    {
+        // swap space is short: free the slot and write
+        // the page to a new one when it is evicted
+        free_swappage(page_map[ppn].saddr);
+        page_map[ppn].saddr = 0;
+        page_map[ppn].dirty = 1;
+    }
+}
+
+#ifdef USE_ASYNC_SWAP
+/*  kswapd: background page reclaim
+    When the free frames are below the low watermark, kswapd reclaims
+    by CLOCK till the high watermark, and the dirty victims are written
+    back by the swap I/O thread. So a page fault mostly finds a free
+    frame and waits for one read only, while other processes run.
+    The I/O runs on the host thread, but the page tables are updated
+    only on the CPU: kswapd runs at page faults and scheduling.
+ */
+int swap_in_async(uint64_t saddr, uint64_t ppn);
+void swap_out_cluster_async(uint64_t *saddrs, uint64_t *ppns, int num, int *ids);
+int swap_done(int id);
+void swap_wait(int id);
+void swap_release(int id);
+
+#define MAX_SWAP_INFLIGHT (32)
+
+typedef struct
+{
+    int valid;
+    int id;         // request id of swap I/O
+    uint64_t ppn;
+    // swap-in only: the faulting process and its PTE
+    pcb_t *pcb;
+    pte4_t *pte;
+    uint64_t vaddr;
+} swap_inflight_t;
+
+static swap_inflight_t swapin_inflight[MAX_SWAP_INFLIGHT];
+static swap_inflight_t writeback_inflight[MAX_SWAP_INFLIGHT];
+static uint64_t writeback_count = 0;
+
+uint64_t kswapd_reclaim_count = 0;
+uint64_t kswapd_writeback_count = 0;
+uint64_t async_swapin_count = 0;
+
+static uint64_t low_watermark()
+{
+    return MAX_NUM_PHYSICAL_PAGE / 8 + 1;
+}
+
+static uint64_t high_watermark()
+{
+    return MAX_NUM_PHYSICAL_PAGE / 4 + 2;
+}
+
+static swap_inflight_t *get_inflight(swap_inflight_t *list)
+{
+    for (int i = 0; i < MAX_SWAP_INFLIGHT; ++ i)
+    {
+        if (list[i].valid == 0)
+        {
+            return &list[i];
+        }
+    }
+    return NULL;
+}
+
+// the disk interrupt: handle the completed I/O
+static void complete_swap()
+{
+    for (int i = 0; i < MAX_SWAP_INFLIGHT; ++ i)
+    {
+        swap_inflight_t *w = &writeback_inflight[i];
+        if (w->valid == 1 && swap_done(w->id) == 1)
+        {
+            // the victim is on disk, free the frame
+            swap_release(w->id);
+            page_map[w->ppn].locked = 0;
+            push_free_frame(w->ppn);
+            free_count += 1;
+            writeback_count -= 1;
+            w->valid = 0;
+        }
+
+        swap_inflight_t *r = &swapin_inflight[i];
+        if (r->valid == 1 && swap_done(r->id) == 1)
+        {
+            swap_release(r->id);
+            page_map[r->ppn].locked = 0;
+            free_count += 1;
+            map_swapped_in(r->pte, r->ppn, r->vaddr);
+
+            // wake up: the faulting instruction is restarted when scheduled
+            wake_up_process(r->pcb);
+            r->valid = 0;
+        }
+    }
+}
+
+void kswapd_run()
+{
+    complete_swap();
+    if (available_frames() >= low_watermark())
+    {
+        return;
+    }
+
+    // the dirty victims are written in clusters
+    uint64_t saddrs[MAX_SWAP_INFLIGHT];
+    uint64_t ppns[MAX_SWAP_INFLIGHT];
+    int ids[MAX_SWAP_INFLIGHT];
+    int num = 0;
+    while (available_frames() + writeback_count + num < high_watermark() &&
+        writeback_count + num < MAX_SWAP_INFLIGHT)
+    {
+        int dirty = 0;
+        int64_t ppn = reclaim_clock(&dirty);
+        if (ppn < 0)
+        {
+            break;
+        }
+
+        if (dirty == 1)
+        {
+            // unmapped after the slot is assigned
+            page_map[ppn].locked = 1;
+            saddrs[num] = page_map[ppn].saddr;
+            ppns[num] = ppn;
+            num += 1;
         }
         else
         {
-            remaining[i] = NULL;
+            unmapall_pte4(ppn);
         }
+        kswapd_reclaim_count += 1;
+    }
+
+    if (num == 0)
+    {
+        return;
     }
 
-    // remove all remaining from old ppn
-    unmapall_pte4(old_ppn);
+    swap_out_cluster_async(saddrs, ppns, num, ids);
+    for (int i = 0; i < num; ++ i)
+    {
+        // the frame is freed when the write completes
+        swap_inflight_t *w = get_inflight(writeback_inflight);
+        assert(w != NULL);
+        w->valid = 1;
+        w->id = ids[i];
+        w->ppn = ppns[i];
+        writeback_count += 1;
+        kswapd_writeback_count += 1;
+        unmapall_pte4(ppns[i]);
+    }
+}
 
-    // reinsert and update r/w mode
-    for (int i = 0; i < MAX_REVERSED_MAPPING_NUMBER; ++ i)
+// all processes are blocked: wait for one swap-in
+void kswapd_wait()
+{
+    for (int i = 0; i < MAX_SWAP_INFLIGHT; ++ i)
     {
-        if (remaining[i] != NULL)
+        if (swapin_inflight[i].valid == 1)
         {
-            assert(remaining[i]->readonly == 1);
-            map_pte4(remaining[i], old_ppn);
+            swap_wait(swapin_inflight[i].id);
+            complete_swap();
+            return;
+        }
+    }
+    // no process would wake up
+    assert(0);
+}
 
-            if (remaining_count == 1)
-            {
-                // if only one pte is left, set it to read/write
-                // This is the case: old mappings = [parent, child]
-                // both are read only. The new mappings are [parent]
-                // [child], both are read/write.
-                remaining[i]->readonly = 0;
-            }
+// return value: 1 if the process is blocked for the swap-in
+static int fault_async(pcb_t *pcb, pte4_t *pte, uint64_t vaddr)
+{
+    swap_inflight_t *r = get_inflight(swapin_inflight);
+    if (r == NULL)
+    {
+        return 0;
+    }
+
+    kswapd_run();
+    int64_t ppn = pop_free_frame();
+    if (ppn < 0)
+    {
+        // direct reclaim
+        return 0;
+    }
+
+    page_map[ppn].locked = 1;
+    free_count -= 1;
+    r->valid = 1;
+    r->id = swap_in_async(pte->saddr, ppn);
+    r->ppn = ppn;
+    r->pcb = pcb;
+    r->pte = pte;
+    r->vaddr = vaddr;
+    pcb->state = PROC_BLOCKED;
+    async_swapin_count += 1;
+
+    // reclaim ahead for the next faults
+    kswapd_run();
+
+    printf(BLUESTR("\tPageFault: swap in to ppn %ld, process %ld blocked\n"), ppn, pcb->pid);
+    return 1;
+}
+#endif
+
+/*  swap readahead
+    The neighbors of the faulting slot are read in the same I/O and
+    parked in swap cache. Only the free frames are used, and one is left
+    for the faulting page.
+    return value: the number of pages, the faulting one at fault_index
+ */
+static int reserve_readahead(uint64_t saddr, uint64_t *saddrs, uint64_t *ppns, int *fault_index)
+{
+    int num = swap_readahead_window(saddr, saddrs, MAX_SWAP_READAHEAD);
+    int n = 0;
+    for (int i = 0; i < num; ++ i)
+    {
+        if (saddrs[i] == saddr)
+        {
+            *fault_index = n;
         }
+        else if (free_count > 1)
+        {
+            int64_t ppn = pop_free_frame();
+            assert(ppn >= 0);
+            free_count -= 1;
+            ppns[n] = ppn;
+        }
+        else
+        {
+            continue;
+        }
+        saddrs[n] = saddrs[i];
+        n += 1;
     }
+    return n;
+}
 
-    // Allocate new physical frame for the PTE
-    // Copy data in physical frame
-    int success = copy_physicalframe(pte, old_ppn);
-    pte->readonly = 0;
-    assert(success == 1);
-    assert(pte->present == 1);
-    uint64_t new_ppn = (uint64_t)pte->ppn;
-    assert(new_ppn != old_ppn);
+// return value: the frame to be mapped by the faulting PTE
+static uint64_t claim_frame()
+{
+    // 1. try to request one free physical page from DRAM
+    // kernel's responsibility
+    int64_t ppn = pop_free_frame();
+    if (ppn >= 0)
+    {
+        printf(BLUESTR("\tPageFault: use free ppn %ld\n"), ppn);
+    }
+    else
+    {
+        // 2. no free physical page: select one victim by CLOCK
+        int dirty = 0;
+        ppn = reclaim_clock(&dirty);
+        assert(ppn >= 0);
+        if (dirty == 1)
+        {
+            // write back (swap out) the DIRTY victim to disk
+            swap_out(page_map[ppn].saddr, ppn);
+            printf(BLUESTR("\tPageFault: write back & use ppn %ld\n"), ppn);
+        }
+        else
+        {
+            printf(BLUESTR("\tPageFault: discard clean ppn %ld as victim\n"), ppn);
+        }
 
-    printf(BLUESTR("\tPTE<%p> removed from Frame[%ld]. New Frame[%ld] allocated\n"),
-        pte, old_ppn, new_ppn);
+        // reversed mapping will find the victim page table
+        unmapall_pte4(ppn);
+    }
+    return ppn;
 }
 
+#ifdef USE_FORK_COW
+uint64_t demand_fault_count = 0;
+
+/*  Demand paging: the page of area is touched for the first time
+    The page of file is mapped from page cache, and read from the file
+    if not cached. The frame is shared, so it is mapped read only even in
+    the writable area, and copied on write.
+    The anonymous page is zero filled. It is clean: a victim of reclaim
+    is discarded without write back, and the next fault gets zeros again.
+    It becomes dirty by the writes through MMU, and is swapped out since.
+ */
+static void fault_demand(vm_area_t *area, pte4_t *pte, uint64_t vaddr)
+{
+    demand_fault_count += 1;
+
+    if (area->vma_mode.file == 0)
+    {
+        uint64_t ppn = claim_frame();
+        memset(&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH], 0, PAGE_SIZE);
+        printf(BLUESTR("\tPageFault: zero ppn %ld for %s\n"), ppn, area->filepath);
+
+        map_pte4_vaddr(pte, ppn, vaddr);
+        pte->readonly = area->vma_mode.write == 0;
+        return;
+    }
+
+    uint64_t ino = get_inode(area->filepath);
+    uint64_t pgoff = area->vma_pgoff + (vaddr - area->vma_start) / PAGE_SIZE;
+    int64_t ppn = find_pagecache(ino, pgoff);
+    if (ppn >= 0)
+    {
+        pagecache_hit_count += 1;
+        if (page_map[ppn].allocated == 0)
+        {
+            // not mapped by others
+            remove_pagecache_lru(ppn);
+        }
+        printf(BLUESTR("\tPageFault: map page %ld of %s from page cache ppn %ld\n"),
+            pgoff, area->filepath, ppn);
+    }
+    else
+    {
+        pagecache_miss_count += 1;
+        ppn = claim_frame();
+        read_filepage(area->filepath, pgoff, &pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH]);
+        add_pagecache(ppn, ino, pgoff);
+        printf(BLUESTR("\tPageFault: read page %ld of %s to ppn %ld\n"),
+            pgoff, area->filepath, ppn);
+    }
+
+    map_pte4_vaddr(pte, ppn, vaddr);
+    pte->readonly = 1;
+}
+#endif
+
+// the fault of kernel is fixed without sleeping
+static int kernel_fault = 0;
+
 void fix_pagefault()
 {
     // get page table directory from rsp
@@ -363,6 +1274,8 @@ void fix_pagefault()
 
     // get the level 4 page table entry
     pte4_t *pte = (pte4_t *)get_pagetableentry(pgd, &vaddr, 4, 1);
+    // huge pages are always present and writable by the owner
+    assert(((pte123_t *)pte)->pagesize == 0 || pte->present == 0);
 
 #ifdef USE_FORK_COW
     // check read/write in vma
@@ -372,7 +1285,13 @@ void fix_pagefault()
         // not in area
         assert(0);
     }
-    else
+    else if (pte->present == 0 && pte->saddr == 0)
+    {
+        // never touched, or discarded clean
+        fault_demand(area, pte, vaddr.vaddr_value);
+        return;
+    }
+    else if (pte->present == 1)
     {
         // found in area
         if (pte->readonly == 1 &&
@@ -380,6 +1299,12 @@ void fix_pagefault()
         {
             copy_on_write(pte);
         }
+        else if (pte->present == 1 &&
+            area->vma_mode.write == 1)
+        {
+            // only the path was read only: the page table shared
+            // by fork is unshared by get_pagetableentry already
+        }
         else
         {
             assert(0);
@@ -387,88 +1312,146 @@ void fix_pagefault()
 
         return;
     }
+    // swapped out: read it from swap space as below
 #endif
 
-    // 1. try to request one free physical page from DRAM
-    // kernel's responsibility
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+    if (pte->saddr != 0)
     {
-        if (page_map[i].allocated == 0)
+        // 0. the page is read ahead by an earlier fault
+        int64_t ppn = take_swapcache(pte->saddr);
+        if (ppn >= 0)
         {
-            // found i as free ppn
-            map_pte4(pte, i);
-         
-            printf(BLUESTR("\tPageFault: use free ppn %d\n"), i);
+            printf(BLUESTR("\tPageFault: map ppn %ld from swap cache\n"), ppn);
+            map_swapped_in(pte, ppn, vaddr.vaddr_value);
             return;
         }
     }
 
-    // 2. no free physical page: select one clean page (LRU) and overwrite
-    // in this case, there is no DRAM - DISK transaction
-    // you know you can optimize this loop in the previous one.
-    int lru_ppn = -1;
-    int lru_time = -1;
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+#ifdef USE_ASYNC_SWAP
+    if (pte->saddr != 0 && kernel_fault == 0 && fault_async(pcb, pte, vaddr.vaddr_value) == 1)
     {
-        if (page_map[i].dirty == 0 && 
-            lru_time < page_map[i].time)
-        {
-            lru_time = page_map[i].time;
-            lru_ppn = i;
-        }
+        // os_schedule runs another process till the page is swapped in
+        return;
     }
-    
-    // this is the selected ppn for vaddr
-    if (-1 != lru_ppn && lru_ppn < MAX_NUM_PHYSICAL_PAGE)
-    {
-        // reversed mapping will find the victim page table
-        // unmap the victim (LRU)
-        unmapall_pte4(lru_ppn);
-
-        // load page from disk to physical memory
-        // at the victim's ppn
-        swap_in(pte->saddr, lru_ppn);
-        map_pte4(pte, lru_ppn);
+#endif
 
-        printf(BLUESTR("\tPageFault: discard clean ppn %d as victim\n"), lru_ppn);
-        return;
+    uint64_t ra_saddrs[MAX_SWAP_READAHEAD];
+    uint64_t ra_ppns[MAX_SWAP_READAHEAD];
+    int ra_num = 0;
+    int fault_index = 0;
+    if (pte->saddr != 0)
+    {
+        ra_num = reserve_readahead(pte->saddr, ra_saddrs, ra_ppns, &fault_index);
     }
 
-    // 3. no free nor clean physical page: select one LRU victim
-    // write back (swap out) the DIRTY victim to disk
-    lru_ppn = -1;
-    lru_time = -1;
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+    uint64_t ppn = claim_frame();
+
+    // load page from disk to physical memory
+    if (ra_num > 1)
     {
-        if (lru_time < page_map[i].time)
+        ra_ppns[fault_index] = ppn;
+        swap_in_cluster(ra_saddrs, ra_ppns, ra_num);
+        for (int i = 0; i < ra_num; ++ i)
         {
-            lru_time = page_map[i].time;
-            lru_ppn = i;
+            if (i != fault_index)
+            {
+                add_swapcache(ra_saddrs[i], ra_ppns[i]);
+            }
         }
     }
-    assert(0 <= lru_ppn && lru_ppn < MAX_NUM_PHYSICAL_PAGE);
+    else
+    {
+        swap_in(pte->saddr, ppn);
+    }
+    map_swapped_in(pte, ppn, vaddr.vaddr_value);
+}
 
-    // write back
-    swap_out(page_map[lru_ppn].saddr, lru_ppn);
+/*  page fault of kernel accessing user memory, e.g. copy_from_user
+    It's fixed in place as the fault of user, then the kernel retries.
+    The kernel does not sleep here: the swap-in is synchronous.
+    return value: 0 if the user address is illegal for the access
+ */
+int fix_kernel_pagefault(uint64_t vaddr_value, int access)
+{
+    pcb_t *pcb = get_current_pcb();
+#ifdef USE_FORK_COW
+    vm_area_t *area = search_vma_vaddr(pcb, vaddr_value);
+    if (area == NULL || (access == MMU_WRITE && area->vma_mode.write == 0))
+    {
+        return 0;
+    }
+#else
+    // no area: only the page swapped out can be fixed
+    address_t vaddr = {.address_value = vaddr_value};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(pcb->mm.pgd, &vaddr, 4, 0);
+    if (pte == NULL || pte->present == 1 || pte->saddr == 0)
+    {
+        return 0;
+    }
+#endif
 
-    // unmap victim
-    unmapall_pte4(lru_ppn);
+    mmu_vaddr_pagefault = vaddr_value;
+    kernel_fault = 1;
+    fix_pagefault();
+    kernel_fault = 0;
+    return 1;
+}
 
-    // load page from disk to physical memory
-    swap_in(pte->saddr, lru_ppn);
-    map_pte4(pte, lru_ppn);
+int allocate_physicalframe(pte4_t *pte, uint64_t vaddr)
+{
+    int64_t ppn = pop_free_frame();
+    if (ppn >= 0)
+    {
+        map_pte4_vaddr(pte, ppn, vaddr);
+        return 1;
+    }
 
-    printf(BLUESTR("\tPageFault: write back & use ppn %d\n"), lru_ppn);
+    return 0;
 }
 
-int allocate_physicalframe(pte4_t *pte)
+/*  allocate the contiguous frames of a huge page and map the leaf
+    pte: the leaf entry in PUD (level 2, 1GB) or PMD (level 3, 2MB)
+    return value: 1 for success, 0 if no aligned free frames
+ */
+int allocate_hugeframe(pte123_t *pte, int level)
 {
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+    assert(level == 2 || level == 3);
+    uint64_t num = 1ul << ((4 - level) * VIRTUAL_PAGE_NUMBER_LENGTH);
+
+    // the first frame must be aligned to the huge page size
+    for (uint64_t i = 0; i + num <= MAX_NUM_PHYSICAL_PAGE; i += num)
     {
-        if (page_map[i].allocated == 0)
+        int found = 1;
+        for (uint64_t j = i; j < i + num; ++ j)
         {
-            // found i as free ppn
-            map_pte4(pte, i);
+            if (page_map[j].allocated == 1 || page_map[j].locked == 1 ||
+                page_map[j].cached == 1)
+            {
+                found = 0;
+                break;
+            }
+        }
+
+        if (found == 1)
+        {
+            for (uint64_t j = i; j < i + num; ++ j)
+            {
+                page_map[j].allocated = 1;
+                page_map[j].huge = 1;
+            }
+            free_count -= num;
+
+            // the leaf is in the layout of pte4_t
+            pte4_t *leaf = (pte4_t *)pte;
+            leaf->pte_value = 0;
+            leaf->present = 1;
+            leaf->ppn = i;
+            pte->pagesize = 1;
+
+            // the entry may have pointed to a table cached by PWC
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+            flush_pwc();
+#endif
             return 1;
         }
     }
@@ -482,38 +1465,31 @@ int allocate_physicalframe(pte4_t *pte)
     ----------------
     parent_ppn: the ppn of the frame (parent process) to be copied
     child_pte: the level 4 page table entry to be mapped
+    vaddr: the page mapped by both PTEs
     return value: 1 for success, 0 for failure
  */
-int copy_physicalframe(pte4_t *child_pte, uint64_t parent_ppn)
+int copy_physicalframe(pte4_t *child_pte, uint64_t parent_ppn, uint64_t vaddr)
 {
     assert(0 <= parent_ppn && parent_ppn < MAX_NUM_PHYSICAL_PAGE);
-    if (allocate_physicalframe(child_pte) == 1)
+    // no reclaim here: parent_ppn itself may be the victim
+    // so the fork fails if no free frame
+    if (allocate_physicalframe(child_pte, vaddr) == 0)
     {
-        uint64_t ppn = child_pte->ppn;
-        memcpy(&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH],
-            &pm[parent_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], PAGE_SIZE);
+        return 0;
     }
-    
-    // TODO && ATTENTION!!: In real world, we may evict victim to provide
-    //                      enough space for new child frame
-    // But in our case, parent_ppn may be evicted. This is bad.
-    // So we should fail the fork
+
+    uint64_t ppn = child_pte->ppn;
+    memcpy(&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH],
+        &pm[parent_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], PAGE_SIZE);
+    // not in swap space yet
+    page_map[ppn].dirty = 1;
     return 1;
 }
 
 // check if there are enough frames to use
 int enough_frames(int request_num)
 {
-    int free_num = 0;
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
-    {
-        if (page_map[i].allocated == 0)
-        {
-            free_num += 1;
-        }
-    }
-    
-    if (request_num <= free_num)
+    if ((uint64_t)request_num <= available_frames())
     {
         return 1;
     }
@@ -18,6 +18,73 @@
 #include "headers/memory.h"
 #include "headers/interrupt.h"
 #include "headers/process.h"
+#include "headers/algorithm.h"
+
+#ifdef USE_ASYNC_SWAP
+void kswapd_run();
+void kswapd_wait();
+#endif
+
+// from exit
+int exit_killed(pcb_t *proc);
+void release_orphan(pcb_t *proc);
+
+// isa.c
+extern uint64_t global_time;
+extern uint64_t timer_deadline;
+#ifdef USE_SCHED_SMP
+extern int num_cores;
+extern int current_core;
+void smp_send_reschedule(int core);
+#endif
+
+#ifdef USE_SCHED_CFS
+// every runnable process runs once in the period
+#ifndef SCHED_LATENCY
+#define SCHED_LATENCY (6000000)
+#endif
+// the period is stretched when there are too many processes
+#ifndef SCHED_MIN_GRANULARITY
+#define SCHED_MIN_GRANULARITY (750000)
+#endif
+#endif
+
+#ifdef USE_SCHED_SMP
+// how often a core pulls processes from the busiest core
+#ifndef SCHED_BALANCE_INTERVAL
+#define SCHED_BALANCE_INTERVAL (4 * SCHED_MIN_GRANULARITY)
+#endif
+// the process ran within this time is cache hot: its cache lines and
+// TLB entries are still on the old core. Moving it costs more than
+// what it waits in the old run queue
+#ifndef SCHED_MIGRATION_COST
+#define SCHED_MIGRATION_COST (SCHED_MIN_GRANULARITY / 2)
+#endif
+// pull only if the busiest core is 25% busier
+#define SCHED_IMBALANCE_PCT (125)
+// the number of processes scanned in one balancing
+#define SCHED_NR_MIGRATE (32)
+#endif
+
+#define NICE_0_WEIGHT (1024)
+
+// from nice -20 to 19, one nice level is about 10% of CPU time
+static const uint64_t nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15,
+};
+
+static uint64_t get_weight(pcb_t *proc)
+{
+    assert(-20 <= proc->sched.nice && proc->sched.nice <= 19);
+    return nice_to_weight[proc->sched.nice + 20];
+}
 
 pcb_t *get_current_pcb()
 {
@@ -44,6 +111,517 @@ static void restore_context(pcb_t *proc)
     memcpy(&cpu_flags, &(proc->context.flags), sizeof(cpu_flags_t));
 }
 
+// charge the running time to the process
+static void update_curr(pcb_t *proc)
+{
+    uint64_t delta = global_time - proc->sched.exec_start;
+    proc->sched.sum_exec_runtime += delta;
+    proc->sched.vruntime += delta * NICE_0_WEIGHT / get_weight(proc);
+    proc->sched.exec_start = global_time;
+}
+
+// the process is switched in after waiting in run queue
+static void update_wait(pcb_t *proc)
+{
+    uint64_t delta = global_time - proc->sched.wait_start;
+    proc->sched.sum_wait_time += delta;
+    if (delta > proc->sched.max_wait_time)
+    {
+        proc->sched.max_wait_time = delta;
+    }
+    proc->sched.run_count += 1;
+}
+
+#ifdef USE_SCHED_CFS
+// the run queue of the processes waiting for CPU, ordered by vruntime
+// the running process is not in the tree
+typedef struct
+{
+    rbtree_internal_t tree;
+    uint64_t nr_running;
+    uint64_t load_weight;
+    // the vruntime of new and woken up processes starts from here
+    uint64_t min_vruntime;
+    // the running process, or the idle one
+    pcb_t *curr;
+    // the core runs idle process when run queue is empty
+    pcb_t *idle;
+    uint64_t next_balance;
+} cfs_rq_t;
+
+// one run queue for each core
+static cfs_rq_t cfs_rqs[MAX_NUM_CORES];
+
+static int this_core()
+{
+#ifdef USE_SCHED_SMP
+    return current_core;
+#else
+    return 0;
+#endif
+}
+
+// the implementation of run queue interface
+// the node id is the address of PCB, keyed by vruntime
+static int is_null_pcb(uint64_t pcb_addr)
+{
+    return pcb_addr == NULL_ID;
+}
+
+static int compare_pcbs(uint64_t a, uint64_t b)
+{
+    return !(a == b);
+}
+
+static uint64_t get_pcb_parent(uint64_t pcb_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        return (uint64_t)pcb->sched.rbt_parent;
+    }
+
+    return NULL_ID;
+}
+
+static int set_pcb_parent(uint64_t pcb_addr, uint64_t parent_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        pcb->sched.rbt_parent = (pcb_t *)parent_addr;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t get_pcb_left(uint64_t pcb_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        return (uint64_t)pcb->sched.rbt_left;
+    }
+
+    return NULL_ID;
+}
+
+static int set_pcb_left(uint64_t pcb_addr, uint64_t left_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        pcb->sched.rbt_left = (pcb_t *)left_addr;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t get_pcb_right(uint64_t pcb_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        return (uint64_t)pcb->sched.rbt_right;
+    }
+
+    return NULL_ID;
+}
+
+static int set_pcb_right(uint64_t pcb_addr, uint64_t right_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        pcb->sched.rbt_right = (pcb_t *)right_addr;
+        return 1;
+    }
+
+    return 0;
+}
+
+static rb_color_t get_pcb_color(uint64_t pcb_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        return (rb_color_t)pcb->sched.rbt_color;
+    }
+
+    // null nodes are black
+    return COLOR_BLACK;
+}
+
+static int set_pcb_color(uint64_t pcb_addr, rb_color_t color)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        pcb->sched.rbt_color = color;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t get_pcb_key(uint64_t pcb_addr)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        return pcb->sched.vruntime;
+    }
+
+    return 0;
+}
+
+static int set_pcb_key(uint64_t pcb_addr, uint64_t key)
+{
+    pcb_t *pcb = (pcb_t *)pcb_addr;
+    if (pcb != NULL)
+    {
+        pcb->sched.vruntime = key;
+        return 1;
+    }
+
+    return 0;
+}
+
+// fill in the interface
+// the PCBs are not constructed by the tree
+static rbtree_node_interface cfs_rq_interface = {
+    .is_null_node = is_null_pcb,
+    .compare_nodes = compare_pcbs,
+    .get_parent = get_pcb_parent,
+    .set_parent = set_pcb_parent,
+    .get_leftchild = get_pcb_left,
+    .set_leftchild = set_pcb_left,
+    .get_rightchild = get_pcb_right,
+    .set_rightchild = set_pcb_right,
+    .get_color = get_pcb_color,
+    .set_color = set_pcb_color,
+    .get_key = get_pcb_key,
+    .set_key = set_pcb_key,
+};
+
+static int cfs_rq_update_root(rbtree_internal_t *this, uint64_t new_root)
+{
+    assert(this != NULL);
+
+    this->root = new_root;
+    return 1;
+}
+
+static void enqueue_entity(cfs_rq_t *rq, pcb_t *proc)
+{
+    assert(proc->sched.on_rq == 0);
+
+    rq->tree.update_root = cfs_rq_update_root;
+    rbt_internal_insert(&(rq->tree), &cfs_rq_interface, (uint64_t)proc);
+    proc->sched.on_rq = 1;
+    proc->sched.core = rq - cfs_rqs;
+    rq->nr_running += 1;
+    rq->load_weight += get_weight(proc);
+}
+
+static void dequeue_entity(cfs_rq_t *rq, pcb_t *proc)
+{
+    assert(proc->sched.on_rq == 1);
+
+    rbt_internal_delete(&(rq->tree), &cfs_rq_interface, (uint64_t)proc);
+    proc->sched.on_rq = 0;
+    rq->nr_running -= 1;
+    rq->load_weight -= get_weight(proc);
+}
+
+// the left most node has the smallest vruntime
+static pcb_t *pick_first_entity(cfs_rq_t *rq)
+{
+    pcb_t *p = (pcb_t *)rq->tree.root;
+    if (p == NULL)
+    {
+        return NULL;
+    }
+
+    while (p->sched.rbt_left != NULL)
+    {
+        p = p->sched.rbt_left;
+    }
+    return p;
+}
+
+// the smaller of the running one and the left most one
+// min_vruntime never goes back
+static void update_min_vruntime(cfs_rq_t *rq, pcb_t *curr)
+{
+    uint64_t vruntime = curr->sched.vruntime;
+    pcb_t *first = pick_first_entity(rq);
+    if (first != NULL && first->sched.vruntime < vruntime)
+    {
+        vruntime = first->sched.vruntime;
+    }
+
+    if (vruntime > rq->min_vruntime)
+    {
+        rq->min_vruntime = vruntime;
+    }
+}
+
+// the share of the period, by weight of all runnable processes
+static uint64_t sched_slice(cfs_rq_t *rq, pcb_t *proc)
+{
+    uint64_t period = SCHED_LATENCY;
+    if (rq->nr_running > SCHED_LATENCY / SCHED_MIN_GRANULARITY)
+    {
+        period = rq->nr_running * SCHED_MIN_GRANULARITY;
+    }
+
+    uint64_t slice = period * get_weight(proc) / rq->load_weight;
+    return slice > 0 ? slice : 1;
+}
+
+// the process which has slept for long should not monopolize CPU.
+// It is credited half of the period so that interactive ones
+// run soon after waking up.
+static void place_entity(cfs_rq_t *rq, pcb_t *proc, int initial)
+{
+    uint64_t vruntime = rq->min_vruntime;
+    if (initial == 0)
+    {
+        uint64_t credit = SCHED_LATENCY / 2;
+        vruntime = vruntime > credit ? vruntime - credit : 0;
+    }
+
+    if (proc->sched.vruntime < vruntime)
+    {
+        proc->sched.vruntime = vruntime;
+    }
+}
+
+// 0 for all cores
+static int core_allowed(pcb_t *proc, int core)
+{
+    return proc->sched.cpus_allowed == 0 ||
+        ((proc->sched.cpus_allowed >> core) & 1) == 1;
+}
+
+#ifdef USE_SCHED_SMP
+// the weight of the runnable processes on the core, running one included
+static uint64_t core_load(int core)
+{
+    cfs_rq_t *rq = &cfs_rqs[core];
+    uint64_t load = rq->load_weight;
+    if (rq->curr != NULL && rq->curr != rq->idle)
+    {
+        load += get_weight(rq->curr);
+    }
+    return load;
+}
+
+// the core of the least load
+static int select_idlest_core(pcb_t *proc)
+{
+    int idlest = -1;
+    for (int i = 0; i < num_cores; ++ i)
+    {
+        if (core_allowed(proc, i) == 1 &&
+            (idlest < 0 || core_load(i) < core_load(idlest)))
+        {
+            idlest = i;
+        }
+    }
+    assert(idlest >= 0);
+    return idlest;
+}
+
+// the woken up process prefers its old core, where its cache is
+static int select_task_core(pcb_t *proc, int initial)
+{
+    int core = proc->sched.core;
+    if (initial == 1 || core >= num_cores || core_allowed(proc, core) == 0 ||
+        cfs_rqs[core].curr == cfs_rqs[core].idle)
+    {
+        // or any idle core
+        core = select_idlest_core(proc);
+    }
+    return core;
+}
+
+uint64_t sched_migration_count = 0;
+
+// the process keeps its lag to min_vruntime on the new core
+static void migrate_task(pcb_t *proc, int src, int dst)
+{
+    cfs_rq_t *src_rq = &cfs_rqs[src];
+    cfs_rq_t *dst_rq = &cfs_rqs[dst];
+
+    dequeue_entity(src_rq, proc);
+    int64_t lag = proc->sched.vruntime - src_rq->min_vruntime;
+    int64_t vruntime = (int64_t)dst_rq->min_vruntime + lag;
+    proc->sched.vruntime = vruntime > 0 ? vruntime : 0;
+    enqueue_entity(dst_rq, proc);
+
+    proc->sched.nr_migrations += 1;
+    sched_migration_count += 1;
+
+    // the TLB of the new core has no entries of the process
+#if defined(USE_TLB_HARDWARE) && defined(USE_PAGETABLE_VA2PA)
+    flush_tlb_asid(proc->asid);
+#endif
+}
+
+static int can_migrate_task(pcb_t *proc, int dst, int idle)
+{
+    if (core_allowed(proc, dst) == 0)
+    {
+        return 0;
+    }
+
+    // an idle core would rather take a cache hot process than nothing
+    return idle == 1 ||
+        global_time - proc->sched.exec_start >= SCHED_MIGRATION_COST;
+}
+
+// in order of vruntime
+static void collect_tasks(pcb_t *p, pcb_t **tasks, int *num)
+{
+    if (p == NULL || *num >= SCHED_NR_MIGRATE)
+    {
+        return;
+    }
+    collect_tasks(p->sched.rbt_left, tasks, num);
+    if (*num < SCHED_NR_MIGRATE)
+    {
+        tasks[*num] = p;
+        *num += 1;
+    }
+    collect_tasks(p->sched.rbt_right, tasks, num);
+}
+
+static int find_busiest_core(int core)
+{
+    int busiest = -1;
+    for (int i = 0; i < num_cores; ++ i)
+    {
+        if (i != core && cfs_rqs[i].nr_running > 0 &&
+            (busiest < 0 || core_load(i) > core_load(busiest)))
+        {
+            busiest = i;
+        }
+    }
+    return busiest;
+}
+
+// pull processes from the busiest core to this one
+// return the number of processes moved
+static int load_balance(int core, int idle)
+{
+    int busiest = find_busiest_core(core);
+    if (busiest < 0)
+    {
+        return 0;
+    }
+
+    uint64_t this_load = core_load(core);
+    uint64_t busiest_load = core_load(busiest);
+    if (idle == 0 && busiest_load * 100 <= this_load * SCHED_IMBALANCE_PCT)
+    {
+        return 0;
+    }
+    // move half of the difference, to make them even
+    uint64_t imbalance = (busiest_load - this_load) / 2;
+
+    pcb_t *tasks[SCHED_NR_MIGRATE];
+    int num = 0;
+    collect_tasks((pcb_t *)cfs_rqs[busiest].tree.root, tasks, &num);
+
+    // the ones at the end of the queue wait the longest
+    int moved = 0;
+    for (int i = num - 1; i >= 0 && imbalance > 0; -- i)
+    {
+        uint64_t weight = get_weight(tasks[i]);
+        if (can_migrate_task(tasks[i], core, idle) == 0 ||
+            (idle == 0 && weight / 2 > imbalance))
+        {
+            continue;
+        }
+
+        migrate_task(tasks[i], busiest, core);
+        moved += 1;
+        imbalance = weight < imbalance ? imbalance - weight : 0;
+
+        if (idle == 1)
+        {
+            // one is enough to keep the core busy
+            break;
+        }
+    }
+    return moved;
+}
+#endif
+
+// the idle process runs on the core when there is nothing to run
+void sched_init_core(int core, pcb_t *idle)
+{
+    assert(0 <= core && core < MAX_NUM_CORES);
+    memset(&cfs_rqs[core], 0, sizeof(cfs_rq_t));
+    cfs_rqs[core].curr = idle;
+    cfs_rqs[core].idle = idle;
+}
+#endif
+
+void wake_up_process(pcb_t *proc)
+{
+    proc->state = PROC_RUNNABLE;
+    proc->sched.wait_start = global_time;
+
+#ifdef USE_SCHED_CFS
+    int core = this_core();
+#ifdef USE_SCHED_SMP
+    core = select_task_core(proc, 0);
+#endif
+    place_entity(&cfs_rqs[core], proc, 0);
+    enqueue_entity(&cfs_rqs[core], proc);
+#ifdef USE_SCHED_SMP
+    if (cfs_rqs[core].curr == cfs_rqs[core].idle)
+    {
+        smp_send_reschedule(core);
+    }
+#endif
+#endif
+}
+
+// the new process inherits the vruntime, nice and affinity of parent
+void wake_up_new_process(pcb_t *proc)
+{
+    proc->state = PROC_RUNNABLE;
+    proc->sched.wait_start = global_time;
+    proc->sched.exec_start = global_time;
+    proc->sched.sum_exec_runtime = 0;
+    proc->sched.sum_wait_time = 0;
+    proc->sched.max_wait_time = 0;
+    proc->sched.run_count = 0;
+    proc->sched.nr_migrations = 0;
+    proc->sched.on_rq = 0;
+
+#ifdef USE_SCHED_CFS
+    int core = this_core();
+#ifdef USE_SCHED_SMP
+    core = select_task_core(proc, 1);
+#endif
+    place_entity(&cfs_rqs[core], proc, 1);
+    enqueue_entity(&cfs_rqs[core], proc);
+#ifdef USE_SCHED_SMP
+    if (cfs_rqs[core].curr == cfs_rqs[core].idle)
+    {
+        smp_send_reschedule(core);
+    }
+#endif
+#endif
+}
+
 void os_schedule()
 {
     // The magic is: RIP is not updated at all
@@ -51,8 +629,111 @@ void os_schedule()
 
     pcb_t *pcb_old = get_current_pcb();
 
-    // pcb_new should be selected by the scheduling algorithm
+#ifdef USE_SCHED_CFS
+    int core = this_core();
+    cfs_rq_t *rq = &cfs_rqs[core];
+
+    // put the old process back to run queue, unless it is blocked
+    if (pcb_old != rq->idle)
+    {
+        update_curr(pcb_old);
+        if (pcb_old->state == PROC_RUNNABLE)
+        {
+            enqueue_entity(rq, pcb_old);
+        }
+    }
+
+#ifdef USE_ASYNC_SWAP
+    // wake up the processes whose pages are swapped in
+    kswapd_run();
+
+    while (rq->nr_running == 0 && rq->idle == NULL)
+    {
+        // all blocked: CPU is idle till one swap-in completes
+        kswapd_wait();
+    }
+#endif
+
+#ifdef USE_SCHED_SMP
+    // periodic balancing on timer, and stealing when the core goes idle
+    if (global_time >= rq->next_balance)
+    {
+        load_balance(core, 0);
+        rq->next_balance = global_time + SCHED_BALANCE_INTERVAL;
+    }
+    if (rq->nr_running == 0)
+    {
+        load_balance(core, 1);
+    }
+#endif
+
+    pcb_t *pcb_new = rq->idle;
+    uint64_t slice = SCHED_MIN_GRANULARITY;
+    while (rq->nr_running > 0)
+    {
+        // the process which has run the least
+        pcb_new = pick_first_entity(rq);
+        slice = sched_slice(rq, pcb_new);
+        dequeue_entity(rq, pcb_new);
+        if (exit_killed(pcb_new) == 0)
+        {
+            update_min_vruntime(rq, pcb_new);
+            break;
+        }
+        pcb_new = rq->idle;
+        slice = SCHED_MIN_GRANULARITY;
+    }
+    assert(pcb_new != NULL);
+    rq->curr = pcb_new;
+
+    // the process keeps the rest of its slice if it is picked again
+    if (pcb_new != pcb_old || global_time >= timer_deadline)
+    {
+        timer_deadline = global_time + slice;
+    }
+#else
+    // round robin
+    update_curr(pcb_old);
     pcb_t *pcb_new = pcb_old->next;
+
+#ifdef USE_ASYNC_SWAP
+    // wake up the processes whose pages are swapped in
+    kswapd_run();
+#endif
+
+    // skip the processes waiting for swap-in, vfork child or exit of child,
+    // the zombies, and the killed processes exit here
+    while (pcb_new->state != PROC_RUNNABLE || exit_killed(pcb_new) == 1)
+    {
+        pcb_new = pcb_new->next;
+        if (pcb_new == pcb_old->next)
+        {
+#ifdef USE_ASYNC_SWAP
+            // all blocked: CPU is idle till one swap-in completes
+            kswapd_wait();
+#else
+            // nobody would wake them up
+            assert(0);
+#endif
+        }
+    }
+#endif
+
+    if (pcb_new != pcb_old)
+    {
+        if (pcb_old->state == PROC_RUNNABLE)
+        {
+            pcb_old->sched.wait_start = global_time;
+        }
+#ifdef USE_SCHED_CFS
+        if (pcb_new != rq->idle)
+#endif
+        {
+            update_wait(pcb_new);
+        }
+    }
+    pcb_new->sched.exec_start = global_time;
+
     printf(REDSTR("    OS schedule [%ld] -> [%ld]\n"), pcb_old->pid, pcb_new->pid);
 
     // context switch
@@ -67,6 +748,18 @@ void os_schedule()
     tr_global_tss.ESP0 = get_kstack_RSP() + KERNEL_STACK_SIZE;
 
     // update CR3 -> page table in MMU
-    // will cause the refreshing of MMU TLB cache
+    // TLB entries are tagged by ASID, no need to flush them
     cpu_controls.cr3 = (uint64_t)(pcb_new->mm.pgd);
+    cpu_controls.asid = pcb_new->asid;
+
+    // host TLB is not tagged
+#ifdef USE_SOFTMMU
+    softmmu_flush();
+#endif
+
+    // the exited process is off its kernel stack now
+    if (pcb_new != pcb_old)
+    {
+        release_orphan(pcb_old);
+    }
 }
\ No newline at end of file
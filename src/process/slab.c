@@ -0,0 +1,359 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/interrupt.h"
+#include "headers/process.h"
+
+/*  Slab allocator of kernel objects
+    fork, exit and page faults keep creating and dropping the same kinds
+    of objects: page tables, PCBs, areas and kernel stacks. Each kind has
+    its own cache. A cache takes big aligned slabs from the host, and cuts
+    every slab into objects of the same size and alignment. The free
+    objects of one slab are linked by their first 8 bytes.
+
+    The slab header is at the beginning of the slab, so the slab of an
+    object is found by masking its address. Page tables are page aligned
+    and kernel stacks are KERNEL_STACK_SIZE aligned (get_kstack_RSP
+    depends on it), the header takes the first object slot of them.
+
+    On top of the slabs, each core has one magazine per cache: a small
+    stack of free objects. Most allocations and frees are one push or pop
+    on the magazine of the current core, the slab lists are touched only
+    when the magazine is empty or full, and half of it is moved at once.
+ */
+
+#define SLAB_SIZE           (64 * 1024)
+#define SLAB_MAGIC          (0x51ab51ab)
+#define SLAB_HASH_SIZE      (256)
+#define MAGAZINE_SIZE       (16)
+
+#ifdef USE_SCHED_SMP
+// from isa
+extern int current_core;
+#endif
+
+typedef struct SLAB_STRUCT
+{
+    uint64_t magic;
+    struct KMEM_CACHE_STRUCT *cache;
+
+    // in one of the lists of the cache: partial, full or empty
+    struct SLAB_STRUCT *prev;
+    struct SLAB_STRUCT *next;
+    // in the bucket of slab_hash
+    struct SLAB_STRUCT *hash_next;
+
+    void *freelist;
+    int inuse;
+} slab_t;
+
+typedef struct
+{
+    int count;
+    void *objs[MAGAZINE_SIZE];
+} magazine_t;
+
+typedef struct KMEM_CACHE_STRUCT
+{
+    const char *name;
+    uint64_t size;
+    uint64_t align;
+
+    // the first object is at offset, after the slab header
+    uint64_t offset;
+    int num;
+
+    slab_t *partial;
+    slab_t *full;
+    // at most one empty slab is kept, the others are given back to host
+    slab_t *empty;
+
+    magazine_t magazines[MAX_NUM_CORES];
+} kmem_cache_t;
+
+static kmem_cache_t kmem_caches[KMEM_NUM_CACHES] = {
+    [KMEM_PAGETABLE] = {
+        .name = "pagetable",
+        .size = PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t),
+        .align = PAGE_SIZE,
+    },
+    [KMEM_PCB] = {
+        .name = "pcb",
+        .size = sizeof(pcb_t),
+        .align = 64,
+    },
+    [KMEM_VMA] = {
+        .name = "vma",
+        .size = sizeof(vm_area_t),
+        .align = 64,
+    },
+    [KMEM_KSTACK] = {
+        .name = "kstack",
+        .size = KERNEL_STACK_SIZE,
+        .align = KERNEL_STACK_SIZE,
+    },
+};
+
+// the slabs of all caches, to tell if an object is from slab
+static slab_t *slab_hash[SLAB_HASH_SIZE];
+
+static uint64_t round_up(uint64_t x, uint64_t align)
+{
+    return (x + align - 1) / align * align;
+}
+
+static int get_core()
+{
+#ifdef USE_SCHED_SMP
+    return current_core;
+#else
+    return 0;
+#endif
+}
+
+static kmem_cache_t *get_cache(int type)
+{
+    assert(0 <= type && type < KMEM_NUM_CACHES);
+    kmem_cache_t *cache = &kmem_caches[type];
+    if (cache->num == 0)
+    {
+        cache->size = round_up(cache->size, cache->align);
+        cache->offset = round_up(sizeof(slab_t), cache->align);
+        cache->num = (SLAB_SIZE - cache->offset) / cache->size;
+        assert(cache->num > 0);
+    }
+    return cache;
+}
+
+/*======================================*/
+/*      slab layer                      */
+/*======================================*/
+
+static uint64_t hash_index(uint64_t base)
+{
+    return (base / SLAB_SIZE) % SLAB_HASH_SIZE;
+}
+
+// return value: the slab of the object, NULL if it's not from any cache
+static slab_t *find_slab(void *obj)
+{
+    uint64_t base = (uint64_t)obj & ~((uint64_t)SLAB_SIZE - 1);
+    for (slab_t *s = slab_hash[hash_index(base)]; s != NULL; s = s->hash_next)
+    {
+        if ((uint64_t)s == base)
+        {
+            assert(s->magic == SLAB_MAGIC);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static slab_t **get_list(kmem_cache_t *cache, int inuse)
+{
+    if (inuse == 0)
+    {
+        return &cache->empty;
+    }
+    else if (inuse == cache->num)
+    {
+        return &cache->full;
+    }
+    return &cache->partial;
+}
+
+static void list_add(slab_t **head, slab_t *s)
+{
+    s->prev = NULL;
+    s->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->prev = s;
+    }
+    *head = s;
+}
+
+static void list_delete(slab_t **head, slab_t *s)
+{
+    if (s->prev != NULL)
+    {
+        s->prev->next = s->next;
+    }
+    else
+    {
+        *head = s->next;
+    }
+    if (s->next != NULL)
+    {
+        s->next->prev = s->prev;
+    }
+}
+
+static slab_t *create_slab(int type, kmem_cache_t *cache)
+{
+    slab_t *s = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    assert(s != NULL);
+    kmem_host_alloc_count[type] += 1;
+    kmem_slab_count[type] += 1;
+
+    s->magic = SLAB_MAGIC;
+    s->cache = cache;
+    s->inuse = 0;
+    s->freelist = NULL;
+    for (int i = cache->num - 1; i >= 0; -- i)
+    {
+        void *obj = (void *)((uint64_t)s + cache->offset + i * cache->size);
+        *(void **)obj = s->freelist;
+        s->freelist = obj;
+    }
+
+    uint64_t h = hash_index((uint64_t)s);
+    s->hash_next = slab_hash[h];
+    slab_hash[h] = s;
+
+    list_add(&cache->empty, s);
+    return s;
+}
+
+// the slab is off the lists of cache
+static void destroy_slab(int type, slab_t *s)
+{
+    assert(s->inuse == 0);
+
+    slab_t **p = &slab_hash[hash_index((uint64_t)s)];
+    while (*p != s)
+    {
+        p = &(*p)->hash_next;
+    }
+    *p = s->hash_next;
+
+    s->magic = 0;
+    free(s);
+    kmem_slab_count[type] -= 1;
+}
+
+static void *slab_alloc(int type, kmem_cache_t *cache)
+{
+    slab_t *s = cache->partial;
+    if (s == NULL)
+    {
+        s = cache->empty;
+    }
+    if (s == NULL)
+    {
+        s = create_slab(type, cache);
+    }
+
+    void *obj = s->freelist;
+    s->freelist = *(void **)obj;
+
+    list_delete(get_list(cache, s->inuse), s);
+    s->inuse += 1;
+    list_add(get_list(cache, s->inuse), s);
+    return obj;
+}
+
+static void slab_free(int type, kmem_cache_t *cache, void *obj)
+{
+    slab_t *s = find_slab(obj);
+    assert(s != NULL && s->cache == cache);
+
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+
+    list_delete(get_list(cache, s->inuse), s);
+    s->inuse -= 1;
+    if (s->inuse == 0 && cache->empty != NULL)
+    {
+        // one empty slab is enough for the next allocations
+        destroy_slab(type, s);
+        return;
+    }
+    list_add(get_list(cache, s->inuse), s);
+}
+
+/*======================================*/
+/*      magazine layer                  */
+/*======================================*/
+
+// the object is not initialized, as malloc
+void *kmem_cache_alloc(int type)
+{
+    kmem_cache_t *cache = get_cache(type);
+    magazine_t *mag = &cache->magazines[get_core()];
+
+    if (mag->count == 0)
+    {
+        // refill half of the magazine from slabs
+        while (mag->count < MAGAZINE_SIZE / 2)
+        {
+            mag->objs[mag->count] = slab_alloc(type, cache);
+            mag->count += 1;
+        }
+    }
+    else
+    {
+        kmem_magazine_hit_count[type] += 1;
+    }
+
+    mag->count -= 1;
+    kmem_alloc_count[type] += 1;
+    kmem_live_count[type] += 1;
+    return mag->objs[mag->count];
+}
+
+void kmem_cache_free(int type, void *obj)
+{
+    if (obj == NULL)
+    {
+        return;
+    }
+
+    kmem_cache_t *cache = get_cache(type);
+    slab_t *s = find_slab(obj);
+    assert(s != NULL && s->cache == cache);
+    assert(((uint64_t)obj - (uint64_t)s - cache->offset) % cache->size == 0);
+
+    magazine_t *mag = &cache->magazines[get_core()];
+    if (mag->count == MAGAZINE_SIZE)
+    {
+        // flush half of the magazine to slabs
+        while (mag->count > MAGAZINE_SIZE / 2)
+        {
+            mag->count -= 1;
+            slab_free(type, cache, mag->objs[mag->count]);
+        }
+    }
+
+    mag->objs[mag->count] = obj;
+    mag->count += 1;
+    assert(kmem_live_count[type] > 0);
+    kmem_live_count[type] -= 1;
+}
+
+void print_kmem_stats()
+{
+    for (int i = 0; i < KMEM_NUM_CACHES; ++ i)
+    {
+        kmem_cache_t *cache = get_cache(i);
+        printf("%s: %lu bytes, %d objects per slab\n",
+            cache->name, cache->size, cache->num);
+        printf("    live %lu, alloc %lu, magazine hit %lu, slabs %lu, host alloc %lu\n",
+            kmem_live_count[i], kmem_alloc_count[i], kmem_magazine_hit_count[i],
+            kmem_slab_count[i], kmem_host_alloc_count[i]);
+    }
+}
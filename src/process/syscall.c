@@ -17,8 +17,14 @@
 #include "headers/memory.h"
 #include "headers/interrupt.h"
 #include "headers/syscall.h"
+#include "headers/process.h"
 #include "headers/color.h"
 
+// from page fault
+int fix_kernel_pagefault(uint64_t vaddr, int access);
+// from fork
+void update_userframe_returnvalue(pcb_t *p, uint64_t retval);
+
 typedef void (*syscall_handler_t)();
 
 // the entry of syscall table
@@ -33,7 +39,9 @@ syscall_entry_t syscall_table[64];
 // handlers of syscalls
 static void write_handler();
 static void getpid_handler();
+static void spawn_handler();
 static void fork_handler();
+static void vfork_handler();
 static void execve_handler();
 static void exit_handler();
 static void wait_handler();
@@ -46,12 +54,143 @@ static void destory_user_registers()
     memset(&cpu_flags, 0, sizeof(cpu_flags));
 }
 
+/*  Kernel access to user memory
+    The user buffer is accessed page by page: one translation for each
+    page, and the bytes in the page are copied at once. The page fault
+    does not interrupt the kernel: MMU jumps to the fixup, the fault is
+    fixed as the one of user, and the translation is retried. As the
+    exception table of Linux. The illegal address stops the copy.
+ */
+
+uint64_t usercopy_translate_count = 0;
+
+// the faults of one translation, e.g. shared page table, then COW
+#define MAX_KERNEL_FAULTS   (2)
+
+// return value: the physical address, -1 if the address is illegal
+static int64_t translate_user(uint64_t vaddr, int access)
+{
+    jmp_buf fixup;
+    volatile int faults = 0;
+    if (setjmp(fixup) != 0)
+    {
+        mmu_fault_fixup = NULL;
+        faults += 1;
+        if (faults > MAX_KERNEL_FAULTS ||
+            fix_kernel_pagefault(mmu_vaddr_pagefault, access) == 0)
+        {
+            return -1;
+        }
+    }
+
+    mmu_fault_fixup = &fixup;
+    uint64_t paddr = va2pa(vaddr, access);
+    mmu_fault_fixup = NULL;
+
+    usercopy_translate_count += 1;
+    return paddr;
+}
+
+// the bytes left in the page of vaddr, at most n
+static uint64_t page_chunk(uint64_t vaddr, uint64_t n)
+{
+    uint64_t left = PAGE_SIZE - vaddr % PAGE_SIZE;
+    return left < n ? left : n;
+}
+
+// return value: the number of bytes not copied
+uint64_t copy_from_user(void *to, uint64_t from, uint64_t n)
+{
+    uint64_t done = 0;
+    while (done < n)
+    {
+        uint64_t chunk = page_chunk(from + done, n - done);
+        int64_t paddr = translate_user(from + done, MMU_READ);
+        if (paddr < 0)
+        {
+            break;
+        }
+        memcpy((uint8_t *)to + done, &pm[paddr], chunk);
+        done += chunk;
+    }
+    return n - done;
+}
+
+// return value: the number of bytes not copied
+uint64_t copy_to_user(uint64_t to, const void *from, uint64_t n)
+{
+    uint64_t done = 0;
+    while (done < n)
+    {
+        uint64_t chunk = page_chunk(to + done, n - done);
+        int64_t paddr = translate_user(to + done, MMU_WRITE);
+        if (paddr < 0)
+        {
+            break;
+        }
+        memcpy(&pm[paddr], (uint8_t *)from + done, chunk);
+        done += chunk;
+    }
+    return n - done;
+}
+
+// copy the string in user space to kernel, at most size - 1 chars
+// return value: the length of string, -1 if the address is illegal
+int64_t strncpy_from_user(char *dst, uint64_t src, uint64_t size)
+{
+    uint64_t len = 0;
+    while (len < size - 1)
+    {
+        uint64_t chunk = page_chunk(src + len, size - 1 - len);
+        int64_t paddr = translate_user(src + len, MMU_READ);
+        if (paddr < 0)
+        {
+            return -1;
+        }
+        for (uint64_t i = 0; i < chunk; ++ i)
+        {
+            dst[len] = pm[paddr + i];
+            if (dst[len] == '\0')
+            {
+                return len;
+            }
+            len += 1;
+        }
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+/*  The output of write goes to the sink, shared by all processes as
+    the terminal. It's flushed to host at new line, or when it is full.
+    So a line is printed once, not by the characters.
+ */
+#define OUTPUT_SINK_SIZE    (4096)
+
+static char output_sink[OUTPUT_SINK_SIZE];
+static uint64_t output_sink_size = 0;
+uint64_t output_flush_count = 0;
+
+void flush_output_sink()
+{
+    if (output_sink_size == 0)
+    {
+        return;
+    }
+    // print as yellow
+    printf(YELLOWSTR("%.*s"), (int)output_sink_size, output_sink);
+    output_sink_size = 0;
+    output_flush_count += 1;
+}
+
 // initialize of IDT
 void syscall_init()
 {
     syscall_table[01].handler = write_handler;
     syscall_table[39].handler = getpid_handler;
+    syscall_table[56].handler = spawn_handler;
     syscall_table[57].handler = fork_handler;
+    syscall_table[58].handler = vfork_handler;
     syscall_table[59].handler = execve_handler;
     syscall_table[60].handler = exit_handler;
     syscall_table[61].handler = wait_handler;
@@ -65,17 +204,55 @@ static void write_handler()
     uint64_t file_no = cpu_reg.rdi;
     uint64_t buf_vaddr = cpu_reg.rsi;
     uint64_t buf_length = cpu_reg.rdx;
+    uint64_t kernel_rsp = cpu_reg.rsp;
     // assembly end
 
     destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
 
     // The following resource are allocated on KERNEL STACK
-    // TODO: this works only with NAVIE VA2PA
-    for (int i = 0; i < buf_length; ++ i)
+    if (file_no != 1 && file_no != 2)
+    {
+        // stdout and stderr only
+        update_userframe_returnvalue(get_current_pcb(), -1);
+        return;
+    }
+
+    uint64_t written = 0;
+    int newline = 0;
+    while (written < buf_length)
     {
-        // print as yellow
-        printf(YELLOWSTR("%c"), pm[va2pa(buf_vaddr + i, 0)]);
+        if (output_sink_size == OUTPUT_SINK_SIZE)
+        {
+            flush_output_sink();
+        }
+
+        char *sink = &output_sink[output_sink_size];
+        uint64_t n = buf_length - written;
+        n = n < OUTPUT_SINK_SIZE - output_sink_size ? n : OUTPUT_SINK_SIZE - output_sink_size;
+        uint64_t copied = n - copy_from_user(sink, buf_vaddr + written, n);
+        newline |= memchr(sink, '\n', copied) != NULL;
+        output_sink_size += copied;
+        written += copied;
+        if (copied < n)
+        {
+            // bad address
+            break;
+        }
+    }
+
+    if (newline == 1)
+    {
+        flush_output_sink();
+    }
+
+    // the bytes before the bad address are written
+    if (written == 0 && buf_length > 0)
+    {
+        update_userframe_returnvalue(get_current_pcb(), -1);
+        return;
     }
+    update_userframe_returnvalue(get_current_pcb(), written);
 }
 
 static void getpid_handler()
@@ -90,24 +267,113 @@ static void fork_handler()
     syscall_fork();
 }
 
+static void vfork_handler()
+{
+    uint64_t kernel_rsp = cpu_reg.rsp;
+    destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
+
+    syscall_vfork();
+}
+
+static void spawn_handler()
+{
+    // assembly begin
+    uint64_t filename_vaddr = cpu_reg.rdi;
+    uint64_t kernel_rsp = cpu_reg.rsp;
+    // assembly end
+
+    // The following resource are allocated on KERNEL STACK
+    char filename[128];
+    int64_t len = strncpy_from_user(filename, filename_vaddr, sizeof(filename));
+
+    destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
+
+    if (len < 0)
+    {
+        update_userframe_returnvalue(get_current_pcb(), -1);
+        return;
+    }
+    syscall_spawn(filename);
+}
+
 static void execve_handler()
-{}
+{
+    // assembly begin
+    uint64_t filename_vaddr = cpu_reg.rdi;
+    uint64_t kernel_rsp = cpu_reg.rsp;
+    // assembly end
+
+    // The following resource are allocated on KERNEL STACK
+    // the old address space is gone after execve
+    char filename[128];
+    int64_t len = strncpy_from_user(filename, filename_vaddr, sizeof(filename));
+
+    destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
+
+    if (len < 0)
+    {
+        update_userframe_returnvalue(get_current_pcb(), -1);
+        return;
+    }
+    syscall_execve(filename);
+}
 
 static void exit_handler()
 {
     // assembly begin
     uint64_t exit_status = cpu_reg.rdi;
+    uint64_t kernel_rsp = cpu_reg.rsp;
     // assembly end
 
     // The following resource are allocated on KERNEL STACK
+    flush_output_sink();
     printf(REDSTR("Good Bye ~~~\n"));
+
+    destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
+
+    syscall_exit(exit_status);
 }
 
 static void wait_handler()
-{}
+{
+    // assembly begin
+    int64_t pid = cpu_reg.rdi;
+    uint64_t status_vaddr = cpu_reg.rsi;
+    uint64_t options = cpu_reg.rdx;
+    uint64_t kernel_rsp = cpu_reg.rsp;
+    // assembly end
+
+    destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
+
+    // The following resource are allocated on KERNEL STACK
+    // the status is int in user space
+    uint64_t status = 0;
+    if (syscall_wait(pid, options, &status) == 1 && status_vaddr != 0 &&
+        copy_to_user(status_vaddr, &status, sizeof(uint32_t)) != 0)
+    {
+        // the child is reaped, but its status is lost
+        update_userframe_returnvalue(get_current_pcb(), -1);
+    }
+}
 
 static void kill_handler()
-{}
+{
+    // assembly begin
+    uint64_t pid = cpu_reg.rdi;
+    uint64_t sig = cpu_reg.rsi;
+    uint64_t kernel_rsp = cpu_reg.rsp;
+    // assembly end
+
+    destory_user_registers();
+    cpu_reg.rsp = kernel_rsp;
+
+    syscall_kill(pid, sig);
+}
 
 void do_syscall(int syscall_no)
 {
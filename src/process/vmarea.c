@@ -19,18 +19,27 @@
 #include "headers/algorithm.h"
 #include "headers/address.h"
 
-int allocate_physicalframe(pte4_t *pte);
+int allocate_physicalframe(pte4_t *pte, uint64_t vaddr);
+int allocate_hugeframe(pte123_t *pte, int level);
+#ifdef USE_FORK_COW
+void unshare_pagetable(pte123_t *pte, int level);
+#endif
 
 // the implementation of VMA list interface
 static uint64_t construct_vma_node()
 {
-    vm_area_t *vma = KERNEL_malloc(sizeof(vm_area_t));
+    vm_area_t *vma = kmem_cache_alloc(KMEM_VMA);
     vma->filepath[0] = '\0';
     vma->next = vma;
     vma->prev = vma;
     vma->vma_start = 0;
     vma->vma_end = 0;
     vma->mode_value = 0;
+    vma->vma_pgoff = 0;
+    vma->rbt_color = COLOR_BLACK;
+    vma->rbt_parent = NULL;
+    vma->rbt_left = NULL;
+    vma->rbt_right = NULL;
 
     return (uint64_t)vma;
 }
@@ -38,7 +47,7 @@ static uint64_t construct_vma_node()
 static int destruct_vma_node(uint64_t vma_addr)
 {
     vm_area_t *vma = (vm_area_t *)vma_addr;
-    KERNEL_free(vma);
+    kmem_cache_free(KMEM_VMA, vma);
     return 0;
 }
 
@@ -125,12 +134,163 @@ static linkedlist_node_interface vma_interface = {
     .compare_nodes = compare_vma_nodes,
     .get_node_prev = get_prev_vma,
     .set_node_prev = set_prev_vma,
-    .get_node_next = get_prev_vma,
+    .get_node_next = get_next_vma,
     .set_node_next = set_next_vma,
     .get_node_value = get_vma_value,
     .set_node_value = set_vma_value
 };
 
+// the implementation of VMA tree interface
+// the node id is the address of the area, keyed by vma_start
+static int compare_vma_ids(uint64_t a, uint64_t b)
+{
+    return !(a == b);
+}
+
+static uint64_t get_vma_parent(uint64_t vma_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        return (uint64_t)vma->rbt_parent;
+    }
+
+    return NULL_ID;
+}
+
+static int set_vma_parent(uint64_t vma_addr, uint64_t parent_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        vma->rbt_parent = (vm_area_t *)parent_addr;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t get_vma_left(uint64_t vma_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        return (uint64_t)vma->rbt_left;
+    }
+
+    return NULL_ID;
+}
+
+static int set_vma_left(uint64_t vma_addr, uint64_t left_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        vma->rbt_left = (vm_area_t *)left_addr;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t get_vma_right(uint64_t vma_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        return (uint64_t)vma->rbt_right;
+    }
+
+    return NULL_ID;
+}
+
+static int set_vma_right(uint64_t vma_addr, uint64_t right_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        vma->rbt_right = (vm_area_t *)right_addr;
+        return 1;
+    }
+
+    return 0;
+}
+
+static rb_color_t get_vma_color(uint64_t vma_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        return (rb_color_t)vma->rbt_color;
+    }
+
+    // null nodes are black
+    return COLOR_BLACK;
+}
+
+static int set_vma_color(uint64_t vma_addr, rb_color_t color)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        vma->rbt_color = color;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint64_t get_vma_key(uint64_t vma_addr)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        return vma->vma_start;
+    }
+
+    return 0;
+}
+
+static int set_vma_key(uint64_t vma_addr, uint64_t key)
+{
+    vm_area_t *vma = (vm_area_t *)vma_addr;
+    if (vma != NULL)
+    {
+        vma->vma_start = key;
+        return 1;
+    }
+
+    return 0;
+}
+
+// fill in the interface
+static rbtree_node_interface vma_rbt_interface = {
+    .construct_node = construct_vma_node,
+    .destruct_node = destruct_vma_node,
+    .is_null_node = is_null_vma_node,
+    .compare_nodes = compare_vma_ids,
+    .get_parent = get_vma_parent,
+    .set_parent = set_vma_parent,
+    .get_leftchild = get_vma_left,
+    .set_leftchild = set_vma_left,
+    .get_rightchild = get_vma_right,
+    .set_rightchild = set_vma_right,
+    .get_color = get_vma_color,
+    .set_color = set_vma_color,
+    .get_key = get_vma_key,
+    .set_key = set_vma_key,
+    .get_value = get_vma_value,
+    .set_value = set_vma_value
+};
+
+static int vmatree_update_root(rbtree_internal_t *this, uint64_t new_root)
+{
+    assert(this != NULL);
+
+    this->root = new_root;
+    return 1;
+}
+
 static int vmalist_update_head(linkedlist_internal_t *this, uint64_t new_head)
 {
     assert(this != NULL);
@@ -147,10 +307,12 @@ static int can_vmas_merge(vm_area_t *prev, vm_area_t *next)
 {
     assert(prev != NULL && next != NULL);
     assert(prev->vma_start < next->vma_start);
-    assert(prev->vma_end < next->vma_start);
+    assert(prev->vma_end <= next->vma_start);
     return strcmp(prev->filepath, next->filepath) == 0 &&
         prev->mode_value == next->mode_value &&
-        prev->vma_end == next->vma_start;
+        prev->vma_end == next->vma_start &&
+        (prev->vma_mode.file == 0 ||
+        prev->vma_pgoff + (prev->vma_end - prev->vma_start) / PAGE_SIZE == next->vma_pgoff);
 }
 
 static void check_vm_areas(pcb_t *proc)
@@ -186,7 +348,6 @@ static void check_vm_areas(pcb_t *proc)
 }
 
 // exposed interface
-// TODO: bad implementation. Maybe refactor it later.
 int vma_add_area(pcb_t *proc, vm_area_t *area)
 {
     assert(proc != NULL);
@@ -200,90 +361,99 @@ int vma_add_area(pcb_t *proc, vm_area_t *area)
     
     // need to insert the node in sequence
     proc->mm.vma.update_head = vmalist_update_head;
+    proc->mm.vma_tree.update_root = vmatree_update_root;
 
     if (proc->mm.vma.count == 0)
     {
+        proc->mm.vma_tree.root = NULL_ID;
+        proc->mm.vma_cache = NULL;
         linkedlist_internal_insert(&(proc->mm.vma),
             &vma_interface, (uint64_t)area);
+        rbt_internal_insert(&(proc->mm.vma_tree),
+            &vma_rbt_interface, (uint64_t)area);
         return 1;
     }
-    else
-    {
-        // search the node and insert behind
-        vm_area_t *head = (vm_area_t *)proc->mm.vma.head;
-        assert(area->vma_start != head->vma_start);
-            
-        // search for the correct vma
-        vm_area_t *p = head;
-        int count = proc->mm.vma.count;
-
-        // note that vma should be SORTED
-        for (int i = 0; i < count; ++ i)
-        {
-            if (area->vma_start < p->vma_start)
-            {
-                // check if vma and a can merge
-                if (can_vmas_merge(area, p) == 1)
-                {
-                    // we just enlarge a to vma
-                    // [vma], [a]
-                    // [a-------]
-                    p->vma_start = area->vma_start;
-                    return 1;
-                }
-                else
-                {
-                    // insert a new vma node
-                    linkedlist_internal_insert_before(&(proc->mm.vma),
-                        &vma_interface, (uint64_t)p, (uint64_t)area);
-                    return 1;
-                }
-            }
 
-            p = p->next;
-        }
+    // the first area starting after the new one
+    vm_area_t *p = (vm_area_t *)bst_internal_find_succ(&(proc->mm.vma_tree),
+        &vma_rbt_interface, area->vma_start);
+
+    if (p != NULL)
+    {
+        assert(area->vma_start != p->vma_start);
 
-        // list.end.start < vma.start
-        if (can_vmas_merge(p, area) == 1)
+        // check if vma and a can merge
+        if (can_vmas_merge(area, p) == 1)
         {
-            p->vma_end = area->vma_end;
+            // we just enlarge a to vma, the order in tree is kept
+            // [vma], [a]
+            // [a-------]
+            p->vma_start = area->vma_start;
+            p->vma_pgoff = area->vma_pgoff;
             return 1;
         }
         else
         {
-            linkedlist_internal_insert_after(&(proc->mm.vma),
+            // insert a new vma node
+            linkedlist_internal_insert_before(&(proc->mm.vma),
                 &vma_interface, (uint64_t)p, (uint64_t)area);
+            rbt_internal_insert(&(proc->mm.vma_tree),
+                &vma_rbt_interface, (uint64_t)area);
             return 1;
         }
     }
 
+    // list.end.start < vma.start
+    p = ((vm_area_t *)proc->mm.vma.head)->prev;
+    if (can_vmas_merge(p, area) == 1)
+    {
+        p->vma_end = area->vma_end;
+        return 1;
+    }
+    else
+    {
+        linkedlist_internal_insert_after(&(proc->mm.vma),
+            &vma_interface, (uint64_t)p, (uint64_t)area);
+        rbt_internal_insert(&(proc->mm.vma_tree),
+            &vma_rbt_interface, (uint64_t)area);
+        return 1;
+    }
+
     return 0;
 }
 
-static pte4_t *create_pagetable(pte123_t *pt, uint64_t *vpns, int level)
+// return the entry at leaf level: 4 for PT, 3 for 2MB leaf in PMD, 2 for 1GB leaf in PUD
+static pte123_t *create_pagetable(pte123_t *pt, uint64_t *vpns, int level, int leaf)
 {
     assert(pt != NULL);
 
-    if (level == 4)
+    if (level == leaf)
     {
-        pte4_t *pte4 = (pte4_t *)(&pt[vpns[3]]);
-        return pte4;
+        return &pt[vpns[level - 1]];
     }
 
     pte123_t *pte = &(pt[vpns[level - 1]]);
     if (pte->present == 1)
     {
+#ifdef USE_FORK_COW
+        if (pte->readonly == 1)
+        {
+            // the table shared by fork is to be changed
+            unshare_pagetable(pte, level);
+        }
+#endif
         // hit, no need to malloc for next level page
         uint64_t pt_next = pte->paddr;
         pte->paddr = (uint64_t)pt_next;
-        return create_pagetable((pte123_t *)pt_next, vpns, level + 1);
+        return create_pagetable((pte123_t *)pt_next, vpns, level + 1, leaf);
     }
     else
     {
-        pte123_t *newpt_next = KERNEL_malloc(PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+        pte123_t *newpt_next = kmem_cache_alloc(KMEM_PAGETABLE);
+        memset(newpt_next, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
         pte->present = 1;
         pte->paddr = (uint64_t)newpt_next;
-        return create_pagetable(newpt_next, vpns, level + 1);
+        return create_pagetable(newpt_next, vpns, level + 1, leaf);
     }
 
     return NULL;
@@ -305,7 +475,8 @@ void setup_pagetable_from_vma(pcb_t *proc)
 
     if (proc->mm.pgd == NULL)
     {
-        proc->mm.pgd = KERNEL_malloc(PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+        proc->mm.pgd = kmem_cache_alloc(KMEM_PAGETABLE);
+        memset(proc->mm.pgd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
     }
 
     vm_area_t *a = (vm_area_t *)(proc->mm.vma.head);
@@ -313,20 +484,42 @@ void setup_pagetable_from_vma(pcb_t *proc)
     {
         uint64_t readonly = (a->vma_mode.read == 1) && (a->vma_mode.write == 0);
 
-        uint64_t page_num = (a->vma_end - a->vma_start) / PAGE_SIZE;
-
-        for (int j = 0; j < page_num; ++ j)
+        uint64_t vpn1234 = a->vma_start;
+        while (vpn1234 < a->vma_end)
         {
-            uint64_t vpn1234 = a->vma_start + j * PAGE_SIZE;
             assert((vpn1234 % PAGE_SIZE) == 0);
 
             address_t vaddr = {.address_value = vpn1234};
             uint64_t vpns[4] = {vaddr.vpn1, vaddr.vpn2, vaddr.vpn3, vaddr.vpn4};
 
-            pte4_t *pte4 = create_pagetable(proc->mm.pgd, vpns, 1);
-            pte4->present = 1;
-            pte4->readonly = readonly;
-            allocate_physicalframe(pte4);
+            // the aligned parts of a large area are mapped by huge pages
+            // 1GB first, then 2MB, if contiguous frames can be found
+            int mapped = 0;
+            for (int level = 2; level <= 3 && mapped == 0; ++ level)
+            {
+                uint64_t size = (uint64_t)PAGE_SIZE << ((4 - level) * VIRTUAL_PAGE_NUMBER_LENGTH);
+                if ((vpn1234 % size) != 0 || vpn1234 + size > a->vma_end)
+                {
+                    continue;
+                }
+
+                pte123_t *pte = create_pagetable(proc->mm.pgd, vpns, 1, level);
+                if (pte->present == 0 && allocate_hugeframe(pte, level) == 1)
+                {
+                    pte->readonly = readonly;
+                    vpn1234 += size;
+                    mapped = 1;
+                }
+            }
+
+            if (mapped == 0)
+            {
+                pte4_t *pte4 = (pte4_t *)create_pagetable(proc->mm.pgd, vpns, 1, 4);
+                pte4->present = 1;
+                pte4->readonly = readonly;
+                allocate_physicalframe(pte4, vpn1234);
+                vpn1234 += PAGE_SIZE;
+            }
         }
 
         // move to next area
@@ -334,19 +527,62 @@ void setup_pagetable_from_vma(pcb_t *proc)
     }
 }
 
-// Actually, this function should be implemented by Red-Black Tree
+uint64_t vma_cache_hit_count = 0;
+
+// the areas do not overlap, so the area containing vaddr
+// is the one with the largest vma_start <= vaddr
 vm_area_t *search_vma_vaddr(pcb_t *p, uint64_t vaddr)
 {
     assert(p != NULL);
 
-    vm_area_t *a = (vm_area_t *)(p->mm.vma.head);
-    for (size_t i = 0; i < p->mm.vma.count; i++)
+    // the faults of a process usually hit the same area
+    vm_area_t *a = p->mm.vma_cache;
+    if (a != NULL && a->vma_start <= vaddr && vaddr < a->vma_end)
     {
-        if (a->vma_start <= vaddr && vaddr < a->vma_end)
+        vma_cache_hit_count += 1;
+        return a;
+    }
+
+    if (p->mm.vma.count == 0)
+    {
+        return NULL;
+    }
+
+    a = (vm_area_t *)p->mm.vma_tree.root;
+    while (a != NULL)
+    {
+        if (vaddr < a->vma_start)
+        {
+            a = a->rbt_left;
+        }
+        else if (vaddr < a->vma_end)
         {
+            p->mm.vma_cache = a;
             return a;
         }
-        a = a->next;
+        else
+        {
+            a = a->rbt_right;
+        }
     }
     return NULL;
-}
\ No newline at end of file
+}
+
+// all the areas are dropped with the address space, e.g. by execve
+void vma_free_all(pcb_t *proc)
+{
+    assert(proc != NULL);
+
+    vm_area_t *a = (vm_area_t *)proc->mm.vma.head;
+    for (int i = 0; i < proc->mm.vma.count; ++ i)
+    {
+        vm_area_t *next = a->next;
+        destruct_vma_node((uint64_t)a);
+        a = next;
+    }
+
+    proc->mm.vma.head = 0;
+    proc->mm.vma.count = 0;
+    proc->mm.vma_tree.root = NULL_ID;
+    proc->mm.vma_cache = NULL;
+}
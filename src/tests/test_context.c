@@ -43,7 +43,7 @@ static void load_code_physically(int pid, address_t *code_addr)
         "movq %rsp, %rsi",          // 4: 0x00400100
         "movq $13, %rdx",           // 5
         "int $0x80",                // 6: 0x00400180
-        "jmp 0x00400100"            // 7: jump to 4
+        "jmp 0x00400080"            // 7: jump to 2
     };
     // the correct execution is:
     // 000, 040, 080, 0c0, [100, 140, 180, 1c0], [100, 140, 180, 1c0], [100, 140, 180, 1c0], ...
@@ -60,6 +60,10 @@ static void link_page_table(pte123_t *pgd, pte123_t *pud, pte123_t *pmd, pte4_t
     int vpn3 = vaddr->vpn3;
     int vpn4 = vaddr->vpn4;
 
+    memset(pud, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+    memset(pmd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+    memset(pt, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte4_t));
+
     (&(pgd[vpn1]))->paddr = (uint64_t)&pud[0];
     (&(pgd[vpn1]))->present = 1;
 
@@ -88,6 +92,9 @@ static void TestContextSwitching()
 
     // prepare 3 processes as circular doubly linked list
     pcb_t p1, p2, p3;
+    memset(&p1, 0, sizeof(pcb_t));
+    memset(&p2, 0, sizeof(pcb_t));
+    memset(&p3, 0, sizeof(pcb_t));
     p1.next = &p2;
     p2.next = &p3;
     p3.next = &p1;
@@ -105,6 +112,9 @@ static void TestContextSwitching()
     pte123_t p1_pgd[512];
     pte123_t p2_pgd[512];
     pte123_t p3_pgd[512];
+    memset(p1_pgd, 0, sizeof(p1_pgd));
+    memset(p2_pgd, 0, sizeof(p2_pgd));
+    memset(p3_pgd, 0, sizeof(p3_pgd));
     p1.mm.pgd = &p1_pgd[0];
     p2.mm.pgd = &p2_pgd[0];
     p3.mm.pgd = &p3_pgd[0];
@@ -0,0 +1,214 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/memory.h"
+#include "headers/color.h"
+
+// dramctrl.c
+extern int dram_page_policy;
+extern int dram_address_mapping;
+
+// default timings of dramctrl.c
+#define tCAS    (15)
+#define tRCD    (15)
+#define tRP     (15)
+#define tBURST  (4)
+#define MAX_BYPASS  (16)
+
+static uint64_t complete(int id)
+{
+    uint64_t cycle = dram_ctrl_complete(id);
+    dram_ctrl_release(id);
+    return cycle;
+}
+
+static void TestAddressMapping()
+{
+    printf("Testing DRAM address mapping ...\n");
+
+    int channel, bank;
+    uint64_t row, column;
+
+    dram_address_mapping = DRAM_MAP_ROW_BANK_COLUMN;
+
+    // 2KiB row buffer: 32 lines of 64 bytes, then the next bank
+    dram_ctrl_map(0x0040, &channel, &bank, &row, &column);
+    assert(channel == 0 && bank == 0 && row == 0 && column == 1);
+    dram_ctrl_map(0x0800, &channel, &bank, &row, &column);
+    assert(channel == 0 && bank == 1 && row == 0 && column == 0);
+    dram_ctrl_map(0x4840, &channel, &bank, &row, &column);
+    assert(channel == 0 && bank == 1 && row == 1 && column == 1);
+
+    dram_address_mapping = DRAM_MAP_ROW_COLUMN_BANK;
+
+    // consecutive lines go to different banks
+    dram_ctrl_map(0x0040, &channel, &bank, &row, &column);
+    assert(channel == 0 && bank == 1 && row == 0 && column == 0);
+    dram_ctrl_map(0x0200, &channel, &bank, &row, &column);
+    assert(channel == 0 && bank == 0 && row == 0 && column == 1);
+
+    dram_address_mapping = DRAM_MAP_ROW_BANK_COLUMN;
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestRowBuffer()
+{
+    printf("Testing row buffer hit, miss and conflict ...\n");
+
+    dram_ctrl_reset();
+    dram_page_policy = DRAM_OPEN_PAGE;
+
+    // miss: activate the row
+    int a = dram_ctrl_request(0x0000, 0, 0);
+    dram_ctrl_run(UINT64_MAX);
+    assert(complete(a) == tRCD + tCAS + tBURST);
+
+    // hit: the row is open
+    int b = dram_ctrl_request(0x0040, 0, 100);
+    dram_ctrl_run(UINT64_MAX);
+    assert(complete(b) == 100 + tCAS + tBURST);
+
+    // conflict: another row of the same bank
+    int c = dram_ctrl_request(0x4000, 1, 200);
+    dram_ctrl_run(UINT64_MAX);
+    assert(complete(c) == 200 + tRP + tRCD + tCAS + tBURST);
+
+    // closed page: every access activates the row
+    dram_ctrl_reset();
+    dram_page_policy = DRAM_CLOSED_PAGE;
+
+    a = dram_ctrl_request(0x0000, 0, 0);
+    dram_ctrl_run(UINT64_MAX);
+    assert(complete(a) == tRCD + tCAS + tBURST);
+
+    b = dram_ctrl_request(0x0040, 0, 100);
+    dram_ctrl_run(UINT64_MAX);
+    assert(complete(b) == 100 + tRCD + tCAS + tBURST);
+
+    c = dram_ctrl_request(0x4000, 0, 200);
+    dram_ctrl_run(UINT64_MAX);
+    assert(complete(c) == 200 + tRCD + tCAS + tBURST);
+
+    dram_page_policy = DRAM_OPEN_PAGE;
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSchedule()
+{
+    printf("Testing FR-FCFS scheduling ...\n");
+
+    // open page: while bank 0 is busy, a conflict arrives before a row hit
+    // the row hit is served first
+    dram_ctrl_reset();
+    dram_page_policy = DRAM_OPEN_PAGE;
+
+    int a = dram_ctrl_request(0x0000, 0, 0);
+    int b = dram_ctrl_request(0x4000, 0, 1);
+    int c = dram_ctrl_request(0x0080, 0, 2);
+
+    // requests are not scheduled before their commands start
+    dram_ctrl_run(0);
+    assert(dram_ctrl_complete(a) != 0);
+    assert(dram_ctrl_complete(b) == 0);
+    assert(dram_ctrl_complete(c) == 0);
+
+    dram_ctrl_run(UINT64_MAX);
+    uint64_t ta = complete(a), tb = complete(b), tc = complete(c);
+    assert(ta < tc && tc < tb);
+    // the row hit is pipelined right after the first burst
+    assert(tc == ta + tBURST);
+
+    // closed page: no row hit, first come first served
+    dram_ctrl_reset();
+    dram_page_policy = DRAM_CLOSED_PAGE;
+
+    a = dram_ctrl_request(0x0000, 0, 0);
+    b = dram_ctrl_request(0x4000, 0, 1);
+    c = dram_ctrl_request(0x0080, 0, 2);
+    dram_ctrl_run(UINT64_MAX);
+    ta = complete(a), tb = complete(b), tc = complete(c);
+    assert(ta < tb && tb < tc);
+
+    // bank parallelism: different banks only share the data bus
+    dram_ctrl_reset();
+    dram_page_policy = DRAM_OPEN_PAGE;
+
+    a = dram_ctrl_request(0x0000, 0, 0);
+    b = dram_ctrl_request(0x0800, 0, 0);
+    dram_ctrl_run(UINT64_MAX);
+    ta = complete(a), tb = complete(b);
+    assert(tb == ta + tBURST);
+
+    print_dram_stats();
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestRowHitStream()
+{
+    printf("Testing row hit pipeline and starvation ...\n");
+
+    dram_ctrl_reset();
+    dram_page_policy = DRAM_OPEN_PAGE;
+
+    // back-to-back hits to the open row: one burst each
+    int ids[32];
+    for (int i = 0; i < 32; ++ i)
+    {
+        ids[i] = dram_ctrl_request(i * 0x40, 0, 0);
+    }
+    dram_ctrl_run(UINT64_MAX);
+    uint64_t first = complete(ids[0]);
+    assert(first == tRCD + tCAS + tBURST);
+    for (int i = 1; i < 32; ++ i)
+    {
+        assert(complete(ids[i]) == first + i * tBURST);
+    }
+
+    // a row conflict is not starved by a stream of younger row hits
+    dram_ctrl_reset();
+    int a = dram_ctrl_request(0x0000, 0, 0);
+    int b = dram_ctrl_request(0x4000, 0, 1);
+    int hits[40];
+    for (int i = 0; i < 40; ++ i)
+    {
+        hits[i] = dram_ctrl_request((i % 31 + 1) * 0x40, 0, 2 + i);
+    }
+    dram_ctrl_run(UINT64_MAX);
+    complete(a);
+    uint64_t tb = complete(b);
+
+    // the hits go first, but at most MAX_BYPASS of them
+    int before = 0;
+    for (int i = 0; i < 40; ++ i)
+    {
+        if (complete(hits[i]) < tb)
+        {
+            before ++;
+        }
+    }
+    assert(0 < before && before <= MAX_BYPASS);
+
+    print_dram_stats();
+    printf(GREENSTR("Pass\n"));
+}
+
+int main()
+{
+    TestAddressMapping();
+    TestRowBuffer();
+    TestSchedule();
+    TestRowHitStream();
+    return 0;
+}
@@ -20,16 +20,33 @@
 #include "headers/instruction.h"
 #include "headers/interrupt.h"
 #include "headers/process.h"
+#include "headers/syscall.h"
 #include "headers/color.h"
 
 void map_pte4(pte4_t *pte, uint64_t ppn);
 void unmapall_pte4(uint64_t ppn);
 void page_map_init();
-void pagemap_dirty(uint64_t ppn);
-void pagemap_update_time(uint64_t ppn);
 void set_pagemap_swapaddr(uint64_t ppn, uint64_t swap_address);
 uint64_t allocate_swappage(uint64_t ppn);
 pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate);
+void fix_pagefault();
+void physical_memory_init(uint64_t size);
+int enough_frames(int request_num);
+
+vm_area_t *search_vma_vaddr(pcb_t *p, uint64_t vaddr);
+
+// vmarea.c
+extern uint64_t vma_cache_hit_count;
+// fork.c
+extern uint64_t pagetable_copy_count;
+// pagefault.c
+extern uint64_t demand_fault_count;
+extern uint64_t pagecache_hit_count;
+extern uint64_t pagecache_miss_count;
+// syscall.c
+extern uint64_t usercopy_translate_count;
+extern uint64_t output_flush_count;
+void unmap_pte4(pte4_t *pte);
 
 static void link_page_table(pte123_t *pgd, pte123_t *pud, pte123_t *pmd, pte4_t *pt,
     int ppn, address_t *vaddr)
@@ -67,17 +84,17 @@ static void TestFork_naive()
     page_map_init();
 
     // pcb is needed to trigger page fault
-    pcb_t p1;
-    memset(&p1, 0, sizeof(pcb_t));
-    p1.pid = 1;
+    pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+    memset(p1, 0, sizeof(pcb_t));
+    p1->pid = 1;
     // the next switched process would still be p1
-    p1.next = &p1;
-    p1.prev = &p1;
+    p1->next = p1;
+    p1->prev = p1;
 
     // prepare PGD
     pte123_t p1_pgd[512];
     memset(&p1_pgd, 0, sizeof(pte123_t) * 512);
-    p1.mm.pgd = &p1_pgd[0];
+    p1->mm.pgd = &p1_pgd[0];
 
     // prepare code page tables
     pte123_t p1_pud[512];
@@ -134,15 +151,15 @@ static void TestFork_naive()
         &code, sizeof(char) * 22 * MAX_INSTRUCTION_CHAR);
 
     // create kernel stacks for trap into kernel
-    kstack_t *stack_buf = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    kstack_t *stack_buf = kmem_cache_alloc(KMEM_KSTACK);
     uint64_t p1_stack_bottom = (uint64_t)stack_buf;
-    p1.kstack = stack_buf;
-    p1.kstack->threadinfo.pcb = &p1;
+    p1->kstack = stack_buf;
+    p1->kstack->threadinfo.pcb = p1;
 
     // run p1
     tr_global_tss.ESP0 = p1_stack_bottom + KERNEL_STACK_SIZE;
 
-    cpu_controls.cr3 = p1.mm.pgd_paddr;
+    cpu_controls.cr3 = p1->mm.pgd_paddr;
     idt_init();
     syscall_init();
 
@@ -157,6 +174,38 @@ static void TestFork_naive()
 #endif
 
 #ifdef USE_FORK_COW
+// readonly in any level of the path
+static int is_writeprotected(pte123_t *pgd, address_t *vaddr)
+{
+    int vpns[4] = {vaddr->vpn1, vaddr->vpn2, vaddr->vpn3, vaddr->vpn4};
+    pte123_t *tab = pgd;
+    for (int level = 0; level < 4; ++ level)
+    {
+        pte123_t *pte = &tab[vpns[level]];
+        assert(pte->present == 1);
+        if (pte->readonly == 1)
+        {
+            return 1;
+        }
+        tab = (pte123_t *)(uint64_t)pte->paddr;
+    }
+    return 0;
+}
+
+static void add_vma(pcb_t *p, uint64_t start, uint64_t end, int write, const char *filepath)
+{
+    vm_area_t *a = kmem_cache_alloc(KMEM_VMA);
+    memset(a, 0, sizeof(vm_area_t));
+    a->vma_start = start;
+    a->vma_end = end;
+    a->vma_mode.read = 1;
+    a->vma_mode.write = write;
+    a->vma_mode.execute = 1 - write;
+    a->vma_mode.private = 1;
+    strcpy(a->filepath, filepath);
+    vma_add_area(p, a);
+}
+
 static void TestFork_cow()
 {
     printf("================\nTesting fork <Copy On Write> ...\n");
@@ -169,41 +218,20 @@ static void TestFork_cow()
     page_map_init();
 
     // pcb is needed to trigger page fault
-    pcb_t p1;
-    memset(&p1, 0, sizeof(pcb_t));
-    p1.pid = 1;
+    pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+    memset(p1, 0, sizeof(pcb_t));
+    p1->pid = 1;
     // the next switched process would still be p1
-    p1.next = &p1;
-    p1.prev = &p1;
+    p1->next = p1;
+    p1->prev = p1;
 
     // prepare vm areas instead of page tables
     // The memory loading should build the page tables from the vm areas
-    vm_area_t vmas [2] = {
-        // vm area for .text section
-        {
-            .vma_start = 0x00400000,
-            .vma_end = 0x00401000,
-            .vma_mode.read = 1,
-            .vma_mode.write = 0,
-            .vma_mode.execute = 1,
-            .vma_mode.private = 1,
-            .filepath = "~/fork"
-        },
-        // vm area for stack
-        {
-            .vma_start = ((cpu_reg.rsp) >> 12) << 12,
-            .vma_end = (((cpu_reg.rsp) >> 12) + 1) << 12,
-            .vma_mode.read = 1,
-            .vma_mode.write = 1,
-            .vma_mode.execute = 0,
-            .vma_mode.private = 1,
-            .filepath = "[stack]"
-        },
-    };
-
-    vma_add_area(&p1, &vmas[0]);
-    vma_add_area(&p1, &vmas[1]);
-    setup_pagetable_from_vma(&p1);
+    // vm area for .text section
+    add_vma(p1, 0x00400000, 0x00401000, 0, "~/fork");
+    // vm area for stack
+    add_vma(p1, ((cpu_reg.rsp) >> 12) << 12, (((cpu_reg.rsp) >> 12) + 1) << 12, 1, "[stack]");
+    setup_pagetable_from_vma(p1);
 
     // load code to frame 0
     char code[22][MAX_INSTRUCTION_CHAR] = {
@@ -238,21 +266,21 @@ static void TestFork_cow()
         "jmp    $0x00400400",
     };
 
-    uint64_t code_ppn = (uint64_t)(((pte4_t *)get_pagetableentry(p1.mm.pgd, &code_addr, 4, 0))->ppn);
+    uint64_t code_ppn = (uint64_t)(((pte4_t *)get_pagetableentry(p1->mm.pgd, &code_addr, 4, 0))->ppn);
     memcpy(
         (char *)(&pm[code_ppn]),
         &code, sizeof(char) * 22 * MAX_INSTRUCTION_CHAR);
 
     // create kernel stacks for trap into kernel
-    kstack_t *stack_buf = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    kstack_t *stack_buf = kmem_cache_alloc(KMEM_KSTACK);
     uint64_t p1_stack_bottom = (uint64_t)stack_buf;
-    p1.kstack = stack_buf;
-    p1.kstack->threadinfo.pcb = &p1;
+    p1->kstack = stack_buf;
+    p1->kstack->threadinfo.pcb = p1;
 
     // run p1
     tr_global_tss.ESP0 = p1_stack_bottom + KERNEL_STACK_SIZE;
 
-    cpu_controls.cr3 = p1.mm.pgd_paddr;
+    cpu_controls.cr3 = p1->mm.pgd_paddr;
     idt_init();
     syscall_init();
 
@@ -264,6 +292,1088 @@ static void TestFork_cow()
 
     printf(GREENSTR("Pass\n"));
 }
+
+static void TestFork_prefork()
+{
+    printf("================\nTesting fork <Pre-fork server> ...\n");
+
+    cpu_reg.rsp = 0x7ffffffee0f0;
+    cpu_pc.rip = 0x00400000;
+    address_t code_addr = {.address_value = cpu_pc.rip};
+    address_t stack_addr = {.address_value = cpu_reg.rsp};
+
+    page_map_init();
+
+    pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+    memset(p1, 0, sizeof(pcb_t));
+    p1->pid = 1;
+    p1->next = p1;
+    p1->prev = p1;
+
+    add_vma(p1, 0x00400000, 0x00401000, 0, "~/prefork");
+    add_vma(p1, ((cpu_reg.rsp) >> 12) << 12, (((cpu_reg.rsp) >> 12) + 1) << 12, 1, "[stack]");
+    setup_pagetable_from_vma(p1);
+
+    // the parent forks 64 children, then writes the stack
+    // shared by all of them
+    char code[15][MAX_INSTRUCTION_CHAR] = {
+        "mov    $0x40, %rbx",       // 0x00400000
+        // LOOP: fork
+        "mov    $0x39, %rax",       // 0x00400040
+        "int    $0x80",
+        "cmpq   $0x0, %rax",
+        "jne    $0x00400200",
+        // child LOOP: getpid
+        "movq   $0x27, %rax",       // 0x00400140
+        "int    $0x80",
+        "jmp    $0x00400140",
+        // parent
+        "sub    $0x1, %rbx",        // 0x00400200
+        "cmpq   $0x0, %rbx",
+        "jne    $0x00400040",
+        "pushq  %rbx",              // 0x004002c0
+        // parent LOOP: getpid
+        "movq   $0x27, %rax",       // 0x00400300
+        "int    $0x80",
+        "jmp    $0x00400300",
+    };
+
+    pte4_t *code_pte = (pte4_t *)get_pagetableentry(p1->mm.pgd, &code_addr, 4, 0);
+    memcpy(
+        (char *)(&pm[(uint64_t)code_pte->ppn << PHYSICAL_PAGE_OFFSET_LENGTH]),
+        &code, sizeof(code));
+
+    pte4_t *stack_pte = (pte4_t *)get_pagetableentry(p1->mm.pgd, &stack_addr, 4, 0);
+    uint64_t stack_ppn = stack_pte->ppn;
+
+    kstack_t *stack_buf = kmem_cache_alloc(KMEM_KSTACK);
+    p1->kstack = stack_buf;
+    p1->kstack->threadinfo.pcb = p1;
+
+    tr_global_tss.ESP0 = (uint64_t)stack_buf + KERNEL_STACK_SIZE;
+    cpu_controls.cr3 = p1->mm.pgd_paddr;
+    idt_init();
+    syscall_init();
+
+    // till the parent writes its stack
+    // the parent copies the page tables shared with the children
+    int cycles = 0;
+    while (stack_pte->ppn == stack_ppn)
+    {
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 100000);
+        stack_pte = (pte4_t *)get_pagetableentry(p1->mm.pgd, &stack_addr, 4, 0);
+    }
+
+    int num = 0;
+    for (pcb_t *p = p1->next; p != p1; p = p->next)
+    {
+        // the children share the old stack frame
+        pte4_t *pte = (pte4_t *)get_pagetableentry(p->mm.pgd, &stack_addr, 4, 0);
+        assert(pte->present == 1 && is_writeprotected(p->mm.pgd, &stack_addr) == 1);
+        assert(pte->ppn == stack_ppn);
+        num += 1;
+    }
+    assert(num == 0x40);
+    assert(is_writeprotected(p1->mm.pgd, &stack_addr) == 0);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+// the write fault of the current process
+static void write_fault(pcb_t *p, uint64_t vaddr)
+{
+    cpu_reg.rsp = (uint64_t)p->kstack + KERNEL_STACK_SIZE
+        - sizeof(trapframe_t) - sizeof(userframe_t);
+    mmu_vaddr_pagefault = vaddr;
+    fix_pagefault();
+}
+
+static uint64_t get_ppn(pcb_t *p, uint64_t vaddr_value)
+{
+    address_t vaddr = {.address_value = vaddr_value};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p->mm.pgd, &vaddr, 4, 0);
+    assert(pte != NULL && pte->present == 1);
+    return pte->ppn;
+}
+
+static void TestSharedPagetable()
+{
+    printf("================\nTesting fork <Shared page tables> ...\n");
+
+    physical_memory_init(1 << 23);
+
+    // the largest area crosses the 1GB boundary, but no 2MB page in it
+    uint64_t data_start = 0x3ff81000;
+    int sizes[3] = {16, 128, 600};
+    for (int k = 0; k < 3; ++ k)
+    {
+        page_map_init();
+
+        pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+        memset(p1, 0, sizeof(pcb_t));
+        p1->pid = 1;
+        p1->next = p1;
+        p1->prev = p1;
+        p1->mm.pgd = kmem_cache_alloc(KMEM_PAGETABLE);
+        memset(p1->mm.pgd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+
+        vm_area_t *data = kmem_cache_alloc(KMEM_VMA);
+        memset(data, 0, sizeof(vm_area_t));
+        data->vma_start = data_start;
+        data->vma_end = data_start + sizes[k] * PAGE_SIZE;
+        data->vma_mode.read = 1;
+        data->vma_mode.write = 1;
+        data->vma_mode.private = 1;
+        strcpy(data->filepath, "[heap]");
+        vma_add_area(p1, data);
+        setup_pagetable_from_vma(p1);
+
+        for (int i = 0; i < sizes[k]; ++ i)
+        {
+            uint64_t ppn = get_ppn(p1, data_start + i * PAGE_SIZE);
+            *(uint64_t *)&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH] = i;
+        }
+
+        p1->kstack = kmem_cache_alloc(KMEM_KSTACK);
+        p1->kstack->threadinfo.pcb = p1;
+
+        // fork copies PGD only, whatever the size is
+        uint64_t copies = pagetable_copy_count;
+        cpu_reg.rsp = (uint64_t)p1->kstack + KERNEL_STACK_SIZE
+            - sizeof(trapframe_t) - sizeof(userframe_t);
+        syscall_fork();
+        pcb_t *child = p1->next;
+        assert(child != p1);
+        printf("%4d pages: fork copies %lu page tables\n",
+            sizes[k], pagetable_copy_count - copies);
+        assert(pagetable_copy_count - copies == 1);
+
+        address_t vaddr = {.address_value = data_start};
+        assert(child->mm.pgd[vaddr.vpn1].paddr == p1->mm.pgd[vaddr.vpn1].paddr);
+        assert(is_writeprotected(p1->mm.pgd, &vaddr) == 1);
+        assert(is_writeprotected(child->mm.pgd, &vaddr) == 1);
+
+        // the parent writes the last page:
+        // PUD, PMD and PT on the path are copied
+        uint64_t last = data_start + (sizes[k] - 1) * PAGE_SIZE;
+        uint64_t old_ppn = get_ppn(p1, last);
+        copies = pagetable_copy_count;
+        write_fault(p1, last);
+        assert(pagetable_copy_count - copies == 3);
+        uint64_t new_ppn = get_ppn(p1, last);
+        assert(new_ppn != old_ppn);
+        assert(*(uint64_t *)&pm[new_ppn << PHYSICAL_PAGE_OFFSET_LENGTH] == sizes[k] - 1);
+        assert(get_ppn(child, last) == old_ppn);
+
+        // the other pages are still shared
+        for (int i = 0; i < sizes[k] - 1; ++ i)
+        {
+            assert(get_ppn(p1, data_start + i * PAGE_SIZE) ==
+                get_ppn(child, data_start + i * PAGE_SIZE));
+        }
+
+        // the child owns the old tables now: no copy of table or frame
+        copies = pagetable_copy_count;
+        write_fault(child, last);
+        assert(pagetable_copy_count == copies);
+        assert(get_ppn(child, last) == old_ppn);
+        address_t last_addr = {.address_value = last};
+        assert(is_writeprotected(child->mm.pgd, &last_addr) == 0);
+        assert(is_writeprotected(p1->mm.pgd, &last_addr) == 0);
+    }
+
+    physical_memory_init(DEFAULT_PHYSICAL_MEMORY_SPACE);
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestHugePageSplit()
+{
+    printf("================\nTesting fork <Huge page split> ...\n");
+
+    // one aligned 2MB run only, taken by the parent
+    physical_memory_init(3 * HUGE_PAGE_2M_SIZE - PAGE_SIZE);
+    page_map_init();
+
+    pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+    memset(p1, 0, sizeof(pcb_t));
+    p1->pid = 1;
+    p1->next = p1;
+    p1->prev = p1;
+    p1->mm.pgd = kmem_cache_alloc(KMEM_PAGETABLE);
+    memset(p1->mm.pgd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+
+    // the 4KB page takes frame 0 from the first run
+    add_vma(p1, 0x00100000, 0x00101000, 1, "[data]");
+    add_vma(p1, 0x00200000, 0x00400000, 1, "[heap]");
+    setup_pagetable_from_vma(p1);
+
+    address_t vaddr = {.address_value = 0x00200000};
+    pte123_t *leaf = get_pagetableentry(p1->mm.pgd, &vaddr, 4, 0);
+    assert(leaf->present == 1 && leaf->pagesize == 1);
+    uint64_t huge_ppn = ((pte4_t *)leaf)->ppn;
+    for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
+    {
+        *(uint64_t *)&pm[(huge_ppn + i) << PHYSICAL_PAGE_OFFSET_LENGTH] = i;
+    }
+
+    p1->kstack = kmem_cache_alloc(KMEM_KSTACK);
+    p1->kstack->threadinfo.pcb = p1;
+    cpu_reg.rsp = (uint64_t)p1->kstack + KERNEL_STACK_SIZE
+        - sizeof(trapframe_t) - sizeof(userframe_t);
+    syscall_fork();
+    pcb_t *child = p1->next;
+    assert(child != p1);
+
+    // unsharing the PMD copies the huge page: no aligned free frames,
+    // the parent gets 4KB pages instead
+    write_fault(p1, 0x00200000 + 5 * PAGE_SIZE);
+    for (int i = 0; i < PAGE_TABLE_ENTRY_NUM; ++ i)
+    {
+        vaddr.address_value = 0x00200000 + i * PAGE_SIZE;
+        pte4_t *pte = (pte4_t *)get_pagetableentry(p1->mm.pgd, &vaddr, 4, 0);
+        assert(((pte123_t *)pte)->pagesize == 0 && pte->present == 1);
+        assert(*(uint64_t *)&pm[pte->ppn << PHYSICAL_PAGE_OFFSET_LENGTH] == i);
+    }
+    assert(is_writeprotected(p1->mm.pgd, &vaddr) == 0);
+
+    // the child keeps the huge page
+    leaf = get_pagetableentry(child->mm.pgd, &vaddr, 4, 0);
+    assert(leaf->pagesize == 1 && ((pte4_t *)leaf)->ppn == huge_ppn);
+
+    // not enough frames to copy the huge page of child: fork fails
+    assert(enough_frames(PAGE_TABLE_ENTRY_NUM) == 0);
+    cpu_reg.rsp = (uint64_t)child->kstack + KERNEL_STACK_SIZE
+        - sizeof(trapframe_t) - sizeof(userframe_t);
+    syscall_fork();
+    assert(child->next == p1);
+    assert(child->context.regs.rax == (uint64_t)-1);
+
+    physical_memory_init(DEFAULT_PHYSICAL_MEMORY_SPACE);
+    printf(GREENSTR("Pass\n"));
+}
+
+static int vma_tree_height(vm_area_t *a)
+{
+    if (a == NULL)
+    {
+        return 0;
+    }
+    int left = vma_tree_height(a->rbt_left);
+    int right = vma_tree_height(a->rbt_right);
+    return 1 + (left > right ? left : right);
+}
+
+static void TestVmaIndex()
+{
+    printf("================\nTesting VMA red-black tree index ...\n");
+
+    pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+    memset(p1, 0, sizeof(pcb_t));
+
+    // 4096 areas of 1 page with 1 page holes, inserted in scrambled order
+    int num = 4096;
+    static vm_area_t *vmas[4096];
+    for (int i = 0; i < num; ++ i)
+    {
+        int k = (i * 2731) % num;
+        vmas[k] = kmem_cache_alloc(KMEM_VMA);
+        memset(vmas[k], 0, sizeof(vm_area_t));
+        vmas[k]->vma_start = 0x10000000 + k * 2 * PAGE_SIZE;
+        vmas[k]->vma_end = vmas[k]->vma_start + PAGE_SIZE;
+        vmas[k]->vma_mode.read = 1;
+        vmas[k]->vma_mode.write = 1;
+        strcpy(vmas[k]->filepath, "[mmap]");
+        vma_add_area(p1, vmas[k]);
+    }
+    assert(p1->mm.vma.count == num);
+
+    // the list is sorted
+    vm_area_t *a = (vm_area_t *)p1->mm.vma.head;
+    for (int i = 0; i < num; ++ i)
+    {
+        assert(a == vmas[i]);
+        a = a->next;
+    }
+
+    // the tree is balanced: height <= 2 * log2(n + 1)
+    int height = vma_tree_height((vm_area_t *)p1->mm.vma_tree.root);
+    assert(height <= 2 * 13);
+    printf("%d areas, tree height %d\n", num, height);
+
+    // interval lookup: the start, the last byte and the hole
+    for (int i = 0; i < num; ++ i)
+    {
+        assert(search_vma_vaddr(p1, vmas[i]->vma_start) == vmas[i]);
+        assert(search_vma_vaddr(p1, vmas[i]->vma_end - 1) == vmas[i]);
+        assert(search_vma_vaddr(p1, vmas[i]->vma_end) == NULL);
+    }
+    assert(search_vma_vaddr(p1, 0x10000000 - 1) == NULL);
+
+    // the faults in the same area hit the cache
+    uint64_t hit = vma_cache_hit_count;
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        assert(search_vma_vaddr(p1, vmas[100]->vma_start + i) == vmas[100]);
+    }
+    assert(vma_cache_hit_count - hit == PAGE_SIZE / 8 - 1);
+
+    // adjacent area is merged into the next one
+    vm_area_t *adjacent = kmem_cache_alloc(KMEM_VMA);
+    *adjacent = *vmas[0];
+    adjacent->vma_start = vmas[0]->vma_start - PAGE_SIZE;
+    adjacent->vma_end = vmas[0]->vma_start;
+    vma_add_area(p1, adjacent);
+    assert(p1->mm.vma.count == num);
+    assert(vmas[0]->vma_start == adjacent->vma_start);
+    assert(search_vma_vaddr(p1, adjacent->vma_start) == vmas[0]);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static int count_free_frames()
+{
+    int num = 0;
+    while (enough_frames(num + 1) == 1)
+    {
+        num += 1;
+    }
+    return num;
+}
+
+static uint64_t read_user(pcb_t *p, uint64_t vaddr)
+{
+    uint64_t ppn = get_ppn(p, vaddr);
+    return *(uint64_t *)&pm[(ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + vaddr % PAGE_SIZE];
+}
+
+#define EXEC_FILE       (0x00400800)    // files/exe/hello.eof.txt
+#define EXEC_NOFILE     (0x00400900)    // not exist
+#define EXEC_SPIN       (0x00400a00)    // files/exe/spin.eof.txt
+#define HELLO_COUNTER   (0x004001c8)
+
+// p1 runs the code, with a heap of heap_pages
+static pcb_t *setup_exec_parent(char code[][MAX_INSTRUCTION_CHAR], int num, int heap_pages)
+{
+    page_map_init();
+
+    pcb_t *p1 = kmem_cache_alloc(KMEM_PCB);
+    memset(p1, 0, sizeof(pcb_t));
+    p1->pid = 1;
+    p1->next = p1;
+    p1->prev = p1;
+    p1->mm.pgd = kmem_cache_alloc(KMEM_PAGETABLE);
+    memset(p1->mm.pgd, 0, PAGE_TABLE_ENTRY_NUM * sizeof(pte123_t));
+
+    add_vma(p1, 0x00400000, 0x00401000, 0, "~/exec");
+    if (heap_pages > 0)
+    {
+        add_vma(p1, 0x00600000, 0x00600000 + heap_pages * PAGE_SIZE, 1, "[heap]");
+    }
+    add_vma(p1, 0x7ffffffee000, 0x7ffffffef000, 1, "[stack]");
+    setup_pagetable_from_vma(p1);
+
+    // the code and the file names in .text page
+    uint64_t code_ppn = get_ppn(p1, 0x00400000);
+    char *text = (char *)&pm[code_ppn << PHYSICAL_PAGE_OFFSET_LENGTH];
+    memcpy(text, code, num * MAX_INSTRUCTION_CHAR);
+    strcpy(&text[EXEC_FILE - 0x00400000], "./files/exe/hello.eof.txt");
+    strcpy(&text[EXEC_NOFILE - 0x00400000], "./files/exe/none.eof.txt");
+    strcpy(&text[EXEC_SPIN - 0x00400000], "./files/exe/spin.eof.txt");
+
+    p1->kstack = kmem_cache_alloc(KMEM_KSTACK);
+    p1->kstack->threadinfo.pcb = p1;
+
+    cpu_pc.rip = 0x00400000;
+    cpu_reg.rsp = 0x7ffffffee0f0;
+    tr_global_tss.ESP0 = (uint64_t)p1->kstack + KERNEL_STACK_SIZE;
+    cpu_controls.cr3 = p1->mm.pgd_paddr;
+    cpu_controls.asid = p1->asid;
+    idt_init();
+    syscall_init();
+    return p1;
+}
+
+static void TestVforkExecve()
+{
+    printf("================\nTesting vfork and execve ...\n");
+
+    char code[12][MAX_INSTRUCTION_CHAR] = {
+        "movq   $0x3a, %rax",       // 0x00400000
+        "int    $0x80",
+        "cmpq   $0x0, %rax",
+        "jne    $0x00400200",
+        // child: execve
+        "movq   $0x00400800, %rdi", // 0x00400100
+        "movq   $0x3b, %rax",
+        "int    $0x80",
+        "jmp    $0x004001c0",
+        // parent LOOP: getpid
+        "mov    %rax, %rbx",        // 0x00400200
+        "movq   $0x27, %rax",
+        "int    $0x80",
+        "jmp    $0x00400240",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 12, 0);
+    uint64_t code_ppn = get_ppn(p1, 0x00400000);
+    uint64_t stack_ppn = get_ppn(p1, 0x7ffffffee000);
+    int frames = count_free_frames();
+
+    // vfork: the child borrows everything, the parent waits
+    instruction_cycle();
+    instruction_cycle();
+    pcb_t *child = p1->next;
+    assert(child != p1);
+    assert(p1->state == PROC_BLOCKED);
+    assert(child->mm.pgd == p1->mm.pgd);
+    assert(child->vfork_parent == p1);
+    assert(cpu_controls.cr3 == (uint64_t)p1->mm.pgd);
+    assert(count_free_frames() == frames);
+
+    // the parent is blocked till the child calls execve
+    int cycles = 0;
+    while (child->mm.pgd == p1->mm.pgd)
+    {
+        assert(p1->state == PROC_BLOCKED);
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 10);
+    }
+    assert(p1->state == PROC_RUNNABLE);
+    assert(child->vfork_parent == NULL);
+
+    // the parent keeps its address space
+    assert(get_ppn(p1, 0x00400000) == code_ppn);
+    assert(get_ppn(p1, 0x7ffffffee000) == stack_ppn);
+    assert(strcmp((char *)&pm[code_ppn << PHYSICAL_PAGE_OFFSET_LENGTH], code[0]) == 0);
+    assert(search_vma_vaddr(p1, 0x00400000) != NULL);
+    assert(search_vma_vaddr(child, 0x7ffffffee000) == NULL);
+
+    // the child runs the new image: .text & .data in one page
+    assert(count_free_frames() == frames);
+    for (int i = 0; i < 100; ++ i)
+    {
+        instruction_cycle();
+    }
+    assert(count_free_frames() == frames - 1);
+    assert(get_ppn(child, 0x00400000) != code_ppn);
+    assert(read_user(child, 0x004001c0) == 0x1234);
+    assert(read_user(child, HELLO_COUNTER) > 0);
+
+    // the parent gets the PID of child from vfork
+    while (cpu_controls.cr3 != (uint64_t)p1->mm.pgd)
+    {
+        instruction_cycle();
+    }
+    assert(cpu_reg.rbx == child->pid);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestExecve()
+{
+    printf("================\nTesting execve teardown ...\n");
+
+    char code[7][MAX_INSTRUCTION_CHAR] = {
+        // not exist: execve returns -1
+        "movq   $0x00400900, %rdi", // 0x00400000
+        "movq   $0x3b, %rax",
+        "int    $0x80",
+        "mov    %rax, %rbx",
+        "movq   $0x00400800, %rdi", // 0x00400100
+        "movq   $0x3b, %rax",
+        "int    $0x80",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 7, 4);
+    int frames = count_free_frames();
+
+    // till the old image is replaced
+    int cycles = 0;
+    while (search_vma_vaddr(p1, 0x00600000) != NULL)
+    {
+        assert(get_ppn(p1, 0x00600000) != 0);
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 10);
+        if (cpu_pc.rip == 0x00400100)
+        {
+            assert(cpu_reg.rbx == (uint64_t)-1);
+        }
+    }
+
+    // code, heap and stack frames are freed: 6 frames
+    // the first instruction of the new image reads 1 page in
+    assert(count_free_frames() == frames + 5);
+    assert(p1->mm.vma.count == 3);
+    assert(cpu_reg.rsp == 0x7ffffffff000);
+
+    cycles = 0;
+    while (read_user(p1, HELLO_COUNTER) < 10)
+    {
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 100);
+    }
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSpawn()
+{
+    printf("================\nTesting spawn ...\n");
+
+    char code[11][MAX_INSTRUCTION_CHAR] = {
+        // not exist: spawn returns -1
+        "movq   $0x00400900, %rdi", // 0x00400000
+        "movq   $0x38, %rax",
+        "int    $0x80",
+        "mov    %rax, %rbx",
+        "movq   $0x00400800, %rdi", // 0x00400100
+        "movq   $0x38, %rax",
+        "int    $0x80",
+        "mov    %rax, %rcx",
+        // parent LOOP: getpid
+        "movq   $0x27, %rax",       // 0x00400200
+        "int    $0x80",
+        "jmp    $0x00400200",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 11, 0);
+    uint64_t code_ppn = get_ppn(p1, 0x00400000);
+    int frames = count_free_frames();
+
+    for (int i = 0; i < 3; ++ i)
+    {
+        instruction_cycle();
+    }
+    assert(p1->next == p1);
+
+    // the parent is never blocked
+    int cycles = 0;
+    while (p1->next == p1)
+    {
+        instruction_cycle();
+        assert(p1->state == PROC_RUNNABLE);
+        cycles += 1;
+        assert(cycles < 10);
+    }
+    pcb_t *child = p1->next;
+    assert(child->mm.pgd != p1->mm.pgd);
+    assert(child->vfork_parent == NULL);
+    // the child has run its first instruction only
+    assert(count_free_frames() == frames - 1);
+    assert(get_ppn(p1, 0x00400000) == code_ppn);
+
+    for (int i = 0; i < 60; ++ i)
+    {
+        instruction_cycle();
+        assert(p1->state == PROC_RUNNABLE);
+    }
+    assert(read_user(child, HELLO_COUNTER) > 0);
+    assert(get_ppn(child, 0x00400000) != code_ppn);
+    while (cpu_controls.cr3 != (uint64_t)p1->mm.pgd)
+    {
+        instruction_cycle();
+    }
+    assert(cpu_reg.rbx == (uint64_t)-1);
+    assert(cpu_reg.rcx == child->pid);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static int is_mapped(pcb_t *p, uint64_t vaddr_value)
+{
+    address_t vaddr = {.address_value = vaddr_value};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p->mm.pgd, &vaddr, 4, 0);
+    return pte != NULL && pte->present == 1;
+}
+
+static void TestDemandPaging()
+{
+    printf("================\nTesting demand paging of execve ...\n");
+
+    char code[3][MAX_INSTRUCTION_CHAR] = {
+        "movq   $0x00400800, %rdi", // 0x00400000
+        "movq   $0x3b, %rax",
+        "int    $0x80",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 3, 0);
+    uint64_t faults = demand_fault_count;
+
+    int cycles = 0;
+    while (search_vma_vaddr(p1, 0x7ffffffee000) != NULL)
+    {
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 10);
+    }
+
+    // .text & .data, [heap], [stack]
+    assert(p1->mm.vma.count == 3);
+    vm_area_t *heap = search_vma_vaddr(p1, 0x00401000);
+    vm_area_t *stack = search_vma_vaddr(p1, 0x7ffffffff000 - 8);
+    assert(heap != NULL && heap->vma_mode.file == 0);
+    assert(stack != NULL && stack->vma_mode.file == 0);
+    assert(search_vma_vaddr(p1, 0x00400000)->vma_mode.file == 1);
+
+    // only the touched page is read in
+    while (read_user(p1, HELLO_COUNTER) < 3)
+    {
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 100);
+    }
+    assert(demand_fault_count - faults == 1);
+    assert(is_mapped(p1, heap->vma_start) == 0);
+    assert(is_mapped(p1, stack->vma_end - PAGE_SIZE) == 0);
+    uint64_t ppn = get_ppn(p1, 0x00400000);
+    assert(strcmp((char *)&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH], "mov    0x004001c8,%rbx") == 0);
+    assert(read_user(p1, 0x004001c0) == 0x1234);
+
+    // anonymous page is zero filled
+    write_fault(p1, heap->vma_start + 8);
+    assert(demand_fault_count - faults == 2);
+    assert(read_user(p1, heap->vma_start + 8) == 0);
+
+    // the clean page of file is discarded, and read again
+    add_vma(p1, 0x10000000, 0x10001000, 0, "./files/exe/hello.eof.txt");
+    search_vma_vaddr(p1, 0x10000000)->vma_mode.file = 1;
+    write_fault(p1, 0x10000000);
+    assert(demand_fault_count - faults == 3);
+    ppn = get_ppn(p1, 0x10000000);
+    assert(read_user(p1, 0x100001c0) == 0x1234);
+    unmapall_pte4(ppn);
+    assert(is_mapped(p1, 0x10000000) == 0);
+    write_fault(p1, 0x10000000 + 0x1c0);
+    assert(demand_fault_count - faults == 4);
+    assert(read_user(p1, 0x100001c0) == 0x1234);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestPageCache()
+{
+    printf("================\nTesting page cache shared by processes ...\n");
+
+    char code[15][MAX_INSTRUCTION_CHAR] = {
+        // spawn 4 processes running spin
+        "movq   $0x00400a00, %rdi", // 0x00400000
+        "movq   $0x38, %rax",
+        "int    $0x80",
+        "movq   $0x00400a00, %rdi",
+        "movq   $0x38, %rax",
+        "int    $0x80",
+        "movq   $0x00400a00, %rdi",
+        "movq   $0x38, %rax",
+        "int    $0x80",
+        "movq   $0x00400a00, %rdi",
+        "movq   $0x38, %rax",
+        "int    $0x80",
+        // parent LOOP: getpid
+        "movq   $0x27, %rax",       // 0x00400300
+        "int    $0x80",
+        "jmp    $0x00400300",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 15, 0);
+    int frames = count_free_frames();
+    uint64_t hits = pagecache_hit_count;
+    uint64_t misses = pagecache_miss_count;
+
+    for (int i = 0; i < 200; ++ i)
+    {
+        instruction_cycle();
+    }
+
+    // one frame for the 4 copies of .text
+    int num = 0;
+    uint64_t text_ppn = get_ppn(p1->next, 0x00400000);
+    for (pcb_t *p = p1->next; p != p1; p = p->next)
+    {
+        address_t vaddr = {.address_value = 0x00400000};
+        assert(get_ppn(p, 0x00400000) == text_ppn);
+        assert(is_writeprotected(p->mm.pgd, &vaddr) == 1);
+        num += 1;
+    }
+    assert(num == 4);
+    assert(pagecache_miss_count - misses == 1);
+    assert(pagecache_hit_count - hits == 3);
+    assert(count_free_frames() == frames - 1);
+
+    // the page not mapped any more is kept in LRU list
+    add_vma(p1, 0x10000000, 0x10001000, 0, "./files/exe/output.eof.txt");
+    search_vma_vaddr(p1, 0x10000000)->vma_mode.file = 1;
+    write_fault(p1, 0x10000000);
+    assert(pagecache_miss_count - misses == 2);
+    uint64_t ppn = get_ppn(p1, 0x10000000);
+    assert(read_user(p1, 0x10000800) == 0x12340000);
+
+    address_t vaddr = {.address_value = 0x10000000};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p1->mm.pgd, &vaddr, 4, 0);
+    unmap_pte4(pte);
+    assert(count_free_frames() == frames - 1);
+    write_fault(p1, 0x10000000);
+    assert(pagecache_hit_count - hits == 4);
+    assert(get_ppn(p1, 0x10000000) == ppn);
+    unmap_pte4(pte);
+
+    // the LRU page is dropped when no frame is free
+    int avail = count_free_frames();
+    add_vma(p1, 0x20000000, 0x20000000 + avail * PAGE_SIZE, 1, "[heap]");
+    for (int i = 0; i < avail; ++ i)
+    {
+        write_fault(p1, 0x20000000 + i * PAGE_SIZE);
+    }
+    assert(count_free_frames() == 0);
+    write_fault(p1, 0x10000000);
+    assert(pagecache_miss_count - misses == 3);
+    assert(read_user(p1, 0x10000800) == 0x12340000);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestCowReclaim()
+{
+    printf("================\nTesting copy-on-write without free frame ...\n");
+
+    char code[1][MAX_INSTRUCTION_CHAR] = {
+        "jmp    $0x00400000",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 1, 1);
+    write_fault(p1, 0x00600000);
+    *(uint64_t *)&pm[get_ppn(p1, 0x00600000) << PHYSICAL_PAGE_OFFSET_LENGTH] = 0xabcd;
+
+    cpu_reg.rsp = (uint64_t)p1->kstack + KERNEL_STACK_SIZE
+        - sizeof(trapframe_t) - sizeof(userframe_t);
+    syscall_fork();
+    pcb_t *child = p1->next;
+    assert(child != p1);
+    assert(get_ppn(child, 0x00600000) == get_ppn(p1, 0x00600000));
+
+    int avail = count_free_frames();
+    add_vma(p1, 0x20000000, 0x20000000 + avail * PAGE_SIZE, 1, "[heap]");
+    for (int i = 0; i < avail; ++ i)
+    {
+        write_fault(p1, 0x20000000 + i * PAGE_SIZE);
+    }
+    assert(count_free_frames() == 0);
+
+    // the copy takes a victim of CLOCK
+    write_fault(child, 0x00600000);
+    assert(is_mapped(child, 0x00600000) == 1);
+    assert(read_user(child, 0x00600000) == 0xabcd);
+    if (is_mapped(p1, 0x00600000) == 0)
+    {
+        // the shared frame itself was the victim
+        write_fault(p1, 0x00600000);
+    }
+    assert(get_ppn(p1, 0x00600000) != get_ppn(child, 0x00600000));
+    assert(read_user(p1, 0x00600000) == 0xabcd);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestExitWait()
+{
+    printf("================\nTesting exit and wait ...\n");
+
+    char code[22][MAX_INSTRUCTION_CHAR] = {
+        "movq   $0x39, %rax",       // 0x00400000
+        "int    $0x80",
+        "cmpq   $0x0, %rax",
+        "jne    $0x00400300",
+        // child: write heap, exit(7)
+        "mov    %rax, 0x00600000",  // 0x00400100
+        "movq   $0x27, %rax",
+        "int    $0x80",
+        "movq   $0x27, %rax",
+        "int    $0x80",             // 0x00400200
+        "movq   $0x7, %rdi",
+        "movq   $0x3c, %rax",
+        "int    $0x80",
+        // parent: wait(pid, 0x00600008, 0)
+        "mov    %rax, %rdi",        // 0x00400300
+        "movq   $0x0, %rdx",
+        "mov    %rdx, 0x00600008",
+        "movq   $0x00600008, %rsi",
+        "movq   $0x3d, %rax",       // 0x00400400
+        "int    $0x80",
+        "mov    %rax, %rbx",
+        // parent LOOP: getpid
+        "movq   $0x27, %rax",
+        "int    $0x80",             // 0x00400500
+        "jmp    $0x004004c0",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 22, 1);
+    int frames = count_free_frames();
+    uint64_t live[KMEM_NUM_CACHES];
+    memcpy(live, kmem_live_count, sizeof(live));
+
+    instruction_cycle();
+    instruction_cycle();
+    pcb_t *child = p1->next;
+    uint64_t child_pid = child->pid;
+    assert(child != p1);
+    assert(child->parent == p1);
+
+    // the parent is blocked in wait till the child exits
+    int blocked = 0;
+    int cycles = 0;
+    while (p1->next != p1)
+    {
+        if (p1->state == PROC_BLOCKED)
+        {
+            assert(p1->waiting == 1);
+            blocked = 1;
+        }
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 100);
+    }
+    assert(blocked == 1);
+    assert(p1->state == PROC_RUNNABLE);
+
+    // the status is returned, and the child is gone with its frames
+    while (cpu_pc.rip < 0x004004c0)
+    {
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 100);
+    }
+    assert(cpu_reg.rbx == child_pid);
+    assert(read_user(p1, 0x00600008) == (7 << 8));
+    assert(count_free_frames() == frames);
+    // the kernel objects of the child are back to the caches
+    for (int i = 0; i < KMEM_NUM_CACHES; ++ i)
+    {
+        assert(kmem_live_count[i] == live[i]);
+    }
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestKill()
+{
+    printf("================\nTesting kill ...\n");
+
+    char code[22][MAX_INSTRUCTION_CHAR] = {
+        "movq   $0x39, %rax",       // 0x00400000
+        "int    $0x80",
+        "cmpq   $0x0, %rax",
+        "jne    $0x00400200",
+        // child LOOP: getpid
+        "movq   $0x27, %rax",       // 0x00400100
+        "int    $0x80",
+        "jmp    $0x00400100",
+        "jmp    $0x00400100",
+        // parent: kill(pid, 9), wait(pid, 0x00600000, 0)
+        "mov    %rax, %rdi",        // 0x00400200
+        "movq   $0x9, %rsi",
+        "movq   $0x3e, %rax",
+        "int    $0x80",
+        "mov    %rax, %rcx",        // 0x00400300
+        "movq   $0x0, %rdx",
+        "mov    %rdx, 0x00600000",
+        "movq   $0x00600000, %rsi",
+        "movq   $0x3d, %rax",       // 0x00400400
+        "int    $0x80",
+        "mov    %rax, %rbx",
+        // parent LOOP: getpid
+        "movq   $0x27, %rax",
+        "int    $0x80",             // 0x00400500
+        "jmp    $0x004004c0",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 22, 1);
+    int frames = count_free_frames();
+
+    instruction_cycle();
+    instruction_cycle();
+    uint64_t child_pid = p1->next->pid;
+
+    // the child spins till it is killed
+    int cycles = 0;
+    while (cpu_controls.cr3 != (uint64_t)p1->mm.pgd || cpu_pc.rip < 0x004004c0)
+    {
+        instruction_cycle();
+        cycles += 1;
+        assert(cycles < 100);
+    }
+    assert(p1->next == p1);
+    assert(cpu_reg.rcx == 0);
+    assert(cpu_reg.rbx == child_pid);
+    assert(read_user(p1, 0x00600000) == 9);
+    assert(count_free_frames() == frames);
+
+    // 128 would be the status of exit(0)
+    cpu_reg.rsp = (uint64_t)p1->kstack + KERNEL_STACK_SIZE
+        - sizeof(trapframe_t) - sizeof(userframe_t);
+    syscall_kill(p1->pid, 128);
+    assert(p1->context.regs.rax == (uint64_t)-1);
+    assert(p1->killed == 0);
+    syscall_kill(p1->pid, 0);
+    assert(p1->context.regs.rax == 0);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestUserCopy()
+{
+    printf("================\nTesting copy from and to user ...\n");
+
+    char code[16][MAX_INSTRUCTION_CHAR] = {
+        // write(1, 0x00600ffa, 12): across the heap pages
+        "movq   $0x1, %rdi",        // 0x00400000
+        "movq   $0x00600ffa, %rsi",
+        "movq   $0xc, %rdx",
+        "movq   $0x1, %rax",
+        "int    $0x80",             // 0x00400100
+        // write(1, 0x10000000, 12): not in area
+        "movq   $0x10000000, %rsi", // 0x00400140
+        "movq   $0x1, %rax",
+        "int    $0x80",
+        // write(3, 0x00600ffa, 12): bad fd
+        "movq   $0x3, %rdi",        // 0x00400200
+        "movq   $0x00600ffa, %rsi",
+        "movq   $0x1, %rax",
+        "int    $0x80",             // 0x004002c0
+        "movq   $0x0, %rdi",
+        // LOOP: getpid
+        "movq   $0x27, %rax",       // 0x00400340
+        "int    $0x80",
+        "jmp    $0x00400340",
+    };
+
+    pcb_t *p1 = setup_exec_parent(code, 16, 2);
+    char *hello = "hello world\n";
+    for (int i = 0; i < 12; ++ i)
+    {
+        uint64_t ppn = get_ppn(p1, 0x00600ffa + i);
+        pm[(ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + (0x00600ffa + i) % PAGE_SIZE] = hello[i];
+    }
+
+    // one translation for each page, one flush for the line
+    uint64_t translates = usercopy_translate_count;
+    uint64_t flushes = output_flush_count;
+    // write returns the bytes written, or -1
+    // stop after the instruction following the int
+    uint64_t stops[3] = {0x00400180, 0x00400240, 0x00400340};
+    uint64_t results[3] = {12, -1, -1};
+    int cycles = 0;
+    for (int i = 0; i < 3; ++ i)
+    {
+        while (cpu_pc.rip < stops[i])
+        {
+            instruction_cycle();
+            cycles += 1;
+            assert(cycles < 20);
+        }
+        assert(cpu_reg.rax == results[i]);
+    }
+    assert(usercopy_translate_count - translates == 2);
+    assert(output_flush_count - flushes == 1);
+
+    // the faults in kernel are fixed as the ones of user
+    cpu_reg.rsp = (uint64_t)p1->kstack + KERNEL_STACK_SIZE
+        - sizeof(trapframe_t) - sizeof(userframe_t);
+    add_vma(p1, 0x20000000, 0x20002000, 1, "[heap]");
+    uint64_t faults = demand_fault_count;
+    assert(copy_to_user(0x20000ffc, "abcdefgh", 8) == 0);
+    assert(demand_fault_count - faults == 2);
+    assert(read_user(p1, 0x20000ff8) == 0x6463626100000000);
+    assert(read_user(p1, 0x20001000) == 0x68676665);
+
+    address_t vaddr = {.address_value = 0x00600000};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p1->mm.pgd, &vaddr, 4, 0);
+    pte->readonly = 1;
+    uint64_t value = 0x1234;
+    assert(copy_to_user(0x00600008, &value, sizeof(value)) == 0);
+    assert(pte->readonly == 0);
+    assert(read_user(p1, 0x00600008) == 0x1234);
+
+    char buf[16];
+    assert(copy_from_user(buf, 0x00600ffa, 12) == 0);
+    assert(memcmp(buf, hello, 12) == 0);
+    assert(strncpy_from_user(buf, EXEC_SPIN, 8) == 7);
+    assert(strcmp(buf, "./files") == 0);
+
+    // illegal: not in area, or write to read only area
+    assert(copy_from_user(buf, 0x10000000, 8) == 8);
+    assert(copy_to_user(0x00400000, &value, sizeof(value)) == sizeof(value));
+    assert(strncpy_from_user(buf, 0x10000000, 8) == -1);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSlab()
+{
+    printf("================\nTesting slab allocator of kernel objects ...\n");
+
+    // page tables and kernel stacks are aligned
+    uint64_t live = kmem_live_count[KMEM_PAGETABLE];
+    pte123_t *tabs[64];
+    for (int i = 0; i < 64; ++ i)
+    {
+        tabs[i] = kmem_cache_alloc(KMEM_PAGETABLE);
+        assert((uint64_t)tabs[i] % PAGE_SIZE == 0);
+        for (int j = 0; j < i; ++ j)
+        {
+            assert(tabs[i] != tabs[j]);
+        }
+    }
+    assert(kmem_live_count[KMEM_PAGETABLE] == live + 64);
+    for (int i = 0; i < 64; ++ i)
+    {
+        kmem_cache_free(KMEM_PAGETABLE, tabs[i]);
+    }
+    assert(kmem_live_count[KMEM_PAGETABLE] == live);
+
+    kstack_t *kstack = kmem_cache_alloc(KMEM_KSTACK);
+    assert((uint64_t)kstack % KERNEL_STACK_SIZE == 0);
+    kmem_cache_free(KMEM_KSTACK, kstack);
+
+    // fork & exit in a loop: the objects are reused, not from host
+    uint64_t host_alloc[KMEM_NUM_CACHES];
+    uint64_t alloc[KMEM_NUM_CACHES];
+    uint64_t hit[KMEM_NUM_CACHES];
+    memcpy(host_alloc, kmem_host_alloc_count, sizeof(host_alloc));
+    memcpy(alloc, kmem_alloc_count, sizeof(alloc));
+    memcpy(hit, kmem_magazine_hit_count, sizeof(hit));
+    for (int n = 0; n < 1000; ++ n)
+    {
+        void *objs[KMEM_NUM_CACHES][4];
+        for (int i = 0; i < KMEM_NUM_CACHES; ++ i)
+        {
+            for (int j = 0; j < 4; ++ j)
+            {
+                objs[i][j] = kmem_cache_alloc(i);
+            }
+        }
+        for (int i = 0; i < KMEM_NUM_CACHES; ++ i)
+        {
+            for (int j = 0; j < 4; ++ j)
+            {
+                kmem_cache_free(i, objs[i][j]);
+            }
+        }
+    }
+    for (int i = 0; i < KMEM_NUM_CACHES; ++ i)
+    {
+        assert(kmem_alloc_count[i] - alloc[i] == 4000);
+        assert(kmem_host_alloc_count[i] == host_alloc[i]);
+        // only the first round may refill the magazine
+        assert(kmem_magazine_hit_count[i] - hit[i] >= 4000 - 1);
+    }
+
+    print_kmem_stats();
+    printf(GREENSTR("Pass\n"));
+}
 #endif
 
 int main()
@@ -272,6 +1382,20 @@ int main()
     TestFork_naive();
 #elif defined(USE_FORK_COW)
     TestFork_cow();
+    TestFork_prefork();
+    TestSharedPagetable();
+    TestHugePageSplit();
+    TestVmaIndex();
+    TestVforkExecve();
+    TestExecve();
+    TestSpawn();
+    TestDemandPaging();
+    TestPageCache();
+    TestCowReclaim();
+    TestExitWait();
+    TestKill();
+    TestUserCopy();
+    TestSlab();
 #endif
     return 0;
 }
\ No newline at end of file
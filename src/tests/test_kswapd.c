@@ -0,0 +1,266 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/instruction.h"
+#include "headers/interrupt.h"
+#include "headers/process.h"
+#include "headers/color.h"
+
+pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate);
+void map_pte4(pte4_t *pte, uint64_t ppn);
+void page_map_init();
+int enough_frames(int request_num);
+uint64_t allocate_swappage(uint64_t ppn);
+int swap_in(uint64_t saddr, uint64_t ppn);
+int swap_out(uint64_t saddr, uint64_t ppn);
+void kswapd_run();
+int swap_in_async(uint64_t saddr, uint64_t ppn);
+void swap_wait(int id);
+void swap_release(int id);
+
+// pagefault.c
+extern uint64_t kswapd_reclaim_count;
+extern uint64_t kswapd_writeback_count;
+extern uint64_t async_swapin_count;
+// swap.c
+extern uint64_t swap_write_count;
+
+static void fill_frame(uint64_t ppn, uint64_t pattern)
+{
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        *(uint64_t *)&pm[(ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + i] = pattern + i;
+    }
+}
+
+static int check_frame(uint64_t ppn, uint64_t pattern)
+{
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        if (*(uint64_t *)&pm[(ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + i] != pattern + i)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void TestWatermarks()
+{
+    printf("Testing kswapd watermarks ...\n");
+
+    page_map_init();
+
+    // all frames are dirty and not referenced
+    pte4_t ptes[MAX_NUM_PHYSICAL_PAGE];
+    memset(&ptes, 0, sizeof(ptes));
+    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+    {
+        map_pte4(&ptes[i], i);
+        allocate_swappage(i);
+        fill_frame(i, (uint64_t)i << 32);
+        ptes[i].dirty = 1;
+    }
+    assert(enough_frames(1) == 0);
+
+    // low: 16 / 8 + 1, high: 16 / 4 + 2
+    uint64_t high = MAX_NUM_PHYSICAL_PAGE / 4 + 2;
+    uint64_t writeback = kswapd_writeback_count;
+    uint64_t writes = swap_write_count;
+    while (enough_frames(high) == 0)
+    {
+        kswapd_run();
+    }
+    assert(enough_frames(high + 1) == 0);
+    assert(kswapd_writeback_count - writeback == high);
+#ifndef USE_ZSWAP
+    // the victims are in adjacent slots: one write
+    assert(swap_write_count - writes == 1);
+#endif
+
+    // the victims are written back
+    int swapped = 0;
+    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
+    {
+        if (ptes[i].present == 0)
+        {
+            swapped += 1;
+            swap_in(ptes[i].saddr, 0);
+            assert(check_frame(0, (uint64_t)i << 32) == 1);
+        }
+    }
+    assert(swapped == high);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestManySwapins()
+{
+    printf("Testing swap-ins kept by the kernel ...\n");
+
+    page_map_init();
+
+    uint64_t saddr = allocate_swappage(1);
+    fill_frame(1, 0x1234000000000000);
+    swap_out(saddr, 1);
+
+    // more requests than one chunk of the queue are completed, and
+    // none is released yet, e.g. the processes are not scheduled
+    int ids[200];
+    for (int i = 0; i < 200; ++ i)
+    {
+        ids[i] = swap_in_async(saddr, 2);
+        swap_wait(ids[i]);
+    }
+
+    // the synchronous I/O does not wait for the releases
+    swap_in(saddr, 3);
+    assert(check_frame(3, 0x1234000000000000) == 1);
+    assert(check_frame(2, 0x1234000000000000) == 1);
+
+    for (int i = 0; i < 200; ++ i)
+    {
+        swap_release(ids[i]);
+    }
+
+    // the entries are reused
+    int id = swap_in_async(saddr, 2);
+    assert(id < 200);
+    swap_wait(id);
+    swap_release(id);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void link_page_table(pte123_t *pgd, uint64_t vaddr_value, int ppn)
+{
+    address_t vaddr = {.address_value = vaddr_value};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(pgd, &vaddr, 4, 1);
+    map_pte4(pte, ppn);
+}
+
+static void load_code(int ppn, char code[][MAX_INSTRUCTION_CHAR], int num)
+{
+    memcpy((char *)&pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH],
+        code, sizeof(char) * num * MAX_INSTRUCTION_CHAR);
+}
+
+static void TestAsyncPageFault()
+{
+    printf("Testing asynchronous swap-in ...\n");
+
+    page_map_init();
+
+    // p1 reads a page in swap space
+    char p1_code[2][MAX_INSTRUCTION_CHAR] = {
+        "mov 0x7fff1008, %rbx",
+        "jmp 0x00400000",
+    };
+    // p2 runs during the swap-in
+    char p2_code[3][MAX_INSTRUCTION_CHAR] = {
+        "movq $39, %rax",
+        "int $0x80",
+        "jmp 0x00400040",
+    };
+
+    pcb_t p1, p2;
+    memset(&p1, 0, sizeof(pcb_t));
+    memset(&p2, 0, sizeof(pcb_t));
+    p1.pid = 1;
+    p2.pid = 2;
+    p1.next = &p2;
+    p2.next = &p1;
+    p1.prev = &p2;
+    p2.prev = &p1;
+
+    static pte123_t p1_pgd[PAGE_TABLE_ENTRY_NUM];
+    static pte123_t p2_pgd[PAGE_TABLE_ENTRY_NUM];
+    memset(p1_pgd, 0, sizeof(p1_pgd));
+    memset(p2_pgd, 0, sizeof(p2_pgd));
+    p1.mm.pgd = p1_pgd;
+    p2.mm.pgd = p2_pgd;
+
+    link_page_table(p1_pgd, 0x00400000, 0);
+    link_page_table(p2_pgd, 0x00400000, 1);
+    load_code(0, p1_code, 2);
+    load_code(1, p2_code, 3);
+
+    // the data page of p1 is swapped out
+    link_page_table(p1_pgd, 0x7fff1000, 2);
+    uint64_t saddr = allocate_swappage(2);
+    fill_frame(2, 0xabcd000000000000);
+    swap_out(saddr, 2);
+    address_t vaddr = {.address_value = 0x7fff1000};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p1_pgd, &vaddr, 4, 0);
+    pte->pte_value = 0;
+    pte->saddr = saddr;
+
+    // kernel stacks
+    p1.kstack = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    p2.kstack = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    p1.kstack->threadinfo.pcb = &p1;
+    p2.kstack->threadinfo.pcb = &p2;
+    trapframe_t tf = {
+        .rip = 0x00400000,
+        .rsp = 0x7ffffffee0f0,
+    };
+    uint64_t p2_stack_top = (uint64_t)p2.kstack + KERNEL_STACK_SIZE;
+    memcpy((trapframe_t *)(p2_stack_top - sizeof(trapframe_t)), &tf, sizeof(trapframe_t));
+    p2.context.regs.rsp = p2_stack_top - sizeof(trapframe_t) - sizeof(userframe_t);
+
+    // run p1
+    cpu_pc.rip = 0x00400000;
+    cpu_reg.rsp = 0x7ffffffee0f0;
+    cpu_reg.rbx = 0;
+    tr_global_tss.ESP0 = (uint64_t)p1.kstack + KERNEL_STACK_SIZE;
+    cpu_controls.cr3 = p1.mm.pgd_paddr;
+    idt_init();
+    syscall_init();
+
+    // p1 faults and is blocked, p2 is running
+    // the swap-in may complete before p2 is scheduled
+    uint64_t async = async_swapin_count;
+    instruction_cycle();
+    assert(async_swapin_count - async == 1);
+    assert(cpu_controls.cr3 == p2.mm.pgd_paddr);
+
+    // p1 is scheduled again after the swap-in
+    // the I/O thread runs on the host: bound the cycles only to catch a hang
+    int p2_cycles = 1;
+    while (cpu_controls.cr3 == p2.mm.pgd_paddr)
+    {
+        instruction_cycle();
+        p2_cycles += 1;
+        assert(p2_cycles < (1 << 20));
+    }
+    assert(p1.state == PROC_RUNNABLE);
+    assert(cpu_reg.rbx == 0xabcd000000000008);
+    assert(pte->present == 1);
+    assert(check_frame(pte->ppn, 0xabcd000000000000) == 1);
+
+    printf("p2 ran %d cycles during the swap-in\n", p2_cycles);
+    printf(GREENSTR("Pass\n"));
+}
+
+int main()
+{
+    TestWatermarks();
+    TestManySwapins();
+    TestAsyncPageFault();
+    return 0;
+}
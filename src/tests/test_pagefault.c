@@ -25,10 +25,18 @@
 void map_pte4(pte4_t *pte, uint64_t ppn);
 void unmapall_pte4(uint64_t ppn);
 void page_map_init();
-void pagemap_dirty(uint64_t ppn);
-void pagemap_update_time(uint64_t ppn);
 void set_pagemap_swapaddr(uint64_t ppn, uint64_t swap_address);
 uint64_t allocate_swappage(uint64_t ppn);
+void free_swappage(uint64_t saddr);
+void duplicate_swappage(uint64_t saddr);
+int swap_in(uint64_t saddr, uint64_t ppn);
+int swap_out(uint64_t saddr, uint64_t ppn);
+pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate);
+
+// swap.c
+extern uint64_t swap_read_count;
+extern uint64_t swap_readahead_count;
+extern uint64_t swap_cache_hit_count;
 
 static void link_page_table(pte123_t *pgd, pte123_t *pud, pte123_t *pmd, pte4_t *pt,
     int ppn, address_t *vaddr)
@@ -100,6 +108,7 @@ static void TestPageFaultHandlingCase1()
     // Mark all other page_map as allocated
     uint64_t free_ppn = 13;
     pte4_t other_process_pte4[MAX_NUM_PHYSICAL_PAGE];
+    memset(&other_process_pte4, 0, sizeof(other_process_pte4));
     for (int i = 1; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
     {
         if (i != free_ppn)
@@ -176,16 +185,18 @@ static void TestPageFaultHandlingCase2()
     // Mark all other page_map as allocated
     uint64_t clean_ppn = 7;
     pte4_t other_process_pte4[MAX_NUM_PHYSICAL_PAGE];
+    memset(&other_process_pte4, 0, sizeof(other_process_pte4));
     for (int i = 1; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
     {
         map_pte4(&other_process_pte4[i], i);
 
         if (i != clean_ppn)
         {
-            pagemap_dirty(i);
+            // recently written by the other process
+            other_process_pte4[i].reference = 1;
+            other_process_pte4[i].dirty = 1;
         }
     }
-    pagemap_dirty(0);
 
     // create kernel stacks for trap into kernel
     uint8_t stack_buf[8192 * 2];
@@ -205,6 +216,10 @@ static void TestPageFaultHandlingCase2()
         instruction_cycle();
     }
 
+    // the clean frame not referenced is the victim
+    assert(other_process_pte4[clean_ppn].present == 0);
+    assert(other_process_pte4[clean_ppn - 1].present == 1);
+
     printf(GREENSTR("Pass\n"));
 }
 
@@ -254,21 +269,18 @@ static void TestPageFaultHandlingCase3()
 
     // Mark all other page_map as allocated
     pte4_t other_process_pte4[MAX_NUM_PHYSICAL_PAGE];
+    memset(&other_process_pte4, 0, sizeof(other_process_pte4));
     char filename[128];
+    uint64_t lru_ppn = 14;
     for (int i = 1; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
     {
         map_pte4(&other_process_pte4[i], i);
-        pagemap_dirty(i);
+        other_process_pte4[i].dirty = 1;
         allocate_swappage(i);
-    }
-    pagemap_dirty(0);
 
-    uint64_t lru_ppn = 14;
-    for (int i = 0; i < MAX_NUM_PHYSICAL_PAGE; ++ i)
-    {
         if (i != lru_ppn)
         {
-            pagemap_update_time(i);
+            other_process_pte4[i].reference = 1;
         }
     }
 
@@ -290,13 +302,187 @@ static void TestPageFaultHandlingCase3()
         instruction_cycle();
     }
 
+    // the hand skips the referenced frames
+    assert(other_process_pte4[lru_ppn].present == 0);
+    assert(other_process_pte4[lru_ppn + 1].present == 1);
+
     printf(GREENSTR("Pass; Check the swapped out files.\n"));
 }
 
+// resident set size of the simulator in bytes
+static uint64_t host_rss()
+{
+    uint64_t size = 0, resident = 0;
+    FILE *fr = fopen("/proc/self/statm", "r");
+    assert(fr != NULL);
+    assert(fscanf(fr, "%lu %lu", &size, &resident) == 2);
+    fclose(fr);
+    return resident * PAGE_SIZE;
+}
+
+static void TestLargePhysicalMemory()
+{
+    printf("================\nTesting large physical memory ...\n");
+
+    uint64_t rss = host_rss();
+
+    // 4GiB physical memory, 1M frames
+    uint64_t size = 1ul << 32;
+    physical_memory_init(size);
+    page_map_init();
+    assert(MAX_NUM_PHYSICAL_PAGE == (size >> PHYSICAL_PAGE_OFFSET_LENGTH));
+
+    // touch frames at the low, middle and top end
+    uint64_t ppns[3] = {0, MAX_NUM_PHYSICAL_PAGE / 2, MAX_NUM_PHYSICAL_PAGE - 1};
+    pte4_t ptes[3];
+    memset(&ptes, 0, sizeof(ptes));
+    for (int i = 0; i < 3; ++ i)
+    {
+        map_pte4(&ptes[i], ppns[i]);
+        assert(ptes[i].ppn == ppns[i]);
+
+        address_t paddr = {.address_value = (ppns[i] << PHYSICAL_PAGE_OFFSET_LENGTH) + 0xff8};
+        assert(paddr.ppn == ppns[i]);
+        cpu_write64bits_dram(paddr.paddr_value, 0xdeadbeef00000000 + i);
+    }
+    for (int i = 0; i < 3; ++ i)
+    {
+        uint64_t paddr = (ppns[i] << PHYSICAL_PAGE_OFFSET_LENGTH) + 0xff8;
+        assert(cpu_read64bits_dram(paddr) == 0xdeadbeef00000000 + i);
+    }
+
+    // untouched frames are not resident on the host
+    assert(host_rss() - rss < (64ul << 20));
+
+    // back to the default memory for the other tests
+    physical_memory_init(DEFAULT_PHYSICAL_MEMORY_SPACE);
+    page_map_init();
+    assert(MAX_NUM_PHYSICAL_PAGE == 16);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSwapSlots()
+{
+    printf("================\nTesting swap slots ...\n");
+
+    page_map_init();
+
+    // slots of one cluster are neighbors
+    uint64_t a = allocate_swappage(1);
+    uint64_t b = allocate_swappage(2);
+    assert(b == a + 1);
+
+    // one page is one I/O
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        *(uint64_t *)&pm[(1 << 12) + i] = 0x1111000000000000 + i;
+    }
+    swap_out(a, 1);
+    swap_in(a, 3);
+    assert(memcmp(&pm[1 << 12], &pm[3 << 12], PAGE_SIZE) == 0);
+
+    // shared by fork: the slot is kept till the last one is freed
+    for (int i = 0; i < 300; ++ i)
+    {
+        duplicate_swappage(a);
+    }
+    for (int i = 0; i < 300; ++ i)
+    {
+        free_swappage(a);
+    }
+    swap_in(a, 4);
+    assert(memcmp(&pm[1 << 12], &pm[4 << 12], PAGE_SIZE) == 0);
+    free_swappage(a);
+    free_swappage(b);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSwapReadahead()
+{
+    printf("================\nTesting swap readahead ...\n");
+
+    page_map_init();
+
+    // read 12 pages in swap space one by one
+    int num = 12;
+    uint64_t data_vaddr = 0x10000000;
+    char code[12][MAX_INSTRUCTION_CHAR];
+    for (int k = 0; k < num; ++ k)
+    {
+        sprintf(code[k], "mov 0x%lx, %%rbx", data_vaddr + k * PAGE_SIZE + 8);
+    }
+
+    pcb_t p1;
+    memset(&p1, 0, sizeof(pcb_t));
+    p1.pid = 1;
+    p1.next = &p1;
+    p1.prev = &p1;
+
+    static pte123_t p1_pgd[512];
+    memset(&p1_pgd, 0, sizeof(p1_pgd));
+    p1.mm.pgd = &p1_pgd[0];
+
+    address_t vaddr = {.address_value = 0x00400000};
+    map_pte4((pte4_t *)get_pagetableentry(p1_pgd, &vaddr, 4, 1), 0);
+    memcpy((char *)&pm[0], &code, sizeof(code));
+
+    // the pages are in adjacent slots, written by frame 1
+    pte4_t *ptes[12];
+    for (int k = 0; k < num; ++ k)
+    {
+        uint64_t saddr = allocate_swappage(1);
+        for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+        {
+            *(uint64_t *)&pm[(1 << 12) + i] = ((uint64_t)k << 32) + i;
+        }
+        swap_out(saddr, 1);
+
+        vaddr.address_value = data_vaddr + k * PAGE_SIZE;
+        ptes[k] = (pte4_t *)get_pagetableentry(p1_pgd, &vaddr, 4, 1);
+        ptes[k]->pte_value = 0;
+        ptes[k]->saddr = saddr;
+        assert(k == 0 || ptes[k]->saddr == ptes[k - 1]->saddr + 1);
+    }
+
+    p1.kstack = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    p1.kstack->threadinfo.pcb = &p1;
+    tr_global_tss.ESP0 = (uint64_t)p1.kstack + KERNEL_STACK_SIZE;
+    cpu_controls.cr3 = p1.mm.pgd_paddr;
+    cpu_pc.rip = 0x00400000;
+    idt_init();
+
+    uint64_t reads = swap_read_count;
+    uint64_t ahead = swap_readahead_count;
+    uint64_t hits = swap_cache_hit_count;
+    for (int k = 0; k < num; ++ k)
+    {
+        instruction_cycle();
+        assert(cpu_reg.rbx == ((uint64_t)k << 32) + 8);
+    }
+
+    // the window grows with the hits: 1, 2, 4, 8 pages
+    assert(swap_read_count - reads == 4);
+    assert(swap_readahead_count - ahead == 8);
+    assert(swap_cache_hit_count - hits == 8);
+    for (int k = 0; k < num; ++ k)
+    {
+        assert(ptes[k]->present == 1);
+        assert(*(uint64_t *)&pm[(ptes[k]->ppn << 12) + 0x10] == ((uint64_t)k << 32) + 0x10);
+    }
+
+    free(p1.kstack);
+    printf(GREENSTR("Pass\n"));
+}
+
 int main()
 {
     TestPageFaultHandlingCase1();
     TestPageFaultHandlingCase2();
     TestPageFaultHandlingCase3();
+    TestSwapSlots();
+    TestSwapReadahead();
+    TestLargePhysicalMemory();
     return 0;
 }
\ No newline at end of file
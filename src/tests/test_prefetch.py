@@ -0,0 +1,133 @@
+#!/usr/bin/python3
+# usage:
+#   /usr/bin/python3 ./src/tests/test_prefetch.py
+# Run the cache simulator (sram.c) with the hardware prefetchers
+# (prefetch.c) on streaming, strided and random traces.
+import os
+import random
+import subprocess
+from ctypes import *
+
+# cache shape: 16 sets, 4 ways, 64 bytes lines
+s, E, b = 4, 4, 6
+
+# same as the defaults in prefetch.c
+PREFETCH_BANDWIDTH = 4
+PREFETCH_WINDOW = 16
+
+NEXT_LINE = 0x1
+IP_STRIDE = 0x2
+STREAM = 0x4
+
+def build(name, prefetchers):
+    so = "./bin/prefetch_%s.so" % name
+    args = [
+        "/usr/bin/gcc-7",
+        "-Wall", "-g", "-O0", "-Werror", "-std=gnu99", "-Wno-unused-function",
+        "-I", "./src",
+        "-DCACHE_SIMULATION_VERIFICATION",
+        "-DSRAM_CACHE_INDEX_LENGTH=%d" % s,
+        "-DSRAM_CACHE_OFFSET_LENGTH=%d" % b,
+        "-DNUM_CACHE_LINE_PER_SET=%d" % E,
+        "-DSRAM_CACHE_TAG_LENGTH=%d" % (64 - s - b),
+        "-shared", "-fPIC",
+        "./src/hardware/cpu/sram.c",
+    ]
+    if prefetchers != 0:
+        args += [
+            "-DUSE_SRAM_PREFETCH",
+            "-DPREFETCHERS=%d" % prefetchers,
+            "./src/hardware/cpu/prefetch.c",
+        ]
+    args += ["-ldl", "-o", so]
+    subprocess.run(args)
+    return cdll.LoadLibrary(so)
+
+def run(name, prefetchers, trace):
+    lib = build(name, prefetchers)
+    for [pc, op, paddr] in trace:
+        if prefetchers != 0:
+            c_uint64.in_dll(lib, "trace_pc").value = pc
+        if op == "L":
+            lib.sram_cache_read(c_ulonglong(paddr))
+        else:
+            lib.sram_cache_write(c_ulonglong(paddr), c_byte(1))
+
+    hits = (c_int.in_dll(lib, "cache_hit_count")).value
+    misses = (c_int.in_dll(lib, "cache_miss_count")).value
+    assert(hits + misses == len(trace))
+
+    stat = { "misses": misses }
+    if prefetchers != 0:
+        for key in ["demand_miss", "issued", "useful", "useless", "pollution", "late"]:
+            stat[key] = (c_uint64.in_dll(lib, "prefetch_%s_count" % key)).value
+        assert(stat["demand_miss"] == misses)
+        assert(stat["useful"] + stat["useless"] <= stat["issued"])
+        # bandwidth budget of the prefetch queue
+        windows = (len(trace) + PREFETCH_WINDOW - 1) // PREFETCH_WINDOW
+        assert(stat["issued"] <= windows * PREFETCH_BANDWIDTH)
+        print("[%s]" % name)
+        lib.print_prefetch_stats()
+        lib.fflush(None)
+    return stat
+
+def streaming_trace():
+    # for (i = 0; i < n; ++ i) c[i] = a[i] + b[i];
+    trace = []
+    a, b, c = 0x10000, 0x20000, 0x30000
+    for i in range(4096):
+        trace += [[0x400100, "L", a + i * 4]]
+        trace += [[0x400108, "L", b + i * 4]]
+        trace += [[0x400110, "S", c + i * 4]]
+    return trace
+
+def strided_trace():
+    # walk one column of a row-major matrix: stride of 3 cache lines
+    trace = []
+    for i in range(2048):
+        trace += [[0x400200, "L", 0x40000 + i * 192]]
+        trace += [[0x400208, "L", 0x80000 + (i % 32) * 8]]
+    return trace
+
+def random_trace():
+    random.seed(1234)
+    trace = []
+    for i in range(8192):
+        trace += [[0x400300, "L", random.randint(0, 0x100000)]]
+    return trace
+
+def test_prefetch():
+    print("Testing hardware prefetchers ...")
+
+    if not os.path.isdir("./bin/"):
+        os.mkdir("./bin/")
+
+    # streaming loop: every prefetcher should hide most of the misses
+    trace = streaming_trace()
+    base = run("none", 0, trace)
+    for [name, prefetchers] in [
+            ["next_line", NEXT_LINE],
+            ["ip_stride", IP_STRIDE],
+            ["stream", STREAM],
+            ["all", NEXT_LINE | IP_STRIDE | STREAM]]:
+        stat = run(name, prefetchers, trace)
+        assert(stat["misses"] * 4 < base["misses"])
+        assert(stat["useful"] * 10 > stat["issued"] * 9)
+
+    # strided walk: only IP-stride can learn the stride
+    # one new line every 2 accesses is beyond the bandwidth budget,
+    # so only part of the misses can be hidden
+    trace = strided_trace()
+    base = run("none_strided", 0, trace)
+    stat = run("ip_stride_strided", IP_STRIDE, trace)
+    assert(stat["misses"] * 4 < base["misses"] * 3)
+
+    # random accesses: nothing to learn, the budget bounds the waste
+    trace = random_trace()
+    base = run("none_random", 0, trace)
+    stat = run("all_random", NEXT_LINE | IP_STRIDE | STREAM, trace)
+    assert(stat["useful"] * 2 < stat["issued"])
+
+    print("\033[32;1mPass\033[0m")
+
+test_prefetch()
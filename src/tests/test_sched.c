@@ -0,0 +1,373 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/instruction.h"
+#include "headers/interrupt.h"
+#include "headers/process.h"
+#include "headers/color.h"
+
+pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate);
+void map_pte4(pte4_t *pte, uint64_t ppn);
+void page_map_init();
+
+// isa.c
+extern uint64_t global_time;
+#ifdef USE_SCHED_SMP
+void smp_init(int num);
+void switch_core(int core);
+void smp_send_reschedule(int core);
+void smp_cycle();
+void sched_init_core(int core, pcb_t *idle);
+// schedule.c
+extern uint64_t sched_migration_count;
+#endif
+
+#ifndef SCHED_LATENCY
+#define SCHED_LATENCY (6000000)
+#endif
+
+#define NUM_PROCESS (40)
+
+static pcb_t procs[NUM_PROCESS];
+static pte123_t pgds[NUM_PROCESS][PAGE_TABLE_ENTRY_NUM];
+static kstack_t *kstacks[NUM_PROCESS];
+
+// getpid once, then spin
+static char code[3][MAX_INSTRUCTION_CHAR] = {
+    "movq $39, %rax",
+    "int $0x80",
+    "jmp 0x00400080",
+};
+
+// all processes share the code in frame 0
+static void create_process(int i, int nice)
+{
+    pcb_t *p = &procs[i];
+    memset(p, 0, sizeof(pcb_t));
+    p->pid = i + 1;
+    p->asid = i + 1;
+    p->sched.nice = nice;
+
+    // code page
+    memset(pgds[i], 0, sizeof(pgds[i]));
+    p->mm.pgd = pgds[i];
+    address_t vaddr = {.address_value = 0x00400000};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p->mm.pgd, &vaddr, 4, 1);
+    map_pte4(pte, 0);
+    memcpy((char *)&pm[0], code, sizeof(code));
+
+    // kernel stack with the trap frame to start from
+    if (kstacks[i] == NULL)
+    {
+        kstacks[i] = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+    }
+    p->kstack = kstacks[i];
+    p->kstack->threadinfo.pcb = p;
+    trapframe_t tf = {
+        .rip = 0x00400000,
+        .rsp = 0x7ffffffee0f0,
+    };
+    uint64_t stack_top = (uint64_t)p->kstack + KERNEL_STACK_SIZE;
+    memcpy((trapframe_t *)(stack_top - sizeof(trapframe_t)), &tf, sizeof(trapframe_t));
+    p->context.regs.rsp = stack_top - sizeof(trapframe_t) - sizeof(userframe_t);
+}
+
+#ifndef USE_SCHED_SMP
+static void run(uint64_t cycles)
+{
+    for (uint64_t i = 0; i < cycles; ++ i)
+    {
+        instruction_cycle();
+    }
+}
+#endif
+
+static double share(int i, uint64_t *runtime, uint64_t total)
+{
+    return (double)(procs[i].sched.sum_exec_runtime - runtime[i]) / total;
+}
+
+#ifndef USE_SCHED_SMP
+static void TestFairness()
+{
+    printf("Testing CFS fairness by nice ...\n");
+
+    page_map_init();
+    create_process(0, -5);
+    create_process(1, 0);
+    create_process(2, 5);
+
+    // process 1 is running, the others are in run queue
+    procs[0].sched.exec_start = global_time;
+    wake_up_new_process(&procs[1]);
+    wake_up_new_process(&procs[2]);
+
+    cpu_pc.rip = 0x00400000;
+    cpu_reg.rsp = 0x7ffffffee0f0;
+    tr_global_tss.ESP0 = (uint64_t)procs[0].kstack + KERNEL_STACK_SIZE;
+    cpu_controls.cr3 = procs[0].mm.pgd_paddr;
+    cpu_controls.asid = procs[0].asid;
+    idt_init();
+    syscall_init();
+
+    uint64_t total = 100 * SCHED_LATENCY;
+    uint64_t runtime[NUM_PROCESS] = {0};
+    run(total);
+
+    // CPU time by weight: 3121, 1024, 335
+    double weights[3] = {3121, 1024, 335};
+    for (int i = 0; i < 3; ++ i)
+    {
+        double expected = weights[i] / (3121 + 1024 + 335);
+        printf("nice %3d: share %.3f, expected %.3f, max wait %lu\n",
+            procs[i].sched.nice, share(i, runtime, total), expected,
+            procs[i].sched.max_wait_time);
+        assert(share(i, runtime, total) > expected - 0.02);
+        assert(share(i, runtime, total) < expected + 0.02);
+
+        // every runnable process runs once in a period
+        assert(procs[i].sched.max_wait_time <= SCHED_LATENCY);
+        assert(procs[i].sched.run_count > 0);
+    }
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestNewProcess()
+{
+    printf("Testing CFS latency of new process ...\n");
+
+    // the others have run for a long time
+    uint64_t runtime[NUM_PROCESS];
+    for (int i = 0; i < 3; ++ i)
+    {
+        runtime[i] = procs[i].sched.sum_exec_runtime;
+    }
+
+    create_process(3, 0);
+    wake_up_new_process(&procs[3]);
+
+    // the new process starts from min_vruntime:
+    // it runs in the current period
+    uint64_t start = global_time;
+    while (procs[3].sched.run_count == 0)
+    {
+        instruction_cycle();
+    }
+    assert(global_time - start <= SCHED_LATENCY);
+    printf("new process waits %lu cycles\n", global_time - start);
+
+    // but it does not monopolize CPU
+    runtime[3] = procs[3].sched.sum_exec_runtime;
+    uint64_t total = 100 * SCHED_LATENCY;
+    run(total);
+    for (int i = 0; i < 3; ++ i)
+    {
+        assert(share(i, runtime, total) > 0);
+    }
+    double expected = 1024.0 / (3121 + 1024 + 335 + 1024);
+    printf("new process: share %.3f, expected %.3f\n", share(3, runtime, total), expected);
+    assert(share(3, runtime, total) > expected - 0.02);
+    assert(share(3, runtime, total) < expected + 0.02);
+
+    printf(GREENSTR("Pass\n"));
+}
+#else
+static pcb_t idles[MAX_NUM_CORES];
+static kstack_t *idle_kstacks[MAX_NUM_CORES];
+static pte123_t idle_pgd[PAGE_TABLE_ENTRY_NUM];
+
+// idle process spins in frame 1
+static char idle_code[1][MAX_INSTRUCTION_CHAR] = {
+    "jmp 0x00400000",
+};
+
+// every core starts from its idle process
+static void boot_cores(int num)
+{
+    page_map_init();
+    smp_init(num);
+
+    memset(idle_pgd, 0, sizeof(idle_pgd));
+    address_t vaddr = {.address_value = 0x00400000};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(idle_pgd, &vaddr, 4, 1);
+    map_pte4(pte, 1);
+    memcpy((char *)&pm[1 << PHYSICAL_PAGE_OFFSET_LENGTH], idle_code, sizeof(idle_code));
+
+    idt_init();
+    syscall_init();
+
+    for (int i = 0; i < num; ++ i)
+    {
+        pcb_t *idle = &idles[i];
+        memset(idle, 0, sizeof(pcb_t));
+        idle->mm.pgd = idle_pgd;
+        if (idle_kstacks[i] == NULL)
+        {
+            idle_kstacks[i] = aligned_alloc(KERNEL_STACK_SIZE, KERNEL_STACK_SIZE);
+        }
+        idle->kstack = idle_kstacks[i];
+        idle->kstack->threadinfo.pcb = idle;
+        sched_init_core(i, idle);
+
+        switch_core(i);
+        cpu_pc.rip = 0x00400000;
+        cpu_reg.rsp = 0x7ffffffee0f0;
+        tr_global_tss.ESP0 = (uint64_t)idle->kstack + KERNEL_STACK_SIZE;
+        cpu_controls.cr3 = idle->mm.pgd_paddr;
+        smp_send_reschedule(i);
+    }
+    switch_core(0);
+}
+
+static void smp_run(uint64_t ticks)
+{
+    for (uint64_t i = 0; i < ticks; ++ i)
+    {
+        smp_cycle();
+    }
+}
+
+// the running process is charged when it is switched out
+static uint64_t get_runtime(pcb_t *p)
+{
+    uint64_t runtime = p->sched.sum_exec_runtime;
+    if (p->state == PROC_RUNNABLE && p->sched.on_rq == 0)
+    {
+        runtime += global_time - p->sched.exec_start;
+    }
+    return runtime;
+}
+
+static double get_throughput(int num, uint64_t *runtime, uint64_t ticks)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < num; ++ i)
+    {
+        sum += get_runtime(&procs[i]) - runtime[i];
+        runtime[i] = get_runtime(&procs[i]);
+    }
+    return (double)sum / ticks;
+}
+
+static void TestAffinity()
+{
+    printf("Testing SMP affinity and load balancing ...\n");
+
+    boot_cores(4);
+
+    // 8 processes are bound to core 0, 1 process to core 3
+    int num = 9;
+    uint64_t runtime[9];
+    for (int i = 0; i < num; ++ i)
+    {
+        create_process(i, 0);
+        procs[i].sched.cpus_allowed = (i < 8) ? 0x1 : 0x8;
+        wake_up_new_process(&procs[i]);
+        runtime[i] = 0;
+    }
+
+    uint64_t ticks = 20 * SCHED_LATENCY;
+    smp_run(ticks);
+    double throughput = get_throughput(num, runtime, ticks);
+    printf("bound: throughput %.2f cores\n", throughput);
+    assert(throughput < 2.05);
+    for (int i = 0; i < num; ++ i)
+    {
+        assert(procs[i].sched.core == ((i < 8) ? 0 : 3));
+        assert(procs[i].sched.nr_migrations == 0);
+    }
+
+    // released: the idle cores steal, the busy core pushes
+    uint64_t migrations = sched_migration_count;
+    for (int i = 0; i < 8; ++ i)
+    {
+        procs[i].sched.cpus_allowed = 0;
+    }
+    smp_run(ticks);
+    throughput = get_throughput(num, runtime, ticks);
+    printf("released: throughput %.2f cores, %lu migrations\n",
+        throughput, sched_migration_count - migrations);
+    assert(sched_migration_count - migrations > 0);
+
+    // balanced: all cores are busy, and nobody starves
+    smp_run(ticks);
+    throughput = get_throughput(num, runtime, ticks);
+    printf("balanced: throughput %.2f cores\n", throughput);
+    assert(throughput > 3.95);
+    for (int i = 0; i < num; ++ i)
+    {
+        assert(runtime[i] > 0);
+    }
+
+    // pinned process never moves
+    assert(procs[8].sched.core == 3);
+    assert(procs[8].sched.nr_migrations == 0);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestScaling()
+{
+    printf("Testing SMP scaling ...\n");
+
+    int num = 32;
+    uint64_t ticks = 10 * SCHED_LATENCY;
+    for (int cores = 1; cores <= MAX_NUM_CORES; cores *= 2)
+    {
+        boot_cores(cores);
+
+        uint64_t runtime[32];
+        for (int i = 0; i < num; ++ i)
+        {
+            create_process(i, 0);
+            wake_up_new_process(&procs[i]);
+            runtime[i] = get_runtime(&procs[i]);
+        }
+
+        uint64_t migrations = sched_migration_count;
+        smp_run(ticks);
+        double throughput = get_throughput(num, runtime, ticks);
+        uint64_t max_wait = 0;
+        for (int i = 0; i < num; ++ i)
+        {
+            if (procs[i].sched.max_wait_time > max_wait)
+            {
+                max_wait = procs[i].sched.max_wait_time;
+            }
+        }
+        printf("%2d cores: throughput %5.2f, max wait %5lu, %lu migrations\n",
+            cores, throughput, max_wait, sched_migration_count - migrations);
+        assert(throughput > 0.95 * cores);
+    }
+
+    printf(GREENSTR("Pass\n"));
+}
+#endif
+
+int main()
+{
+#ifdef USE_SCHED_SMP
+    TestAffinity();
+    TestScaling();
+#else
+    TestFairness();
+    TestNewProcess();
+#endif
+    return 0;
+}
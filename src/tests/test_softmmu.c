@@ -0,0 +1,147 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/color.h"
+
+pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate);
+void page_map_init();
+void map_pte4(pte4_t *pte, uint64_t ppn);
+void unmapall_pte4(uint64_t ppn);
+
+static pte123_t pgd[PAGE_TABLE_ENTRY_NUM];
+
+static pte4_t *map_page(uint64_t vaddr_value, uint64_t ppn)
+{
+    address_t vaddr = {.address_value = vaddr_value};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(pgd, &vaddr, 4, 1);
+    map_pte4(pte, ppn);
+    return pte;
+}
+
+static void TestFastPath()
+{
+    printf("Testing softmmu fast path ...\n");
+
+    page_map_init();
+    softmmu_flush();
+    cpu_controls.cr3 = (uint64_t)&pgd[0];
+    cpu_controls.asid = 1;
+    map_page(0x7fff0000, 2);
+    map_page(0x7fff1000, 3);
+
+    // the first write misses, the others hit
+    uint64_t hit = softmmu_hit_count;
+    uint64_t miss = softmmu_miss_count;
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        virtual_write_data(0x7fff0000 + i, 0xabcd0000 + i);
+    }
+    assert(softmmu_miss_count - miss == 1);
+    assert(softmmu_hit_count - hit == PAGE_SIZE / 8 - 1);
+
+    // a writable page is readable
+    miss = softmmu_miss_count;
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        assert(virtual_read_data(0x7fff0000 + i) == 0xabcd0000 + i);
+        assert(*(uint64_t *)&pm[(2 << 12) + i] == 0xabcd0000 + i);
+    }
+    assert(softmmu_miss_count == miss);
+
+    // read fill does not allow write
+    virtual_read_data(0x7fff1000);
+    miss = softmmu_miss_count;
+    virtual_write_data(0x7fff1008, 0x1234);
+    assert(softmmu_miss_count - miss == 1);
+    virtual_write_data(0x7fff1010, 0x5678);
+    assert(softmmu_miss_count - miss == 1);
+
+    // must not cross the page
+    miss = softmmu_miss_count;
+    char buf[MAX_INSTRUCTION_CHAR];
+    virtual_read_inst(0x7fff0000, buf);
+    virtual_read_inst(0x7fff0000 + PAGE_SIZE - 32, buf);
+    virtual_read_inst(0x7fff0000 + PAGE_SIZE - 64, buf);
+    assert(softmmu_miss_count - miss == 2);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestFlush()
+{
+    printf("Testing softmmu flush on swap ...\n");
+
+    softmmu_flush();
+    cpu_controls.cr3 = (uint64_t)&pgd[0];
+    pte4_t *pte = map_page(0x7fff2000, 4);
+
+    *(uint64_t *)&pm[(4 << 12) + 0x10] = 0x4444;
+    *(uint64_t *)&pm[(5 << 12) + 0x10] = 0x5555;
+
+    assert(virtual_read_data(0x7fff2010) == 0x4444);
+    assert(virtual_read_data(0x7fff2010) == 0x4444);
+
+    // swap out frame 4, then swap in to frame 5
+    unmapall_pte4(4);
+    map_pte4(pte, 5);
+    assert(virtual_read_data(0x7fff2010) == 0x5555);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSpeed()
+{
+    printf("Testing softmmu speed ...\n");
+
+    softmmu_flush();
+    uint64_t sum = 0;
+    clock_t start = clock();
+    for (int k = 0; k < 1000; ++ k)
+    {
+        for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+        {
+            sum += virtual_read_data(0x7fff0000 + i);
+        }
+    }
+    double fast = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int k = 0; k < 1000; ++ k)
+    {
+        for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+        {
+            // the path without softmmu
+            sum -= cpu_read64bits_dram(va2pa(0x7fff0000 + i, MMU_READ));
+        }
+    }
+    double slow = (double)(clock() - start) / CLOCKS_PER_SEC;
+    assert(sum == 0);
+
+    printf("512000 reads: softmmu %.3fs, va2pa %.3fs\n", fast, slow);
+    printf("softmmu hit %lu, miss %lu\n", softmmu_hit_count, softmmu_miss_count);
+    printf(GREENSTR("Pass\n"));
+}
+
+int main()
+{
+    TestFastPath();
+    TestFlush();
+    TestSpeed();
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/color.h"
+
+// sram.c
+extern uint64_t sram_cycle;
+extern uint64_t sram_finish_cycle;
+extern uint64_t sram_mshr_miss_count;
+extern uint64_t sram_mshr_merge_count;
+extern uint64_t sram_mshr_inflight_sum;
+extern uint64_t sram_wb_push_count;
+extern uint64_t sram_wb_forward_count;
+void print_sram_timing();
+#ifdef USE_SRAM_PREFETCH
+extern uint64_t sram_prefetch_mshr_count;
+// prefetch.c
+extern int prefetchers;
+extern uint64_t prefetch_issued_count;
+void print_prefetch_stats();
+#endif
+
+// the DRAM image when all writes go through
+static uint8_t shadow[DEFAULT_PHYSICAL_MEMORY_SPACE];
+
+static uint64_t shadow_read64(uint64_t paddr)
+{
+    uint64_t val = 0;
+    for (int i = 0; i < 8; ++ i)
+    {
+        val += ((uint64_t)shadow[paddr + i]) << (i * 8);
+    }
+    return val;
+}
+
+static void shadow_write64(uint64_t paddr, uint64_t data)
+{
+    for (int i = 0; i < 8; ++ i)
+    {
+        shadow[paddr + i] = (data >> (i * 8)) & 0xff;
+    }
+}
+
+static void TestWriteBack()
+{
+    printf("Testing write-back through write buffer ...\n");
+
+    srand(1234);
+    memset(pm, 0, PHYSICAL_MEMORY_SPACE);
+    memset(shadow, 0, PHYSICAL_MEMORY_SPACE);
+
+    // random 64-bit writes and reads all over the physical memory
+    // lots of dirty evictions go through the write buffer
+    for (int i = 0; i < 100000; ++ i)
+    {
+        uint64_t paddr = (rand() % (PHYSICAL_MEMORY_SPACE / 8)) * 8;
+        if (rand() % 2 == 0)
+        {
+            uint64_t data = ((uint64_t)rand() << 32) | (uint64_t)rand();
+            cpu_write64bits_dram(paddr, data);
+            shadow_write64(paddr, data);
+        }
+        else
+        {
+            assert(cpu_read64bits_dram(paddr) == shadow_read64(paddr));
+        }
+    }
+
+    // 9 dirty lines in one set of 8 ways: the 1st line is evicted
+    // and read back at once, the data comes from the write buffer
+    uint64_t forward = sram_wb_forward_count;
+    uint64_t set_stride = 1 << (SRAM_CACHE_INDEX_LENGTH + SRAM_CACHE_OFFSET_LENGTH);
+    for (int i = 0; i < 9; ++ i)
+    {
+        cpu_write64bits_dram(i * set_stride + 0x40, 0xabcd0000 + i);
+        shadow_write64(i * set_stride + 0x40, 0xabcd0000 + i);
+    }
+    assert(cpu_read64bits_dram(0x40) == 0xabcd0000);
+    assert(sram_wb_forward_count > forward);
+
+    for (uint64_t paddr = 0; paddr < PHYSICAL_MEMORY_SPACE; paddr += 8)
+    {
+        assert(cpu_read64bits_dram(paddr) == shadow_read64(paddr));
+    }
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestMemoryParallelism()
+{
+    printf("Testing memory-level parallelism of MSHRs ...\n");
+
+    uint64_t cycle = sram_cycle > sram_finish_cycle ? sram_cycle : sram_finish_cycle;
+    uint64_t miss = sram_mshr_miss_count;
+    uint64_t merge = sram_mshr_merge_count;
+    uint64_t inflight = sram_mshr_inflight_sum;
+#ifdef USE_SRAM_PREFETCH
+    uint64_t prefetches = sram_prefetch_mshr_count;
+#endif
+
+    // read one word of every line: each line misses once and the other
+    // bytes of the word merge, the misses of next lines overlap
+    uint64_t sum = 0;
+    for (uint64_t paddr = 0; paddr < PHYSICAL_MEMORY_SPACE; paddr += (1 << SRAM_CACHE_OFFSET_LENGTH))
+    {
+        sum += cpu_read64bits_dram(paddr);
+    }
+    printf("checksum %lx\n", sum);
+
+    uint64_t cycles = (sram_cycle > sram_finish_cycle ? sram_cycle : sram_finish_cycle) - cycle;
+    miss = sram_mshr_miss_count - miss;
+    merge = sram_mshr_merge_count - merge;
+    inflight = sram_mshr_inflight_sum - inflight;
+
+    assert(miss > 0);
+    assert(merge > 0);
+    // misses overlap each other
+    assert(inflight > miss);
+    // much faster than serializing every line read from DRAM
+    uint64_t reads = miss;
+#ifdef USE_SRAM_PREFETCH
+    reads += sram_prefetch_mshr_count - prefetches;
+#endif
+    assert(cycles * 2 < reads * 100);
+
+    print_sram_timing();
+    printf(GREENSTR("Pass\n"));
+}
+
+#ifdef USE_SRAM_PREFETCH
+// cycles to read every word in [start, end)
+// the accesses to one line fill its MSHR, then the core waits for it
+static uint64_t scan_cycles(uint64_t start, uint64_t end)
+{
+    uint64_t cycle = sram_cycle > sram_finish_cycle ? sram_cycle : sram_finish_cycle;
+    uint64_t sum = 0;
+    for (uint64_t paddr = start; paddr < end; paddr += 8)
+    {
+        sum += cpu_read64bits_dram(paddr);
+    }
+    printf("checksum %lx\n", sum);
+    return (sram_cycle > sram_finish_cycle ? sram_cycle : sram_finish_cycle) - cycle;
+}
+
+static void TestPrefetchTiming()
+{
+    printf("Testing prefetch through MSHRs ...\n");
+
+    // the cache holds half of the memory: each scan misses on every line
+    uint64_t half = PHYSICAL_MEMORY_SPACE / 2;
+    int enabled = prefetchers;
+    prefetchers = 0;
+    scan_cycles(half, PHYSICAL_MEMORY_SPACE);
+    uint64_t issued = prefetch_issued_count;
+    uint64_t requests = sram_prefetch_mshr_count;
+    uint64_t cold = scan_cycles(0, half);
+    assert(prefetch_issued_count == issued);
+
+    prefetchers = enabled;
+    uint64_t warm = scan_cycles(half, PHYSICAL_MEMORY_SPACE);
+    printf("scan: %lu cycles without prefetch, %lu cycles with prefetch\n", cold, warm);
+
+    // every prefetch is a DRAM request holding an MSHR
+    assert(prefetch_issued_count > issued);
+    assert(sram_prefetch_mshr_count - requests == prefetch_issued_count - issued);
+    // the latency is hidden in part
+    assert(warm < cold);
+
+    print_sram_timing();
+    print_prefetch_stats();
+    printf(GREENSTR("Pass\n"));
+}
+#endif
+
+int main()
+{
+    TestWriteBack();
+    TestMemoryParallelism();
+#ifdef USE_SRAM_PREFETCH
+    TestPrefetchTiming();
+#endif
+    return 0;
+}
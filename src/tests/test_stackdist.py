@@ -0,0 +1,117 @@
+#!/usr/bin/python3
+# usage:
+#   /usr/bin/python3 ./src/tests/test_stackdist.py
+# Check the one-pass stack distance analysis against the
+# cache simulator (sram.c) of every single (s, E, b) shape.
+import os
+import random
+import subprocess
+from ctypes import *
+
+trace_file = "./bin/stackdist.trace"
+
+def generate_trace(filename, n):
+    # mix streaming, strided and random accesses
+    # so that all kinds of stack distances show up
+    # keep the addresses inside the 16-bit physical address of sram.c
+    random.seed(1234)
+    with open(filename, "w", encoding = 'ascii') as fw:
+        base = 0x1000
+        for i in range(n):
+            r = random.random()
+            if r < 0.4:
+                paddr = base + (i % 512) * 4
+            elif r < 0.7:
+                paddr = base + 0x8000 + ((i * 72) % 8192)
+            else:
+                paddr = base + random.randint(0, 0x4000)
+            op = "L" if random.random() < 0.7 else "S"
+            fw.write(" %s %x,4\n" % (op, paddr))
+
+def run_csim(s, E, b):
+    # same as test_cache.py, one shared library for each shape
+    so = "./bin/csim_%d_%d_%d.so" % (s, E, b)
+    subprocess.run(
+        [
+            "/usr/bin/gcc-7",
+            "-Wall", "-g", "-O0", "-Werror", "-std=gnu99", "-Wno-unused-function",
+            "-I", "./src",
+            "-DCACHE_SIMULATION_VERIFICATION",
+            "-DSRAM_CACHE_INDEX_LENGTH=%d" % s,
+            "-DSRAM_CACHE_OFFSET_LENGTH=%d" % b,
+            "-DNUM_CACHE_LINE_PER_SET=%d" % E,
+            "-DSRAM_CACHE_TAG_LENGTH=%d" % (64 - s - b),
+            "-shared", "-fPIC",
+            "./src/hardware/cpu/sram.c",
+            "-ldl", "-o", so
+        ])
+    lib = cdll.LoadLibrary(so)
+
+    with open(trace_file, "r", encoding = 'ascii') as fr:
+        for line in fr.readlines():
+            [op, addr] = line.strip(" \n").split(" ")
+            paddr = int(addr.split(",")[0], 16)
+            if op == "L":
+                lib.sram_cache_read(c_ulonglong(paddr))
+            else:
+                lib.sram_cache_write(c_ulonglong(paddr), c_byte(1))
+
+    return [
+        (c_int.in_dll(lib, "cache_hit_count")).value,
+        (c_int.in_dll(lib, "cache_miss_count")).value,
+        (c_int.in_dll(lib, "cache_evict_count")).value,
+    ]
+
+def test_stackdist():
+    print("Testing one-pass stack distance analysis ...")
+
+    generate_trace(trace_file, 20000)
+
+    subprocess.run(
+        [
+            "/usr/bin/gcc-7",
+            "-Wall", "-g", "-O0", "-Werror", "-std=gnu99", "-Wno-unused-function",
+            "-I", "./src",
+            "-shared", "-fPIC",
+            "./src/hardware/cpu/stackdist.c",
+            "-o", "./bin/stackdist.so"
+        ])
+    lib = cdll.LoadLibrary("./bin/stackdist.so")
+    lib.stackdist_run.restype = c_uint64
+    lib.stackdist_hits.restype = c_uint64
+    lib.stackdist_misses.restype = c_uint64
+    lib.stackdist_evictions.restype = c_uint64
+
+    # s = 0 is not supported by the bit fields of sram.c
+    shapes = [
+        # s E b
+        [1, 1,  4],
+        [1, 8,  4],
+        [2, 1,  3],
+        [3, 2,  4],
+        [4, 4,  5],
+        [5, 1,  6],
+        [6, 16, 2],
+    ]
+
+    for b in set([shape[2] for shape in shapes]):
+        # one trace read covers all s and E for this block size
+        n = lib.stackdist_run(c_char_p(trace_file.encode("ascii")), c_int(6), c_int(b), c_int(64))
+        assert(n == 20000)
+
+        for [s, E, _] in [shape for shape in shapes if shape[2] == b]:
+            ref = run_csim(s, E, b)
+            test = [
+                lib.stackdist_hits(c_int(s), c_int(E)),
+                lib.stackdist_misses(c_int(s), c_int(E)),
+                lib.stackdist_evictions(c_int(s), c_int(E)),
+            ]
+            print("\ts=%d E=%d b=%d\t" % (s, E, b), test, ref)
+            assert(test == ref)
+
+    lib.stackdist_free()
+    print("\033[32;1mPass\033[0m")
+
+if not os.path.isdir("./bin/"):
+    os.mkdir("./bin/")
+test_stackdist()
@@ -0,0 +1,334 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/process.h"
+#include "headers/color.h"
+
+pte123_t *get_pagetableentry(pte123_t *pgd, address_t *vaddr, int level, int allocate);
+void page_map_init();
+void map_pte4(pte4_t *pte, uint64_t ppn);
+void map_pte4_vaddr(pte4_t *pte, uint64_t ppn, uint64_t vaddr);
+void unmapall_pte4(uint64_t ppn);
+int allocate_physicalframe(pte4_t *pte, uint64_t vaddr);
+
+static void map_page(pte123_t *pgd, uint64_t vaddr_value, uint64_t ppn)
+{
+    address_t vaddr = {.address_value = vaddr_value};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(pgd, &vaddr, 4, 1);
+    pte->present = 1;
+    pte->ppn = ppn;
+}
+
+static void switch_to(pte123_t *pgd, uint64_t asid)
+{
+    cpu_controls.cr3 = (uint64_t)pgd;
+    cpu_controls.asid = asid;
+}
+
+// translate and return the TLB level: 1 - L1 hit; 2 - STLB hit; 3 - page walk
+// ppn - the 4KB frame of vaddr, inside a huge page as well
+static int translate(uint64_t vaddr, int access, uint64_t ppn)
+{
+    int l1 = access == MMU_FETCH ? TLB_ITLB : TLB_DTLB;
+    uint64_t l1_hit = tlb_hit_count[l1];
+    uint64_t l2_hit = tlb_hit_count[TLB_STLB];
+
+    uint64_t paddr = va2pa(vaddr, access);
+    assert(paddr == ((ppn << PHYSICAL_PAGE_OFFSET_LENGTH) | (vaddr & 0xfff)));
+
+    if (tlb_hit_count[l1] > l1_hit)
+    {
+        return 1;
+    }
+    if (tlb_hit_count[TLB_STLB] > l2_hit)
+    {
+        return 2;
+    }
+    return 3;
+}
+
+static pte123_t pgd1[PAGE_TABLE_ENTRY_NUM];
+static pte123_t pgd2[PAGE_TABLE_ENTRY_NUM];
+
+static void TestTwoLevels()
+{
+    printf("Testing iTLB, dTLB and STLB ...\n");
+
+    flush_tlb();
+    map_page(pgd1, 0x00400000, 1);
+    map_page(pgd1, 0x7fff0000, 2);
+    switch_to(pgd1, 1);
+
+    // instruction fetch goes to iTLB
+    assert(translate(0x00400010, MMU_FETCH, 1) == 3);
+    assert(translate(0x00400020, MMU_FETCH, 1) == 1);
+
+    // data read of the code page misses dTLB but hits STLB
+    assert(translate(0x00400018, MMU_READ, 1) == 2);
+    assert(translate(0x00400018, MMU_READ, 1) == 1);
+
+    // the first write of a clean page walks the page table
+    assert(translate(0x7fff0008, MMU_READ, 2) == 3);
+    assert(translate(0x7fff0008, MMU_WRITE, 2) == 3);
+    assert(translate(0x7fff0010, MMU_WRITE, 2) == 1);
+    assert(translate(0x7fff0010, MMU_READ, 2) == 1);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestAddressSpaceID()
+{
+    printf("Testing ASID tagging ...\n");
+
+    flush_tlb();
+    map_page(pgd2, 0x00400000, 3);
+
+    switch_to(pgd1, 1);
+    assert(translate(0x00400000, MMU_FETCH, 1) == 3);
+
+    // same virtual address in another address space
+    switch_to(pgd2, 2);
+    assert(translate(0x00400000, MMU_FETCH, 3) == 3);
+    assert(translate(0x00400000, MMU_FETCH, 3) == 1);
+
+    // switching back does not flush
+    switch_to(pgd1, 1);
+    assert(translate(0x00400000, MMU_FETCH, 1) == 1);
+
+    // flush only one address space
+    flush_tlb_asid(1);
+    assert(translate(0x00400000, MMU_FETCH, 1) == 3);
+    switch_to(pgd2, 2);
+    assert(translate(0x00400000, MMU_FETCH, 3) == 1);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestReplacement()
+{
+    printf("Testing TLB replacement ...\n");
+
+    // 5 pages in the same dTLB set of 4 ways
+    uint64_t stride = (1 << 4) << PHYSICAL_PAGE_OFFSET_LENGTH;
+    for (int i = 0; i < 5; ++ i)
+    {
+        map_page(pgd1, 0x10000000 + i * stride, 16 + i);
+    }
+
+    flush_tlb();
+    switch_to(pgd1, 1);
+    for (int i = 0; i < 4; ++ i)
+    {
+        assert(translate(0x10000000 + i * stride, MMU_READ, 16 + i) == 3);
+    }
+    assert(translate(0x10000000, MMU_READ, 16) == 1);
+
+    // the 5th page evicts one of the others, not the recently used one
+    assert(translate(0x10000000 + 4 * stride, MMU_READ, 20) == 3);
+    assert(translate(0x10000000, MMU_READ, 16) == 1);
+
+#if !defined(TLB_REPLACEMENT) || TLB_REPLACEMENT == 0
+    // LRU: the least recently used page is evicted
+    assert(translate(0x10000000 + 1 * stride, MMU_READ, 17) == 2);
+#else
+    // tree PLRU: the left half was used more recently, and
+    // way 3 was used after way 2
+    assert(translate(0x10000000 + 2 * stride, MMU_READ, 18) == 2);
+#endif
+
+    print_tlb_stats();
+    printf(GREENSTR("Pass\n"));
+}
+
+// page walk: memory references done and saved by PWC
+static void walk(uint64_t vaddr, uint64_t ppn, uint64_t refs, uint64_t saved)
+{
+    uint64_t r = pagewalk_ref_count;
+    uint64_t s = pagewalk_saved_count;
+    assert(translate(vaddr, MMU_READ, ppn) == 3);
+    assert(pagewalk_ref_count - r == refs);
+    assert(pagewalk_saved_count - s == saved);
+}
+
+static void TestPageWalkCache()
+{
+    printf("Testing page walk cache ...\n");
+
+    page_map_init();
+    map_page(pgd1, 0x7fff1000, 4);
+    // another PMD entry in the same PUD
+    map_page(pgd1, 0x7fc00000, 5);
+
+    flush_tlb();
+    flush_pwc();
+    switch_to(pgd1, 1);
+
+    // PGD, PUD, PMD, PT
+    walk(0x7fff0000, 2, 4, 0);
+    // neighbor page: only PT
+    walk(0x7fff1000, 4, 1, 3);
+    // PMD, PT
+    walk(0x7fc00000, 5, 2, 2);
+
+    // CR3 changed
+    switch_to(pgd2, 2);
+    walk(0x00400000, 3, 4, 0);
+    switch_to(pgd1, 1);
+    flush_tlb();
+    walk(0x7fff0000, 2, 4, 0);
+
+    // leaf updated: the tables are still cached
+    address_t vaddr = {.address_value = 0x7fff2000};
+    pte4_t *pte = (pte4_t *)get_pagetableentry(pgd1, &vaddr, 4, 1);
+    map_pte4(pte, 6);
+    walk(0x7fff2000, 6, 1, 3);
+    walk(0x7fff1000, 4, 1, 3);
+
+    // page fault fixed by a new frame
+    vaddr.address_value = 0x7fff5000;
+    pte = (pte4_t *)get_pagetableentry(pgd1, &vaddr, 4, 1);
+    assert(allocate_physicalframe(pte, vaddr.address_value) == 1);
+    walk(0x7fff5000, pte->ppn, 1, 3);
+
+    print_pwc_stats();
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestFlushPage()
+{
+    printf("Testing TLB flush of one page ...\n");
+
+    page_map_init();
+    flush_tlb();
+
+    // frame 7 is shared by two address spaces
+    address_t vaddr = {.address_value = 0x7fff3000};
+    pte4_t *pte1 = (pte4_t *)get_pagetableentry(pgd1, &vaddr, 4, 1);
+    pte4_t *pte2 = (pte4_t *)get_pagetableentry(pgd2, &vaddr, 4, 1);
+    map_pte4_vaddr(pte1, 7, vaddr.address_value);
+    map_pte4_vaddr(pte2, 7, vaddr.address_value);
+    map_page(pgd1, 0x7fff4000, 8);
+
+    switch_to(pgd2, 2);
+    assert(translate(0x7fff3000, MMU_READ, 7) == 3);
+    switch_to(pgd1, 1);
+    assert(translate(0x7fff3000, MMU_READ, 7) == 3);
+    assert(translate(0x7fff4000, MMU_READ, 8) == 3);
+    assert(translate(0x00400000, MMU_FETCH, 1) == 3);
+
+    // the frame is reclaimed and the PTEs are mapped again:
+    // the stale translations of both address spaces are invalid
+    unmapall_pte4(7);
+    map_pte4_vaddr(pte1, 9, vaddr.address_value);
+    map_pte4_vaddr(pte2, 10, vaddr.address_value);
+    assert(translate(0x7fff3000, MMU_READ, 9) == 3);
+    switch_to(pgd2, 2);
+    assert(translate(0x7fff3000, MMU_READ, 10) == 3);
+
+    // the other pages are kept
+    switch_to(pgd1, 1);
+    assert(translate(0x7fff4000, MMU_READ, 8) == 1);
+    assert(translate(0x00400000, MMU_FETCH, 1) == 1);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestHugePage()
+{
+    printf("Testing huge pages ...\n");
+
+    // large enough for contiguous frames of 2MB and 1GB pages
+    physical_memory_init(2 * HUGE_PAGE_1G_SIZE);
+    page_map_init();
+    flush_tlb();
+
+    pcb_t p;
+    memset(&p, 0, sizeof(pcb_t));
+    p.pid = 3;
+    p.asid = 3;
+    p.next = &p;
+    p.prev = &p;
+
+    // 2MB aligned with one more 4KB page, and 1GB aligned
+    uint64_t starts[2] = {0x00200000, 0x40000000};
+    uint64_t ends[2] = {0x00200000 + HUGE_PAGE_2M_SIZE + PAGE_SIZE, 0x40000000 + HUGE_PAGE_1G_SIZE};
+    const char *paths[2] = {"[heap]", "[anon]"};
+    for (int i = 0; i < 2; ++ i)
+    {
+        vm_area_t *a = kmem_cache_alloc(KMEM_VMA);
+        memset(a, 0, sizeof(vm_area_t));
+        a->vma_start = starts[i];
+        a->vma_end = ends[i];
+        a->vma_mode.read = 1;
+        a->vma_mode.write = 1;
+        a->vma_mode.private = 1;
+        strcpy(a->filepath, paths[i]);
+        vma_add_area(&p, a);
+    }
+    setup_pagetable_from_vma(&p);
+    switch_to(p.mm.pgd, p.asid);
+
+    // 2MB leaf in PMD
+    address_t vaddr = {.address_value = 0x00200000};
+    pte123_t *leaf = get_pagetableentry(p.mm.pgd, &vaddr, 4, 0);
+    assert(leaf->present == 1 && leaf->pagesize == 1);
+    uint64_t ppn = ((pte4_t *)leaf)->ppn;
+    assert(ppn % PAGE_TABLE_ENTRY_NUM == 0);
+
+    // one TLB entry covers all 512 frames
+    assert(translate(0x00200000, MMU_READ, ppn) == 3);
+    for (uint64_t i = 1; i < PAGE_TABLE_ENTRY_NUM; ++ i)
+    {
+        assert(translate(0x00200008 + i * PAGE_SIZE, MMU_READ, ppn + i) == 1);
+    }
+
+    // the tail is a 4KB page
+    vaddr.address_value = 0x00400000;
+    pte4_t *pte = (pte4_t *)get_pagetableentry(p.mm.pgd, &vaddr, 4, 0);
+    assert(pte->present == 1);
+    assert(translate(0x00400000, MMU_READ, pte->ppn) == 3);
+
+    // write through the huge page
+    virtual_write_data(0x00200000 + 0x1ff008, 0x1122334455667788);
+    assert(*(uint64_t *)&pm[(ppn << PHYSICAL_PAGE_OFFSET_LENGTH) + 0x1ff008] == 0x1122334455667788);
+
+    // 1GB leaf in PUD
+    vaddr.address_value = 0x40000000;
+    leaf = get_pagetableentry(p.mm.pgd, &vaddr, 4, 0);
+    assert(leaf->present == 1 && leaf->pagesize == 1);
+    ppn = ((pte4_t *)leaf)->ppn;
+    assert(ppn % (PAGE_TABLE_ENTRY_NUM * PAGE_TABLE_ENTRY_NUM) == 0);
+
+    assert(translate(0x40000000, MMU_FETCH, ppn) == 3);
+    assert(translate(0x40000000 + 0x3ffff010, MMU_FETCH, ppn + 0x3ffff) == 1);
+    assert(translate(0x40000000 + 0x12345678, MMU_READ, ppn + 0x12345) == 2);
+
+    print_tlb_stats();
+    printf(GREENSTR("Pass\n"));
+}
+
+int main()
+{
+    TestTwoLevels();
+    TestAddressSpaceID();
+    TestReplacement();
+    TestPageWalkCache();
+    TestFlushPage();
+    TestHugePage();
+    return 0;
+}
@@ -0,0 +1,168 @@
+/* BCST - Introduction to Computer Systems
+ * Author:      yangminz@outlook.com
+ * Github:      https://github.com/yangminz/bcst_csapp
+ * Bilibili:    https://space.bilibili.com/4564101
+ * Zhihu:       https://www.zhihu.com/people/zhao-yang-min
+ * This project (code repository and videos) is exclusively owned by yangminz
+ * and shall not be used for commercial and profitting purpose
+ * without yangminz's permission.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "headers/cpu.h"
+#include "headers/memory.h"
+#include "headers/common.h"
+#include "headers/address.h"
+#include "headers/color.h"
+
+void page_map_init();
+uint64_t allocate_swappage(uint64_t ppn);
+void free_swappage(uint64_t saddr);
+int swap_in(uint64_t saddr, uint64_t ppn);
+int swap_out(uint64_t saddr, uint64_t ppn);
+
+// swap.c
+extern uint64_t zswap_pool_size;
+extern uint64_t zswap_store_count;
+extern uint64_t zswap_same_filled_count;
+extern uint64_t zswap_reject_count;
+extern uint64_t zswap_load_count;
+extern uint64_t zswap_spill_count;
+extern uint64_t swap_read_count;
+extern uint64_t swap_write_count;
+
+#ifndef ZSWAP_POOL_LIMIT
+#define ZSWAP_POOL_LIMIT (64 << 10)
+#endif
+
+static uint8_t *frame(uint64_t ppn)
+{
+    return &pm[ppn << PHYSICAL_PAGE_OFFSET_LENGTH];
+}
+
+// xorshift, the same seed gives the same page
+static void fill_random(uint8_t *buf, uint64_t length, uint64_t seed)
+{
+    uint64_t x = seed * 0x9e3779b97f4a7c15 + 1;
+    for (uint64_t i = 0; i < length; ++ i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = x & 0xff;
+    }
+}
+
+// store one page and load it back to frame 2
+static void round_trip(uint64_t saddr)
+{
+    memset(frame(2), 0xcc, PAGE_SIZE);
+    swap_out(saddr, 1);
+    swap_in(saddr, 2);
+    assert(memcmp(frame(1), frame(2), PAGE_SIZE) == 0);
+}
+
+static void TestCompress()
+{
+    printf("Testing zswap compression ...\n");
+
+    page_map_init();
+    uint64_t saddr = allocate_swappage(1);
+    uint64_t writes = swap_write_count;
+    uint64_t reads = swap_read_count;
+
+    // zero page
+    uint64_t same = zswap_same_filled_count;
+    uint64_t pool = zswap_pool_size;
+    memset(frame(1), 0, PAGE_SIZE);
+    round_trip(saddr);
+    assert(zswap_same_filled_count - same == 1);
+    assert(zswap_pool_size == pool);
+
+    // same-filled page
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        *(uint64_t *)&frame(1)[i] = 0xdeadbeefcafebabe;
+    }
+    round_trip(saddr);
+    assert(zswap_same_filled_count - same == 2);
+
+    // structured page: small integers
+    uint64_t stored = zswap_store_count;
+    for (uint64_t i = 0; i < PAGE_SIZE; i += 8)
+    {
+        *(uint64_t *)&frame(1)[i] = i / 8 % 100;
+    }
+    round_trip(saddr);
+    assert(zswap_store_count - stored == 1);
+    assert(zswap_pool_size - pool < PAGE_SIZE / 4);
+    printf("structured page: %lu bytes\n", zswap_pool_size - pool);
+
+    // nothing goes to swap file so far
+    assert(swap_write_count == writes);
+    assert(swap_read_count == reads);
+
+    // random page is rejected and written to swap file
+    uint64_t reject = zswap_reject_count;
+    fill_random(frame(1), PAGE_SIZE, 1);
+    round_trip(saddr);
+    assert(zswap_reject_count - reject == 1);
+    assert(swap_write_count - writes == 1);
+    assert(swap_read_count - reads == 1);
+    assert(zswap_pool_size == pool);
+
+    free_swappage(saddr);
+    printf(GREENSTR("Pass\n"));
+}
+
+static void TestSpill()
+{
+    printf("Testing zswap spill to swap file ...\n");
+
+    page_map_init();
+
+    // half random, half zero: about 2KB each, more than the pool
+    int num = 40;
+    uint64_t saddr[40];
+    uint64_t spill = zswap_spill_count;
+    for (int k = 0; k < num; ++ k)
+    {
+        saddr[k] = allocate_swappage(1);
+        fill_random(frame(1), PAGE_SIZE / 2, k + 100);
+        swap_out(saddr[k], 1);
+        assert(zswap_pool_size <= ZSWAP_POOL_LIMIT);
+    }
+    assert(zswap_spill_count - spill > 0);
+    printf("%lu pages spilled\n", zswap_spill_count - spill);
+
+    // from both the pool and the file
+    uint64_t load = zswap_load_count;
+    uint64_t reads = swap_read_count;
+    for (int k = 0; k < num; ++ k)
+    {
+        memset(frame(1), 0, PAGE_SIZE);
+        fill_random(frame(1), PAGE_SIZE / 2, k + 100);
+        swap_in(saddr[k], 2);
+        assert(memcmp(frame(1), frame(2), PAGE_SIZE) == 0);
+    }
+    assert(zswap_load_count - load + swap_read_count - reads == num);
+    assert(swap_read_count - reads == zswap_spill_count - spill);
+
+    for (int k = 0; k < num; ++ k)
+    {
+        free_swappage(saddr[k]);
+    }
+    assert(zswap_pool_size == 0);
+
+    printf(GREENSTR("Pass\n"));
+}
+
+int main()
+{
+    TestCompress();
+    TestSpill();
+    return 0;
+}